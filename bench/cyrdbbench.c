@@ -56,10 +56,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "bufarray.h"
 #include "cyrusdb.h"
+#include "libcyr_cfg.h"
+#include "retry.h"
 #include "strarray.h"
 #include "util.h"
 #include "xmalloc.h"
@@ -71,8 +76,17 @@ static const char *BENCHMARKS;
 static int NUMRECS = 1000;
 static int new_db = 0;          /* set to 1 if we created a new db */
 static size_t VALLEN = 0;
+static int NUMREADERS = 4;      /* reader processes for concurrent loads */
+static int DURATION = 5;        /* seconds to run concurrent loads for */
+static int NOSYNC = 0;
 
-#define ALLBENCHMARKS "writeseq,writeseqtxn,writerandom,writerandomtxn,write100k"
+#define ALLBENCHMARKS "writeseq,writeseqtxn,writerandom,writerandomtxn,write100k," \
+                      "readseq,readrandom,fetchmany,foreachprefix,conversations," \
+                      "concurrent,checkpointload"
+
+#define FETCHMANY_BATCH   100   /* keys per fetchmany call */
+#define FOLDERS_PER_USER  10    /* mailboxes.db-like records per user */
+#define WRITER_TXN_SIZE   10    /* records changed per writer transaction */
 
 enum {
         BATCHED,
@@ -85,7 +99,10 @@ static struct option long_options[] = {
         {"benchmarks", required_argument, NULL, 'b'},
         {"db", required_argument, NULL, 'd'},
         {"backend", required_argument, NULL, 't'},
-        {"numrecs", optional_argument, NULL, 'n'},
+        {"numrecs", required_argument, NULL, 'n'},
+        {"readers", required_argument, NULL, 'r'},
+        {"time", required_argument, NULL, 'T'},
+        {"nosync", no_argument, NULL, 's'},
         {"help", no_argument, NULL, 'h'},
         {NULL, 0, NULL, 0}
 };
@@ -230,6 +247,153 @@ static uint64_t get_time_now(void)
     return tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
+static uint64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Latency histograms.
+ *
+ * Values are nanoseconds, bucketed by power of two with HIST_SUB
+ * linear sub-buckets per power, so any reported percentile is within
+ * about 6% of the true value while the whole histogram stays a fixed
+ * size that can be merged and shipped between processes as-is.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (64 * HIST_SUB)
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+enum {
+    OP_FETCH = 0,
+    OP_FETCHMANY,
+    OP_FOREACH,
+    OP_STORE,
+    OP_DELETE,
+    OP_COMMIT,
+    OP_REPACK,
+    NUM_OPS
+};
+
+static const char * const op_names[NUM_OPS] = {
+    "fetch", "fetchmany", "foreach", "store", "delete", "commit", "repack"
+};
+
+struct latencies {
+    struct histogram op[NUM_OPS];
+    uint64_t errors;            /* failed reads under concurrent load */
+};
+
+static unsigned hist_bucket(uint64_t v)
+{
+    unsigned msb;
+
+    if (v < HIST_SUB) return v;
+
+    msb = 63 - __builtin_clzll(v);
+
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+           ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* upper bound of the values which land in bucket idx */
+static uint64_t hist_value(unsigned idx)
+{
+    unsigned shift;
+
+    if (idx < HIST_SUB) return idx;
+
+    shift = idx / HIST_SUB - 1;
+
+    return (((uint64_t) HIST_SUB + idx % HIST_SUB) << shift) +
+           ((uint64_t) 1 << shift) - 1;
+}
+
+static void hist_add(struct histogram *h, uint64_t v)
+{
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+    h->buckets[hist_bucket(v)]++;
+}
+
+static void hist_merge(struct histogram *h, const struct histogram *other)
+{
+    unsigned i;
+
+    h->count += other->count;
+    h->sum += other->sum;
+    if (other->max > h->max) h->max = other->max;
+    for (i = 0; i < HIST_BUCKETS; i++)
+        h->buckets[i] += other->buckets[i];
+}
+
+static uint64_t hist_percentile(const struct histogram *h, double pct)
+{
+    uint64_t want = (uint64_t) (h->count * pct / 100.0 + 0.5);
+    uint64_t seen = 0;
+    unsigned i;
+
+    if (!want) want = 1;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want) {
+            uint64_t v = hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+static void latencies_merge(struct latencies *lat, const struct latencies *other)
+{
+    int i;
+
+    for (i = 0; i < NUM_OPS; i++)
+        hist_merge(&lat->op[i], &other->op[i]);
+    lat->errors += other->errors;
+}
+
+/* time a single operation: start is the value of get_time_ns() taken
+ * just before it */
+#define LATENCY(lat, opnum, start) \
+    hist_add(&(lat)->op[(opnum)], get_time_ns() - (start))
+
+static void print_latencies(const char *benchname, const struct latencies *lat)
+{
+    int i;
+
+    for (i = 0; i < NUM_OPS; i++) {
+        const struct histogram *h = &lat->op[i];
+
+        if (!h->count) continue;
+
+        fprintf(stderr, "%-16s %-10s: %8" PRIu64 " ops  avg %9.1f"
+                "  p50 %9.1f  p99 %9.1f  p999 %9.1f  max %9.1f μs\n",
+                benchname, op_names[i], h->count,
+                h->sum / 1000.0 / h->count,
+                hist_percentile(h, 50.0) / 1000.0,
+                hist_percentile(h, 99.0) / 1000.0,
+                hist_percentile(h, 99.9) / 1000.0,
+                h->max / 1000.0);
+    }
+
+    if (lat->errors)
+        fprintf(stderr, "%-16s %-10s: %8" PRIu64 " failed reads\n",
+                benchname, "errors", lat->errors);
+}
+
 
 static void usage(const char *progname)
 {
@@ -243,13 +407,32 @@ static void usage(const char *progname)
     printf("                       * writerandom    - write values in random key order\n");
     printf("                       * writerandomtxn - write values in random key order in separate transactions\n");
     printf("                       * write100k      - write values 100K long in random key order\n");
+    printf("                       * readseq        - fetch every key in sequential order\n");
+    printf("                       * readrandom     - fetch keys in random order\n");
+    printf("                       * fetchmany      - fetch random keys in sorted batches of %d\n",
+           FETCHMANY_BATCH);
+    printf("                       * foreachprefix  - prefix scans over mailboxes.db shaped keys\n");
+    printf("                       * conversations  - conversations.db style G/B/f lookups and appends\n");
+    printf("                       * concurrent     - readers plus one writer against the same db\n");
+    printf("                       * checkpointload - concurrent, with the writer repacking once a second\n");
     printf("\n");
     printf("  -d, --db             the db to run the benchmarks on\n");
     printf("                       (if not provided, will create a new db)\n");
-    printf("  -t, --backend        type of the db backend to run benchmarks on\n");
-    printf("                       Available Cyrus DB's: twoskip, zeroskip\n");
+    printf("  -t, --backend        comma separated list of db backends to run benchmarks on,\n");
+    printf("                       or `all' for every compiled in backend\n");
+    printf("                       Available Cyrus DB's: ");
+    strarray_t *backends = cyrusdb_backends();
+    char *list = strarray_join(backends, ", ");
+    printf("%s\n", list);
+    free(list);
+    strarray_free(backends);
     printf("  -n, --numrecs        number of records to write[default: 1000]\n");
+    printf("  -r, --readers        reader processes for concurrent loads [default: 4]\n");
+    printf("  -T, --time           seconds to run concurrent loads for [default: 5]\n");
+    printf("  -s, --nosync         don't fsync on commit, where the backend allows it\n");
     printf("  -h, --help           display this help and exit\n");
+    printf("\n");
+    printf("Every benchmark reports p50/p99/p999 latency for each operation it performs.\n");
 }
 
 
@@ -313,13 +496,14 @@ static void print_header(void)
     fprintf(stdout, "------------------------------------------------\n");
 }
 
-static size_t do_write(int txnmode, int insmode)
+static size_t do_write(int txnmode, int insmode, struct latencies *lat)
 {
     int i;
     int ret;
     struct db *db = NULL;
     size_t bytes = 0;
     struct txn *txn = NULL;
+    uint64_t t0;
 
     /* Open DB */
     ret = cyrusdb_open(BACKEND, DBNAME, new_db ? CYRUSDB_CREATE : 0, &db);
@@ -339,9 +523,12 @@ static size_t do_write(int txnmode, int insmode)
         vallen = VALLEN ? VALLEN : keylen * 2;
         val = random_string(vallen);
 
+        t0 = get_time_ns();
         ret = cyrusdb_store(db, key, keylen, val, vallen,
                             (txnmode == BATCHED) ? &txn : NULL);
+        LATENCY(lat, OP_STORE, t0);
         assert(ret == CYRUSDB_OK);
+        free(val);
 
         if (txnmode == BATCHED) {
                 assert(txn != NULL);
@@ -350,13 +537,15 @@ static size_t do_write(int txnmode, int insmode)
         bytes += (keylen + vallen);
 
         if (txnmode == BATCHED) {
+            t0 = get_time_ns();
             ret = cyrusdb_commit(db, txn);
+            LATENCY(lat, OP_COMMIT, t0);
             assert(ret == CYRUSDB_OK);
             txn = NULL;
         }
     }
 
-    if (txnmode == NOTBATCHED) {
+    if (txnmode == NOTBATCHED && txn) {
         ret = cyrusdb_commit(db, txn);
         assert(ret == CYRUSDB_OK);
     }
@@ -368,13 +557,503 @@ static size_t do_write(int txnmode, int insmode)
     return bytes;
 }
 
+/* Populate the db with NUMRECS records keyed like do_write's, untimed,
+ * for the benchmarks that need something to read */
+static void fill_db(void)
+{
+    struct db *db = NULL;
+    struct txn *txn = NULL;
+    int i, ret;
+
+    ret = cyrusdb_open(BACKEND, DBNAME, CYRUSDB_CREATE, &db);
+    assert(ret == CYRUSDB_OK);
+
+    for (i = 0; i < NUMRECS; i++) {
+        char key[100];
+        size_t vallen;
+        char *val;
+
+        snprintf(key, sizeof(key), "%016d", i);
+        vallen = VALLEN ? VALLEN : 32;
+        val = random_string(vallen);
+
+        ret = cyrusdb_store(db, key, strlen(key), val, vallen, &txn);
+        assert(ret == CYRUSDB_OK);
+        free(val);
+
+        if (i % 1000 == 999) {
+            ret = cyrusdb_commit(db, txn);
+            assert(ret == CYRUSDB_OK);
+            txn = NULL;
+        }
+    }
+
+    if (txn) {
+        ret = cyrusdb_commit(db, txn);
+        assert(ret == CYRUSDB_OK);
+    }
+
+    ret = cyrusdb_close(db);
+    assert(ret == CYRUSDB_OK);
+}
+
+static size_t do_read(int insmode, struct latencies *lat)
+{
+    struct db *db = NULL;
+    size_t bytes = 0;
+    int i, ret;
+
+    fill_db();
+
+    ret = cyrusdb_open(BACKEND, DBNAME, 0, &db);
+    assert(ret == CYRUSDB_OK);
+
+    for (i = 0; i < NUMRECS; i++) {
+        const char *data = NULL;
+        size_t datalen = 0;
+        char key[100];
+        uint64_t t0;
+        int k;
+
+        k = (insmode == SEQUENTIAL) ? i : rand() % NUMRECS;
+        snprintf(key, sizeof(key), "%016d", k);
+
+        t0 = get_time_ns();
+        ret = cyrusdb_fetch(db, key, strlen(key), &data, &datalen, NULL);
+        LATENCY(lat, OP_FETCH, t0);
+        assert(ret == CYRUSDB_OK);
+
+        bytes += datalen;
+    }
+
+    ret = cyrusdb_close(db);
+    assert(ret == CYRUSDB_OK);
+
+    return bytes;
+}
+
+static int count_bytes_cb(void *rock,
+                          const char *key __attribute__((unused)),
+                          size_t keylen,
+                          const char *data __attribute__((unused)),
+                          size_t datalen)
+{
+    size_t *bytes = (size_t *) rock;
+
+    *bytes += keylen + datalen;
+
+    return 0;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *) a, y = *(const int *) b;
+
+    return (x > y) - (x < y);
+}
+
+static size_t do_fetchmany(struct latencies *lat)
+{
+    struct db *db = NULL;
+    bufarray_t keys = BUFARRAY_INITIALIZER;
+    int knum[FETCHMANY_BATCH];
+    size_t bytes = 0;
+    int i, j, ret;
+
+    fill_db();
+
+    ret = cyrusdb_open(BACKEND, DBNAME, 0, &db);
+    assert(ret == CYRUSDB_OK);
+
+    for (i = 0; i < NUMRECS; i += FETCHMANY_BATCH) {
+        uint64_t t0;
+
+        /* callers are expected to hand over sorted keys */
+        for (j = 0; j < FETCHMANY_BATCH; j++)
+            knum[j] = rand() % NUMRECS;
+        qsort(knum, FETCHMANY_BATCH, sizeof(int), cmp_int);
+
+        bufarray_truncate(&keys, 0);
+        for (j = 0; j < FETCHMANY_BATCH; j++) {
+            struct buf key = BUF_INITIALIZER;
+            buf_printf(&key, "%016d", knum[j]);
+            bufarray_append(&keys, &key);
+            buf_free(&key);
+        }
+
+        t0 = get_time_ns();
+        ret = cyrusdb_fetchmany(db, &keys, count_bytes_cb, &bytes, NULL);
+        LATENCY(lat, OP_FETCHMANY, t0);
+        assert(ret == CYRUSDB_OK);
+    }
+
+    bufarray_fini(&keys);
+
+    ret = cyrusdb_close(db);
+    assert(ret == CYRUSDB_OK);
+
+    return bytes;
+}
+
+/* mailboxes.db: one record per mailbox, a user's folders sorting
+ * directly after their INBOX */
+static const char * const mbox_folders[FOLDERS_PER_USER] = {
+    NULL, "Archive", "Drafts", "Junk", "Lists", "Lists.cyrus",
+    "Lists.cyrus.devel", "Sent", "Trash", "Work"
+};
+
+static size_t do_foreachprefix(struct latencies *lat)
+{
+    struct db *db = NULL;
+    struct txn *txn = NULL;
+    int numusers = NUMRECS / FOLDERS_PER_USER;
+    size_t bytes = 0;
+    int i, j, ret;
+
+    if (!numusers) numusers = 1;
+
+    ret = cyrusdb_open(BACKEND, DBNAME, CYRUSDB_CREATE, &db);
+    assert(ret == CYRUSDB_OK);
+
+    for (i = 0; i < numusers; i++) {
+        for (j = 0; j < FOLDERS_PER_USER; j++) {
+            struct buf key = BUF_INITIALIZER;
+            struct buf val = BUF_INITIALIZER;
+
+            buf_printf(&key, "user.u%06d", i);
+            if (mbox_folders[j]) buf_printf(&key, ".%s", mbox_folders[j]);
+            buf_printf(&val, "%%(A %%(u%06d lrswipkxtecdan admin lrswipkxtecdan) "
+                       "I %08x-%04x-%04x M %d P default T r V %d)",
+                       i, rand(), rand() & 0xffff, rand() & 0xffff,
+                       (int) time(NULL), 12 + j);
+
+            ret = cyrusdb_store(db, key.s, key.len, val.s, val.len, &txn);
+            assert(ret == CYRUSDB_OK);
+
+            buf_free(&key);
+            buf_free(&val);
+        }
+    }
+
+    ret = cyrusdb_commit(db, txn);
+    assert(ret == CYRUSDB_OK);
+    txn = NULL;
+
+    for (i = 0; i < NUMRECS; i++) {
+        char prefix[100];
+        uint64_t t0;
+
+        snprintf(prefix, sizeof(prefix), "user.u%06d", rand() % numusers);
+
+        t0 = get_time_ns();
+        ret = cyrusdb_foreach(db, prefix, strlen(prefix), NULL,
+                              count_bytes_cb, &bytes, NULL);
+        LATENCY(lat, OP_FOREACH, t0);
+        assert(ret == CYRUSDB_OK);
+    }
+
+    ret = cyrusdb_close(db);
+    assert(ret == CYRUSDB_OK);
+
+    return bytes;
+}
+
+/* conversations.db: G<guid> and B<msgid> records per message, plus a
+ * handful of hot f<folder> counter records touched by every append */
+#define CONV_FOLDERS 20
+
+static void conv_guid(char *out, int msgno)
+{
+    uint64_t x = (uint64_t) msgno * 0x9e3779b97f4a7c15ULL;
+    int i;
+
+    for (i = 0; i < 40; i++) {
+        x ^= x >> 29;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        out[i] = "0123456789abcdef"[(x >> 32) & 0xf];
+    }
+    out[40] = '\0';
+}
+
+static void conv_append(struct db *db, int msgno, struct latencies *lat)
+{
+    struct txn *txn = NULL;
+    const char *data = NULL;
+    size_t datalen = 0;
+    char guid[41];
+    char key[100], val[100];
+    uint64_t t0;
+    int folder = msgno % CONV_FOLDERS;
+    int ret;
+
+    /* threading lookup on the message-id, usually a miss */
+    snprintf(key, sizeof(key), "B<%d.%d@example.com>", msgno, msgno * 7);
+    t0 = get_time_ns();
+    ret = cyrusdb_fetch(db, key, strlen(key), &data, &datalen, &txn);
+    LATENCY(lat, OP_FETCH, t0);
+    assert(ret == CYRUSDB_OK || ret == CYRUSDB_NOTFOUND);
+
+    snprintf(val, sizeof(val), "%016llx %d", (unsigned long long) msgno, (int) time(NULL));
+    t0 = get_time_ns();
+    ret = cyrusdb_store(db, key, strlen(key), val, strlen(val), &txn);
+    LATENCY(lat, OP_STORE, t0);
+    assert(ret == CYRUSDB_OK);
+
+    conv_guid(guid, msgno);
+    snprintf(key, sizeof(key), "G%s", guid);
+    snprintf(val, sizeof(val), "%d:%d:%016llx", folder, msgno,
+             (unsigned long long) msgno);
+    t0 = get_time_ns();
+    ret = cyrusdb_store(db, key, strlen(key), val, strlen(val), &txn);
+    LATENCY(lat, OP_STORE, t0);
+    assert(ret == CYRUSDB_OK);
+
+    snprintf(key, sizeof(key), "fuser.u000001.folder%02d", folder);
+    t0 = get_time_ns();
+    ret = cyrusdb_fetch(db, key, strlen(key), &data, &datalen, &txn);
+    LATENCY(lat, OP_FETCH, t0);
+    assert(ret == CYRUSDB_OK || ret == CYRUSDB_NOTFOUND);
+
+    snprintf(val, sizeof(val), "%%(MODSEQ %d EXISTS %d UNSEEN 0)",
+             msgno, msgno / CONV_FOLDERS);
+    t0 = get_time_ns();
+    ret = cyrusdb_store(db, key, strlen(key), val, strlen(val), &txn);
+    LATENCY(lat, OP_STORE, t0);
+    assert(ret == CYRUSDB_OK);
+
+    t0 = get_time_ns();
+    ret = cyrusdb_commit(db, txn);
+    LATENCY(lat, OP_COMMIT, t0);
+    assert(ret == CYRUSDB_OK);
+}
+
+static size_t do_conversations(struct latencies *lat)
+{
+    struct latencies *fill = xzmalloc(sizeof(struct latencies));
+    struct db *db = NULL;
+    size_t bytes = 0;
+    int nextmsg = NUMRECS;
+    int i, ret;
+
+    ret = cyrusdb_open(BACKEND, DBNAME, CYRUSDB_CREATE, &db);
+    assert(ret == CYRUSDB_OK);
+
+    for (i = 0; i < NUMRECS; i++)
+        conv_append(db, i, fill);
+    free(fill);
+
+    /* three lookups for every append, as when serving JMAP/IMAP
+     * clients alongside delivery */
+    for (i = 0; i < NUMRECS; i++) {
+        const char *data = NULL;
+        size_t datalen = 0;
+        char key[100];
+        uint64_t t0;
+
+        if (i % 4 == 3) {
+            conv_append(db, nextmsg++, lat);
+            continue;
+        }
+
+        key[0] = 'G';
+        conv_guid(key + 1, rand() % nextmsg);
+        t0 = get_time_ns();
+        ret = cyrusdb_fetch(db, key, strlen(key), &data, &datalen, NULL);
+        LATENCY(lat, OP_FETCH, t0);
+        assert(ret == CYRUSDB_OK || ret == CYRUSDB_NOTFOUND);
+        bytes += datalen;
+    }
+
+    ret = cyrusdb_close(db);
+    assert(ret == CYRUSDB_OK);
+
+    return bytes;
+}
+
+static int backend_can_repack(void)
+{
+    /* skiplist can only checkpoint under an existing write lock */
+    return !strcmp(BACKEND, "twoskip") || !strcmp(BACKEND, "zeroskip");
+}
+
+static void run_reader(uint64_t deadline, struct latencies *lat)
+{
+    struct db *db = NULL;
+    size_t bytes = 0;
+    int ret;
+
+    ret = cyrusdb_open(BACKEND, DBNAME, 0, &db);
+    assert(ret == CYRUSDB_OK);
+
+    while (get_time_ns() < deadline) {
+        const char *data = NULL;
+        size_t datalen = 0;
+        char key[100];
+        uint64_t t0;
+
+        snprintf(key, sizeof(key), "%016d", rand() % NUMRECS);
+
+        if (rand() % 10) {
+            t0 = get_time_ns();
+            ret = cyrusdb_fetch(db, key, strlen(key), &data, &datalen, NULL);
+            LATENCY(lat, OP_FETCH, t0);
+            if (ret && ret != CYRUSDB_NOTFOUND) lat->errors++;
+        }
+        else {
+            /* a range of up to 100 keys */
+            t0 = get_time_ns();
+            ret = cyrusdb_foreach(db, key, 14, NULL,
+                                  count_bytes_cb, &bytes, NULL);
+            LATENCY(lat, OP_FOREACH, t0);
+            if (ret) lat->errors++;
+        }
+    }
+
+    ret = cyrusdb_close(db);
+    assert(ret == CYRUSDB_OK);
+}
+
+static void run_writer(uint64_t deadline, int repack, struct latencies *lat)
+{
+    struct db *db = NULL;
+    uint64_t lastrepack = get_time_ns();
+    int i, ret;
+
+    ret = cyrusdb_open(BACKEND, DBNAME, 0, &db);
+    assert(ret == CYRUSDB_OK);
+
+    while (get_time_ns() < deadline) {
+        struct txn *txn = NULL;
+        uint64_t t0;
+
+        for (i = 0; i < WRITER_TXN_SIZE; i++) {
+            char key[100];
+
+            snprintf(key, sizeof(key), "%016d", rand() % NUMRECS);
+
+            if (rand() % 10) {
+                char *val = random_string(VALLEN ? VALLEN : 32);
+                t0 = get_time_ns();
+                ret = cyrusdb_store(db, key, strlen(key),
+                                    val, strlen(val), &txn);
+                LATENCY(lat, OP_STORE, t0);
+                free(val);
+            }
+            else {
+                t0 = get_time_ns();
+                ret = cyrusdb_delete(db, key, strlen(key), &txn, 1);
+                LATENCY(lat, OP_DELETE, t0);
+            }
+            assert(ret == CYRUSDB_OK);
+        }
+
+        t0 = get_time_ns();
+        ret = cyrusdb_commit(db, txn);
+        LATENCY(lat, OP_COMMIT, t0);
+        assert(ret == CYRUSDB_OK);
+
+        if (repack && get_time_ns() - lastrepack > 1000000000) {
+            t0 = get_time_ns();
+            ret = cyrusdb_repack(db);
+            LATENCY(lat, OP_REPACK, t0);
+            assert(ret == CYRUSDB_OK);
+            lastrepack = get_time_ns();
+        }
+    }
+
+    ret = cyrusdb_close(db);
+    assert(ret == CYRUSDB_OK);
+}
+
+/* Fork NUMREADERS readers and one writer against the same db for
+ * DURATION seconds.  Each child sends its histograms back over a pipe
+ * when it is done, and they are merged into lat. */
+static void do_concurrent(int repack, struct latencies *lat)
+{
+    struct latencies *child = xmalloc(sizeof(struct latencies));
+    int nchildren = NUMREADERS + 1;
+    int *fds = xmalloc(nchildren * sizeof(int));
+    pid_t *pids = xmalloc(nchildren * sizeof(pid_t));
+    uint64_t deadline;
+    int i;
+
+    if (repack && !backend_can_repack()) {
+        fprintf(stderr, "%s can't repack online, running without checkpoints\n",
+                BACKEND);
+        repack = 0;
+    }
+
+    fill_db();
+
+    fflush(stdout);
+    fflush(stderr);
+
+    deadline = get_time_ns() + (uint64_t) DURATION * 1000000000;
+
+    for (i = 0; i < nchildren; i++) {
+        int p[2];
+
+        if (pipe(p) < 0) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+
+        if (!pids[i]) {
+            close(p[0]);
+            srand(getpid() ^ time(NULL));
+            memset(child, 0, sizeof(struct latencies));
+
+            /* the last child is the writer */
+            if (i == NUMREADERS)
+                run_writer(deadline, repack, child);
+            else
+                run_reader(deadline, child);
+
+            if (retry_write(p[1], child, sizeof(struct latencies)) < 0)
+                _exit(EXIT_FAILURE);
+            _exit(EXIT_SUCCESS);
+        }
+
+        close(p[1]);
+        fds[i] = p[0];
+    }
+
+    for (i = 0; i < nchildren; i++) {
+        int status;
+
+        if (retry_read(fds[i], child, sizeof(struct latencies))
+            == sizeof(struct latencies)) {
+            latencies_merge(lat, child);
+        }
+        else {
+            fprintf(stderr, "lost results from child %d\n", (int) pids[i]);
+        }
+        close(fds[i]);
+
+        if (waitpid(pids[i], &status, 0) < 0 ||
+            !WIFEXITED(status) || WEXITSTATUS(status)) {
+            fprintf(stderr, "child %d failed\n", (int) pids[i]);
+        }
+    }
+
+    free(pids);
+    free(fds);
+    free(child);
+}
+
 static int parse_options(int argc, char **argv, const struct option *options)
 {
     int option;
     int option_index;
 
-    while ((option = getopt_long(argc, argv, "d:b:t:h?",
-                                 long_options, &option_index)) != -1) {
+    while ((option = getopt_long(argc, argv, "d:b:t:n:r:T:sh?",
+                                 options, &option_index)) != -1) {
         switch (option) {
             case 'b':
                 BENCHMARKS = optarg;
@@ -388,6 +1067,15 @@ static int parse_options(int argc, char **argv, const struct option *options)
             case 'n':
                 NUMRECS = atoi(optarg);
                 break;
+            case 'r':
+                NUMREADERS = atoi(optarg);
+                break;
+            case 'T':
+                DURATION = atoi(optarg);
+                break;
+            case 's':
+                NOSYNC = 1;
+                break;
             case 'h':
                 GCC_FALLTHROUGH
             case '?':
@@ -396,6 +1084,11 @@ static int parse_options(int argc, char **argv, const struct option *options)
         }
     }
 
+    if (NUMRECS < 1 || NUMREADERS < 0 || DURATION < 1) {
+        usage(basename(argv[0]));
+        exit(EXIT_FAILURE);
+    }
+
     return 0;
 }
 
@@ -412,30 +1105,32 @@ static int run_benchmarks(void)
 
     for (i = 0; i < benchmarks->count; i++) {
         const char *benchname = strarray_nth(benchmarks, i);
+        struct latencies *lat = xzmalloc(sizeof(struct latencies));
+
         if (strcmp(benchname, "writeseq") == 0) {
             start = get_time_now();
-            bytes = do_write(NOTBATCHED, SEQUENTIAL);
+            bytes = do_write(NOTBATCHED, SEQUENTIAL, lat);
             finish = get_time_now();
 
             fprintf(stderr, "writeseq        : %zu bytes written in %" PRIu64 " μs.\n",
                     bytes, (finish - start));
         } else if (strcmp(benchname, "writeseqtxn") == 0) {
             start = get_time_now();
-            bytes = do_write(BATCHED, SEQUENTIAL);
+            bytes = do_write(BATCHED, SEQUENTIAL, lat);
             finish = get_time_now();
 
             fprintf(stderr, "writeseqtxn     : %zu bytes written in %" PRIu64 " μs.\n",
                     bytes, (finish - start));
         } else if (strcmp(benchname, "writerandom") == 0) {
             start = get_time_now();
-            bytes = do_write(NOTBATCHED, RANDOM);
+            bytes = do_write(NOTBATCHED, RANDOM, lat);
             finish = get_time_now();
 
             fprintf(stderr, "writerandom     : %zu bytes written in %" PRIu64 " μs.\n",
                     bytes, (finish - start));
         } else if (strcmp(benchname, "writerandomtxn") == 0) {
             start = get_time_now();
-            bytes = do_write(BATCHED, RANDOM);
+            bytes = do_write(BATCHED, RANDOM, lat);
             finish = get_time_now();
 
             fprintf(stderr, "writerandomtxn  : %zu bytes written in %" PRIu64 " μs.\n",
@@ -443,16 +1138,64 @@ static int run_benchmarks(void)
         } else if (strcmp(benchname, "write100k") == 0) {
             VALLEN = 100 * 1000;
             start = get_time_now();
-            bytes = do_write(NOTBATCHED, RANDOM);
+            bytes = do_write(NOTBATCHED, RANDOM, lat);
             finish = get_time_now();
 
             fprintf(stderr, "write100k       : %zu bytes written in %" PRIu64 " μs.\n",
                     bytes, (finish - start));
             VALLEN = 0;
+        } else if (strcmp(benchname, "readseq") == 0) {
+            start = get_time_now();
+            bytes = do_read(SEQUENTIAL, lat);
+            finish = get_time_now();
+
+            fprintf(stderr, "readseq         : %zu bytes read in %" PRIu64 " μs.\n",
+                    bytes, (finish - start));
+        } else if (strcmp(benchname, "readrandom") == 0) {
+            start = get_time_now();
+            bytes = do_read(RANDOM, lat);
+            finish = get_time_now();
+
+            fprintf(stderr, "readrandom      : %zu bytes read in %" PRIu64 " μs.\n",
+                    bytes, (finish - start));
+        } else if (strcmp(benchname, "fetchmany") == 0) {
+            start = get_time_now();
+            bytes = do_fetchmany(lat);
+            finish = get_time_now();
+
+            fprintf(stderr, "fetchmany       : %zu bytes read in %" PRIu64 " μs.\n",
+                    bytes, (finish - start));
+        } else if (strcmp(benchname, "foreachprefix") == 0) {
+            start = get_time_now();
+            bytes = do_foreachprefix(lat);
+            finish = get_time_now();
+
+            fprintf(stderr, "foreachprefix   : %zu bytes scanned in %" PRIu64 " μs.\n",
+                    bytes, (finish - start));
+        } else if (strcmp(benchname, "conversations") == 0) {
+            start = get_time_now();
+            bytes = do_conversations(lat);
+            finish = get_time_now();
+
+            fprintf(stderr, "conversations   : %zu bytes read in %" PRIu64 " μs.\n",
+                    bytes, (finish - start));
+        } else if (strcmp(benchname, "concurrent") == 0) {
+            do_concurrent(0, lat);
+
+            fprintf(stderr, "concurrent      : %d readers, 1 writer for %d s.\n",
+                    NUMREADERS, DURATION);
+        } else if (strcmp(benchname, "checkpointload") == 0) {
+            do_concurrent(1, lat);
+
+            fprintf(stderr, "checkpointload  : %d readers, 1 writer for %d s.\n",
+                    NUMREADERS, DURATION);
         } else {
             fprintf(stderr, "Unknown benchmark '%s'\n", benchname);
         }
 
+        print_latencies(benchname, lat);
+        free(lat);
+
         if (new_db) {
             cleanup_db_dir();
         }
@@ -467,6 +1210,9 @@ int main(int argc, char *argv[])
 {
     int ret = EXIT_SUCCESS;
     int seed = 1103515245;
+    strarray_t *available = NULL;
+    strarray_t *backends = NULL;
+    int i;
 
     /* Random Seed */
     srand(time(NULL) * seed);
@@ -480,37 +1226,67 @@ int main(int argc, char *argv[])
         goto done;
     }
 
-    if (strncmp(BACKEND, "twoskip", strlen("twoskip")) == 0 ||
-        strncmp(BACKEND, "zeroskip", strlen("zeroskip")) == 0) {
-        fprintf(stderr, "Running benchmarks for `%s` backend\n", BACKEND);
-    } else {
-        fprintf(stderr, "%s is not a valid CyrusDB backend. ", BACKEND);
-        fprintf(stderr, "Choose between `twoskip` or `zeroskip`.\n");
+    available = cyrusdb_backends();
+    if (!strcmp(BACKEND, "all"))
+        backends = strarray_dup(available);
+    else
+        backends = strarray_split(BACKEND, ",", STRARRAY_TRIM);
+
+    for (i = 0; i < backends->count; i++) {
+        if (strarray_find(available, strarray_nth(backends, i), 0) < 0) {
+            char *list = strarray_join(available, "`, `");
+            fprintf(stderr, "%s is not a valid CyrusDB backend. ",
+                    strarray_nth(backends, i));
+            fprintf(stderr, "Choose between `%s`.\n", list);
+            free(list);
+            ret = EXIT_FAILURE;
+            goto done;
+        }
+    }
+
+    if (DBNAME && backends->count > 1) {
+        fprintf(stderr, "Only one backend can be run against an existing DB.\n");
         ret = EXIT_FAILURE;
         goto done;
     }
 
+    if (NOSYNC) {
+        /* only skiplist has a knob for this; the other backends always
+         * sync on commit, so comparing -s runs shows what it costs */
+        libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_UNSAFE, 1);
+        fprintf(stderr, "Not syncing commits (skiplist only)\n");
+    }
+
     if (BENCHMARKS == NULL) {
         fprintf(stderr, "Running all benchmarks\n");
         BENCHMARKS = ALLBENCHMARKS;
     }
 
-    if (DBNAME == NULL) {
-        new_db = 1;
-        DBNAME = create_tmp_dir_name();
-        assert(DBNAME != NULL);
-        printf("Creating a new DB: %s\n", DBNAME);
-    } else {
-        printf("Using existing DB: %s\n", DBNAME);
-    }
+    for (i = 0; i < backends->count; i++) {
+        BACKEND = (char *) strarray_nth(backends, i);
+        fprintf(stderr, "Running benchmarks for `%s` backend\n", BACKEND);
+
+        if (DBNAME == NULL || new_db) {
+            new_db = 1;
+            DBNAME = create_tmp_dir_name();
+            assert(DBNAME != NULL);
+            printf("Creating a new DB: %s\n", DBNAME);
+        } else {
+            printf("Using existing DB: %s\n", DBNAME);
+        }
+
+        ret = run_benchmarks();
 
-    ret = run_benchmarks();
+        if (new_db) {
+            free(DBNAME);
+            DBNAME = NULL;
+        }
 
-    if (new_db) {
-        free(DBNAME);
-        DBNAME = NULL;
+        if (ret) break;
     }
 
  done:
+    strarray_free(backends);
+    strarray_free(available);
     exit(ret);
 }
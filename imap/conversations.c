@@ -100,6 +100,9 @@
 
 #define DB config_conversations_db
 
+/* most conversations to hold in the write-back cache before flushing */
+#define CONV_CACHE_MAX 4096
+
 struct conversations_open {
     struct conversations_state s;
     struct mboxlock *local_namespacelock;
@@ -121,6 +124,9 @@ static int _conversations_set_key(struct conversations_state *state,
                                   const arrayu64_t *cids, time_t stamp);
 
 static void _conv_remove(struct conversations_state *state);
+static int conversations_flushconvs(struct conversations_state *state);
+static void _conv_cache_free(void *data);
+static void conversations_dropconvs(struct conversations_state *state);
 
 EXPORTED void conversations_set_directory(const char *dir)
 {
@@ -326,7 +332,8 @@ EXPORTED int conversations_open_path(const char *fname, const char *userid, int
     }
 
     /* open db */
-    int flags = CYRUSDB_CREATE | (shared ? (CYRUSDB_SHARED|CYRUSDB_NOCRC) : CYRUSDB_CONVERT);
+    int flags = CYRUSDB_CREATE | CYRUSDB_BLOOM |
+                (shared ? (CYRUSDB_SHARED|CYRUSDB_NOCRC) : CYRUSDB_CONVERT);
     r = cyrusdb_lockopen(DB, fname, flags, &open->s.db, &open->s.txn);
     if (r || open->s.db == NULL) {
         _conv_remove(&open->s);
@@ -364,6 +371,9 @@ EXPORTED int conversations_open_path(const char *fname, const char *userid, int
     /* create the status cache */
     construct_hash_table(&open->s.folderstatus, strarray_size(open->s.folder_names)/4+4, 0);
 
+    /* and the conversation cache */
+    construct_hash_table(&open->s.convcache, 256, 0);
+
     *statep = &open->s;
 
     return 0;
@@ -457,6 +467,7 @@ static void conversations_abortcache(struct conversations_state *state)
 {
     /* still gotta clean up */
     free_hash_table(&state->folderstatus, free);
+    free_hash_table(&state->convcache, _conv_cache_free);
 }
 
 static void commitstatus_cb(const char *key, void *data, void *rock)
@@ -509,11 +520,16 @@ EXPORTED int conversations_commit(struct conversations_state **statep)
 
     *statep = NULL;
 
+    /* write out the conversations changed in this transaction */
+    r = conversations_flushconvs(state);
+    if (r) goto fail;
+    free_hash_table(&state->convcache, _conv_cache_free);
+
     /* commit cache, writes to to DB */
     conversations_commitcache(state);
 
     r = _write_quota(state);
-    if (r) return r;
+    if (r) goto fail;
 
     /* finally it's safe to commit the DB itself */
     if (state->db) {
@@ -524,6 +540,18 @@ EXPORTED int conversations_commit(struct conversations_state **statep)
 
     _conv_remove(state);
 
+    return r;
+
+fail:
+    /* nothing of this transaction can be kept */
+    conversations_abortcache(state);
+    if (state->db) {
+        if (state->txn)
+            cyrusdb_abort(state->db, state->txn);
+        cyrusdb_close(state->db);
+    }
+    _conv_remove(state);
+
     return r;
 }
 
@@ -754,16 +782,51 @@ static int folder_number_rename(struct conversations_state *state,
     return write_folders(state);
 }
 
-EXPORTED int conversation_storestatus(struct conversations_state *state,
-                                      const char *key, size_t keylen,
-                                      const conv_status_t *status)
+/* LEB128: seven bits per byte, least significant first */
+static void putvarint(struct buf *buf, bit64 v)
 {
-    if (!status || !status->threadmodseq) {
-        return cyrusdb_delete(state->db,
-                              key, keylen,
-                              &state->txn, /*force*/1);
+    while (v >= 0x80) {
+        buf_putc(buf, (v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    buf_putc(buf, v);
+}
+
+static int parsevarint(const char **pp, const char *end, bit64 *vp)
+{
+    const unsigned char *p = (const unsigned char *)*pp;
+    bit64 v = 0;
+    int shift;
+
+    for (shift = 0; shift < 64; shift += 7) {
+        if (p >= (const unsigned char *)end) return IMAP_MAILBOX_BADFORMAT;
+        v |= (bit64)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+            *pp = (const char *)p;
+            *vp = v;
+            return 0;
+        }
     }
 
+    return IMAP_MAILBOX_BADFORMAT;
+}
+
+/* signed deltas, zigzag encoded so small values of either sign stay short */
+static void putvarint_signed(struct buf *buf, int64_t v)
+{
+    putvarint(buf, ((bit64)v << 1) ^ (bit64)(v >> 63));
+}
+
+static int parsevarint_signed(const char **pp, const char *end, int64_t *vp)
+{
+    bit64 v;
+    int r = parsevarint(pp, end, &v);
+    if (!r) *vp = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    return r;
+}
+
+static void status_to_text(const conv_status_t *status, struct buf *buf)
+{
     struct dlist *dl = dlist_newlist(NULL, NULL);
     dlist_setnum64(dl, "THREADMODSEQ", status->threadmodseq);
     dlist_setnum32(dl, "THREADEXISTS", status->threadexists);
@@ -771,10 +834,33 @@ EXPORTED int conversation_storestatus(struct conversations_state *state,
     dlist_setnum32(dl, "EMAILEXISTS", status->emailexists);
     dlist_setnum32(dl, "EMAILUNSEEN", status->emailunseen);
 
-    struct buf buf = BUF_INITIALIZER;
-    buf_printf(&buf, "%d ", CONVERSATIONS_STATUS_VERSION);
-    dlist_printbuf(dl, 0, &buf);
+    buf_printf(buf, "%d ", CONVERSATIONS_STATUS_VERSION);
+    dlist_printbuf(dl, 0, buf);
     dlist_free(&dl);
+}
+
+static void status_to_binary(const conv_status_t *status, struct buf *buf)
+{
+    buf_putc(buf, CONVERSATIONS_BINARY_FLAG | CONVERSATIONS_STATUS_VERSION);
+    putvarint(buf, status->threadmodseq);
+    putvarint(buf, status->threadexists);
+    putvarint(buf, status->threadunseen);
+    putvarint(buf, status->emailexists);
+    putvarint(buf, status->emailunseen);
+}
+
+EXPORTED int conversation_storestatus(struct conversations_state *state,
+                                      const char *key, size_t keylen,
+                                      const conv_status_t *status)
+{
+    if (!status || !status->threadmodseq) {
+        return cyrusdb_delete(state->db,
+                              key, keylen,
+                              &state->txn, /*force*/1);
+    }
+
+    struct buf buf = BUF_INITIALIZER;
+    status_to_binary(status, &buf);
 
     int r = cyrusdb_store(state->db,
                           key, keylen,
@@ -807,7 +893,8 @@ EXPORTED int conversation_setstatus(struct conversations_state *state,
     return 0;
 }
 
-static void conv_to_buf(conversation_t *conv, struct buf *buf, int flagcount)
+static void conv_to_text(const conversation_t *conv, struct buf *buf,
+                         int flagcount)
 {
     struct dlist *dl, *n, *nn;
     const conv_folder_t *folder;
@@ -875,13 +962,125 @@ static void conv_to_buf(conversation_t *conv, struct buf *buf, int flagcount)
     dlist_free(&dl);
 }
 
+/* index of str in the record's string table, adding it if need be.
+ * 0 is NULL, so the table is 1-based */
+static uint64_t conv_intern(strarray_t *strs, const char *str)
+{
+    int i;
+
+    if (!str) return 0;
+
+    i = strarray_find(strs, str, 0);
+    if (i < 0) i = strarray_append(strs, str);
+
+    return i + 1;
+}
+
+/*
+ * The binary format is a version byte followed by varints:
+ *
+ *   modseq numrecords exists unseen size createdmodseq
+ *   nflags flagcount*nflags
+ *   nstrings (len bytes)*nstrings subject
+ *   nfolders (numberdelta modseqdelta numrecords exists unseen)*nfolders
+ *   nsenders (name route mailbox domain lastseen exists)*nsenders
+ *   nthreads (guid[20] exists internaldate)*nthreads
+ *
+ * Strings are indexes into the string table, with 0 for NULL, so
+ * senders from the same domain share one copy of it.  Folder numbers
+ * are deltas from the previous folder and folder modseqs are deltas
+ * from the conversation modseq.
+ */
+static void conv_to_binary(const conversation_t *conv, struct buf *buf,
+                           int flagcount)
+{
+    strarray_t strs = STRARRAY_INITIALIZER;
+    struct buf body = BUF_INITIALIZER;
+    const conv_folder_t *folder;
+    const conv_sender_t *sender;
+    const conv_thread_t *thread;
+    char guid[MESSAGE_GUID_SIZE];
+    int prevnumber = 0;
+    int i, n;
+
+    buf_putc(buf, CONVERSATIONS_BINARY_FLAG | conv->version);
+    putvarint(buf, conv->modseq);
+    putvarint(buf, conv->num_records);
+    putvarint(buf, conv->exists);
+    putvarint(buf, conv->unseen);
+    putvarint(buf, conv->size);
+    putvarint(buf, conv->createdmodseq);
+
+    putvarint(buf, flagcount);
+    for (i = 0; i < flagcount; i++)
+        putvarint(buf, conv->counts[i]);
+
+    /* everything after the string table refers to it, so build it
+     * separately and then write the table first */
+    putvarint(&body, conv_intern(&strs, conv->subject));
+
+    for (n = 0, folder = conv->folders ; folder ; folder = folder->next)
+        if (folder->num_records) n++;
+    putvarint(&body, n);
+    for (folder = conv->folders ; folder ; folder = folder->next) {
+        if (!folder->num_records)
+            continue;
+        putvarint_signed(&body, folder->number - prevnumber);
+        putvarint_signed(&body, conv->modseq - folder->modseq);
+        putvarint(&body, folder->num_records);
+        putvarint(&body, folder->exists);
+        putvarint(&body, folder->unseen);
+        prevnumber = folder->number;
+    }
+
+    /* same limit as the dlist format, don't ever store more than 100 */
+    for (n = 0, sender = conv->senders ; sender ; sender = sender->next)
+        if (sender->exists && n < 99) n++;
+    putvarint(&body, n);
+    for (i = 0, sender = conv->senders ; sender && i < n ; sender = sender->next) {
+        if (!sender->exists)
+            continue;
+        putvarint(&body, conv_intern(&strs, sender->name));
+        putvarint(&body, conv_intern(&strs, sender->route));
+        putvarint(&body, conv_intern(&strs, sender->mailbox));
+        putvarint(&body, conv_intern(&strs, sender->domain));
+        putvarint(&body, sender->lastseen);
+        putvarint(&body, sender->exists);
+        i++;
+    }
+
+    for (n = 0, thread = conv->thread; thread; thread = thread->next)
+        if (thread->exists) n++;
+    putvarint(&body, n);
+    for (thread = conv->thread; thread; thread = thread->next) {
+        if (!thread->exists)
+            continue;
+        message_guid_export(&thread->guid, guid);
+        buf_appendmap(&body, guid, MESSAGE_GUID_SIZE);
+        putvarint(&body, thread->exists);
+        putvarint(&body, thread->internaldate);
+    }
+
+    putvarint(buf, strarray_size(&strs));
+    for (i = 0; i < strarray_size(&strs); i++) {
+        const char *str = strarray_nth(&strs, i);
+        size_t len = strlen(str);
+        putvarint(buf, len);
+        buf_appendmap(buf, str, len);
+    }
+    buf_append(buf, &body);
+
+    buf_free(&body);
+    strarray_fini(&strs);
+}
+
 EXPORTED int conversation_store(struct conversations_state *state,
                        const char *key, int keylen,
                        conversation_t *conv)
 {
     struct buf buf = BUF_INITIALIZER;
 
-    conv_to_buf(conv, &buf, state->counted_flags ? state->counted_flags->count : 0);
+    conv_to_binary(conv, &buf, state->counted_flags ? state->counted_flags->count : 0);
 
     int r = cyrusdb_store(state->db, key, keylen, buf.s, buf.len, &state->txn);
 
@@ -1008,17 +1207,160 @@ static int _conversation_save(struct conversations_state *state,
     return r;
 }
 
+/* free a conversation evicted from the cache */
+static void _conv_cache_free(void *data)
+{
+    conversation_t *conv = (conversation_t *)data;
+
+    conv->flags &= ~CONV_ISCACHED;
+    conversation_free(conv);
+}
+
+/* write out the cached copy of key, if any, and forget it, so that the
+ * record in the DB is current */
+static int _conv_cache_flushone(struct conversations_state *state,
+                                const char *key)
+{
+    conversation_t *conv = hash_lookup(key, &state->convcache);
+    int r = 0;
+
+    if (!conv) return 0;
+
+    if (conv->flags & CONV_ISDIRTY)
+        r = _conversation_save(state, key, strlen(key), conv);
+
+    hash_del(key, &state->convcache);
+    _conv_cache_free(conv);
+
+    return r;
+}
+
+/* write out every cached conversation and empty the cache */
+static int conversations_flushconvs(struct conversations_state *state)
+{
+    hash_iter *iter = hash_table_iter(&state->convcache);
+    int r = 0;
+
+    while (!r && hash_iter_next(iter)) {
+        const char *key = hash_iter_key(iter);
+        conversation_t *conv = hash_iter_val(iter);
+
+        if (conv->flags & CONV_ISDIRTY)
+            r = _conversation_save(state, key, strlen(key), conv);
+    }
+    hash_iter_free(&iter);
+
+    if (!r) conversations_dropconvs(state);
+
+    return r;
+}
+
+/* empty the cache without writing anything */
+static void conversations_dropconvs(struct conversations_state *state)
+{
+    if (!hash_numrecords(&state->convcache)) return;
+
+    free_hash_table(&state->convcache, _conv_cache_free);
+    construct_hash_table(&state->convcache, 256, 0);
+}
+
+/* Find conversation cid in the cache, loading it from the DB if need
+ * be.  Sets *convp to NULL if there is no such conversation.  Changes
+ * to the returned conversation are written at conversations_commit(),
+ * and the caller must not free it. */
+static int _conversation_cache_load(struct conversations_state *state,
+                                    conversation_id_t cid,
+                                    conversation_t **convp)
+{
+    char bkey[CONVERSATION_ID_STRMAX+2];
+    conversation_t *conv;
+    int r;
+
+    snprintf(bkey, sizeof(bkey), "B" CONV_FMT, cid);
+
+    conv = hash_lookup(bkey, &state->convcache);
+    if (conv) {
+        xstats_inc(CONV_CACHE_HIT);
+        *convp = conv;
+        return 0;
+    }
+
+    conv = conversation_new();
+    r = conversation_load_advanced(state, cid, conv, CONV_WITHALL);
+    if (r) {
+        conversation_free(conv);
+        *convp = NULL;
+        /* no such conversation is not an error, as for conversation_load() */
+        return 0;
+    }
+
+    *convp = conv;
+    return 0;
+}
+
+/* hand a conversation loaded by _conversation_cache_load(), or a new
+ * one, over to the cache */
+static int _conversation_cache_insert(struct conversations_state *state,
+                                      conversation_id_t cid,
+                                      conversation_t *conv)
+{
+    char bkey[CONVERSATION_ID_STRMAX+2];
+    int r;
+
+    if (conv->flags & CONV_ISCACHED) return 0;
+
+    /* keep the memory held by a huge transaction in check */
+    if (hash_numrecords(&state->convcache) >= CONV_CACHE_MAX) {
+        r = conversations_flushconvs(state);
+        if (r) return r;
+    }
+
+    snprintf(bkey, sizeof(bkey), "B" CONV_FMT, cid);
+    hash_insert(bkey, conv, &state->convcache);
+    conv->flags |= CONV_ISCACHED;
+
+    return 0;
+}
+
+EXPORTED int conversation_load_cached(struct conversations_state *state,
+                                      conversation_id_t cid,
+                                      conversation_t **convp)
+{
+    conversation_t *conv = NULL;
+    int r;
+
+    *convp = NULL;
+
+    r = _conversation_cache_load(state, cid, &conv);
+    if (r) return r;
+    if (!conv) conv = conversation_new();
+
+    r = _conversation_cache_insert(state, cid, conv);
+    if (r) {
+        if (!(conv->flags & CONV_ISCACHED)) conversation_free(conv);
+        return r;
+    }
+
+    *convp = conv;
+    return 0;
+}
+
 EXPORTED int conversation_save(struct conversations_state *state,
                       conversation_id_t cid,
                       conversation_t *conv)
 {
     char bkey[CONVERSATION_ID_STRMAX+2];
+    int r;
 
     if (!conv)
         return IMAP_INTERNAL;
     if (!(conv->flags & CONV_ISDIRTY))
         return 0;
 
+    /* cached copies are written at commit */
+    if (conv->flags & CONV_ISCACHED)
+        return 0;
+
     /* old pre-conversations message, nothing to do */
     if (!cid)
         return 0;
@@ -1026,6 +1368,10 @@ EXPORTED int conversation_save(struct conversations_state *state,
 
     snprintf(bkey, sizeof(bkey), "B" CONV_FMT, cid);
 
+    /* this copy replaces any cached one */
+    r = _conv_cache_flushone(state, bkey);
+    if (r) return r;
+
     return _conversation_save(state, bkey, strlen(bkey), conv);
 }
 
@@ -1078,6 +1424,28 @@ EXPORTED int conversation_parsestatus(const char *data, size_t datalen,
     status->emailexists = 0;
     status->emailunseen = 0;
 
+    if (datalen && (data[0] & CONVERSATIONS_BINARY_FLAG)) {
+        const char *p = data + 1;
+        const char *end = data + datalen;
+        bit64 v[4];
+
+        if ((data[0] & 0x7f) != CONVERSATIONS_STATUS_VERSION)
+            return IMAP_MAILBOX_BADFORMAT;
+
+        r = parsevarint(&p, end, &status->threadmodseq);
+        if (!r) r = parsevarint(&p, end, &v[0]);
+        if (!r) r = parsevarint(&p, end, &v[1]);
+        if (!r) r = parsevarint(&p, end, &v[2]);
+        if (!r) r = parsevarint(&p, end, &v[3]);
+        if (r) return r;
+
+        status->threadexists = v[0];
+        status->threadunseen = v[1];
+        status->emailexists = v[2];
+        status->emailunseen = v[3];
+        return 0;
+    }
+
     r = parsenum(data, &rest, datalen, &version);
     if (r) return IMAP_MAILBOX_BADFORMAT;
 
@@ -1419,6 +1787,134 @@ int _saxconvparse(int type, struct dlistsax_data *d)
     return IMAP_MAILBOX_BADFORMAT;
 }
 
+static int conversation_parse_binary(const char *data, size_t datalen,
+                                     conversation_t *conv, int flags)
+{
+    const char *p = data + 1;
+    const char *end = data + datalen;
+    const char **strs = NULL;
+    size_t *lens = NULL;
+    bit64 nstrs = 0, n, i, v[6];
+    int64_t delta;
+    int number = 0;
+    int r = 0;
+
+#define STR(idx) ((idx) ? xstrndup(strs[(idx)-1], lens[(idx)-1]) : NULL)
+#define GETNUM(vp) do { r = parsevarint(&p, end, (vp)); if (r) goto done; } while (0)
+
+    GETNUM(&conv->modseq);
+    GETNUM(&v[0]); conv->num_records = v[0];
+    GETNUM(&v[0]); conv->exists = v[0];
+    GETNUM(&v[0]); conv->unseen = v[0];
+    GETNUM(&v[0]); conv->size = v[0];
+    GETNUM(&conv->createdmodseq);
+
+    GETNUM(&n);
+    for (i = 0; i < n; i++) {
+        GETNUM(&v[0]);
+        if (i < MAX_CONVERSATION_FLAGS && i < sizeof(conv->counts)/sizeof(conv->counts[0]))
+            conv->counts[i] = v[0];
+    }
+
+    GETNUM(&nstrs);
+    if (nstrs > (bit64)(end - p)) {
+        r = IMAP_MAILBOX_BADFORMAT;
+        goto done;
+    }
+    strs = xmalloc((nstrs + 1) * sizeof(*strs));
+    lens = xmalloc((nstrs + 1) * sizeof(*lens));
+    for (i = 0; i < nstrs; i++) {
+        GETNUM(&v[0]);
+        if (v[0] > (bit64)(end - p)) {
+            r = IMAP_MAILBOX_BADFORMAT;
+            goto done;
+        }
+        strs[i] = p;
+        lens[i] = v[0];
+        p += v[0];
+    }
+
+    /* subject */
+    GETNUM(&v[0]);
+    if (v[0] > nstrs) goto badformat;
+    if (flags & CONV_WITHSUBJECT)
+        conv->subject = STR(v[0]);
+
+    GETNUM(&n);
+    for (i = 0; i < n; i++) {
+        r = parsevarint_signed(&p, end, &delta);
+        if (r) goto done;
+        number += delta;
+        r = parsevarint_signed(&p, end, &delta);
+        if (r) goto done;
+        GETNUM(&v[0]);
+        GETNUM(&v[1]);
+        GETNUM(&v[2]);
+        if (flags & CONV_WITHFOLDERS) {
+            conv_folder_t *folder = conversation_get_folder(conv, number, 1);
+            if (!folder) goto badformat;
+            folder->modseq = conv->modseq - delta;
+            folder->num_records = v[0];
+            folder->exists = v[1];
+            folder->unseen = v[2];
+        }
+    }
+
+    GETNUM(&n);
+    for (i = 0; i < n; i++) {
+        int j;
+        for (j = 0; j < 6; j++)
+            GETNUM(&v[j]);
+        for (j = 0; j < 4; j++)
+            if (v[j] > nstrs) goto badformat;
+        if (flags & CONV_WITHSENDERS) {
+            char *name = STR(v[0]);
+            char *route = STR(v[1]);
+            char *mailbox = STR(v[2]);
+            char *domain = STR(v[3]);
+            conversation_update_sender(conv, name, route, mailbox, domain,
+                                       v[4], v[5]);
+            free(name);
+            free(route);
+            free(mailbox);
+            free(domain);
+        }
+    }
+
+    GETNUM(&n);
+    conv_thread_t **nextthread = &conv->thread;
+    for (i = 0; i < n; i++) {
+        if (end - p < MESSAGE_GUID_SIZE) goto badformat;
+        const char *guid = p;
+        p += MESSAGE_GUID_SIZE;
+        GETNUM(&v[0]);
+        GETNUM(&v[1]);
+        if (flags & CONV_WITHTHREAD) {
+            conv_thread_t *thread = xzmalloc(sizeof(conv_thread_t));
+            message_guid_import(&thread->guid, guid);
+            thread->exists = v[0];
+            thread->internaldate = v[1];
+            *nextthread = thread;
+            nextthread = &thread->next;
+        }
+    }
+
+    conv->flags = flags;
+    conv->version = data[0] & 0x7f;
+
+done:
+    free(strs);
+    free(lens);
+    return r;
+
+badformat:
+    r = IMAP_MAILBOX_BADFORMAT;
+    goto done;
+
+#undef GETNUM
+#undef STR
+}
+
 EXPORTED int conversation_parse(const char *data, size_t datalen,
                                 conversation_t *conv, int flags)
 {
@@ -1427,6 +1923,12 @@ EXPORTED int conversation_parse(const char *data, size_t datalen,
     bit64 version;
     int r;
 
+    if (datalen && (data[0] & CONVERSATIONS_BINARY_FLAG)) {
+        if ((data[0] & 0x7f) > CONVERSATIONS_RECORD_VERSION)
+            return IMAP_MAILBOX_BADFORMAT;
+        return conversation_parse_binary(data, datalen, conv, flags);
+    }
+
     r = parsenum(data, &rest, datalen, &version);
     if (r) return IMAP_MAILBOX_BADFORMAT;
 
@@ -1460,6 +1962,11 @@ EXPORTED int conversation_load_advanced(struct conversations_state *state,
     int r;
 
     snprintf(bkey, sizeof(bkey), "B" CONV_FMT, cid);
+
+    /* callers get their own copy, so make sure the DB is current */
+    r = _conv_cache_flushone(state, bkey);
+    if (r) return r;
+
     r = cyrusdb_fetch(state->db,
                   bkey, strlen(bkey),
                   &data, &datalen,
@@ -1502,8 +2009,8 @@ EXPORTED int conversation_load(struct conversations_state *state,
 
 /* Parse just enough of the B record to retrieve the modseq.
  * Fortunately the modseq is the first field after the record version
- * number, given the way that _conversation_save() and dlist works.  See
- * _conversation_load() for the full shebang. */
+ * number in both formats, given the way that conv_to_binary() and
+ * dlist work.  See conversation_parse() for the full shebang. */
 static int _conversation_load_modseq(const char *data, int datalen,
                                      modseq_t *modseqp)
 {
@@ -1512,6 +2019,13 @@ static int _conversation_load_modseq(const char *data, int datalen,
     bit64 version = ~0ULL;
     int r;
 
+    if (datalen && (data[0] & CONVERSATIONS_BINARY_FLAG)) {
+        if ((data[0] & 0x7f) > CONVERSATIONS_RECORD_VERSION)
+            return IMAP_MAILBOX_BADFORMAT;
+        p++;
+        return parsevarint(&p, end, modseqp);
+    }
+
     r = parsenum(p, &p, (end-p), &version);
     if (r || version > CONVERSATIONS_RECORD_VERSION)
         return IMAP_MAILBOX_BADFORMAT;
@@ -1534,9 +2048,17 @@ EXPORTED int conversation_get_modseq(struct conversations_state *state,
     const char *data;
     size_t datalen;
     char bkey[CONVERSATION_ID_STRMAX+2];
+    conversation_t *conv;
     int r;
 
     snprintf(bkey, sizeof(bkey), "B" CONV_FMT, cid);
+
+    conv = hash_lookup(bkey, &state->convcache);
+    if (conv) {
+        *modseqp = conv->num_records ? conv->modseq : 0;
+        return 0;
+    }
+
     r = cyrusdb_fetch(state->db,
                   bkey, strlen(bkey),
                   &data, &datalen,
@@ -2316,7 +2838,7 @@ EXPORTED int conversations_update_record(struct conversations_state *cstate,
         if (r) goto done;
     }
     else if (record->cid) {
-        r = conversation_load(cstate, record->cid, &conv);
+        r = _conversation_cache_load(cstate, record->cid, &conv);
         if (r) goto done;
         /* add subject if it loses draft flag */
         if (conv && !conv->subject && !(record->system_flags & FLAG_DRAFT)) {
@@ -2334,6 +2856,10 @@ EXPORTED int conversations_update_record(struct conversations_state *cstate,
             }
             conv = conversation_new();
         }
+        /* a bulk change may touch this conversation many times, so
+         * keep it decoded until commit */
+        r = _conversation_cache_insert(cstate, record->cid, conv);
+        if (r) goto done;
     }
 
     struct emailcounts ecounts = EMAILCOUNTS_INIT;
@@ -2477,7 +3003,8 @@ EXPORTED int conversations_update_record(struct conversations_state *cstate,
     r = conversation_save(cstate, record->cid, conv);
 
 done:
-    conversation_free(conv);
+    if (conv && !(conv->flags & CONV_ISCACHED))
+        conversation_free(conv);
     free(delta_counts);
     return r;
 }
@@ -2754,6 +3281,11 @@ EXPORTED int conversations_prune(struct conversations_state *state,
                                  unsigned int *ndeletedp)
 {
     struct prune_rock rock = { state, NULL, ARRAYU64_INITIALIZER, thresh, 0, 0 };
+    int r;
+
+    /* the B records must all be in the DB to be seen */
+    r = conversations_flushconvs(state);
+    if (r) return r;
 
     if (config_getswitch(IMAPOPT_CONVERSATIONS_KEEP_EXISTING)) {
         // these will be added in CID order, so we don't need to sort them
@@ -2945,6 +3477,9 @@ EXPORTED int conversations_zero_counts(struct conversations_state *state)
 {
     int r = 0;
 
+    r = conversations_flushconvs(state);
+    if (r) return r;
+
     /* wipe B counts */
     r = cyrusdb_foreach(state->db, "B", 1, NULL, zero_b_cb,
                         state, &state->txn);
@@ -2997,23 +3532,87 @@ done:
 
 EXPORTED int conversations_cleanup_zero(struct conversations_state *state)
 {
+    int r = conversations_flushconvs(state);
+    if (r) return r;
+
     /* check B counts */
     return cyrusdb_foreach(state->db, "B", 1, NULL, cleanup_b_cb,
                            state, &state->txn);
 }
 
+/* Render a record as text: binary B and F records in their old dlist
+ * form, everything else unchanged.  Undumping the text is fine, as
+ * both formats are read back. */
+EXPORTED void conversations_record_totext(struct conversations_state *state,
+                                          const char *key, size_t keylen,
+                                          const char *data, size_t datalen,
+                                          struct buf *buf)
+{
+    buf_reset(buf);
+
+    if (keylen && datalen && (data[0] & CONVERSATIONS_BINARY_FLAG)) {
+        if (key[0] == 'B') {
+            conversation_t conv = CONVERSATION_INIT;
+            if (!conversation_parse(data, datalen, &conv, CONV_WITHALL)) {
+                conv_to_text(&conv, buf, state->counted_flags ?
+                                         state->counted_flags->count : 0);
+                conversation_fini(&conv);
+                return;
+            }
+            conversation_fini(&conv);
+        }
+        else if (key[0] == 'F') {
+            conv_status_t status = CONV_STATUS_INIT;
+            if (!conversation_parsestatus(data, datalen, &status)) {
+                status_to_text(&status, buf);
+                return;
+            }
+        }
+    }
+
+    buf_setmap(buf, data, datalen);
+}
+
+struct dump_rock {
+    struct conversations_state *state;
+    FILE *fp;
+    struct buf buf;
+};
+
+static int dump_cb(void *rock,
+                   const char *key, size_t keylen,
+                   const char *data, size_t datalen)
+{
+    struct dump_rock *drock = (struct dump_rock *)rock;
+
+    conversations_record_totext(drock->state, key, keylen,
+                                data, datalen, &drock->buf);
+    fprintf(drock->fp, "%.*s\t%.*s\n", (int)keylen, key,
+            (int)drock->buf.len, drock->buf.s);
+
+    return 0;
+}
+
 EXPORTED void conversations_dump(struct conversations_state *state, FILE *fp)
 {
-    cyrusdb_dumpfile(state->db, "", 0, fp, &state->txn);
+    struct dump_rock rock = { state, fp, BUF_INITIALIZER };
+
+    conversations_flushconvs(state);
+    cyrusdb_foreach(state->db, "", 0, NULL, dump_cb, &rock, &state->txn);
+    buf_free(&rock.buf);
 }
 
 EXPORTED int conversations_truncate(struct conversations_state *state)
 {
+    conversations_dropconvs(state);
     return cyrusdb_truncate(state->db, &state->txn);
 }
 
 EXPORTED int conversations_undump(struct conversations_state *state, FILE *fp)
 {
+    int r = conversations_flushconvs(state);
+    if (r) return r;
+
     return cyrusdb_undumpfile(state->db, fp, &state->txn);
 }
 
@@ -67,11 +67,17 @@ struct mailbox;
 #define CONVERSATIONS_STATUS_VERSION 0
 #define CONVERSATIONS_RECORD_VERSION 1
 
+/* B and F records whose first byte has the high bit set are stored in
+ * the compact binary format, with the record version in the low bits.
+ * Older records are dlists prefixed with a decimal version. */
+#define CONVERSATIONS_BINARY_FLAG 0x80
+
 #define CONV_ISDIRTY     (1<<0)
 #define CONV_WITHFOLDERS (1<<1)
 #define CONV_WITHSENDERS (1<<2)
 #define CONV_WITHSUBJECT (1<<3)
 #define CONV_WITHTHREAD  (1<<4)
+#define CONV_ISCACHED    (1<<5)  /* owned by the conversations_state */
 
 #define CONV_WITHALL CONV_WITHFOLDERS|CONV_WITHSENDERS|\
                      CONV_WITHSUBJECT|CONV_WITHTHREAD
@@ -90,6 +96,7 @@ struct conversations_state {
     strarray_t *counted_flags;
     strarray_t *folder_names;
     hash_table folderstatus;
+    hash_table convcache;   /* conversation_t by B key, written at commit */
     struct conv_quota quota;
     int trashfolder;
     char *trashmboxname;
@@ -282,6 +289,17 @@ extern int conversation_load_advanced(struct conversations_state *state,
 extern int conversation_load(struct conversations_state *state,
                              conversation_id_t cid,
                              conversation_t **convp);
+/* As conversation_load(), but starts a new conversation if there is
+ * none, and the conversation belongs to 'state': changes to it are
+ * written at conversations_commit() and dropped by conversations_abort(),
+ * and the caller must not free it. */
+extern int conversation_load_cached(struct conversations_state *state,
+                                    conversation_id_t cid,
+                                    conversation_t **convp);
+extern void conversations_record_totext(struct conversations_state *state,
+                                        const char *key, size_t keylen,
+                                        const char *data, size_t datalen,
+                                        struct buf *buf);
 extern int conversation_parse(const char *data, size_t datalen,
                               conversation_t *conv, int flags);
 extern int conversation_store(struct conversations_state *state,
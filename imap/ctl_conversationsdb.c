@@ -388,6 +388,8 @@ static unsigned int diff_records(struct conversations_state *a,
     struct cursor ca, cb;
     int keydelta;
     int delta;
+    struct buf texta = BUF_INITIALIZER;
+    struct buf textb = BUF_INITIALIZER;
 
     cursor_init(&ca, a->db, &a->txn);
     ra = cursor_next(&ca);
@@ -418,7 +420,22 @@ static unsigned int diff_records(struct conversations_state *a,
 
         /* both exist an are the same key */
         delta = blob_compare(ca.data, ca.datalen, cb.data, cb.datalen);
-        if (delta) {
+        if (delta && (ca.key[0] == 'B' || ca.key[0] == 'F')) {
+            /* the real DB may still have records in the old text
+             * format, so compare what they say rather than the bytes */
+            conversations_record_totext(a, ca.key, ca.keylen,
+                                        ca.data, ca.datalen, &texta);
+            conversations_record_totext(b, cb.key, cb.keylen,
+                                        cb.data, cb.datalen, &textb);
+            delta = buf_cmp(&texta, &textb);
+            if (delta && verbose)
+                printf("REAL: \"%.*s\" data \"%.*s\"\n"
+                       "TEMP: \"%.*s\" data \"%.*s\"\n",
+                       (int)ca.keylen, ca.key, (int)texta.len, texta.s,
+                       (int)cb.keylen, cb.key, (int)textb.len, textb.s);
+            if (delta) ndiffs++;
+        }
+        else if (delta) {
             ndiffs++;
             if (verbose)
                 printf("REAL: \"%.*s\" data \"%.*s\"\n"
@@ -431,6 +448,9 @@ static unsigned int diff_records(struct conversations_state *a,
         rb = next_diffable_record(&cb);
     }
 
+    buf_free(&texta);
+    buf_free(&textb);
+
     return ndiffs;
 }
 
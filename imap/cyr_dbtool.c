@@ -141,6 +141,34 @@ static int aprinter_cb(void *rock,
     return 0;
 }
 
+static void repack_cb(const struct cyrusdb_repack_progress *progress,
+                      void *rock __attribute__((unused)))
+{
+    switch (progress->phase) {
+    case CYRUSDB_REPACK_COPY:
+        fprintf(stderr, "%s: copied %lu of %lu records in %.3f seconds\n",
+                progress->fname, (unsigned long)progress->records,
+                (unsigned long)progress->total, progress->elapsed);
+        break;
+    case CYRUSDB_REPACK_REPLAY:
+        fprintf(stderr, "%s: copied %lu records, catching up with changes\n",
+                progress->fname, (unsigned long)progress->records);
+        break;
+    case CYRUSDB_REPACK_DONE:
+        printf("Repacked %s: %lu records, %lu => %lu bytes,"
+               " %lu changes replayed, %.3f seconds (%.3f locked)\n",
+               progress->fname, (unsigned long)progress->records,
+               (unsigned long)progress->old_size,
+               (unsigned long)progress->new_size,
+               (unsigned long)progress->replayed,
+               progress->elapsed, progress->locked);
+        break;
+    }
+
+    /* still count it in the stats */
+    cyrus_repack_progress(progress, NULL);
+}
+
 static void batch_commands(struct db *db)
 {
     struct buf cmd = BUF_INITIALIZER;
@@ -386,6 +414,7 @@ int main(int argc, char *argv[])
             printf("Yes, consistent\n");
         }
     } else if (!strcmp(action, "repack")) {
+        cyrusdb_set_repack_progress(&repack_cb, NULL);
         if (cyrusdb_repack(db))
             printf("Failed to repack\n");
     } else if (!strcmp(action, "damage")) {
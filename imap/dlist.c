@@ -174,6 +174,8 @@ static int reservefile(struct protstream *in, const char *part,
 {
     FILE *file;
     char buf[8192+1];
+    struct message_guid_ctx guidctx;
+    struct message_guid guid2;
     int r = 0;
 
     /* XXX - write to a temporary file then move in to place! */
@@ -191,7 +193,8 @@ static int reservefile(struct protstream *in, const char *part,
          * to avoid losing protocol sync */
     }
 
-    /* XXX - calculate sha1 on the fly? */
+    /* calculate the sha1 on the fly, rather than reading it back */
+    message_guid_init(&guidctx);
     while (size) {
         size_t n = prot_read(in, buf, size > 8192 ? 8192 : size);
         if (!n) {
@@ -202,6 +205,7 @@ static int reservefile(struct protstream *in, const char *part,
         }
         size -= n;
         if (!file) continue;
+        message_guid_update(&guidctx, buf, n);
         if (fwrite(buf, 1, n, file) != n) {
             syslog(LOG_ERR, "IOERROR: writing to file '%s': %m", *fname);
             r = IMAP_IOERROR;
@@ -209,9 +213,18 @@ static int reservefile(struct protstream *in, const char *part,
         }
     }
 
+    message_guid_final(&guidctx, &guid2);
+
     if (r)
         goto error;
 
+    if (!message_guid_equal(&guid2, guid)) {
+        syslog(LOG_ERR, "IOERROR: GUID mismatch on upload %s (%s)",
+               message_guid_encode(guid), *fname);
+        r = IMAP_IOERROR;
+        goto error;
+    }
+
     /* Make sure that message flushed to disk just incase mmap has problems */
     fflush(file);
     if (ferror(file)) {
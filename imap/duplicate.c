@@ -101,7 +101,7 @@ EXPORTED int duplicate_init(const char *fname)
         fname = tofree;
     }
 
-    r = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &dupdb);
+    r = cyrusdb_open(DB, fname, CYRUSDB_CREATE|CYRUSDB_BLOOM, &dupdb);
     if (r != 0) {
         syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
                cyrusdb_strerror(r));
@@ -65,6 +65,7 @@
 #include "assert.h"
 #include "charset.h"
 #include "cyr_lock.h"
+#include "cyrusdb.h"
 #include "gmtoff.h"
 #include "iptostring.h"
 #include "global.h"
@@ -72,6 +73,7 @@
 #include "libcyr_cfg.h"
 #include "mboxlist.h"
 #include "mutex.h"
+#include "prometheus.h"
 #include "prot.h" /* for PROT_BUFSIZE */
 #include "strarray.h"
 #include "userdeny.h"
@@ -180,6 +182,17 @@ static void cyrus_modules_done()
     }
 }
 
+EXPORTED void cyrus_repack_progress(const struct cyrusdb_repack_progress *progress,
+                                   void *rock __attribute__((unused)))
+{
+    if (progress->phase != CYRUSDB_REPACK_DONE) return;
+
+    prometheus_increment(CYRUS_DB_REPACK_TOTAL);
+    prometheus_apply_delta(CYRUS_DB_REPACK_SECONDS_TOTAL, progress->elapsed);
+    prometheus_apply_delta(CYRUS_DB_REPACK_LOCKED_SECONDS_TOTAL,
+                           progress->locked);
+}
+
 /* Called before a cyrus application starts (but after command line parameters
  * are read) */
 EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flags, int config_need_data)
@@ -380,9 +393,15 @@ EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flag
                                   config_getswitch(IMAPOPT_SQL_USESSL));
         libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
                                   config_getswitch(IMAPOPT_SKIPLIST_ALWAYS_CHECKPOINT));
+        libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_SNAPSHOT_READS,
+                                  config_getswitch(IMAPOPT_TWOSKIP_SNAPSHOT_READS));
+        libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_BLOOM_FILTERS,
+                                  config_getswitch(IMAPOPT_TWOSKIP_BLOOM_FILTERS));
 
         /* Not until all configuration parameters are set! */
         libcyrus_init();
+
+        cyrusdb_set_repack_progress(&cyrus_repack_progress, NULL);
     }
 
     /* debug lock timing */
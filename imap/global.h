@@ -85,6 +85,11 @@ extern void cyrus_modules_add(void (*done)(void*), void *rock);
 /* Shutdown a cyrus process */
 extern void cyrus_done(void);
 
+/* Account for a database repack in the prometheus stats */
+struct cyrusdb_repack_progress;
+extern void cyrus_repack_progress(const struct cyrusdb_repack_progress *progress,
+                                  void *rock);
+
 /* sasl configuration */
 extern int mysasl_config(void *context,
                          const char *plugin_name,
@@ -44,6 +44,7 @@
 #include <config.h>
 
 #include <errno.h>
+#include <limits.h>
 
 #include "acl.h"
 #include "append.h"
@@ -51,9 +52,11 @@
 #include "http_jmap.h"
 #include "http_proxy.h"
 #include "http_ws.h"
+#include "idle.h"
 #include "mboxname.h"
 #include "proxy.h"
 #include "times.h"
+#include "userdeny.h"
 #include "sync_support.h"
 #include "syslog.h"
 #include "user.h"
@@ -1121,8 +1124,182 @@ static int jmap_ws(struct buf *inbuf, struct buf *outbuf,
     return ret;
 }
 
-/* Handle a GET on the eventsource endpoint */
-static int jmap_eventsource(struct transaction_t *txn __attribute__((unused)))
+/* The data types which can be pushed, and the counters that their /get
+ * methods report as state (see jmap_highestmodseq()) */
+static const struct eventsource_type {
+    const char *name;
+    size_t offset;
+} eventsource_types[] = {
+    { "Mailbox",         offsetof(struct mboxname_counters, mailmodseq)       },
+    { "Email",           offsetof(struct mboxname_counters, mailmodseq)       },
+    { "EmailDelivery",   offsetof(struct mboxname_counters, mailmodseq)       },
+    { "Thread",          offsetof(struct mboxname_counters, mailmodseq)       },
+    { "Calendar",        offsetof(struct mboxname_counters, caldavmodseq)     },
+    { "CalendarEvent",   offsetof(struct mboxname_counters, caldavmodseq)     },
+    { "AddressBook",     offsetof(struct mboxname_counters, carddavmodseq)    },
+    { "ContactGroup",    offsetof(struct mboxname_counters, carddavmodseq)    },
+    { "Contact",         offsetof(struct mboxname_counters, carddavmodseq)    },
+    { "EmailSubmission", offsetof(struct mboxname_counters, submissionmodseq) },
+    { NULL,              0                                                    }
+};
+
+#define EVENTSOURCE_MODSEQ(counters, type) \
+    (*(modseq_t *) ((char *) (counters) + (type)->offset))
+
+/* idled forgets its watchers after half an hour, so clients
+ * must reconnect before then */
+#define EVENTSOURCE_MAXAGE  (30 * 60)
+
+/* Write one event to the open event stream */
+static void eventsource_event(struct transaction_t *txn,
+                              const char *event, json_t *data)
 {
-    return HTTP_NO_CONTENT;
+    char *dump = json_dumps(data, JSON_PRESERVE_ORDER | JSON_COMPACT);
+
+    buf_reset(&txn->buf);
+    buf_printf(&txn->buf, "event: %s\ndata: %s\n\n", event, dump);
+    write_body(0, txn, buf_base(&txn->buf), buf_len(&txn->buf));
+    prot_flush(httpd_out);
+
+    free(dump);
+}
+
+/* Handle a GET on the eventsource endpoint (RFC 8620, Section 7.3) */
+static int jmap_eventsource(struct transaction_t *txn)
+{
+    const struct eventsource_type *types[sizeof(eventsource_types) /
+                                         sizeof(eventsource_types[0])];
+    modseq_t states[sizeof(types) / sizeof(types[0])];
+    struct mboxname_counters counters;
+    struct strlist *param;
+    int closeafter = 0, ping = 0;
+    char *inboxname = NULL;
+    time_t now, deadline, lastwrite;
+    int i, n = 0, flags, r;
+
+    /* Parse the parameters */
+    if ((param = hash_lookup("types", &txn->req_qparams))) {
+        strarray_t *names = strarray_split(param->s, ",", STRARRAY_TRIM);
+
+        for (i = 0; eventsource_types[i].name; i++) {
+            if (!strcmp(param->s, "*") ||
+                strarray_find(names, eventsource_types[i].name, 0) >= 0) {
+                types[n++] = &eventsource_types[i];
+            }
+        }
+        strarray_free(names);
+    }
+    if ((param = hash_lookup("closeafter", &txn->req_qparams))) {
+        if (!strcmp(param->s, "state")) closeafter = 1;
+        else if (strcmp(param->s, "no")) {
+            txn->error.desc = "Invalid closeafter parameter";
+            return HTTP_BAD_REQUEST;
+        }
+    }
+    if ((param = hash_lookup("ping", &txn->req_qparams))) {
+        char *end = NULL;
+        long val = strtol(param->s, &end, 10);
+
+        if (!*param->s || *end || val < 0 || val > INT_MAX) {
+            txn->error.desc = "Invalid ping parameter";
+            return HTTP_BAD_REQUEST;
+        }
+        ping = val;
+    }
+
+    /* Read the current states of the account */
+    inboxname = mboxname_user_mbox(httpd_userid, NULL);
+    r = mboxname_read_counters(inboxname, &counters);
+    if (r) {
+        syslog(LOG_ERR, "mboxname_read_counters(%s) failed: %s",
+               inboxname, error_message(r));
+        free(inboxname);
+        txn->error.desc = "mboxname_read_counters() failed";
+        return HTTP_SERVER_ERROR;
+    }
+    for (i = 0; i < n; i++) states[i] = EVENTSOURCE_MODSEQ(&counters, types[i]);
+
+    /* Setup for an uncompressed chunked response */
+    txn->flags.te |= TE_CHUNKED;
+    txn->resp_body.enc.type = CE_IDENTITY;
+    txn->resp_body.enc.proc = NULL;
+    txn->resp_body.type = "text/event-stream";
+
+    /* Response should not be cached */
+    txn->flags.cc |= CC_NOCACHE | CC_NOSTORE | CC_REVALIDATE;
+
+    /* Short-circuit for HEAD request */
+    if (txn->meth == METH_HEAD) {
+        response_header(HTTP_OK, txn);
+        free(inboxname);
+        return 0;
+    }
+
+    write_body(HTTP_OK, txn, NULL, 0);
+    prot_flush(httpd_out);
+
+    /* Watch for changes to any of the user's mailboxes */
+    idle_start_user(httpd_userid);
+
+    now = lastwrite = time(NULL);
+    deadline = now + EVENTSOURCE_MAXAGE;
+
+    while ((flags = idle_wait_timeout(httpd_in->fd,
+                                      ping ? ping : EVENTSOURCE_MAXAGE))) {
+        now = time(NULL);
+
+        /* Any input means that the client went away */
+        if ((flags & IDLE_INPUT) || now >= deadline) break;
+
+        if (flags & IDLE_ALERT) {
+            if (shutdown_file(NULL, 0) ||
+                userdeny(httpd_userid, config_ident, NULL, 0)) break;
+        }
+
+        if ((flags & IDLE_MAILBOX) && n &&
+            !mboxname_read_counters(inboxname, &counters)) {
+            json_t *changed = json_object();
+
+            for (i = 0; i < n; i++) {
+                modseq_t modseq = EVENTSOURCE_MODSEQ(&counters, types[i]);
+
+                if (modseq == states[i]) continue;
+
+                states[i] = modseq;
+                buf_reset(&txn->buf);
+                buf_printf(&txn->buf, MODSEQ_FMT, modseq);
+                json_object_set_new(changed, types[i]->name,
+                                    json_string(buf_cstring(&txn->buf)));
+            }
+
+            if (json_object_size(changed)) {
+                json_t *jstate = json_pack("{s:s s:{s:o}}",
+                                           "@type", "StateChange",
+                                           "changed", httpd_userid, changed);
+
+                eventsource_event(txn, "state", jstate);
+                json_decref(jstate);
+                lastwrite = now;
+
+                if (closeafter) break;
+            }
+            else json_decref(changed);
+        }
+
+        if (ping && now - lastwrite >= ping) {
+            json_t *jping = json_pack("{s:i}", "interval", ping);
+
+            eventsource_event(txn, "ping", jping);
+            json_decref(jping);
+            lastwrite = now;
+        }
+    }
+
+    idle_stop_user(httpd_userid);
+
+    /* Terminate the event stream */
+    write_body(0, txn, NULL, 0);
+
+    free(inboxname);
+    return 0;
 }
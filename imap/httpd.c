@@ -711,7 +711,7 @@ int service_init(int argc __attribute__((unused)),
     global_sasl_init(1, 1, mysasl_cb);
 
     /* setup for sending IMAP IDLE notifications */
-    idle_enabled();
+    idle_init();
 
     /* Set namespace */
     if ((r = mboxname_init_namespace(&httpd_namespace, 1)) != 0) {
@@ -1031,6 +1031,8 @@ void shut_down(int code)
 
     annotatemore_close();
 
+    idle_done();
+
     if (httpd_in) {
         prot_NONBLOCK(httpd_in);
         prot_fill(httpd_in);
@@ -60,6 +60,9 @@
 #include "global.h"
 #include "util.h"
 
+/* generated headers are not necessarily in current directory */
+#include "imap/imap_err.h"
+
 HIDDEN const char *idle_method_desc = "no";
 
 /* link to idled */
@@ -68,6 +71,15 @@ static struct sockaddr_un idle_remote;
 /* true if we've successfully told the idled
  * that we want to be notified of changes */
 static int idle_started;
+static int idle_user_started;
+
+/* notifications which arrived while waiting for something else, to be
+ * returned by the next idle_wait() */
+static idle_flags_t idle_pending;
+
+/* how often to check that idled is still there while waiting
+ * for it to answer a PARK */
+#define IDLE_PARK_WAIT 5
 
 /* Send the message 'which' about the mailbox 'mboxname' to the idled.
  * Returns 0 on success or an IMAP error code on failure */
@@ -177,6 +189,12 @@ EXPORTED void idle_start(const char *mboxname)
 }
 
 EXPORTED int idle_wait(int otherfd)
+{
+    return idle_wait_timeout(otherfd,
+                             config_getduration(IMAPOPT_IMAPIDLEPOLL, 's'));
+}
+
+EXPORTED int idle_wait_timeout(int otherfd, int idle_timeout)
 {
     fd_set rfds;
     int maxfd = -1;
@@ -184,10 +202,15 @@ EXPORTED int idle_wait(int otherfd)
     struct timeval timeout;
     int r;
     int flags = 0;
-    int idle_timeout = config_getduration(IMAPOPT_IMAPIDLEPOLL, 's');
 
     if (!idle_enabled()) return 0;
 
+    if (idle_pending) {
+        flags = idle_pending;
+        idle_pending = 0;
+        return flags;
+    }
+
     /* If idled was not contacted, we still listen on the socket,
      * because we might get ALERTs, but we won't get mailbox
      * notifications.  The poll timeout controls how quickly
@@ -265,6 +288,126 @@ EXPORTED void idle_stop(const char *mboxname)
     idle_started = 0;
 }
 
+EXPORTED void idle_start_user(const char *userid)
+{
+    int r;
+
+    if (!idle_enabled()) return;
+
+    r = idle_send_msg(IDLE_MSG_INIT_USER, userid);
+    if (r) {
+        syslog(LOG_ERR, "IDLE: error sending message "
+                        "INIT_USER to idled for user %s: %s.",
+                        userid, error_message(r));
+        return;
+    }
+
+    idle_user_started = 1;
+}
+
+EXPORTED void idle_stop_user(const char *userid)
+{
+    int r;
+
+    if (!idle_user_started) return;
+
+    r = idle_send_msg(IDLE_MSG_DONE_USER, userid);
+    if (r && (r != ENOENT)) {
+        /* See comment in idle_notify() about ENOENT */
+        syslog(LOG_ERR, "IDLE: error sending message "
+                        "DONE_USER to idled for user %s: %s.",
+                        userid, error_message(r));
+    }
+
+    idle_user_started = 0;
+}
+
+/* Wait for idled to say whether it took a parked connection, keeping
+ * any notifications which arrive meanwhile for idle_wait().  Once the
+ * descriptors are in flight only idled knows who owns the connection,
+ * so we don't give up waiting unless idled has gone away, taking its
+ * copies with it. */
+static int idle_park_answer(void)
+{
+    int s = idle_get_sock();
+    struct sockaddr_un from;
+    struct timeval timeout;
+    idle_message_t msg;
+    fd_set rfds;
+    int r;
+
+    for (;;) {
+        FD_ZERO(&rfds);
+        FD_SET(s, &rfds);
+        timeout.tv_sec = IDLE_PARK_WAIT;
+        timeout.tv_usec = 0;
+
+        r = signals_select(s+1, &rfds, NULL, NULL, &timeout);
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            syslog(LOG_ERR, "IDLE: select failed: %m");
+            return IMAP_IOERROR;
+        }
+
+        if (r == 0) {
+            /* a busy idled gets there eventually, a dead one never */
+            r = idle_send_msg(IDLE_MSG_NOOP, NULL);
+            if (r == ENOENT || r == ECONNREFUSED) {
+                syslog(LOG_ERR, "IDLE: idled went away before answering PARK");
+                return IMAP_SERVER_UNAVAILABLE;
+            }
+            syslog(LOG_WARNING, "IDLE: still waiting for idled to answer PARK");
+            continue;
+        }
+
+        while (idle_recv(&from, &msg)) {
+            switch (msg.which) {
+            case IDLE_MSG_PARK_OK:
+                return 0;
+            case IDLE_MSG_PARK_NO:
+                return IMAP_SERVER_UNAVAILABLE;
+            case IDLE_MSG_NOTIFY:
+                idle_pending |= IDLE_MAILBOX;
+                break;
+            case IDLE_MSG_ALERT:
+                idle_pending |= IDLE_ALERT;
+                break;
+            }
+        }
+    }
+}
+
+EXPORTED int idle_park(const char *mboxname, int clientfd, int statefd)
+{
+    idle_message_t msg;
+    int fds[2] = { clientfd, statefd };
+    int r;
+
+    if (!idle_started) return IMAP_SERVER_UNAVAILABLE;
+
+    msg.which = IDLE_MSG_PARK;
+    xstrncpy(msg.mboxname, mboxname, sizeof(msg.mboxname));
+
+    r = idle_send_fds(&idle_remote, &msg, fds, 2);
+    if (r) return r;
+
+    return idle_park_answer();
+}
+
+EXPORTED int idle_unpark(int sock, int *clientfdp, int *statefdp)
+{
+    int fds[2];
+    int r;
+
+    r = idle_take_fds(sock, fds, 2);
+    if (r) return r;
+
+    *clientfdp = fds[0];
+    *statefdp = fds[1];
+
+    return 0;
+}
+
 EXPORTED void idle_done(void)
 {
     /* close the local socket */
@@ -79,9 +79,34 @@ void idle_start(const char *mboxname);
  */
 int idle_wait(int otherfd);
 
+/* As idle_wait(), but double-checks every 'timeout' seconds rather
+ * than at the imapidlepoll interval. */
+int idle_wait_timeout(int otherfd, int timeout);
+
 /* Stop IDLEing on 'mailbox'. */
 void idle_stop(const char *mboxname);
 
+/* Start and stop being notified of changes to any mailbox belonging
+ * to 'userid', for example to push them to a client.  These arrive
+ * from idle_wait() as IDLE_MAILBOX, alongside any from idle_start(). */
+void idle_start_user(const char *userid);
+void idle_stop_user(const char *userid);
+
+/* Hand the client connection 'clientfd' and the session state saved
+ * in 'statefd' over to idled while IDLEing on 'mboxname', so that this
+ * process can go on to other work.  Must be called between idle_start()
+ * and idle_stop().  Waits for idled's answer however long it takes,
+ * and returns 0 if idled now holds copies of both descriptors, or an
+ * IMAP error code if the caller should keep idling itself (idled
+ * refuses unless it can reach the resume service, and has none if it
+ * exits first).  See imapd's "imapidlepark" option. */
+int idle_park(const char *mboxname, int clientfd, int statefd);
+
+/* Take a parked client handed back by idled on the socket 'sock', as
+ * the descriptors passed to idle_park().  Returns 0 on success or an
+ * IMAP error code. */
+int idle_unpark(int sock, int *clientfdp, int *statefdp);
+
 /* Clean up when IDLE is completed. */
 void idle_done(void);
 
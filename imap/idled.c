@@ -45,6 +45,7 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sysexits.h>
 #include <syslog.h>
 #include <sys/stat.h>
@@ -55,27 +56,91 @@
 #endif
 #include <signal.h>
 #include <fcntl.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include "idlemsg.h"
 #include "global.h"
 #include "mboxlist.h"
+#include "prometheus.h"
+#include "ptrarray.h"
 #include "xmalloc.h"
+#include "xstrlcpy.h"
 #include "hash.h"
 
 extern int optind;
 extern char *optarg;
 
+/* most messages to read from the socket before looking at anything else */
+#define IDLED_BATCH 1024
+
+/* most parked connections to look at per wakeup */
+#define IDLED_PARK_EVENTS 256
+
+/* how often to look for parked connections which have timed out */
+#define IDLED_PARK_SWEEP 60
+
+/* how many times, and how many microseconds apart, to try answering
+ * a PARK when the imapd's socket is full */
+#define IDLED_PARK_TRIES 50
+#define IDLED_PARK_RETRY 20000
+
 static int verbose = 0;
 static int debugmode = 0;
 static time_t idle_timeout;
+static int notify_delay; /* milliseconds */
 
 struct ientry {
     struct sockaddr_un remote;
     time_t itime;
     struct ientry *next;
 };
+
+/* processes idling on a mailbox, by mailbox name */
 static struct hash_table itable;
 
+/* processes watching every mailbox of a user, by userid */
+static struct hash_table utable;
+static int nuserwatch; /* number of ientries in utable */
+
+/* mailboxes with a notification waiting to be sent, oldest first */
+struct pnotify {
+    char *mboxname;
+    struct timeval queued;
+    struct pnotify *next;
+};
+static struct hash_table ptable;
+static struct pnotify *pending_head;
+static struct pnotify **pending_tail = &pending_head;
+
+/* connections handed over by an imapd while idling (IDLE_MSG_PARK) */
+struct parked {
+    int fd;             /* the client connection */
+    int statefd;        /* its saved session state */
+    char *mboxname;
+    time_t ptime;
+    int waking;         /* on the wake list */
+    int deferred;       /* the resume service has been busy */
+    struct parked *next;
+};
+
+/* parked connections, by name of the mailbox they are idling on */
+static struct hash_table parktable;
+
+/* parked connections due to be handed back to imapd */
+static ptrarray_t wakelist = PTRARRAY_INITIALIZER;
+
+static time_t park_timeout;
+static int park_epfd = -1;
+
+/* has the resume service accepted a connection, and when did we last
+ * try it? */
+static int resume_ok;
+static time_t resume_checked;
+
+static void wake_mailbox(const char *mboxname);
+
 EXPORTED void fatal(const char *msg, int err)
 {
     if (debugmode) fprintf(stderr, "dying with %s %d\n",msg,err);
@@ -95,13 +160,36 @@ static int mbox_count_cb(const mbentry_t *mbentry __attribute__((unused)), void
     return 0;
 }
 
-/* remove an ientry from list of those idling on mboxname */
-static void remove_ientry(const char *mboxname,
+static double timeval_since(const struct timeval *then, const struct timeval *now)
+{
+    return (now->tv_sec - then->tv_sec) +
+           (now->tv_usec - then->tv_usec) / 1000000.0;
+}
+
+/* add an ientry to list of those idling on (or watching) key */
+static void add_ientry(struct hash_table *table, const char *key,
+                       const struct sockaddr_un *remote)
+{
+    struct ientry *t, *n;
+
+    t = (struct ientry *) hash_lookup(key, table);
+    n = (struct ientry *) xzmalloc(sizeof(struct ientry));
+    n->remote = *remote;
+    n->itime = time(NULL);
+    n->next = t;
+    hash_insert(key, n, table);
+
+    if (table == &utable) nuserwatch++;
+    prometheus_increment(CYRUS_IDLED_SUBSCRIPTIONS);
+}
+
+/* remove an ientry from list of those idling on (or watching) key */
+static void remove_ientry(struct hash_table *table, const char *key,
                           const struct sockaddr_un *remote)
 {
     struct ientry *t, *p = NULL;
 
-    t = (struct ientry *) hash_lookup(mboxname, &itable);
+    t = (struct ientry *) hash_lookup(key, table);
     while (t && memcmp(&t->remote, remote, sizeof(*remote))) {
         p = t;
         t = t->next;
@@ -113,8 +201,10 @@ static void remove_ientry(const char *mboxname,
             p = t->next; /* remove node */
 
             /* we just removed the data that the hash entry
-               was pointing to, so insert the new data */
-            hash_insert(mboxname, p, &itable);
+               was pointing to, so insert the new data,
+               or forget the key if that was the last one */
+            if (p) hash_insert(key, p, table);
+            else hash_del(key, table);
         }
         else {
             /* not the first ientry in the linked list */
@@ -122,71 +212,444 @@ static void remove_ientry(const char *mboxname,
             p->next = t->next; /* remove node */
         }
         free(t);
+
+        if (table == &utable) nuserwatch--;
+        prometheus_decrement(CYRUS_IDLED_SUBSCRIPTIONS);
+    }
+}
+
+/* send a NOTIFY for mboxname to every process listed under key */
+static void notify_ientries(struct hash_table *table, const char *key,
+                            const char *mboxname, time_t now)
+{
+    struct ientry *t, *n;
+    idle_message_t msg;
+    int r;
+
+    msg.which = IDLE_MSG_NOTIFY;
+    xstrncpy(msg.mboxname, mboxname, sizeof(msg.mboxname));
+
+    t = (struct ientry *) hash_lookup(key, table);
+    for ( ; t ; t = n) {
+        n = t->next;
+        if ((t->itime + idle_timeout) < now) {
+            /* This process has been idling for longer than the timeout
+             * period, so it probably died.  Remove it from the list.
+             */
+            if (verbose || debugmode)
+                syslog(LOG_DEBUG, "    TIMEOUT %s\n", idle_id_from_addr(&t->remote));
+
+            remove_ientry(table, key, &t->remote);
+        }
+        else { /* signal process to update */
+            if (verbose || debugmode)
+                syslog(LOG_DEBUG, "    fwd NOTIFY %s\n", idle_id_from_addr(&t->remote));
+
+            /* forward the received msg onto our clients */
+            r = idle_send(&t->remote, &msg);
+            if (r == EAGAIN || r == EWOULDBLOCK) {
+                /* its socket is full of notifications it hasn't read
+                 * yet, so it will look at the mailbox anyway */
+                continue;
+            }
+            if (r) {
+                /* ENOENT can happen as result of a race between delivering
+                 * messages and shutting down imapd.  It indicates that the
+                 * imapd's socket was unlinked, which means that imapd went
+                 * through it's graceful shutdown path, so don't syslog. */
+                if (r != ENOENT)
+                    syslog(LOG_ERR, "IDLE: error sending message "
+                                    "NOTIFY to imapd %s for mailbox %s: %s, "
+                                    "forgetting.",
+                                    idle_id_from_addr(&t->remote),
+                                    mboxname, error_message(r));
+                if (verbose || debugmode)
+                    syslog(LOG_DEBUG, "    forgetting %s\n", idle_id_from_addr(&t->remote));
+                remove_ientry(table, key, &t->remote);
+                continue;
+            }
+
+            prometheus_increment(CYRUS_IDLED_NOTIFY_SENT_TOTAL);
+        }
     }
 }
 
+/* queue a notification for mboxname, unless one is already waiting */
+static void queue_notify(const char *mboxname)
+{
+    struct pnotify *p;
+
+    prometheus_increment(CYRUS_IDLED_NOTIFY_RECEIVED_TOTAL);
 
+    if (hash_lookup(mboxname, &ptable)) {
+        prometheus_increment(CYRUS_IDLED_NOTIFY_COALESCED_TOTAL);
+        return;
+    }
 
-static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
+    /* nobody to tell? */
+    if (!hash_lookup(mboxname, &itable) && !nuserwatch &&
+        !hash_lookup(mboxname, &parktable))
+        return;
+
+    p = xzmalloc(sizeof(struct pnotify));
+    p->mboxname = xstrdup(mboxname);
+    gettimeofday(&p->queued, NULL);
+    hash_insert(mboxname, p, &ptable);
+    *pending_tail = p;
+    pending_tail = &p->next;
+
+    prometheus_increment(CYRUS_IDLED_PENDING_MAILBOXES);
+}
+
+/* send the notifications which have waited notify_delay, or all of
+ * them if force is set */
+static void flush_notify(int force)
 {
-    struct ientry *t, *n;
+    struct timeval now;
+    struct pnotify *p;
+
+    gettimeofday(&now, NULL);
+
+    while ((p = pending_head)) {
+        double waited = timeval_since(&p->queued, &now);
+
+        if (!force && waited * 1000 < notify_delay) break;
+
+        pending_head = p->next;
+        if (!pending_head) pending_tail = &pending_head;
+        hash_del(p->mboxname, &ptable);
+
+        if (verbose || debugmode)
+            syslog(LOG_DEBUG, "IDLE_MSG_NOTIFY '%s'\n", p->mboxname);
+
+        /* send a message to all clients idling on mboxname */
+        notify_ientries(&itable, p->mboxname, p->mboxname, now.tv_sec);
+
+        /* and hand back those parked on it, to be told themselves */
+        wake_mailbox(p->mboxname);
+
+        /* and to those watching its owner */
+        if (nuserwatch) {
+            char *userid = mboxname_to_userid(p->mboxname);
+            if (userid)
+                notify_ientries(&utable, userid, p->mboxname, now.tv_sec);
+            free(userid);
+        }
+
+        prometheus_decrement(CYRUS_IDLED_PENDING_MAILBOXES);
+        prometheus_apply_delta(CYRUS_IDLED_NOTIFY_DELAY_SECONDS_TOTAL, waited);
+
+        free(p->mboxname);
+        free(p);
+    }
+}
+
+/* how long until the oldest pending notification is due */
+static void notify_timeout(struct timeval *timeout)
+{
+    struct timeval now;
+    long usec;
+
+    if (!pending_head) return;
+
+    gettimeofday(&now, NULL);
+    usec = notify_delay * 1000L -
+           (long) (timeval_since(&pending_head->queued, &now) * 1000000);
+    if (usec < 0) usec = 0;
+
+    if (usec < timeout->tv_sec * 1000000L + timeout->tv_usec) {
+        timeout->tv_sec = usec / 1000000;
+        timeout->tv_usec = usec % 1000000;
+    }
+}
+
+/* forget a parked connection, closing our copies of its descriptors */
+static void unpark(struct parked *p)
+{
+    struct parked *t, **prev;
+
+    t = (struct parked *) hash_lookup(p->mboxname, &parktable);
+    if (t == p) {
+        if (p->next) hash_insert(p->mboxname, p->next, &parktable);
+        else hash_del(p->mboxname, &parktable);
+    }
+    else {
+        for (prev = &t->next; *prev != p; prev = &(*prev)->next);
+        *prev = p->next;
+    }
+
+    /* closing the last descriptor drops it from the epoll set */
+    close(p->fd);
+    close(p->statefd);
+    free(p->mboxname);
+    free(p);
+
+    prometheus_decrement(CYRUS_IDLED_PARKED_CONNECTIONS);
+}
+
+/*
+ * Parked connections can only be handed back through the resume
+ * service, so only take them once it has accepted a connection.  If it
+ * hasn't, try again now and then, as idled may start before it.
+ * Returns nonzero if connections may be parked.
+ */
+static int check_resume(void)
+{
+    const char *path = config_getstring(IMAPOPT_IDLERESUMESOCKET);
+    struct sockaddr_un addr;
+    time_t now = time(NULL);
+    int s;
+
+    if (resume_ok) return 1;
+    if (park_epfd == -1 || !config_getswitch(IMAPOPT_IMAPIDLEPARK)) return 0;
+    if (resume_checked && now < resume_checked + IDLED_PARK_SWEEP) return 0;
+    resume_checked = now;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlcpy(addr.sun_path, path, sizeof(addr.sun_path))
+        >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "IDLE: idleresumesocket %s too long, "
+                        "not parking connections", path);
+        return 0;
+    }
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1 ||
+        connect(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        syslog(LOG_WARNING, "IDLE: can't connect to %s: %m, "
+                            "not parking connections", path);
+        if (s != -1) close(s);
+        return 0;
+    }
+    close(s);
+
+    syslog(LOG_INFO, "IDLE: parking connections, resuming them via %s",
+           path);
+    resume_ok = 1;
+    return 1;
+}
+
+/* queue a parked connection to be handed back to imapd */
+static void wake_parked(struct parked *p)
+{
+    if (p->waking) return;
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (park_epfd != -1)
+        epoll_ctl(park_epfd, EPOLL_CTL_DEL, p->fd, NULL);
+#endif
+
+    p->waking = 1;
+    ptrarray_append(&wakelist, p);
+}
+
+/* take over a connection from an idling imapd */
+static void park(const char *mboxname, int fd, int statefd)
+{
+    struct parked *p;
+
+    p = xzmalloc(sizeof(struct parked));
+    p->fd = fd;
+    p->statefd = statefd;
+    p->mboxname = xstrdup(mboxname);
+    p->ptime = time(NULL);
+    p->next = (struct parked *) hash_lookup(mboxname, &parktable);
+    hash_insert(mboxname, p, &parktable);
+
+    prometheus_increment(CYRUS_IDLED_PARKED_TOTAL);
+    prometheus_increment(CYRUS_IDLED_PARKED_CONNECTIONS);
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (park_epfd != -1) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = p;
+        if (!epoll_ctl(park_epfd, EPOLL_CTL_ADD, fd, &ev))
+            return;
+
+        syslog(LOG_ERR, "IDLE: can't watch parked connection: %m");
+    }
+#endif
+
+    /* no way to watch it, so give it straight back */
+    wake_parked(p);
+}
+
+/* wake everything parked on mboxname */
+static void wake_mailbox(const char *mboxname)
+{
+    struct parked *p;
+
+    for (p = hash_lookup(mboxname, &parktable); p; p = p->next)
+        wake_parked(p);
+}
+
+/* hand woken connections back to imapd, keeping those that can't go
+ * yet; returns the number still waiting */
+static int flush_wakelist(void)
+{
+    const char *path = config_getstring(IMAPOPT_IDLERESUMESOCKET);
+    ptrarray_t retry = PTRARRAY_INITIALIZER;
+    int i, r;
+
+    for (i = 0; i < wakelist.count; i++) {
+        struct parked *p = ptrarray_nth(&wakelist, i);
+        int fds[2] = { p->fd, p->statefd };
+
+        r = idle_pass_fds(path, fds, 2);
+        if (r == EAGAIN || r == EWOULDBLOCK || r == EINTR) {
+            /* the resume service is busy, try again shortly */
+            if (!p->deferred++)
+                syslog(LOG_NOTICE, "IDLE: %s busy, will retry handing "
+                                   "back parked connection on %s",
+                                   path, p->mboxname);
+            ptrarray_append(&retry, p);
+            continue;
+        }
+
+        if (r) {
+            syslog(LOG_ERR, "IDLE: can't hand parked connection on %s "
+                            "to %s: %s, closing.",
+                            p->mboxname, path, strerror(r));
+
+            /* and don't take any more until it's back */
+            if (r == ENOENT || r == ECONNREFUSED) {
+                resume_ok = 0;
+                resume_checked = time(NULL);
+            }
+        }
+        else {
+            if (verbose || debugmode)
+                syslog(LOG_DEBUG, "    RESUME %s\n", p->mboxname);
+            prometheus_increment(CYRUS_IDLED_RESUMED_TOTAL);
+        }
+
+        unpark(p);
+    }
+
+    ptrarray_fini(&wakelist);
+    wakelist = retry;
+
+    return wakelist.count;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/* deal with parked connections whose clients have spoken or gone */
+static void poll_parked(void)
+{
+    struct epoll_event events[IDLED_PARK_EVENTS];
+    int i, n;
+
+    n = epoll_wait(park_epfd, events, IDLED_PARK_EVENTS, 0);
+    for (i = 0; i < n; i++) {
+        struct parked *p = events[i].data.ptr;
+        char c;
+
+        if (!(events[i].events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) ||
+            recv(p->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0) {
+            /* most likely DONE, which a fresh imapd will read */
+            wake_parked(p);
+        }
+        else {
+            /* the client went away, nothing to resume */
+            if (verbose || debugmode)
+                syslog(LOG_DEBUG, "    HANGUP %s\n", p->mboxname);
+            epoll_ctl(park_epfd, EPOLL_CTL_DEL, p->fd, NULL);
+            unpark(p);
+        }
+    }
+}
+#endif
+
+/* close parked connections idling for longer than the IDLE timeout,
+ * as imapd would have */
+static void expire_parked_cb(const char *key __attribute__((unused)),
+                             void *data, void *rock)
+{
+    struct parked *p = (struct parked *) data;
+    ptrarray_t *expired = (ptrarray_t *) rock;
+    time_t now = time(NULL);
+
+    for ( ; p; p = p->next) {
+        if (!p->waking && p->ptime + park_timeout < now)
+            ptrarray_append(expired, p);
+    }
+}
+
+static void expire_parked(void)
+{
+    ptrarray_t expired = PTRARRAY_INITIALIZER;
+    int i;
+
+    if (park_timeout <= 0) return;
+
+    hash_enumerate(&parktable, expire_parked_cb, &expired);
+    for (i = 0; i < expired.count; i++) {
+        struct parked *p = ptrarray_nth(&expired, i);
+
+        if (verbose || debugmode)
+            syslog(LOG_DEBUG, "    TIMEOUT parked %s\n", p->mboxname);
+#ifdef HAVE_SYS_EPOLL_H
+        if (park_epfd != -1)
+            epoll_ctl(park_epfd, EPOLL_CTL_DEL, p->fd, NULL);
+#endif
+        unpark(p);
+    }
+    ptrarray_fini(&expired);
+}
+
+static void wake_all_cb(const char *key __attribute__((unused)),
+                        void *data, void *rock __attribute__((unused)))
+{
+    struct parked *p;
+
+    for (p = (struct parked *) data; p; p = p->next)
+        wake_parked(p);
+}
+
+/* tell the imapd which sent a PARK whether we took the connection;
+ * returns nonzero if it couldn't be told */
+static int answer_park(const struct sockaddr_un *remote, int which,
+                       const char *mboxname)
+{
+    idle_message_t msg;
+    int tries = 0;
     int r;
 
+    msg.which = which;
+    xstrncpy(msg.mboxname, mboxname, sizeof(msg.mboxname));
+
+    /* the imapd waits for this however long it takes, so don't lose
+     * it just because its socket is momentarily full */
+    while ((r = idle_send(remote, &msg)) == EAGAIN && ++tries < IDLED_PARK_TRIES)
+        usleep(IDLED_PARK_RETRY);
+    if (r) {
+        syslog(LOG_ERR, "IDLE: error answering PARK from imapd %s "
+                        "for mailbox %s: %s.",
+                        idle_id_from_addr(remote), mboxname,
+                        error_message(r));
+    }
+
+    return r;
+}
+
+static void process_message(struct sockaddr_un *remote, idle_message_t *msg,
+                            int *fds, int nfds)
+{
     switch (msg->which) {
     case IDLE_MSG_INIT:
         if (verbose || debugmode)
             syslog(LOG_DEBUG, "imapd[%s]: IDLE_MSG_INIT '%s'\n",
                    idle_id_from_addr(remote), msg->mboxname);
 
-        /* add an ientry to list of those idling on mboxname */
-        t = (struct ientry *) hash_lookup(msg->mboxname, &itable);
-        n = (struct ientry *) xzmalloc(sizeof(struct ientry));
-        n->remote = *remote;
-        n->itime = time(NULL);
-        n->next = t;
-        hash_insert(msg->mboxname, n, &itable);
+        add_ientry(&itable, msg->mboxname, remote);
         break;
 
     case IDLE_MSG_NOTIFY:
-        if (verbose || debugmode)
-            syslog(LOG_DEBUG, "IDLE_MSG_NOTIFY '%s'\n", msg->mboxname);
-
-        /* send a message to all clients idling on mboxname */
-        t = (struct ientry *) hash_lookup(msg->mboxname, &itable);
-        for ( ; t ; t = n) {
-            n = t->next;
-            if ((t->itime + idle_timeout) < time(NULL)) {
-                /* This process has been idling for longer than the timeout
-                 * period, so it probably died.  Remove it from the list.
-                 */
-                if (verbose || debugmode)
-                    syslog(LOG_DEBUG, "    TIMEOUT %s\n", idle_id_from_addr(&t->remote));
-
-                remove_ientry(msg->mboxname, &t->remote);
-            }
-            else { /* signal process to update */
-                if (verbose || debugmode)
-                    syslog(LOG_DEBUG, "    fwd NOTIFY %s\n", idle_id_from_addr(&t->remote));
-
-                /* forward the received msg onto our clients */
-                r = idle_send(&t->remote, msg);
-                if (r) {
-                    /* ENOENT can happen as result of a race between delivering
-                     * messages and shutting down imapd.  It indicates that the
-                     * imapd's socket was unlinked, which means that imapd went
-                     * through it's graceful shutdown path, so don't syslog. */
-                    if (r != ENOENT)
-                        syslog(LOG_ERR, "IDLE: error sending message "
-                                        "NOTIFY to imapd %s for mailbox %s: %s, "
-                                        "forgetting.",
-                                        idle_id_from_addr(&t->remote),
-                                        msg->mboxname, error_message(r));
-                    if (verbose || debugmode)
-                        syslog(LOG_DEBUG, "    forgetting %s\n", idle_id_from_addr(&t->remote));
-                    remove_ientry(msg->mboxname, &t->remote);
-                }
-            }
-        }
+        queue_notify(msg->mboxname);
         break;
 
     case IDLE_MSG_DONE:
@@ -195,9 +658,47 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
                    idle_id_from_addr(remote), msg->mboxname);
 
         /* remove client from list of those idling on mboxname */
-        remove_ientry(msg->mboxname, remote);
+        remove_ientry(&itable, msg->mboxname, remote);
         break;
 
+    case IDLE_MSG_INIT_USER:
+        if (verbose || debugmode)
+            syslog(LOG_DEBUG, "imapd[%s]: IDLE_MSG_INIT_USER '%s'\n",
+                   idle_id_from_addr(remote), msg->mboxname);
+
+        add_ientry(&utable, msg->mboxname, remote);
+        break;
+
+    case IDLE_MSG_DONE_USER:
+        if (verbose || debugmode)
+            syslog(LOG_DEBUG, "imapd[%s]: IDLE_MSG_DONE_USER '%s'\n",
+                   idle_id_from_addr(remote), msg->mboxname);
+
+        remove_ientry(&utable, msg->mboxname, remote);
+        break;
+
+    case IDLE_MSG_PARK:
+        if (verbose || debugmode)
+            syslog(LOG_DEBUG, "imapd[%s]: IDLE_MSG_PARK '%s'\n",
+                   idle_id_from_addr(remote), msg->mboxname);
+
+        if (nfds != 2) {
+            syslog(LOG_ERR, "IDLE: PARK from imapd %s with %d descriptors",
+                   idle_id_from_addr(remote), nfds);
+            break;
+        }
+
+        /* the imapd keeps the client unless we say we have it */
+        if (!check_resume()) {
+            answer_park(remote, IDLE_MSG_PARK_NO, msg->mboxname);
+            break;
+        }
+        if (answer_park(remote, IDLE_MSG_PARK_OK, msg->mboxname))
+            break;
+
+        park(msg->mboxname, fds[0], fds[1]);
+        return;
+
     case IDLE_MSG_NOOP:
         break;
 
@@ -205,15 +706,17 @@ static void process_message(struct sockaddr_un *remote, idle_message_t *msg)
         syslog(LOG_ERR, "unrecognized message: %lx", msg->which);
         break;
     }
+
+    /* any descriptors not taken over */
+    while (nfds) close(fds[--nfds]);
 }
 
 
-static void send_alert(const char *key,
+static void send_alert(const char *key __attribute__((unused)),
                        void *data,
                        void *rock __attribute__((unused)))
 {
     struct ientry *t = (struct ientry *) data;
-    struct ientry *n;
     idle_message_t msg;
     int r;
 
@@ -221,9 +724,7 @@ static void send_alert(const char *key,
     strncpy(msg.mboxname, ".", sizeof(msg.mboxname));
 
 
-    for ( ; t ; t = n) {
-        n = t->next;
-
+    for ( ; t ; t = t->next) {
         /* signal process to check ALERTs */
         if (verbose || debugmode)
             syslog(LOG_DEBUG, "    ALERT %s\n", idle_id_from_addr(&t->remote));
@@ -236,13 +737,9 @@ static void send_alert(const char *key,
              * through it's graceful shutdown path, so don't syslog. */
             if (r != ENOENT)
                 syslog(LOG_ERR, "IDLE: error sending message "
-                                "ALERT to imapd %s for mailbox %s: %s, "
-                                "forgetting.",
+                                "ALERT to imapd %s for mailbox %s: %s.",
                                 idle_id_from_addr(&t->remote),
                                 msg.mboxname, error_message(r));
-            if (verbose || debugmode)
-                syslog(LOG_DEBUG, "    forgetting %s\n", idle_id_from_addr(&t->remote));
-            remove_ientry(key, &t->remote);
         }
     }
 }
@@ -250,7 +747,16 @@ static void send_alert(const char *key,
 static void shut_down(int ec) __attribute__((noreturn));
 static void shut_down(int ec)
 {
+    /* deliver anything still waiting before the ALERTs */
+    flush_notify(1);
     hash_enumerate(&itable, send_alert, NULL);
+    hash_enumerate(&utable, send_alert, NULL);
+    /* parked clients can only be told from an imapd; any which can't
+     * be handed back now are dropped */
+    hash_enumerate(&parktable, wake_all_cb, NULL);
+    if (flush_wakelist())
+        syslog(LOG_WARNING, "IDLE: dropping %d parked connections which "
+                            "couldn't be handed back", wakelist.count);
     idle_done_sock();
     cyrus_done();
     exit(ec);
@@ -267,7 +773,9 @@ int main(int argc, char **argv)
     int nfds;
     struct timeval timeout;
     pid_t pid;
+    int fdflags;
     char *alt_config = NULL;
+    time_t next_sweep = 0;
 
     p = getenv("CYRUS_VERBOSE");
     if (p) verbose = atoi(p) + 1;
@@ -293,6 +801,14 @@ int main(int argc, char **argv)
     idle_timeout = config_getduration(IMAPOPT_TIMEOUT, 'm');
     if (idle_timeout < 30 * 60) idle_timeout = 30 * 60;
 
+    notify_delay = config_getint(IMAPOPT_IDLED_NOTIFY_DELAY);
+    if (notify_delay < 0) notify_delay = 0;
+
+    /* parked connections time out as imapd's IDLE would */
+    park_timeout = config_getduration(IMAPOPT_IMAPIDLETIMEOUT, 'm');
+    if (park_timeout <= 0)
+        park_timeout = config_getduration(IMAPOPT_TIMEOUT, 'm');
+
     /* count the number of mailboxes */
     mboxlist_allmbox("", &mbox_count_cb, &nmbox, /*flags*/0);
 
@@ -300,7 +816,10 @@ int main(int argc, char **argv)
     signals_add_handlers(0);
 
     /* create idle table -- +1 to avoid a zero value */
-    construct_hash_table(&itable, nmbox + 1, 1);
+    construct_hash_table(&itable, nmbox + 1, 0);
+    construct_hash_table(&utable, nmbox / 8 + 1, 0);
+    construct_hash_table(&ptable, 1024, 0);
+    construct_hash_table(&parktable, 1024, 0);
 
     if (!idle_make_server_address(&local) ||
         !idle_init_sock(&local)) {
@@ -309,6 +828,15 @@ int main(int argc, char **argv)
     }
     s = idle_get_sock();
 
+    /* so that we can drain it without blocking */
+    fdflags = fcntl(s, F_GETFL, 0);
+    if (fdflags == -1 || fcntl(s, F_SETFL, O_NONBLOCK | fdflags) == -1) {
+        syslog(LOG_ERR, "IDLE: can't make socket nonblocking: %m");
+        idle_done_sock();
+        cyrus_done();
+        exit(1);
+    }
+
     /* fork unless we were given the -d option or we're running as a daemon */
     if (debugmode == 0 && !getenv("CYRUS_ISDAEMON")) {
 
@@ -331,6 +859,24 @@ int main(int argc, char **argv)
     FD_SET(s, &read_set);
     nfds = s + 1;
 
+#ifdef HAVE_SYS_EPOLL_H
+    /* parked connections are watched through an epoll set, which
+     * select() sees as readable when any of them has something */
+    park_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (park_epfd == -1) {
+        syslog(LOG_ERR, "IDLE: epoll_create1: %m, not parking connections");
+    }
+    else {
+        FD_SET(park_epfd, &read_set);
+        if (park_epfd >= nfds) nfds = park_epfd + 1;
+    }
+#endif
+
+    /* find out now whether we can park connections, rather than on
+     * the first IDLE */
+    if (config_getswitch(IMAPOPT_IMAPIDLEPARK))
+        check_resume();
+
     for (;;) {
         int n;
         int sig;
@@ -350,9 +896,16 @@ int main(int argc, char **argv)
             shut_down(1);
         }
 
-        /* timeout for select is 1 second */
+        /* timeout for select is 1 second, or sooner if notifications
+         * are due to go out or parked connections are waiting to be
+         * handed back */
         timeout.tv_sec = 1;
         timeout.tv_usec = 0;
+        if (wakelist.count) {
+            timeout.tv_sec = 0;
+            timeout.tv_usec = 100000;
+        }
+        notify_timeout(&timeout);
 
         /* check for the next input */
         rset = read_set;
@@ -366,13 +919,37 @@ int main(int argc, char **argv)
             fatal("select error",-1);
         }
 
-        /* read and process a message */
-        if (FD_ISSET(s, &rset)) {
+        /* read and process everything that's waiting, so that
+         * repeated notifications for a mailbox are sent once */
+        if (n > 0 && FD_ISSET(s, &rset)) {
             struct sockaddr_un from;
             idle_message_t msg;
+            int fds[IDLE_MAX_FDS];
+            int i;
+
+            for (i = 0; i < IDLED_BATCH; i++) {
+                int nrecv = IDLE_MAX_FDS;
+
+                errno = 0;
+                if (idle_recv_fds(&from, &msg, fds, &nrecv))
+                    process_message(&from, &msg, fds, nrecv);
+                else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+            }
+        }
+
+#ifdef HAVE_SYS_EPOLL_H
+        if (n > 0 && park_epfd != -1 && FD_ISSET(park_epfd, &rset))
+            poll_parked();
+#endif
+
+        flush_notify(0);
+
+        if (wakelist.count) flush_wakelist();
 
-            if (idle_recv(&from, &msg))
-                process_message(&from, &msg);
+        if (time(NULL) >= next_sweep) {
+            expire_parked();
+            next_sweep = time(NULL) + IDLED_PARK_SWEEP;
         }
 
     }
@@ -184,31 +184,258 @@ EXPORTED int idle_send(const struct sockaddr_un *remote,
     return 0;
 }
 
-EXPORTED int idle_recv(struct sockaddr_un *remote, idle_message_t *msg)
+/*
+ * Attach 'nfds' descriptors from 'fds' to 'hdr' as SCM_RIGHTS, using
+ * 'cbuf' (at least CMSG_SPACE(IDLE_MAX_FDS * sizeof(int)) bytes) as the
+ * control buffer.
+ */
+static void idle_attach_fds(struct msghdr *hdr, char *cbuf,
+                            const int *fds, int nfds)
+{
+    struct cmsghdr *cmsg;
+
+    assert(nfds > 0 && nfds <= IDLE_MAX_FDS);
+
+    hdr->msg_control = cbuf;
+    hdr->msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+}
+
+/*
+ * Collect the descriptors passed with 'hdr' into 'fds' (up to *nfdsp
+ * of them), closing any surplus.  Sets *nfdsp to the number kept.
+ */
+static void idle_collect_fds(struct msghdr *hdr, int *fds, int *nfdsp)
+{
+    struct cmsghdr *cmsg;
+    int max = fds ? *nfdsp : 0;
+    int n = 0;
+
+    for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        const unsigned char *data = CMSG_DATA(cmsg);
+        int i, count;
+
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < count; i++) {
+            int fd;
+
+            memcpy(&fd, data + i * sizeof(int), sizeof(int));
+            if (n < max) fds[n++] = fd;
+            else close(fd);
+        }
+    }
+
+    if (nfdsp) *nfdsp = n;
+}
+
+/*
+ * Send a message to a peer along with 'nfds' open descriptors, which
+ * the peer receives as duplicates.  The caller keeps its own copies.
+ * Returns 0 on success or an IMAP error code on failure.
+ */
+EXPORTED int idle_send_fds(const struct sockaddr_un *remote,
+                           const idle_message_t *msg,
+                           const int *fds, int nfds)
+{
+    char cbuf[CMSG_SPACE(IDLE_MAX_FDS * sizeof(int))];
+    struct msghdr hdr;
+    struct iovec iov;
+    int flags = 0;
+
+#ifdef MSG_DONTWAIT
+    flags |= MSG_DONTWAIT;
+#endif
+
+    if (idle_sock < 0)
+        return IMAP_SERVER_UNAVAILABLE;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memset(cbuf, 0, sizeof(cbuf));
+    iov.iov_base = (void *) msg;
+    iov.iov_len = IDLE_MESSAGE_BASE_SIZE+strlen(msg->mboxname)+1;
+    hdr.msg_name = (void *) remote;
+    hdr.msg_namelen = sizeof(*remote);
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    idle_attach_fds(&hdr, cbuf, fds, nfds);
+
+    if (sendmsg(idle_sock, &hdr, flags) == -1) {
+        return errno;
+    }
+
+    return 0;
+}
+
+/*
+ * Receive a message from a peer, along with up to *nfdsp descriptors
+ * passed with it.  On return *nfdsp holds the number of descriptors
+ * stored in 'fds'; any beyond that (or all of them, if 'fds' is NULL)
+ * are closed.
+ * Returns 1 if a valid message was read, or 0 otherwise, with errno
+ * set to EAGAIN if the socket is nonblocking and nothing was waiting.
+ */
+EXPORTED int idle_recv_fds(struct sockaddr_un *remote, idle_message_t *msg,
+                           int *fds, int *nfdsp)
 {
-    socklen_t remote_len = sizeof(*remote);
-    int n;
+    char cbuf[CMSG_SPACE(IDLE_MAX_FDS * sizeof(int))];
+    struct msghdr hdr;
+    struct iovec iov;
+    int n, nfds = 0;
+
+    if (nfdsp) {
+        nfds = *nfdsp;
+        *nfdsp = 0;
+    }
 
     if (idle_sock < 0)
         return 0;
 
-    memset(remote, 0, remote_len);
+    memset(remote, 0, sizeof(*remote));
     memset(msg, 0, sizeof(idle_message_t));
-
-    n = recvfrom(idle_sock, (void *) msg, sizeof(idle_message_t), 0,
-                 (struct sockaddr *) remote, &remote_len);
+    memset(&hdr, 0, sizeof(hdr));
+    iov.iov_base = (void *) msg;
+    iov.iov_len = sizeof(idle_message_t);
+    hdr.msg_name = remote;
+    hdr.msg_namelen = sizeof(*remote);
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = cbuf;
+    hdr.msg_controllen = sizeof(cbuf);
+
+    n = recvmsg(idle_sock, &hdr, 0);
 
     if (n < 0) {
-        syslog(LOG_ERR, "IDLE: recvfrom failed: %m");
+        /* nothing waiting on a nonblocking socket is not an error */
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            syslog(LOG_ERR, "IDLE: recvfrom failed: %m");
         return 0;
     }
 
+    if (nfdsp) *nfdsp = nfds;
+    idle_collect_fds(&hdr, fds, nfdsp);
+
     if (n <= IDLE_MESSAGE_BASE_SIZE ||
         msg->mboxname[n - 1 - IDLE_MESSAGE_BASE_SIZE] != '\0') {
         syslog(LOG_ERR, "IDLE: invalid message received: size=%d", n);
+        if (nfdsp) {
+            while (*nfdsp) close(fds[--*nfdsp]);
+        }
         return 0;
     }
 
     return 1;
 }
 
+/*
+ * Receive a message from a peer.  Any descriptors passed with it are
+ * closed.  Returns as idle_recv_fds().
+ */
+EXPORTED int idle_recv(struct sockaddr_un *remote, idle_message_t *msg)
+{
+    return idle_recv_fds(remote, msg, NULL, NULL);
+}
+
+/*
+ * Hand 'nfds' descriptors to whoever is listening on the stream socket
+ * at 'path' (a service started by master), without blocking.
+ * Returns 0 on success or an errno value on failure; EAGAIN means the
+ * listener's backlog is full and the caller should try again later.
+ */
+EXPORTED int idle_pass_fds(const char *path, const int *fds, int nfds)
+{
+    char cbuf[CMSG_SPACE(IDLE_MAX_FDS * sizeof(int))];
+    struct sockaddr_un addr;
+    struct msghdr hdr;
+    struct iovec iov;
+    char byte = 0;
+    int s, r = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlcpy(addr.sun_path, path, sizeof(addr.sun_path))
+        >= sizeof(addr.sun_path))
+        return ENAMETOOLONG;
+
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return errno;
+
+    if (fcntl(s, F_SETFL, O_NONBLOCK) == -1 ||
+        connect(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        r = errno;
+        close(s);
+        return r;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memset(cbuf, 0, sizeof(cbuf));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    idle_attach_fds(&hdr, cbuf, fds, nfds);
+
+    if (sendmsg(s, &hdr, 0) == -1)
+        r = errno;
+
+    close(s);
+    return r;
+}
+
+/*
+ * Receive exactly 'nfds' descriptors sent by idle_pass_fds() on the
+ * connected stream socket 'sock', from a peer running as the same user
+ * where the system can tell us who the peer is.
+ * Returns 0 on success or an IMAP error code on failure.
+ */
+EXPORTED int idle_take_fds(int sock, int *fds, int nfds)
+{
+    char cbuf[CMSG_SPACE(IDLE_MAX_FDS * sizeof(int))];
+    struct msghdr hdr;
+    struct iovec iov;
+    char byte;
+    int n, got = nfds;
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t credlen = sizeof(cred);
+
+    /* descriptors are only trusted from processes running as us */
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == -1 ||
+        cred.uid != geteuid()) {
+        syslog(LOG_ERR, "IDLE: refusing descriptors from foreign peer");
+        return IMAP_PERMISSION_DENIED;
+    }
+#endif
+
+    memset(&hdr, 0, sizeof(hdr));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = cbuf;
+    hdr.msg_controllen = sizeof(cbuf);
+
+    do {
+        n = recvmsg(sock, &hdr, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        if (n < 0) syslog(LOG_ERR, "IDLE: recvmsg failed: %m");
+        return IMAP_IOERROR;
+    }
+
+    idle_collect_fds(&hdr, fds, &got);
+    if (got != nfds) {
+        syslog(LOG_ERR, "IDLE: expected %d descriptors, got %d", nfds, got);
+        while (got) close(fds[--got]);
+        return IMAP_PROTOCOL_ERROR;
+    }
+
+    return 0;
+}
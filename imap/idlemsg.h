@@ -68,9 +68,23 @@ enum {
     IDLE_MSG_DONE,
     IDLE_MSG_NOTIFY,
     IDLE_MSG_NOOP,
-    IDLE_MSG_ALERT
+    IDLE_MSG_ALERT,
+    /* as INIT and DONE, but for changes to any of a user's mailboxes;
+     * the mboxname field carries the userid */
+    IDLE_MSG_INIT_USER,
+    IDLE_MSG_DONE_USER,
+    /* hand an idling client over to idled; carries the client socket
+     * and the saved session state as descriptors */
+    IDLE_MSG_PARK,
+    /* idled's answer to PARK: it now holds the client, or it doesn't
+     * and the imapd keeps it */
+    IDLE_MSG_PARK_OK,
+    IDLE_MSG_PARK_NO
 };
 
+/* most descriptors passed with a single message */
+#define IDLE_MAX_FDS 2
+
 int idle_make_server_address(struct sockaddr_un *);
 int idle_make_client_address(struct sockaddr_un *);
 const char *idle_id_from_addr(const struct sockaddr_un *);
@@ -80,6 +94,13 @@ int idle_get_sock(void);
 int idle_send(const struct sockaddr_un *remote,
               const idle_message_t *msg);
 int idle_recv(struct sockaddr_un *remote, idle_message_t *msg);
+int idle_send_fds(const struct sockaddr_un *remote,
+                  const idle_message_t *msg,
+                  const int *fds, int nfds);
+int idle_recv_fds(struct sockaddr_un *remote, idle_message_t *msg,
+                  int *fds, int *nfdsp);
+int idle_pass_fds(const char *path, const int *fds, int nfds);
+int idle_take_fds(int sock, int *fds, int nfds);
 
 
 #endif
@@ -104,6 +104,7 @@
 #include "proc.h"
 #include "prometheus.h"
 #include "quota.h"
+#include "retry.h"
 #include "seen.h"
 #include "statuscache.h"
 #include "sync_log.h"
@@ -229,6 +230,13 @@ struct namespace imapd_namespace;
 /* track if we're idling */
 static int idling = 0;
 
+/* are we the service idled hands parked IDLE connections back to (-R)? */
+static int imapd_resuming = 0;
+/* saved state of a parked connection being resumed, or -1 */
+static int imapd_statefd = -1;
+/* has this session been handed over to idled? */
+static int imapd_parked = 0;
+
 const struct mbox_name_attribute mbox_name_attributes[] = {
     /* from RFC 3501 */
     { MBOX_ATTRIBUTE_NOINFERIORS,   "\\Noinferiors"   },
@@ -386,6 +394,8 @@ static struct capa_struct base_capabilities[] = {
 
 
 static void motd_file(void);
+static int take_parked(void);
+static void resume_parked(void);
 void shut_down(int code);
 void fatal(const char *s, int code);
 
@@ -433,7 +443,7 @@ static void cmd_namespace(char* tag);
 static void cmd_mupdatepush(char *tag, char *name);
 static void cmd_id(char* tag);
 
-static void cmd_idle(char* tag);
+static void cmd_idle(char* tag, int resumed);
 
 static void cmd_starttls(char *tag, int imaps);
 
@@ -839,6 +849,11 @@ static void imapd_reset(void)
     imapd_tls_comp = NULL;
     imapd_starttls_done = 0;
     plaintextloginalert = NULL;
+    imapd_parked = 0;
+    if (imapd_statefd != -1) {
+        close(imapd_statefd);
+        imapd_statefd = -1;
+    }
 
     saslprops_reset(&saslprops);
 
@@ -871,7 +886,7 @@ int service_init(int argc, char **argv, char **envp)
     apns_enabled =
       (events & EVENT_APPLEPUSHSERVICE) && config_getstring(IMAPOPT_APS_TOPIC);
 
-    while ((opt = getopt(argc, argv, "Np:sq")) != EOF) {
+    while ((opt = getopt(argc, argv, "Np:sqR")) != EOF) {
         switch (opt) {
         case 's': /* imaps (do starttls right away) */
             imaps = 1;
@@ -891,6 +906,9 @@ int service_init(int argc, char **argv, char **envp)
         case 'q': /* don't enforce quotas */
             ignorequota = 1;
             break;
+        case 'R': /* resume IDLE connections parked in idled */
+            imapd_resuming = 1;
+            break;
         default:
             break;
         }
@@ -947,6 +965,14 @@ int service_main(int argc __attribute__((unused)),
     id_getcmdline(argc, argv);
 #endif
 
+    if (imapd_resuming && take_parked()) {
+        /* nothing to resume; go back to waiting for idled */
+        cyrus_reset_stdio();
+        prometheus_decrement(CYRUS_IMAP_ACTIVE_CONNECTIONS);
+        prometheus_increment(CYRUS_IMAP_READY_LISTENERS);
+        return 0;
+    }
+
     imapd_in = prot_new(0, 0);
     imapd_out = prot_new(1, 1);
     protgroup_insert(protin, imapd_in);
@@ -1002,8 +1028,9 @@ int service_main(int argc __attribute__((unused)),
     prot_flush(imapd_out);
     prometheus_decrement(CYRUS_IMAP_ACTIVE_CONNECTIONS);
 
-    /* send a Logout event notification */
-    if ((mboxevent = mboxevent_new(EVENT_LOGOUT))) {
+    /* send a Logout event notification, unless the session lives on
+     * in idled */
+    if (!imapd_parked && (mboxevent = mboxevent_new(EVENT_LOGOUT))) {
         mboxevent_set_access(mboxevent,
                              buf_cstringnull_ifempty(&saslprops.iplocalport),
                              buf_cstringnull_ifempty(&saslprops.ipremoteport),
@@ -1239,19 +1266,26 @@ static void cmdloop(void)
     struct applepushserviceargs applepushserviceargs;
     int readonly = config_getswitch(IMAPOPT_READONLY);
 
-    prot_printf(imapd_out, "* OK [CAPABILITY ");
-    capa_response(CAPA_PREAUTH);
-    prot_printf(imapd_out, "]");
-    if (config_serverinfo) prot_printf(imapd_out, " %s", config_servername);
-    if (config_serverinfo == IMAP_ENUM_SERVERINFO_ON) {
-        prot_printf(imapd_out, " Cyrus IMAP %s", CYRUS_VERSION);
+    if (imapd_statefd == -1) {
+        prot_printf(imapd_out, "* OK [CAPABILITY ");
+        capa_response(CAPA_PREAUTH);
+        prot_printf(imapd_out, "]");
+        if (config_serverinfo) prot_printf(imapd_out, " %s", config_servername);
+        if (config_serverinfo == IMAP_ENUM_SERVERINFO_ON) {
+            prot_printf(imapd_out, " Cyrus IMAP %s", CYRUS_VERSION);
+        }
+        prot_printf(imapd_out, " server ready\r\n");
     }
-    prot_printf(imapd_out, " server ready\r\n");
 
     /* clear cancelled flag if present before the next command */
     cmd_cancelled(/*insearch*/0);
 
-    motd_file();
+    if (imapd_statefd != -1) {
+        /* carry on an IDLE handed back by idled */
+        resume_parked();
+        if (imapd_parked) goto done;
+    }
+    else motd_file();
 
     /* Get command timer logging paramater. This string
      * is a time in seconds. Any command that takes >=
@@ -1620,9 +1654,10 @@ static void cmdloop(void)
             else if (!imapd_userid) goto nologin;
             else if (!strcmp(cmd.s, "Idle") && idle_enabled()) {
                 if (!IS_EOL(c, imapd_in)) goto extraargs;
-                cmd_idle(tag.s);
+                cmd_idle(tag.s, 0);
 
                 prometheus_increment(CYRUS_IMAP_IDLE_TOTAL);
+                if (imapd_parked) goto done;
             }
             else goto badcmd;
             break;
@@ -2539,12 +2574,14 @@ static void autocreate_inbox(void)
 }
 #endif // USE_AUTOCREATE
 
-static void authentication_success(void)
+/*
+ * Set up the session for the now authenticated imapd_userid, whose
+ * authstate must already exist
+ */
+static void authentication_setup(void)
 {
     int r;
-    struct mboxevent *mboxevent;
 
-    /* authstate already created by mysasl_proxy_policy() */
     imapd_userisadmin = global_authisa(imapd_authstate, IMAPOPT_ADMINS);
 
     /* Create telemetry log */
@@ -2563,6 +2600,14 @@ static void authentication_success(void)
 
     /* Make a copy of the external userid for use in proxying */
     proxy_userid = xstrdup(imapd_userid);
+}
+
+static void authentication_success(void)
+{
+    struct mboxevent *mboxevent;
+
+    /* authstate already created by mysasl_proxy_policy() */
+    authentication_setup();
 
     /* send a Login event notification */
     if ((mboxevent = mboxevent_new(EVENT_LOGIN))) {
@@ -3215,10 +3260,211 @@ static bool deadline_exceeded(const struct timespec *d)
            (now.tv_sec == d->tv_sec && now.tv_nsec > d->tv_nsec);
 }
 
+/*
+ * Try to hand the IDLEing client over to idled (see "imapidlepark"),
+ * along with what it has been told about the selected mailbox so that
+ * a fresh imapd can carry on the session.  Returns 0 if idled now holds
+ * the connection, in which case this process has let go of it.
+ */
+static int park_idle(const char *tag)
+{
+    const char *mboxname = index_mboxname(imapd_index);
+    struct index_resume resume = { 0, 0, 0, NULL };
+    struct statusdata sdata = STATUSDATA_INIT;
+    struct buf buf = BUF_INITIALIZER;
+    mailbox_notifyproc_t *notify;
+    struct dlist *dl;
+    char *uids;
+    int fd, devnull;
+    char c;
+    int r;
+
+    if (!config_getswitch(IMAPOPT_IMAPIDLEPARK))
+        return IMAP_SERVER_UNAVAILABLE;
+
+    /* only a bare socket with nothing in flight can change hands; TLS,
+     * COMPRESS and SASL security layers keep state in this process */
+    if (imapd_starttls_done || imapd_compress_done || imapd_in->saslssf ||
+        imapd_logfd != -1 || imapd_magicplus || imapd_userisproxyadmin ||
+        imapd_in->cnt)
+        return IMAP_SERVER_UNAVAILABLE;
+
+    /* nor if the client has already ended the IDLE (or hung up), which
+     * would only have idled hand it straight back */
+    if (recv(imapd_in->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) >= 0)
+        return IMAP_SERVER_UNAVAILABLE;
+
+    fd = create_tempfile(config_getstring(IMAPOPT_TEMP_PATH));
+    if (fd == -1) return IMAP_IOERROR;
+
+    index_resume_save(imapd_index, &resume);
+    uids = seqset_cstring(resume.uids);
+
+    dl = dlist_newkvlist(NULL, "PARK");
+    dlist_setatom(dl, "TAG", tag);
+    dlist_setatom(dl, "USERID", imapd_userid);
+    dlist_setnum32(dl, "CAPA", client_capa);
+    dlist_setatom(dl, "MBOXNAME", mboxname);
+    dlist_setnum32(dl, "EXAMINE", imapd_index->examining);
+    dlist_setnum32(dl, "UIDVALIDITY", resume.uidvalidity);
+    dlist_setnum32(dl, "LASTUID", resume.last_uid);
+    dlist_setnum64(dl, "HIGHESTMODSEQ", resume.highestmodseq);
+    dlist_setatom(dl, "UIDS", uids ? uids : "");
+    dlist_printbuf(dl, 1, &buf);
+    dlist_free(&dl);
+    free(uids);
+    seqset_free(resume.uids);
+
+    if (retry_write(fd, buf_base(&buf), buf_len(&buf)) != (ssize_t) buf_len(&buf))
+        r = IMAP_IOERROR;
+    else
+        r = idle_park(mboxname, imapd_in->fd, fd);
+    buf_free(&buf);
+    close(fd);
+
+    if (r) {
+        syslog(LOG_NOTICE, "IDLE: unable to park %s on %s: %s",
+               imapd_userid, mboxname, error_message(r));
+        return r;
+    }
+
+    /* a change committed after we saved the state, but before idled
+     * knew to watch for it on the client's behalf, must still wake the
+     * client, so repeat the notification for any we might have missed */
+    if (!index_status(imapd_index, &sdata) &&
+        sdata.highestmodseq != resume.highestmodseq &&
+        (notify = mailbox_get_updatenotifier()))
+        notify(mboxname);
+
+    /* let go of the client without shutting the socket down under idled */
+    devnull = open("/dev/null", O_RDWR, 0);
+    if (devnull != -1) {
+        dup2(devnull, imapd_in->fd);
+        dup2(devnull, imapd_out->fd);
+        if (devnull != imapd_in->fd && devnull != imapd_out->fd)
+            close(devnull);
+    }
+
+    syslog(LOG_DEBUG, "IDLE: parked %s on %s", imapd_userid, mboxname);
+
+    return 0;
+}
+
+/*
+ * Accept a parked client from idled on fd 0, putting the client socket
+ * in its place and keeping the saved state for resume_parked().
+ * Returns 0 on success.
+ */
+static int take_parked(void)
+{
+    struct stat sbuf;
+    int clientfd, statefd;
+    int r;
+
+    r = idle_unpark(0, &clientfd, &statefd);
+    if (r) return r;
+
+    /* only another imapd can have written the state */
+    if (fstat(statefd, &sbuf) == -1 || sbuf.st_uid != geteuid() ||
+        dup2(clientfd, 0) == -1 || dup2(clientfd, 1) == -1) {
+        syslog(LOG_ERR, "IDLE: refusing parked connection");
+        close(clientfd);
+        close(statefd);
+        return IMAP_PERMISSION_DENIED;
+    }
+
+    close(clientfd);
+    imapd_statefd = statefd;
+
+    return 0;
+}
+
+/*
+ * Restore the session saved by park_idle() and carry on its IDLE,
+ * first telling the client about anything that happened meanwhile
+ */
+static void resume_parked(void)
+{
+    struct index_resume resume = { 0, 0, 0, NULL };
+    struct index_init init;
+    struct buf buf = BUF_INITIALIZER;
+    struct dlist *dl = NULL;
+    const char *tag = NULL, *userid = NULL, *mboxname = NULL, *uids = NULL;
+    uint32_t capa = 0, examine = 0;
+    bit64 modseq = 0;
+    struct stat sbuf;
+    int r = IMAP_IOERROR;
+
+    if (!fstat(imapd_statefd, &sbuf)) {
+        buf_refresh_mmap(&buf, /*onceonly*/1, imapd_statefd, "idle state",
+                         sbuf.st_size, NULL);
+        r = dlist_parsemap(&dl, 1, 0, buf_base(&buf), buf_len(&buf));
+    }
+    close(imapd_statefd);
+    imapd_statefd = -1;
+
+    if (!r && (!dlist_getatom(dl, "TAG", &tag) ||
+               !dlist_getatom(dl, "USERID", &userid) ||
+               !dlist_getnum32(dl, "CAPA", &capa) ||
+               !dlist_getatom(dl, "MBOXNAME", &mboxname) ||
+               !dlist_getnum32(dl, "EXAMINE", &examine) ||
+               !dlist_getnum32(dl, "UIDVALIDITY", &resume.uidvalidity) ||
+               !dlist_getnum32(dl, "LASTUID", &resume.last_uid) ||
+               !dlist_getnum64(dl, "HIGHESTMODSEQ", &modseq) ||
+               !dlist_getatom(dl, "UIDS", &uids)))
+        r = IMAP_PROTOCOL_ERROR;
+    if (r) goto done;
+
+    /* the client authenticated with the imapd that parked it */
+    imapd_userid = xstrdup(userid);
+    imapd_authstate = auth_newstate(imapd_userid);
+    authentication_setup();
+    client_capa = capa;
+
+    proc_register(config_ident, imapd_clienthost, imapd_userid, mboxname, NULL);
+
+    resume.highestmodseq = modseq;
+    resume.uids = seqset_parse(uids, NULL, resume.last_uid);
+
+    memset(&init, 0, sizeof(struct index_init));
+    init.userid = imapd_userid;
+    init.authstate = imapd_authstate;
+    init.out = imapd_out;
+    init.examine_mode = examine;
+    init.select = 1;
+    init.resume = &resume;
+
+    r = index_open(mboxname, &init, &imapd_index);
+    if (!r && !index_hasrights(imapd_index, ACL_READ)) {
+        index_close(&imapd_index);
+        r = IMAP_PERMISSION_DENIED;
+    }
+    seqset_free(resume.uids);
+
+  done:
+    if (r) {
+        syslog(LOG_NOTICE, "IDLE: unable to resume %s on %s: %s",
+               userid ? userid : "(unknown)", mboxname ? mboxname : "(unknown)",
+               error_message(r));
+        prot_printf(imapd_out, "* BYE %s\r\n", error_message(r));
+        dlist_free(&dl);
+        buf_free(&buf);
+        shut_down(0);
+    }
+
+    syslog(LOG_DEBUG, "IDLE: resumed %s on %s", imapd_userid, mboxname);
+
+    /* tag points into dl, which outlives the IDLE */
+    cmd_idle((char *) tag, 1);
+
+    dlist_free(&dl);
+    buf_free(&buf);
+}
+
 /*
  * Perform an IDLE command
  */
-static void cmd_idle(char *tag)
+static void cmd_idle(char *tag, int resumed)
 {
     int c = EOF;
     int flags;
@@ -3247,16 +3493,29 @@ static void cmd_idle(char *tag)
     if (!backend_current) {  /* Local mailbox */
 
         /* Tell client we are idling and waiting for end of command */
-        prot_printf(imapd_out, "+ idling\r\n");
-        prot_flush(imapd_out);
+        if (!resumed) {
+            prot_printf(imapd_out, "+ idling\r\n");
+            prot_flush(imapd_out);
+        }
 
         /* Start doing mailbox updates */
         index_check(imapd_index, 1, 0);
+        prot_flush(imapd_out);
         idle_start(index_mboxname(imapd_index));
         /* use this flag so if getc causes a shutdown due to
          * connection abort we tell idled about it */
         idling = 1;
 
+        if (!park_idle(tag)) {
+            /* idled holds the client now; we're done with it */
+            idling = 0;
+            idle_stop(index_mboxname(imapd_index));
+            /* the session carries on elsewhere, so no autoexpunge */
+            index_close(&imapd_index);
+            imapd_parked = 1;
+            return;
+        }
+
         index_release(imapd_index);
         while ((flags = idle_wait(imapd_in->fd))) {
             if (deadline_exceeded(&deadline)) {
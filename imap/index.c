@@ -84,6 +84,8 @@
 #include "search_engines.h"
 #include "search_query.h"
 #include "seen.h"
+#include "sortidx.h"
+#include "sortpool.h"
 #include "statuscache.h"
 #include "strhash.h"
 #include "user.h"
@@ -159,9 +161,6 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
                             const struct fetchargs *fetchargs);
 static void index_printflags(struct index_state *state, uint32_t msgno,
                              int usinguid, int printmodseq);
-static char *get_localpart_addr(const char *header);
-static char *get_displayname(const char *header);
-static char *index_extract_subject(const char *subj, size_t len, int *is_refwd);
 static char *_index_extract_subject(char *s, int *is_refwd);
 static void index_get_ids(MsgData *msgdata,
                           char *envtokens[], const char *headers, unsigned size);
@@ -188,6 +187,7 @@ static void index_thread_refs(struct index_state *state,
 
 static struct seqset *_parse_sequence(struct index_state *state,
                                       const char *sequence, int usinguid);
+static void sortcache_free(struct index_sortcache **cachep);
 static void massage_header(char *hdr);
 
 /* NOTE: Make sure these are listed in CAPABILITY_STRING */
@@ -290,6 +290,7 @@ EXPORTED void index_close(struct index_state **stateptr)
 
     index_release(state);
 
+    sortcache_free(&state->sortcache);
     xfree(state->map);
     xfree(state->mboxname);
     xfree(state->userid);
@@ -300,6 +301,63 @@ EXPORTED void index_close(struct index_state **stateptr)
     *stateptr = NULL;
 }
 
+/*
+ * Seed the message map with the state saved by index_resume_save(),
+ * checking that it can still be merged with the mailbox as it is now.
+ */
+static int index_seed_resume(struct index_state *state,
+                             struct index_resume *resume)
+{
+    struct mailbox *mailbox = state->mailbox;
+    const struct index_view *view;
+    struct index_map *im;
+    uint32_t recno, msgno = 0;
+    uint32_t count = 0;
+    uint32_t uid;
+
+    if (resume->uidvalidity != mailbox->i.uidvalidity ||
+        resume->last_uid > mailbox->i.last_uid)
+        return IMAP_SYNC_CHANGED;
+
+    while ((uid = seqset_getnext(resume->uids))) {
+        if (uid > resume->last_uid)
+            return IMAP_SYNC_CHANGED;
+        if (count >= state->mapsize) {
+            state->mapsize = (count | 0xff) + 1; /* round up 1-256 */
+            state->map = xrealloc(state->map,
+                                  state->mapsize * sizeof(struct index_map));
+        }
+        im = &state->map[count++];
+        memset(im, 0, sizeof(struct index_map));
+        im->uid = uid;
+        im->modseq = im->told_modseq = resume->highestmodseq;
+    }
+
+    /* the refresh can only merge in records the client wasn't told
+     * about if they sort after everything it was told about */
+    view = mailbox_index_view(mailbox);
+    for (recno = 1; count && recno <= view->num_records; recno++) {
+        uint32_t internal_flags = view->internal_flags[recno-1];
+
+        uid = view->uid[recno-1];
+        if (!uid) continue;
+        if (internal_flags & FLAG_INTERNAL_UNLINKED) continue;
+        if (!state->want_expunged && (internal_flags & FLAG_INTERNAL_EXPUNGED))
+            continue;
+
+        while (msgno < count && state->map[msgno].uid < uid) msgno++;
+        if (msgno == count) break;
+        if (state->map[msgno].uid != uid)
+            return IMAP_SYNC_CHANGED;
+    }
+
+    state->exists = count;
+    state->last_uid = resume->last_uid;
+    state->highestmodseq = resume->highestmodseq;
+
+    return 0;
+}
+
 /*
  * A new mailbox has been selected and already opened, map it into
  * memory and do the initial CHECK.
@@ -344,6 +402,13 @@ EXPORTED int index_open_mailbox(struct mailbox *mailbox, struct index_init *init
         }
     }
 
+    /* pick up where another process left off, so the refresh reports
+     * everything that changed since as ordinary untagged responses */
+    if (init && init->resume) {
+        r = index_seed_resume(state, init->resume);
+        if (r) goto fail;
+    }
+
     /* initialise the index_state */
     index_refresh_locked(state);
 
@@ -358,6 +423,7 @@ EXPORTED int index_open_mailbox(struct mailbox *mailbox, struct index_init *init
     return 0;
 
 fail:
+    free(state->map);
     xfree(state->mboxname);
     xfree(state->userid);
     xfree(state);
@@ -627,7 +693,8 @@ static struct seqset *_readseen(struct index_state *state, unsigned *recentuid)
 static void index_refresh_locked(struct index_state *state)
 {
     struct mailbox *mailbox = state->mailbox;
-    const message_t *msg;
+    const struct index_view *view;
+    uint32_t recno;
     uint32_t msgno = 1;
     uint32_t firstnotseen = 0;
     uint32_t numrecent = 0;
@@ -661,12 +728,15 @@ static void index_refresh_locked(struct index_state *state)
 
     seenlist = _readseen(state, &recentuid);
 
-    /* walk through all records */
-    struct mailbox_iter *iter = mailbox_iter_init(mailbox, 0, ITER_SKIP_UNLINKED);
-    while ((msg = mailbox_iter_step(iter))) {
-        const struct index_record *record = msg_record(msg);
+    /* walk through all records, straight from the decoded view */
+    view = mailbox_index_view(mailbox);
+    for (recno = 1; recno <= view->num_records; recno++) {
+        uint32_t uid = view->uid[recno-1];
+        uint32_t internal_flags = view->internal_flags[recno-1];
+        if (!uid) continue; /* can happen on damaged mailboxes */
+        if (internal_flags & FLAG_INTERNAL_UNLINKED) continue;
         im = &state->map[msgno-1];
-        while (msgno <= state->exists && im->uid < record->uid) {
+        while (msgno <= state->exists && im->uid < uid) {
             /* NOTE: this same logic is repeated below for messages
              * past the end of recno (repack removing the trailing
              * records).  Make sure to keep them in sync */
@@ -697,27 +767,27 @@ static void index_refresh_locked(struct index_state *state)
          * never been told to this connection, so it doesn't need to
          * get its own msgno */
         if (!state->want_expunged
-            && (msgno > state->exists || record->uid < im->uid)
-            && (record->internal_flags & FLAG_INTERNAL_EXPUNGED))
+            && (msgno > state->exists || uid < im->uid)
+            && (internal_flags & FLAG_INTERNAL_EXPUNGED))
             continue;
 
         /* make sure our UID map is consistent */
         if (msgno <= state->exists) {
-            assert(im->uid == record->uid);
+            assert(im->uid == uid);
         }
         else {
             memset(im, 0, sizeof(struct index_map));
-            im->uid = record->uid;
+            im->uid = uid;
         }
 
         /* copy all mutable fields */
-        im->recno = record->recno;
-        im->modseq = record->modseq;
-        im->system_flags = record->system_flags;
-        im->internal_flags = record->internal_flags;
-        im->cache_offset = record->cache_offset;
+        im->recno = recno;
+        im->modseq = view->modseq[recno-1];
+        im->system_flags = view->system_flags[recno-1];
+        im->internal_flags = internal_flags;
+        im->cache_offset = view->cache_offset[recno-1];
         for (i = 0; i < MAX_USER_FLAGS/32; i++)
-            im->user_flags[i] = record->user_flags[i];
+            im->user_flags[i] = view->user_flags[recno-1][i];
 
         /* re-calculate seen flags */
         if (state->internalseen)
@@ -771,7 +841,6 @@ static void index_refresh_locked(struct index_state *state)
 
         msgno++;
     }
-    mailbox_iter_done(&iter);
 
     /* may be trailing records which need to be considered for
      * delayed_modseq purposes, and to get the count right for
@@ -1806,6 +1875,24 @@ EXPORTED int index_refresh(struct index_state *state)
     return 0;
 }
 
+/*
+ * Record what the client has been told about the mailbox, so that
+ * another process can resume the session by passing it to index_open()
+ * in struct index_init.  Free resume->uids with seqset_free().
+ */
+EXPORTED void index_resume_save(struct index_state *state,
+                                struct index_resume *resume)
+{
+    uint32_t msgno;
+
+    resume->uidvalidity = state->uidvalidity;
+    resume->last_uid = state->last_uid;
+    resume->highestmodseq = state->highestmodseq;
+    resume->uids = seqset_init(0, SEQ_SPARSE);
+    for (msgno = 1; msgno <= state->exists; msgno++)
+        seqset_add(resume->uids, state->map[msgno-1].uid, 1);
+}
+
 static void index_unlock(struct index_state *state)
 {
     // only update seen if we've got a writelocked mailbox
@@ -1990,6 +2077,252 @@ out:
     return nmsg;
 }
 
+/*
+ * Cache of the last few SORT and THREAD results in this session.
+ *
+ * Clients tend to repeat the same SORT or THREAD after every IDLE
+ * wakeup.  If nothing has changed since, the cached result is simply
+ * replayed.  If the search and sort criteria only look at things that
+ * can't change once a message is delivered (see search_is_mutable()),
+ * flag changes don't matter either, and for SORT a handful of new or
+ * expunged messages are merged into the cached order rather than
+ * loading and sorting every message again.
+ */
+#define SORTCACHE_ENTRIES 4
+#define SORTCACHE_MAX_DELTA 64
+
+struct sortcache_entry {
+    char *key;
+    modseq_t highestmodseq;
+    uint32_t last_uid;
+    unsigned exists;
+    unsigned num_expunged;
+    int exact_only;         /* criteria are mutable, no deltas */
+    uint32_t *uids;         /* SORT: result UIDs, in order */
+    unsigned nuids;
+    struct buf thread;      /* THREAD: the rendered response */
+};
+
+struct index_sortcache {
+    struct sortcache_entry entries[SORTCACHE_ENTRIES];
+    unsigned next;
+    struct buf *capture;    /* THREAD output being recorded */
+};
+
+static void sortcache_entry_fini(struct sortcache_entry *ent)
+{
+    free(ent->key);
+    free(ent->uids);
+    buf_free(&ent->thread);
+    memset(ent, 0, sizeof(struct sortcache_entry));
+}
+
+static void sortcache_free(struct index_sortcache **cachep)
+{
+    struct index_sortcache *cache = *cachep;
+    int i;
+
+    if (!cache) return;
+
+    for (i = 0; i < SORTCACHE_ENTRIES; i++)
+        sortcache_entry_fini(&cache->entries[i]);
+    free(cache);
+
+    *cachep = NULL;
+}
+
+static int is_fuzzy_node(search_expr_t *e, void *rock __attribute__((unused)))
+{
+    return e->op == SEOP_FUZZYMATCH;
+}
+
+/* deltas need to evaluate the search program ourselves, which only
+ * approximates what the search engine does for fuzzy matches */
+static int sortcache_exact_only(const struct sortcrit *sortcrit,
+                                search_expr_t *root)
+{
+    return search_is_mutable((struct sortcrit *)sortcrit, root) ||
+           search_expr_apply(root, is_fuzzy_node, NULL);
+}
+
+static char *sortcache_key(const char *command, const char *args,
+                           search_expr_t *root)
+{
+    char *search = search_expr_serialise(root);
+    char *key = strconcat(command, " ", args, " ", search, (char *)NULL);
+
+    free(search);
+    return key;
+}
+
+static struct sortcache_entry *sortcache_find(struct index_state *state,
+                                              const char *key)
+{
+    int i;
+
+    if (!state->sortcache) return NULL;
+
+    for (i = 0; i < SORTCACHE_ENTRIES; i++) {
+        struct sortcache_entry *ent = &state->sortcache->entries[i];
+        if (ent->key && !strcmp(ent->key, key))
+            return ent;
+    }
+
+    return NULL;
+}
+
+/* the entry for 'key', reset and marked as current; takes over 'key' */
+static struct sortcache_entry *sortcache_store(struct index_state *state,
+                                               char *key, int exact_only)
+{
+    struct sortcache_entry *ent = sortcache_find(state, key);
+
+    if (!state->sortcache)
+        state->sortcache = xzmalloc(sizeof(struct index_sortcache));
+
+    if (!ent) {
+        ent = &state->sortcache->entries[state->sortcache->next];
+        state->sortcache->next = (state->sortcache->next + 1) % SORTCACHE_ENTRIES;
+    }
+    sortcache_entry_fini(ent);
+
+    ent->key = key;
+    ent->highestmodseq = state->highestmodseq;
+    ent->last_uid = state->last_uid;
+    ent->exists = state->exists;
+    ent->num_expunged = state->num_expunged;
+    ent->exact_only = exact_only;
+
+    return ent;
+}
+
+/* no messages have been added or expunged since 'ent' was stored */
+static int sortcache_same_messages(struct index_state *state,
+                                   const struct sortcache_entry *ent)
+{
+    return ent->last_uid == state->last_uid &&
+           ent->exists == state->exists &&
+           ent->num_expunged == state->num_expunged;
+}
+
+static int sortcache_unchanged(struct index_state *state,
+                               const struct sortcache_entry *ent)
+{
+    if (!sortcache_same_messages(state, ent)) return 0;
+    if (ent->highestmodseq == state->highestmodseq) return 1;
+    /* flag changes can't affect immutable criteria */
+    return !ent->exact_only;
+}
+
+static int index_sort_compare(MsgData *md1, MsgData *md2,
+                              const struct sortcrit *sortcrit);
+
+/*
+ * Bring a cached SORT result up to date by dropping expunged messages
+ * and merging in new ones.  Only the new messages and the cached ones
+ * they are compared against get loaded.  Returns 0 if that isn't
+ * possible and the search has to be run again.
+ */
+static int sortcache_update_sort(struct index_state *state,
+                                 struct sortcache_entry *ent,
+                                 const struct sortcrit *sortcrit,
+                                 struct searchargs *searchargs)
+{
+    unsigned *newmsgnos = NULL;
+    unsigned nnew = 0, nmatch = 0;
+    uint32_t *uids;
+    unsigned nuids = 0;
+    MsgData **msgdata = NULL;
+    uint32_t msgno;
+    unsigned i, pos;
+
+    if (sortcache_unchanged(state, ent)) {
+        syslog(LOG_DEBUG, "sortcache: replaying SORT on %s",
+               index_mboxname(state));
+        goto done;
+    }
+    if (ent->exact_only) return 0;
+
+    /* the new messages are at the end of the map */
+    msgno = ent->last_uid ? index_finduid(state, ent->last_uid) : 0;
+    if (state->exists - msgno > SORTCACHE_MAX_DELTA) return 0;
+
+    newmsgnos = xmalloc((state->exists - msgno + 1) * sizeof(unsigned));
+    for (msgno++; msgno <= state->exists; msgno++) {
+        struct index_map *im = &state->map[msgno-1];
+        if (im->uid <= ent->last_uid) continue;
+        if (im->internal_flags & FLAG_INTERNAL_EXPUNGED) continue;
+        newmsgnos[nnew++] = msgno;
+    }
+
+    /* drop anything that's gone */
+    for (i = 0; i < ent->nuids; i++) {
+        msgno = index_finduid(state, ent->uids[i]);
+        if (!msgno || state->map[msgno-1].uid != ent->uids[i]) continue;
+        if (state->map[msgno-1].internal_flags & FLAG_INTERNAL_EXPUNGED) continue;
+        ent->uids[nuids++] = ent->uids[i];
+    }
+    ent->nuids = nuids;
+
+    /* which of the new messages match? */
+    search_expr_internalise(state, searchargs->root);
+    for (i = 0; i < nnew; i++) {
+        if (index_search_evaluate(state, searchargs->root, newmsgnos[i]))
+            newmsgnos[nmatch++] = newmsgnos[i];
+    }
+
+    syslog(LOG_DEBUG, "sortcache: updating SORT on %s, %u new matches",
+           index_mboxname(state), nmatch);
+
+    if (!nmatch) goto done;
+
+    msgdata = index_msgdata_load(state, newmsgnos, nmatch, sortcrit, 0, NULL);
+    index_msgdata_sort(msgdata, nmatch, sortcrit);
+
+    /* merge them in, each one goes after the last */
+    uids = xmalloc((ent->nuids + nmatch) * sizeof(uint32_t));
+    nuids = 0;
+    pos = 0;
+    for (i = 0; i < nmatch; i++) {
+        unsigned low = pos, high = ent->nuids;
+
+        while (low < high) {
+            unsigned mid = low + (high - low) / 2;
+            MsgData **probe;
+            int cmp;
+
+            msgno = index_finduid(state, ent->uids[mid]);
+            probe = index_msgdata_load(state, &msgno, 1, sortcrit, 0, NULL);
+            cmp = index_sort_compare(probe[0], msgdata[i], sortcrit);
+            index_msgdata_free(probe, 1);
+
+            if (cmp < 0) low = mid + 1;
+            else high = mid;
+        }
+
+        memcpy(uids + nuids, ent->uids + pos, (low - pos) * sizeof(uint32_t));
+        nuids += low - pos;
+        pos = low;
+        uids[nuids++] = msgdata[i]->uid;
+    }
+    memcpy(uids + nuids, ent->uids + pos, (ent->nuids - pos) * sizeof(uint32_t));
+    nuids += ent->nuids - pos;
+
+    free(ent->uids);
+    ent->uids = uids;
+    ent->nuids = nuids;
+
+    index_msgdata_free(msgdata, nmatch);
+
+ done:
+    free(newmsgnos);
+    ent->highestmodseq = state->highestmodseq;
+    ent->last_uid = state->last_uid;
+    ent->exists = state->exists;
+    ent->num_expunged = state->num_expunged;
+    return 1;
+}
+
 /*
  * Performs a SORT command
  */
@@ -2002,6 +2335,9 @@ EXPORTED int index_sort(struct index_state *state,
     modseq_t highestmodseq = 0;
     search_query_t *query = NULL;
     search_folder_t *folder = NULL;
+    struct sortcache_entry *ent;
+    char *key = NULL;
+    int exact_only = 0;
     int r;
 
     /* update the index */
@@ -2010,6 +2346,28 @@ EXPORTED int index_sort(struct index_state *state,
 
     highestmodseq = needs_modseq(searchargs, NULL);
 
+    /* plain SORT responses can come from the cache */
+    if (!highestmodseq && !searchargs->returnopts) {
+        char *crit = sortcrit_as_string(sortcrit);
+        key = sortcache_key("SORT", crit, searchargs->root);
+        free(crit);
+        /* the search takes over searchargs->root, so ask now */
+        exact_only = sortcache_exact_only(sortcrit, searchargs->root);
+
+        ent = sortcache_find(state, key);
+        if (ent && sortcache_update_sort(state, ent, sortcrit, searchargs)) {
+            prot_printf(state->out, "* SORT");
+            for (i = 0; i < (int)ent->nuids; i++) {
+                prot_printf(state->out, " %u",
+                            usinguid ? ent->uids[i] :
+                            index_finduid(state, ent->uids[i]));
+            }
+            prot_printf(state->out, "\r\n");
+            free(key);
+            return ent->nuids;
+        }
+    }
+
     /* Search for messages based on the given criteria */
     query = search_query_new(state, searchargs);
     query->sortcrit = sortcrit;
@@ -2017,6 +2375,16 @@ EXPORTED int index_sort(struct index_state *state,
     if (r) goto out;        /* search failed */
     folder = search_query_find_folder(query, index_mboxname(state));
 
+    if (key) {
+        ent = sortcache_store(state, key, exact_only);
+        key = NULL;
+        ent->uids = xmalloc((query->merged_msgdata.count + 1) * sizeof(uint32_t));
+        for (i = 0 ; i < query->merged_msgdata.count ; i++) {
+            MsgData *md = ptrarray_nth(&query->merged_msgdata, i);
+            ent->uids[ent->nuids++] = md->uid;
+        }
+    }
+
     if (folder) {
         if (highestmodseq)
             highestmodseq = search_folder_get_highest_modseq(folder);
@@ -2076,6 +2444,7 @@ EXPORTED int index_sort(struct index_state *state,
 
 out:
     search_query_free(query);
+    free(key);
     return nmsg;
 }
 
@@ -2855,6 +3224,7 @@ EXPORTED int index_thread(struct index_state *state, int algorithm,
     int nmsg = 0;
     clock_t start;
     modseq_t highestmodseq = 0;
+    struct sortcache_entry *ent = NULL;
     int r;
 
     /* update the index */
@@ -2863,6 +3233,30 @@ EXPORTED int index_thread(struct index_state *state, int algorithm,
 
     highestmodseq = needs_modseq(searchargs, NULL);
 
+    /* without MODSEQ, the same THREAD gives the same response until
+     * messages come or go (or flags change, for mutable searches) */
+    if (!highestmodseq) {
+        char *args = strconcat(thread_algs[algorithm].alg_name,
+                               usinguid ? " UID" : " MSGNO", (char *)NULL);
+        char *key = sortcache_key("THREAD", args, searchargs->root);
+        free(args);
+
+        ent = sortcache_find(state, key);
+        if (ent && sortcache_unchanged(state, ent)) {
+            syslog(LOG_DEBUG, "sortcache: replaying THREAD on %s",
+                   index_mboxname(state));
+            prot_putbuf(state->out, &ent->thread);
+            prot_printf(state->out, "\r\n");
+            ent->highestmodseq = state->highestmodseq;
+            free(key);
+            return ent->nuids;
+        }
+
+        ent = sortcache_store(state, key,
+                              sortcache_exact_only(NULL, searchargs->root));
+        state->sortcache->capture = &ent->thread;
+    }
+
     if(CONFIG_TIMING_VERBOSE)
         start = clock();
 
@@ -2879,6 +3273,8 @@ EXPORTED int index_thread(struct index_state *state, int algorithm,
         nmsg = search_folder_get_array(folder, &msgno_list);
     }
 
+    if (ent) ent->nuids = nmsg;
+
     if (nmsg) {
         /* Thread messages using given algorithm */
         (*thread_algs[algorithm].threader)(state, msgno_list, nmsg, usinguid);
@@ -2903,6 +3299,11 @@ EXPORTED int index_thread(struct index_state *state, int algorithm,
     }
 
 out:
+    if (ent) {
+        state->sortcache->capture = NULL;
+        /* don't replay a failed search */
+        if (r) sortcache_entry_fini(ent);
+    }
     search_query_free(query);
     return nmsg;
 }
@@ -4123,6 +4524,7 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
     struct index_map *im = &state->map[msgno-1];
     struct index_record record;
     struct body *body = NULL;
+    int sendfd = -1;
 
     /* Check the modseq against changedsince */
     if (fetchargs->changedsince && im->modseq <= fetchargs->changedsince)
@@ -4158,6 +4560,23 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
             prot_printf(state->out, "\r\n");
             return 0;
         }
+
+        /* Let large literals go straight from the page cache to the
+         * socket.  Message files are never rewritten in place, so
+         * anything we can open with the same size is the same file. */
+        if (buf.len >= PROT_SENDFILE_MIN && prot_cansendfile(state->out)) {
+            struct stat sbuf;
+
+            sendfd = open(mailbox_record_fname(mailbox, &record), O_RDONLY, 0);
+            if (sendfd != -1 && !fstat(sendfd, &sbuf) &&
+                (size_t) sbuf.st_size == buf.len) {
+                prot_setsendfile(state->out, buf.s, buf.len, sendfd);
+            }
+            else if (sendfd != -1) {
+                close(sendfd);
+                sendfd = -1;
+            }
+        }
     }
     int ischanged = im->told_modseq < record.modseq;
 
@@ -4525,6 +4944,10 @@ static int index_fetchreply(struct index_state *state, uint32_t msgno,
         /* finsh the response if we have one */
         prot_printf(state->out, ")\r\n");
     }
+    if (sendfd != -1) {
+        prot_setsendfile(state->out, NULL, 0, PROT_NO_FD);
+        close(sendfd);
+    }
     buf_free(&buf);
     if (body) {
         message_free_body(body);
@@ -5046,6 +5469,7 @@ struct getsearchtext_rock
     strarray_t striphtml; /* strip HTML from these plain text body part ids */
     uint8_t indexlevel;
     int flags;
+    struct buf *cachetext; /* if set, also collect extracted text here */
 };
 
 static void stuff_part(search_text_receiver_t *receiver,
@@ -5069,6 +5493,48 @@ static void extract_cb(const struct buf *text, void *rock)
 {
     struct getsearchtext_rock *str = (struct getsearchtext_rock *)rock;
     str->receiver->append_text(str->receiver, text);
+    if (str->cachetext) buf_append(str->cachetext, text);
+}
+
+/*
+ * Extract the text of a body part into the receiver, going through the
+ * receiver's text cache if it has one.  The cache key includes everything
+ * besides the decoded content which changes the extracted text.
+ */
+static void extract_bodytext(struct getsearchtext_rock *str,
+                             const struct message_guid *content_guid,
+                             struct buf *data, charset_t charset,
+                             int encoding, const char *subtype, int flags)
+{
+    search_text_receiver_t *rx = str->receiver;
+    struct buf key = BUF_INITIALIZER;
+    struct buf text = BUF_INITIALIZER;
+    size_t minsize = config_getint(IMAPOPT_SEARCH_TEXTCACHE_MINSIZE);
+
+    if (!rx->get_cached_text || !content_guid ||
+        message_guid_isnull(content_guid) || buf_len(data) < minsize) {
+        charset_extract(extract_cb, str, data, charset, encoding, subtype, flags);
+        return;
+    }
+
+    buf_printf(&key, "%s.%d.%s.%s.%x", message_guid_encode(content_guid),
+               SEARCH_TEXTCACHE_VERSION, subtype,
+               charset_canon_name(charset), flags);
+
+    if (!rx->get_cached_text(rx, buf_cstring(&key), &text)) {
+        xstats_inc(SEARCH_TEXTCACHE_HIT);
+        if (buf_len(&text)) rx->append_text(rx, &text);
+    }
+    else {
+        str->cachetext = &text;
+        charset_extract(extract_cb, str, data, charset, encoding, subtype, flags);
+        str->cachetext = NULL;
+        if (rx->put_cached_text)
+            rx->put_cached_text(rx, buf_cstring(&key), &text);
+    }
+
+    buf_free(&text);
+    buf_free(&key);
 }
 
 #ifdef USE_HTTPD
@@ -5715,8 +6181,8 @@ static int getsearchtext_cb(int isbody, charset_t charset, int encoding,
             }
 
             str->receiver->begin_part(str->receiver, SEARCH_PART_BODY, content_guid);
-            charset_extract(extract_cb, str, data, charset, encoding, mysubtype,
-                           mycharset_flags);
+            extract_bodytext(str, content_guid, data, charset, encoding,
+                             mysubtype, mycharset_flags);
             str->receiver->end_part(str->receiver, SEARCH_PART_BODY);
         }
     }
@@ -6045,6 +6511,151 @@ static int index_copysetup(struct index_state *state, uint32_t msgno,
     return 0;
 }
 
+/* sort criteria normalised from the cache.  cyrus.sortidx holds them
+ * pre-computed, and for big mailboxes they're worked out in parallel */
+static int is_normalised_key(int label)
+{
+    switch (label) {
+    case SORT_CC:
+    case SORT_FROM:
+    case SORT_SUBJECT:
+    case SORT_TO:
+    case SORT_DISPLAYFROM:
+    case SORT_DISPLAYTO:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static void index_msgdata_from_sortidx(MsgData *cur,
+                                       const struct sortidx_entry *entry,
+                                       int label)
+{
+    switch (label) {
+    case SORT_CC:
+        cur->cc = xstrdupnull(entry->cc);
+        break;
+    case SORT_FROM:
+        cur->from = xstrdupnull(entry->from);
+        break;
+    case SORT_SUBJECT:
+        cur->xsubj = xstrdup(entry->xsubj);
+        cur->is_refwd = entry->is_refwd;
+        cur->xsubj_hash = strhash(cur->xsubj);
+        break;
+    case SORT_TO:
+        cur->to = xstrdupnull(entry->to);
+        break;
+    case SORT_DISPLAYFROM:
+        cur->displayfrom = xstrdupnull(entry->displayfrom);
+        break;
+    case SORT_DISPLAYTO:
+        cur->displayto = xstrdupnull(entry->displayto);
+        break;
+    }
+}
+
+/* raw cache fields, copied out to be normalised by the sort threads */
+struct msgdata_deferred {
+    char *subject;
+    char *from;
+    char *to;
+    char *cc;
+};
+
+struct msgdata_finish_rock {
+    MsgData *md;
+    struct msgdata_deferred *deferred;
+    const struct sortcrit *sortcrit;
+};
+
+static void msgdata_defer(struct msgdata_deferred *d, int label,
+                          const struct index_record *record)
+{
+    char **field;
+    int item;
+
+    switch (label) {
+    case SORT_CC:
+        field = &d->cc;
+        item = CACHE_CC;
+        break;
+    case SORT_FROM:
+    case SORT_DISPLAYFROM:
+        field = &d->from;
+        item = CACHE_FROM;
+        break;
+    case SORT_TO:
+    case SORT_DISPLAYTO:
+        field = &d->to;
+        item = CACHE_TO;
+        break;
+    case SORT_SUBJECT:
+        field = &d->subject;
+        item = CACHE_SUBJECT;
+        break;
+    default:
+        return;
+    }
+
+    if (!*field)
+        *field = xstrndup(cacheitem_base(record, item),
+                          cacheitem_size(record, item));
+}
+
+/* runs in the sort threads, so only touches messages start to end */
+static void msgdata_finish(void *rock, size_t start, size_t end)
+{
+    struct msgdata_finish_rock *frock = (struct msgdata_finish_rock *) rock;
+    const struct sortcrit *sortcrit = frock->sortcrit;
+    size_t i;
+    int j;
+
+    for (i = start; i < end; i++) {
+        MsgData *cur = &frock->md[i];
+        struct msgdata_deferred *d = &frock->deferred[i];
+
+        for (j = 0; sortcrit[j].key; j++) {
+            switch (sortcrit[j].key) {
+            case SORT_CC:
+                if (d->cc && !cur->cc)
+                    cur->cc = index_get_localpart_addr(d->cc);
+                break;
+            case SORT_FROM:
+                if (d->from && !cur->from)
+                    cur->from = index_get_localpart_addr(d->from);
+                break;
+            case SORT_SUBJECT:
+                if (d->subject && !cur->xsubj) {
+                    cur->xsubj = index_extract_subject(d->subject,
+                                                       strlen(d->subject),
+                                                       &cur->is_refwd);
+                    cur->xsubj_hash = strhash(cur->xsubj);
+                }
+                break;
+            case SORT_TO:
+                if (d->to && !cur->to)
+                    cur->to = index_get_localpart_addr(d->to);
+                break;
+            case SORT_DISPLAYFROM:
+                if (d->from && !cur->displayfrom)
+                    cur->displayfrom = index_get_displayname(d->from);
+                break;
+            case SORT_DISPLAYTO:
+                if (d->to && !cur->displayto)
+                    cur->displayto = index_get_displayname(d->to);
+                break;
+            }
+        }
+
+        free(d->subject);
+        free(d->from);
+        free(d->to);
+        free(d->cc);
+    }
+}
+
 /*
  * Creates a list, and optionally also an array of pointers to, of msgdata.
  *
@@ -6066,9 +6677,26 @@ MsgData **index_msgdata_load(struct index_state *state,
     struct index_record record;
     struct conversations_state *cstate = NULL;
     conversation_t conv = CONVERSATION_INIT;
+    struct sortidx *sidx = NULL;
+    struct sortidx_entry sentry;
+    int have_sentry;
+    struct msgdata_deferred *deferred = NULL;
 
     if (!n) return NULL;
 
+    for (j = 0; sortcrit[j].key; j++) {
+        if (is_normalised_key(sortcrit[j].key)) {
+            /* reading the sort keys means parsing the whole file, not
+             * worth it for a few messages */
+            if ((unsigned)n >= state->exists / 16)
+                sortidx_open(mailbox, &sidx);
+            /* big enough to normalise in parallel? */
+            if (sortpool_threads(n) > 1)
+                deferred = xzmalloc(n * sizeof(struct msgdata_deferred));
+            break;
+        }
+    }
+
     /* create an array of MsgData */
     ptrs = (MsgData **) xzmalloc(n * sizeof(MsgData *) + n * sizeof(MsgData));
     md = (MsgData *)(ptrs + n);
@@ -6101,9 +6729,17 @@ MsgData **index_msgdata_load(struct index_state *state,
         did_cache = did_env = did_conv = 0;
         tmpenv = NULL;
 
+        have_sentry = sidx && !sortidx_lookup(sidx, record.uid, &sentry);
+
         for (j = 0; sortcrit[j].key; j++) {
             label = sortcrit[j].key;
 
+            /* pre-normalised keys, no need to go to the cache */
+            if (have_sentry && is_normalised_key(label)) {
+                index_msgdata_from_sortidx(cur, &sentry, label);
+                continue;
+            }
+
             if ((label == SORT_CC ||
                  label == SORT_FROM || label == SORT_SUBJECT ||
                  label == SORT_TO || label == LOAD_IDS ||
@@ -6118,6 +6754,12 @@ MsgData **index_msgdata_load(struct index_state *state,
                 did_cache++;
             }
 
+            /* copy out the raw fields, the sort threads do the rest */
+            if (deferred && is_normalised_key(label)) {
+                msgdata_defer(&deferred[i], label, &record);
+                continue;
+            }
+
             if ((label == LOAD_IDS) && !did_env) {
                 /* no point if we don't have enough data */
                 if (cacheitem_size(&record, CACHE_ENVELOPE) <= 2)
@@ -6149,7 +6791,7 @@ MsgData **index_msgdata_load(struct index_state *state,
 
             switch (label) {
             case SORT_CC:
-                cur->cc = get_localpart_addr(cacheitem_base(&record, CACHE_CC));
+                cur->cc = index_get_localpart_addr(cacheitem_base(&record, CACHE_CC));
                 break;
             case SORT_DATE:
                 cur->sentdate = record.gmtime;
@@ -6158,7 +6800,7 @@ MsgData **index_msgdata_load(struct index_state *state,
                 cur->internaldate = record.internaldate;
                 break;
             case SORT_FROM:
-                cur->from = get_localpart_addr(cacheitem_base(&record, CACHE_FROM));
+                cur->from = index_get_localpart_addr(cacheitem_base(&record, CACHE_FROM));
                 break;
             case SORT_MODSEQ:
                 /* already copied above */
@@ -6176,7 +6818,7 @@ MsgData **index_msgdata_load(struct index_state *state,
                 cur->xsubj_hash = strhash(cur->xsubj);
                 break;
             case SORT_TO:
-                cur->to = get_localpart_addr(cacheitem_base(&record, CACHE_TO));
+                cur->to = index_get_localpart_addr(cacheitem_base(&record, CACHE_TO));
                 break;
             case SORT_ANNOTATION: {
                 struct buf value = BUF_INITIALIZER;
@@ -6233,11 +6875,11 @@ MsgData **index_msgdata_load(struct index_state *state,
                                               cacheitem_size(&record, CACHE_HEADERS));
                 break;
             case SORT_DISPLAYFROM:
-                cur->displayfrom = get_displayname(
+                cur->displayfrom = index_get_displayname(
                                    cacheitem_base(&record, CACHE_FROM));
                 break;
             case SORT_DISPLAYTO:
-                cur->displayto = get_displayname(
+                cur->displayto = index_get_displayname(
                                  cacheitem_base(&record, CACHE_TO));
                 break;
             case SORT_SPAMSCORE: {
@@ -6281,10 +6923,18 @@ MsgData **index_msgdata_load(struct index_state *state,
         conversation_fini(&conv);
     }
 
+    sortidx_close(&sidx);
+
+    if (deferred) {
+        struct msgdata_finish_rock frock = { md, deferred, sortcrit };
+        sortpool_run(n, msgdata_finish, &frock);
+        free(deferred);
+    }
+
     return ptrs;
 }
 
-static char *get_localpart_addr(const char *header)
+EXPORTED char *index_get_localpart_addr(const char *header)
 {
     struct address *addr = NULL;
     char *ret = NULL;
@@ -6303,7 +6953,7 @@ static char *get_localpart_addr(const char *header)
 /*
  * Get the 'display-name' of an address from a header
  */
-static char *get_displayname(const char *header)
+EXPORTED char *index_get_displayname(const char *header)
 {
     struct address *addr = NULL;
     char *ret = NULL;
@@ -6340,7 +6990,7 @@ static char *get_displayname(const char *header)
  * This is a wrapper around _index_extract_subject() which preps the
  * subj NSTRING and checks for Netscape "[Fwd: ]".
  */
-static char *index_extract_subject(const char *subj, size_t len, int *is_refwd)
+EXPORTED char *index_extract_subject(const char *subj, size_t len, int *is_refwd)
 {
     char *rawbuf, *buf, *s, *base;
 
@@ -6869,29 +7519,29 @@ static int index_sort_compare_reverse_flagged(const void *v1, const void *v2)
 void index_msgdata_sort(MsgData **msgdata, int n, const struct sortcrit *sortcrit)
 {
     if (sortcrit_is_uid(sortcrit)) {
-        qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_uid);
+        sortpool_qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_uid);
     }
     else if (sortcrit_is_reverse_uid(sortcrit)) {
-        qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_reverse_uid);
+        sortpool_qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_reverse_uid);
     }
     else if (sortcrit_is_modseq(sortcrit)) {
-        qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_modseq);
+        sortpool_qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_modseq);
     }
     else if (sortcrit_is_arrival(sortcrit)) {
-        qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_arrival);
+        sortpool_qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_arrival);
     }
     else if (sortcrit_is_reverse_arrival(sortcrit)) {
-        qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_reverse_arrival);
+        sortpool_qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_reverse_arrival);
     }
     else if (sortcrit_is_reverse_flagged(sortcrit)) {
-        qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_reverse_flagged);
+        sortpool_qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_reverse_flagged);
     }
     else {
         char *tmp = sortcrit_as_string(sortcrit);
         syslog(LOG_DEBUG, "GENERICSORT: %s", tmp);
         free(tmp);
         the_sortcrit = (struct sortcrit *)sortcrit;
-        qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_generic_qsort);
+        sortpool_qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_generic_qsort);
     }
 }
 
@@ -7067,7 +7717,7 @@ static void index_thread_orderedsubj(struct index_state *state,
  *
  * Frees contents of msgdata as a side effect.
  */
-static void _index_thread_print(struct index_state *state,
+static void _index_thread_print(struct buf *buf,
                                 Thread *thread, int usinguid)
 {
     Thread *child;
@@ -7075,18 +7725,18 @@ static void _index_thread_print(struct index_state *state,
     /* for each thread... */
     while (thread) {
         /* start the thread */
-        prot_printf(state->out, "(");
+        buf_putc(buf, '(');
 
         /* if we have a message, print its identifier
          * (do nothing for empty containers)
          */
         if (thread->msgdata && thread->msgdata->uid) {
-            prot_printf(state->out, "%u",
-                        usinguid ? thread->msgdata->uid :
-                        thread->msgdata->msgno);
+            buf_printf(buf, "%u",
+                       usinguid ? thread->msgdata->uid :
+                       thread->msgdata->msgno);
 
             /* if we have a child, print the parent-child separator */
-            if (thread->child) prot_printf(state->out, " ");
+            if (thread->child) buf_putc(buf, ' ');
         }
 
         /* for each child, grandchild, etc... */
@@ -7094,24 +7744,24 @@ static void _index_thread_print(struct index_state *state,
         while (child) {
             /* if the child has siblings, print new branch and break */
             if (child->next) {
-                _index_thread_print(state, child, usinguid);
+                _index_thread_print(buf, child, usinguid);
                 break;
             }
             /* otherwise print the only child */
             else {
-                prot_printf(state->out, "%u",
-                            usinguid ? child->msgdata->uid :
-                            child->msgdata->msgno);
+                buf_printf(buf, "%u",
+                           usinguid ? child->msgdata->uid :
+                           child->msgdata->msgno);
 
                 /* if we have a child, print the parent-child separator */
-                if (child->child) prot_printf(state->out, " ");
+                if (child->child) buf_putc(buf, ' ');
 
                 child = child->child;
             }
         }
 
         /* end the thread */
-        prot_printf(state->out, ")");
+        buf_putc(buf, ')');
 
         thread = thread->next;
     }
@@ -7126,12 +7776,22 @@ static void _index_thread_print(struct index_state *state,
 static void index_thread_print(struct index_state *state,
                                Thread *thread, int usinguid)
 {
-    prot_printf(state->out, "* THREAD");
+    struct buf buf = BUF_INITIALIZER;
+
+    buf_appendcstr(&buf, "* THREAD");
 
     if (thread) {
-        prot_printf(state->out, " ");
-        _index_thread_print(state, thread->child, usinguid);
+        buf_putc(&buf, ' ');
+        _index_thread_print(&buf, thread->child, usinguid);
     }
+
+    prot_putbuf(state->out, &buf);
+
+    /* keep a copy for the next identical THREAD command */
+    if (state->sortcache && state->sortcache->capture)
+        buf_copy(state->sortcache->capture, &buf);
+
+    buf_free(&buf);
 }
 
 /*
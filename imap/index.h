@@ -80,6 +80,15 @@ struct vanished_params {
     int uidvalidity_is_max;
 };
 
+/* what a client had been told about a mailbox, so a fresh process can
+ * carry on the session; see index_resume_save() */
+struct index_resume {
+    uint32_t uidvalidity;
+    uint32_t last_uid;
+    modseq_t highestmodseq;
+    struct seqset *uids;
+};
+
 struct index_init {
     const char *userid;
     struct auth_state *authstate;
@@ -91,8 +100,11 @@ struct index_init {
     int want_expunged;
     struct vanished_params vanished;
     struct seqset *vanishedlist;
+    struct index_resume *resume;
 };
 
+struct index_sortcache;
+
 struct index_map {
     modseq_t modseq;
     modseq_t told_modseq;
@@ -137,6 +149,7 @@ struct index_state {
     int want_expunged;
     unsigned num_expunged;
     message_t *m;
+    struct index_sortcache *sortcache;
 };
 
 struct copyargs {
@@ -287,6 +300,8 @@ extern int index_open(const char *name, struct index_init *init,
 extern int index_open_mailbox(struct mailbox *mailbox, struct index_init *init,
                               struct index_state **stateptr);
 extern int index_refresh(struct index_state *state);
+extern void index_resume_save(struct index_state *state,
+                              struct index_resume *resume);
 extern void index_checkflags(struct index_state *state, int print, int dirty);
 extern void index_select(struct index_state *state, struct index_init *init);
 extern int index_status(struct index_state *state, struct statusdata *sdata);
@@ -345,6 +360,11 @@ extern int index_getuidsequence(struct index_state *state,
                                 unsigned **uid_list);
 
 extern const char *index_mboxname(const struct index_state *state);
+
+/* SORT key normalisation */
+extern char *index_extract_subject(const char *subj, size_t len, int *is_refwd);
+extern char *index_get_localpart_addr(const char *header);
+extern char *index_get_displayname(const char *header);
 extern int index_hasrights(const struct index_state *state, int rights);
 
 extern int index_reload_record(struct index_state *state,
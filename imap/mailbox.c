@@ -100,6 +100,7 @@
 #include "proc.h"
 #include "retry.h"
 #include "seen.h"
+#include "sortidx.h"
 #include "user.h"
 #include "util.h"
 #include "sequence.h"
@@ -146,6 +147,8 @@ struct mailbox_repack {
     struct synccrcs crcs;
     char *userid;
     ptrarray_t caches;
+    int sortidx_fd;
+    struct buf sortidx;
 };
 
 static struct MsgFlagMap msgflagmap[] = {
@@ -176,6 +179,10 @@ static int mailbox_lock_index_internal(struct mailbox *mailbox,
 static void cleanup_stale_expunged(struct mailbox *mailbox);
 static bit32 mailbox_index_record_to_buf(struct index_record *record, int version,
                                          unsigned char *buf);
+static void index_view_set_change(struct mailbox *mailbox,
+                                  struct index_record *record);
+static void index_view_invalidate(struct mailbox *mailbox, int discard);
+static void index_view_free(struct index_view **viewp);
 
 #ifdef WITH_DAV
 static struct webdav_db *mailbox_open_webdav(struct mailbox *);
@@ -1250,6 +1257,8 @@ EXPORTED void mailbox_close(struct mailbox **mailboxptr)
     }
 
     mailbox_release_resources(mailbox);
+    index_view_free(&mailbox->index_view);
+    buf_free(&mailbox->sortidx_pending);
 
     free(mailbox->name);
     free(mailbox->part);
@@ -1768,6 +1777,9 @@ static int mailbox_read_index_header(struct mailbox *mailbox)
     r = mailbox_refresh_index_map(mailbox);
     if (r) return r;
 
+    /* records may have been changed by someone else */
+    index_view_invalidate(mailbox, /*discard*/0);
+
     return 0;
 }
 
@@ -1908,6 +1920,9 @@ static int _store_change(struct mailbox *mailbox, struct index_record *record, i
     change->record = *record;
     change->flags = flags;
 
+    if (mailbox->index_view && mailbox->index_view->is_current)
+        index_view_set_change(mailbox, record);
+
     if (mailbox_cacherecord(mailbox, record)) {
         /* failed to load cache record */
         free(change->msgid);
@@ -2199,13 +2214,228 @@ static struct webdav_db *mailbox_open_webdav(struct mailbox *mailbox)
 }
 #endif
 
-static uint32_t mailbox_getuid(struct mailbox *mailbox, uint32_t recno)
+/******************** index view ********************/
+
+#define INDEX_VIEW_ALIGN 64 /* keep each array on its own cache lines */
+
+static size_t index_view_align(size_t size)
+{
+    return (size + INDEX_VIEW_ALIGN - 1) & ~((size_t)INDEX_VIEW_ALIGN - 1);
+}
+
+/* lay the arrays out for 'alloc' records in one new block, keeping
+ * the records we already have */
+static void index_view_grow(struct index_view *view, uint32_t alloc)
+{
+    size_t size_uid = index_view_align(alloc * sizeof(*view->uid));
+    size_t size_system = index_view_align(alloc * sizeof(*view->system_flags));
+    size_t size_internal = index_view_align(alloc * sizeof(*view->internal_flags));
+    size_t size_modseq = index_view_align(alloc * sizeof(*view->modseq));
+    size_t size_cache = index_view_align(alloc * sizeof(*view->cache_offset));
+    size_t size_user = index_view_align(alloc * sizeof(*view->user_flags));
+    size_t size_crc = index_view_align(alloc * sizeof(*view->crc));
+    void *base = xzmalloc(size_uid + size_system + size_internal + size_modseq
+                          + size_cache + size_user + size_crc + INDEX_VIEW_ALIGN);
+    char *p = (char *)index_view_align((uintptr_t)base);
+    struct index_view old = *view;
+
+    view->uid = (uint32_t *)p;
+    p += size_uid;
+    view->system_flags = (uint32_t *)p;
+    p += size_system;
+    view->internal_flags = (uint32_t *)p;
+    p += size_internal;
+    view->modseq = (modseq_t *)p;
+    p += size_modseq;
+    view->cache_offset = (size_t *)p;
+    p += size_cache;
+    view->user_flags = (bit32 (*)[MAX_USER_FLAGS/32])p;
+    p += size_user;
+    view->crc = (bit32 *)p;
+
+    if (old.num_records) {
+        uint32_t n = old.num_records;
+        memcpy(view->uid, old.uid, n * sizeof(*view->uid));
+        memcpy(view->system_flags, old.system_flags,
+               n * sizeof(*view->system_flags));
+        memcpy(view->internal_flags, old.internal_flags,
+               n * sizeof(*view->internal_flags));
+        memcpy(view->modseq, old.modseq, n * sizeof(*view->modseq));
+        memcpy(view->cache_offset, old.cache_offset,
+               n * sizeof(*view->cache_offset));
+        memcpy(view->user_flags, old.user_flags, n * sizeof(*view->user_flags));
+        memcpy(view->crc, old.crc, n * sizeof(*view->crc));
+    }
+
+    free(old.base);
+    view->base = base;
+    view->alloc = alloc;
+}
+
+static void index_view_set(struct index_view *view, uint32_t recno,
+                           const struct index_record *record, bit32 crc)
+{
+    uint32_t n = recno - 1;
+
+    view->uid[n] = record->uid;
+    view->system_flags[n] = record->system_flags;
+    view->internal_flags[n] = record->internal_flags;
+    view->modseq[n] = record->modseq;
+    view->cache_offset[n] = record->cache_offset;
+    memcpy(view->user_flags[n], record->user_flags, sizeof(view->user_flags[n]));
+    view->crc[n] = crc;
+}
+
+/* a change of ours: remember the CRC it will have once committed, so
+ * the next refresh knows it's already got it */
+static void index_view_set_change(struct mailbox *mailbox,
+                                  struct index_record *record)
+{
+    struct index_view *view = mailbox->index_view;
+    indexbuffer_t ibuf;
+    bit32 crc;
+
+    if (record->recno > view->alloc)
+        index_view_grow(view, (record->recno | 0xff) + 1);
+
+    crc = mailbox_index_record_to_buf(record, mailbox->i.minor_version,
+                                      ibuf.buf);
+    index_view_set(view, record->recno, record, crc);
+
+    if (record->recno > view->num_records)
+        view->num_records = record->recno;
+}
+
+static void index_view_free(struct index_view **viewp)
 {
+    struct index_view *view = *viewp;
+
+    if (!view) return;
+
+    free(view->base);
+    free(view);
+    *viewp = NULL;
+}
+
+/* the next use will need to check the index file again */
+static void index_view_invalidate(struct mailbox *mailbox, int discard)
+{
+    struct index_view *view = mailbox->index_view;
+
+    if (!view) return;
+
+    view->is_current = 0;
+    if (discard) view->num_records = 0;
+}
+
+/*
+ * Bring the index view up to date with the mapped index file and our
+ * own pending changes, re-decoding only the records whose CRC has
+ * changed since we last looked.
+ */
+static void index_view_refresh(struct mailbox *mailbox)
+{
+    struct index_view *view = mailbox->index_view;
     struct index_record record;
-    record.uid = 0;
-    /* XXX - cheaper memory-access reads? */
-    mailbox_read_index_record(mailbox, recno, &record);
-    return record.uid;
+    uint32_t num_records = mailbox->i.num_records;
+    uint32_t file_records = 0;
+    uint32_t recno;
+    uint32_t i;
+    int version = mailbox->i.minor_version;
+
+    if (!view)
+        view = mailbox->index_view = xzmalloc(sizeof(struct index_view));
+
+    /* a different index file, or a changed record format */
+    if (view->ino != mailbox->index_ino
+        || view->generation_no != mailbox->i.generation_no
+        || view->minor_version != version
+        || view->num_records > num_records) {
+        view->num_records = 0;
+        view->ino = mailbox->index_ino;
+        view->generation_no = mailbox->i.generation_no;
+        view->minor_version = version;
+    }
+
+    if (num_records > view->alloc)
+        index_view_grow(view, (num_records | 0xff) + 1);
+
+    if (mailbox->index_size > mailbox->i.start_offset && mailbox->i.record_size)
+        file_records = (mailbox->index_size - mailbox->i.start_offset)
+                       / mailbox->i.record_size;
+    if (file_records > num_records)
+        file_records = num_records;
+
+    for (recno = 1; recno <= file_records; recno++) {
+        const char *buf = mailbox->index_base + mailbox->i.start_offset
+                          + (recno-1) * mailbox->i.record_size;
+        bit32 crc = 0;
+
+        /* older formats keep the CRC elsewhere, if at all */
+        if (version >= 16) {
+            crc = ntohl(*((bit32 *)(buf+OFFSET_RECORD_CRC)));
+            if (recno <= view->num_records && view->crc[recno-1] == crc)
+                continue;
+        }
+
+        /* damaged records are skipped, as by mailbox_iter_step */
+        if (mailbox_buf_to_index_record(buf, version, &record, 0))
+            memset(&record, 0, sizeof(struct index_record));
+
+        index_view_set(view, recno, &record, crc);
+    }
+
+    /* records we've appended but not committed are all changes,
+     * anything else is past the end of the file */
+    memset(&record, 0, sizeof(struct index_record));
+    for (; recno <= num_records; recno++)
+        index_view_set(view, recno, &record, 0);
+
+    view->num_records = num_records;
+
+    for (i = 0; i < mailbox->index_change_count; i++)
+        index_view_set_change(mailbox, &mailbox->index_changes[i].record);
+
+    view->is_current = 1;
+}
+
+/*
+ * Returns the index view for 'mailbox', refreshing it first if the
+ * index has been relocked since it was last used.  The arrays are only
+ * good until the next index change or unlock.
+ */
+EXPORTED const struct index_view *mailbox_index_view(struct mailbox *mailbox)
+{
+    if (!mailbox->index_view || !mailbox->index_view->is_current)
+        index_view_refresh(mailbox);
+
+    return mailbox->index_view;
+}
+
+
+/*
+ * The UID of record 'recno', without decoding the rest of it.  From the
+ * view if that's already current, otherwise straight from the map -
+ * bringing the whole view up to date isn't worth it for a lookup.
+ */
+static uint32_t mailbox_getuid(struct mailbox *mailbox, uint32_t recno)
+{
+    const struct index_view *view = mailbox->index_view;
+    size_t offset;
+
+    if (view && view->is_current)
+        return view->uid[recno-1];
+
+    if (mailbox->index_change_count) {
+        struct index_change *change = _find_change(mailbox, recno);
+        if (change) return change->record.uid;
+    }
+
+    offset = mailbox->i.start_offset + (recno-1) * mailbox->i.record_size;
+    if (offset + mailbox->i.record_size > mailbox->index_size)
+        return 0;
+
+    return ntohl(*((bit32 *)(mailbox->index_base+offset+OFFSET_UID)));
 }
 
 
@@ -2213,16 +2443,38 @@ static uint32_t mailbox_getuid(struct mailbox *mailbox, uint32_t recno)
  * Returns the recno of the message with UID 'uid'.
  * If no message with UID 'uid', returns the message with
  * the highest UID not greater than 'uid'.
+ *
+ * UIDs are ascending and mostly dense, so guess where 'uid' is from
+ * the UIDs at either end of the range.  If a guess doesn't at least
+ * halve the range, bisect next time, so sparse mailboxes are never
+ * worse than a binary search.
  */
 static uint32_t mailbox_finduid(struct mailbox *mailbox, uint32_t uid)
 {
     uint32_t low = 1;
     uint32_t high = mailbox->i.num_records;
+    uint32_t lowuid, highuid;
     uint32_t mid;
     uint32_t miduid;
+    uint32_t range;
+    int bisect = 0;
 
     while (low <= high) {
-        mid = (high - low)/2 + low;
+        lowuid = mailbox_getuid(mailbox, low);
+        if (uid < lowuid)
+            return low - 1;
+        highuid = mailbox_getuid(mailbox, high);
+        if (uid >= highuid)
+            return high;
+
+        /* lowuid <= uid < highuid, so low < high */
+        range = high - low;
+        if (bisect)
+            mid = range/2 + low;
+        else
+            mid = low + (uint32_t)((uint64_t)(uid - lowuid) * range
+                                   / (highuid - lowuid));
+
         miduid = mailbox_getuid(mailbox, mid);
         if (miduid == uid)
             return mid;
@@ -2230,6 +2482,8 @@ static uint32_t mailbox_finduid(struct mailbox *mailbox, uint32_t uid)
             high = mid - 1;
         else
             low = mid + 1;
+
+        bisect = (high - low) > range/2;
     }
     return high;
 }
@@ -2703,6 +2957,8 @@ EXPORTED int mailbox_abort(struct mailbox *mailbox)
     if (mailbox->local_cstate)
         conversations_abort(&mailbox->local_cstate);
 
+    buf_reset(&mailbox->sortidx_pending);
+
     if (!mailbox->i.dirty)
         return 0;
 
@@ -2715,6 +2971,7 @@ EXPORTED int mailbox_abort(struct mailbox *mailbox)
 
     /* removed cached changes */
     _cleanup_changes(mailbox);
+    index_view_invalidate(mailbox, /*discard*/1);
 
     /* we re-read the header and index header to wipe
      * away all the changed values */
@@ -2781,6 +3038,12 @@ EXPORTED int mailbox_commit(struct mailbox *mailbox)
         return IMAP_IOERROR;
     }
 
+    /* the sort keys are only an accelerator, don't fail the commit */
+    if (mailbox->sortidx_pending.len) {
+        sortidx_commit(mailbox, &mailbox->sortidx_pending);
+        buf_reset(&mailbox->sortidx_pending);
+    }
+
     if (config_auditlog && mailbox->modseq_dirty)
         syslog(LOG_NOTICE, "auditlog: modseq sessionid=<%s> "
                "mailbox=<%s> uniqueid=<%s> highestmodseq=<" MODSEQ_FMT
@@ -4075,6 +4338,9 @@ EXPORTED int mailbox_append_index_record(struct mailbox *mailbox,
          * will set the cache_offset field. */
         r = mailbox_append_cache(mailbox, record);
         if (r) return r;
+
+        if (config_getswitch(IMAPOPT_MAILBOX_SORTIDX))
+            sortidx_add_record(&mailbox->sortidx_pending, record);
     }
 
     r = mailbox_update_indexes(mailbox, NULL, record);
@@ -4229,6 +4495,8 @@ static int mailbox_repack_setup(struct mailbox *mailbox, int version,
     unsigned char *buf = ibuf.buf;
     int n;
 
+    repack->sortidx_fd = -1;
+
     /* if we're changing version at all, recalculate counts up-front */
     if (version != mailbox->i.minor_version) {
         /* NOTE: this maps in annot_state in mailbox, which will get copied
@@ -4245,6 +4513,8 @@ static int mailbox_repack_setup(struct mailbox *mailbox, int version,
     repack->crcs = mailbox->i.synccrcs;
     repack->newmailbox = *mailbox; // struct copy
     repack->newmailbox.index_fd = -1;
+    repack->newmailbox.index_view = NULL;
+    memset(&repack->newmailbox.sortidx_pending, 0, sizeof(struct buf));
 
     /* new files */
     fname = mailbox_meta_newfname(mailbox, META_INDEX);
@@ -4256,6 +4526,12 @@ static int mailbox_repack_setup(struct mailbox *mailbox, int version,
         goto fail;
     }
 
+    /* rebuilding the sort keys is optional, carry on without them */
+    if (config_getswitch(IMAPOPT_MAILBOX_SORTIDX)) {
+        fname = mailbox_meta_newfname(mailbox, META_SORTIDX);
+        repack->sortidx_fd = sortidx_create(fname, mailbox->i.uidvalidity);
+    }
+
     /* update the generation number */
     repack->newmailbox.i.generation_no++;
 
@@ -4396,6 +4672,16 @@ static int mailbox_repack_add(struct mailbox_repack *repack,
 
     repack->newmailbox.i.num_records++;
 
+    if (repack->sortidx_fd != -1 &&
+        !(record->internal_flags & FLAG_INTERNAL_UNLINKED)) {
+        const char *fname = mailbox_meta_newfname(repack->mailbox, META_SORTIDX);
+        if (sortidx_add_and_flush(repack->sortidx_fd, fname,
+                                  &repack->sortidx, record)) {
+            xclose(repack->sortidx_fd);
+            unlink(fname);
+        }
+    }
+
     return 0;
 }
 
@@ -4412,6 +4698,12 @@ static void mailbox_repack_abort(struct mailbox_repack **repackptr)
     xclose(repack->newmailbox.index_fd);
     unlink(mailbox_meta_newfname(repack->mailbox, META_INDEX));
 
+    if (repack->sortidx_fd != -1) {
+        xclose(repack->sortidx_fd);
+        unlink(mailbox_meta_newfname(repack->mailbox, META_SORTIDX));
+    }
+    buf_free(&repack->sortidx);
+
     /* close and remove all new caches */
     for (i = 0; i < repack->caches.count; i++) {
         struct mappedfile *cachefile = ptrarray_nth(&repack->caches, i);
@@ -4544,6 +4836,17 @@ HIDDEN int mailbox_repack_commit(struct mailbox_repack **repackptr)
 
     strarray_fini(&cachefiles);
 
+    /* and the sort keys, if they were rebuilt */
+    if (repack->sortidx_fd != -1) {
+        const char *fname = mailbox_meta_newfname(repack->mailbox, META_SORTIDX);
+        if (sortidx_append(repack->sortidx_fd, fname, &repack->sortidx))
+            unlink(fname);
+        else
+            mailbox_meta_rename(repack->mailbox, META_SORTIDX);
+        xclose(repack->sortidx_fd);
+    }
+    buf_free(&repack->sortidx);
+
     // drop the map if we've mapped in the newmailbox index separately
     if (repack->newmailbox.index_base != repack->mailbox->index_base) {
         map_free(&repack->newmailbox.index_base, &repack->newmailbox.index_len);
@@ -5683,6 +5986,7 @@ static struct meta_file meta_files[] = {
     { META_SQUAT,        1, 0 },
     { META_ANNOTATIONS,  1, 1 },
     { META_ARCHIVECACHE, 1, 1 },
+    { META_SORTIDX,      1, 1 },
     { 0, 0, 0 }
 };
 
@@ -7095,6 +7399,11 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
     r = mailbox_reconstruct_uniqueid(mailbox, flags);
     if (r) goto close;
 
+    /* cached sort keys may not match what we find, they will be
+     * rebuilt on the next repack */
+    if (make_changes)
+        unlink(mailbox_meta_fname(mailbox, META_SORTIDX));
+
     /* open and lock the annotation state */
     r = mailbox_get_annotate_state(mailbox, ANNOTATE_ANY_UID, NULL);
     if (r) {
@@ -7378,12 +7687,15 @@ EXPORTED const message_t *mailbox_iter_step(struct mailbox_iter *iter)
     if (mailbox_wait_cb) mailbox_wait_cb(mailbox_wait_cb_rock);
 
     for (iter->recno++; iter->recno <= iter->num_records; iter->recno++) {
+        /* check from the view, so skipped records are never decoded */
+        const struct index_view *view = mailbox_index_view(iter->mailbox);
+        uint32_t n = iter->recno - 1;
+        if (iter->recno > view->num_records) break;
+        if (!view->uid[n]) continue; /* can happen on damaged mailboxes */
+        if ((view->system_flags[n] & iter->skipflags)) continue;
+        if ((view->internal_flags[n] & iter->skipflags)) continue;
+        if (iter->changedsince && view->modseq[n] <= iter->changedsince) continue;
         message_set_from_mailbox(iter->mailbox, iter->recno, iter->msg);
-        const struct index_record *record = msg_record(iter->msg);
-        if (!record->uid) continue; /* can happen on damaged mailboxes */
-        if ((record->system_flags & iter->skipflags)) continue;
-        if ((record->internal_flags & iter->skipflags)) continue;
-        if (iter->changedsince && record->modseq <= iter->changedsince) continue;
         return iter->msg;
     }
 
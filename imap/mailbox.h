@@ -91,6 +91,7 @@
 #define FNAME_DAV "/cyrus.dav"
 #endif
 #define FNAME_ANNOTATIONS "/cyrus.annotations"
+#define FNAME_SORTIDX "/cyrus.sortidx"
 
 #define CRC_INIT_BASIC 0
 // annot value should be visible as an integer via replication protocol,
@@ -107,7 +108,8 @@ enum meta_filename {
 #ifdef WITH_DAV
   META_DAV,
 #endif
-  META_ARCHIVECACHE
+  META_ARCHIVECACHE,
+  META_SORTIDX
 };
 
 #define MAILBOX_FNAME_LEN 256
@@ -240,6 +242,30 @@ struct index_change {
 
 #define INDEX_MAP_SIZE 65536
 
+/* A decoded copy of the most used index record fields, as one array per
+ * field indexed by recno-1, so scanning a big mailbox doesn't decode
+ * every record.  It's brought up to date at most once per index lock,
+ * re-reading only records which have changed, and follows our own
+ * uncommitted changes.  See mailbox_index_view() */
+struct index_view {
+    uint32_t num_records;
+    uint32_t *uid;
+    uint32_t *system_flags;
+    uint32_t *internal_flags;
+    modseq_t *modseq;
+    size_t *cache_offset;
+    bit32 (*user_flags)[MAX_USER_FLAGS/32];
+
+    /* private to mailbox.c */
+    bit32 *crc;
+    void *base;
+    uint32_t alloc;
+    ino_t ino;
+    uint32_t generation_no;
+    int minor_version;
+    int is_current;
+};
+
 struct mailbox {
     int index_fd;
     int header_fd;
@@ -303,6 +329,12 @@ struct mailbox {
     struct index_change *index_changes;
     uint32_t index_change_alloc;
     uint32_t index_change_count;
+
+    /* decoded index records */
+    struct index_view *index_view;
+
+    /* sortidx entries for appends, written on commit */
+    struct buf sortidx_pending;
 };
 
 #define ITER_SKIP_UNLINKED (1<<0)
@@ -586,6 +618,7 @@ extern int mailbox_rewrite_index_record(struct mailbox *mailbox,
                                         struct index_record *record);
 extern int mailbox_append_index_record(struct mailbox *mailbox,
                                        struct index_record *record);
+extern const struct index_view *mailbox_index_view(struct mailbox *mailbox);
 extern int mailbox_find_index_record(struct mailbox *mailbox, uint32_t uid,
                                      struct index_record *record);
 extern int mailbox_read_basecid(struct mailbox *mailbox,
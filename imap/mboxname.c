@@ -2018,6 +2018,11 @@ EXPORTED char *mboxname_metapath(const char *partition,
         filename = FNAME_CACHE;
         archiveflag = 1;
         break;
+    case META_SORTIDX:
+        snprintf(confkey, 256, "metadir-index-%s", partition);
+        metaflag = IMAP_ENUM_METAPARTITION_FILES_INDEX;
+        filename = FNAME_SORTIDX;
+        break;
     case 0:
         break;
     default:
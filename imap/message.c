@@ -138,7 +138,7 @@ static void message_parse_content(struct msg *msg,
                                   strarray_t *boundaries,
                                   const char *efname);
 
-static char *message_getline(struct buf *, struct msg *msg);
+static const char *message_nextline(const struct msg *msg, const char *line);
 static int message_pendingboundary(const char *s, int slen, strarray_t *);
 
 static void message_write_envelope(struct buf *buf, const struct body *body);
@@ -151,6 +151,9 @@ static void message_write_searchaddr(struct buf *buf,
                                      const struct address *addrlist);
 static int message_need(const message_t *m, unsigned int need);
 static void message_yield(message_t *m, unsigned int yield);
+static void header_index_build(struct header_index *idx,
+                               const char *base, size_t len);
+static void header_index_fini(struct header_index *idx);
 
 /*
  * Convert a string to uppercase.  Returns the string.
@@ -834,8 +837,11 @@ static int message_parse_headers(struct msg *msg, struct body *body,
                                  const char *efname)
 {
     struct buf headers = BUF_INITIALIZER;
+    const char *start = msg->base + msg->offset;
+    const char *end = msg->base + msg->len;
+    const char *line, *eol;
     char *next;
-    int len;
+    size_t headerlen;
     int sawboundary = 0;
     uint32_t maxlines = config_getint(IMAPOPT_MAXHEADERLINES);
     int have_max = 0;
@@ -843,151 +849,168 @@ static int message_parse_headers(struct msg *msg, struct body *body,
 
     body->header_offset = msg->offset;
 
-    buf_putc(&headers, '\n');   /* Leading newline to prime the pump */
-
-    /* Slurp up all of the headers into 'headers' */
-    while ((next = message_getline(&headers, msg)) &&
-           (next[-1] != '\n' ||
-            (*next != '\r' || next[1] != '\n'))) {
+    /* Find the end of the headers: a CRLF on its own, or a boundary */
+    for (line = start; line < end; line = eol) {
+        eol = message_nextline(msg, line);
 
-        len = strlen(next);
+        if (eol - line >= 2 && line[0] == '\r' && line[1] == '\n') {
+            /* the blank line belongs to the headers */
+            line = eol;
+            break;
+        }
 
-        if (next[-1] == '\n' && *next == '-' &&
-            message_pendingboundary(next, len, boundaries)) {
-            body->boundary_size = len;
+        if (*line == '-' &&
+            message_pendingboundary(line, strnlen(line, eol - line),
+                                    boundaries)) {
+            body->boundary_size = strnlen(line, eol - line);
             body->boundary_lines++;
-            if (next - 1 > headers.s) {
+            if (line > start) {
                 body->boundary_size += 2;
                 body->boundary_lines++;
-                next[-2] = '\0';
-            }
-            else {
-                *next = '\0';
             }
             sawboundary = 1;
             break;
         }
     }
 
+    msg->offset = (sawboundary ? eol : line) - msg->base;
     body->content_offset = msg->offset;
+
+    /* Copy them out in one go, after a leading newline to prime the
+     * pump.  A boundary takes the CRLF before it too. */
+    headerlen = line - start;
+    if (sawboundary && headerlen == 1) {
+        /* A bare LF before the boundary: the CRLF trim lands on the
+         * priming newline, so the boundary line is counted in
+         * header_size and there are no header lines.  Existing cache
+         * records say so, keep agreeing with them. */
+        buf_putc(&headers, '\0');
+        buf_appendmap(&headers, start, eol - start);
+    }
+    else {
+        if (sawboundary) headerlen = headerlen > 2 ? headerlen - 2 : 0;
+        buf_ensure(&headers, headerlen + 2);
+        buf_putc(&headers, '\n');
+        buf_appendmap(&headers, start, headerlen);
+    }
+    buf_cstring(&headers);
+
     body->header_size = strlen(headers.s+1);
 
     /* Scan over the slurped-up headers for interesting header information */
     body->header_lines = -1;    /* Correct for leading newline */
-    for (next = headers.s; *next; next++) {
-        if (*next == '\n') {
-            body->header_lines++;
-
-            /* if we're skipping, skip now */
-            if (have_max) continue;
-
-            /* check if we've hit a limit and flag it */
-            if (maxlines && body->header_lines > maxlines) {
-                if (efname)
-                    syslog(LOG_ERR, "ERROR: message (%s) has more than %d header lines "
-                                    "not caching any more",
-                           efname, maxlines);
-                else
-                    syslog(LOG_ERR, "ERROR: message has more than %d header lines "
-                                    "not caching any more",
-                           maxlines);
-                have_max = 1;
-                continue;
-            }
+    for (next = headers.s; next && *next; next = strchr(next+1, '\n')) {
+        body->header_lines++;
+
+        /* if we're skipping, skip now */
+        if (have_max) continue;
+
+        /* check if we've hit a limit and flag it */
+        if (maxlines && body->header_lines > maxlines) {
+            if (efname)
+                syslog(LOG_ERR, "ERROR: message (%s) has more than %d header lines "
+                                "not caching any more",
+                       efname, maxlines);
+            else
+                syslog(LOG_ERR, "ERROR: message has more than %d header lines "
+                                "not caching any more",
+                       maxlines);
+            have_max = 1;
+            continue;
+        }
 
-            if (/* space preallocated, i.e. must be top-level body */
-                body->cacheheaders.s &&
-                /* this is not a continuation line */
-                (next[1] != ' ') && (next[1] != '\t') &&
-                /* this header is supposed to be cached */
-                mailbox_cached_header_inline(next+1) != BIT32_MAX) {
-                    /* append to the headers cache */
-                    message_parse_header(next+1, &body->cacheheaders);
-            }
+        if (/* space preallocated, i.e. must be top-level body */
+            body->cacheheaders.s &&
+            /* this is not a continuation line */
+            (next[1] != ' ') && (next[1] != '\t') &&
+            /* this header is supposed to be cached */
+            mailbox_cached_header_inline(next+1) != BIT32_MAX) {
+                /* append to the headers cache */
+                message_parse_header(next+1, &body->cacheheaders);
+        }
 
-            switch (message_header_lookup(next+1, &value)) {
-            case RFC822_BCC:
-                message_parse_address(value, &body->bcc);
-                break;
-            case RFC822_CC:
-                message_parse_address(value, &body->cc);
-                break;
-            case RFC822_CONTENT_DESCRIPTION:
-                message_parse_string(value, &body->description);
-                break;
-            case RFC822_CONTENT_DISPOSITION:
-                message_parse_bodydisposition(value, body);
-                break;
-            case RFC822_CONTENT_ID:
-                message_parse_string(value, &body->id);
-                break;
-            case RFC822_CONTENT_LANGUAGE:
-                message_parse_language(value, &body->language);
-                break;
-            case RFC822_CONTENT_LOCATION:
-                message_parse_string(value, &body->location);
-                break;
-            case RFC822_CONTENT_MD5:
-                message_parse_string(value, &body->md5);
-                break;
-            case RFC822_CONTENT_TRANSFER_ENCODING:
-                message_parse_encoding(value, &body->encoding);
-
-                /* If we're encoding binary, replace "binary"
-                   with "base64" in CTE header body */
-                if (msg->encode &&
-                    !strcmpsafe(body->encoding, "BINARY")) {
-                    char *p = (char*)
-                        stristr(msg->base + body->header_offset +
-                                (next - headers.s) + 27,
-                                "binary");
-                    memcpy(p, "base64", 6);
-                }
-                break;
-            case RFC822_CONTENT_TYPE:
-                message_parse_bodytype(value, body);
-                break;
-            case RFC822_DATE:
-                message_parse_string(value, &body->date);
-                break;
-            case RFC822_FROM:
-                message_parse_address(value, &body->from);
-                break;
-            case RFC822_IN_REPLY_TO:
-                message_parse_string(value, &body->in_reply_to);
-                break;
-            case RFC822_MESSAGE_ID:
-                message_parse_string(value, &body->message_id);
-                break;
-            case RFC822_REPLY_TO:
-                message_parse_address(value, &body->reply_to);
-                break;
-            case RFC822_RECEIVED:
-                message_parse_received_date(value, &body->received_date);
-                break;
-            case RFC822_REFERENCES:
-                message_parse_string(value, &body->references);
-                break;
-            case RFC822_SUBJECT:
-                message_parse_string(value, &body->subject);
-                break;
-            case RFC822_SENDER:
-                message_parse_address(value, &body->sender);
-                break;
-            case RFC822_TO:
-                message_parse_address(value, &body->to);
-                break;
-            case RFC822_X_DELIVEREDINTERNALDATE:
-                /* Explicit x-deliveredinternaldate overrides received: headers */
-                message_parse_string(value, &body->x_deliveredinternaldate);
-                break;
-            case RFC822_X_ME_MESSAGE_ID:
-                message_parse_string(value, &body->x_me_message_id);
-                break;
-            default:
-                break;
-            } /* switch() */
-        } /* if (*next == '\n') */
+        switch (message_header_lookup(next+1, &value)) {
+        case RFC822_BCC:
+            message_parse_address(value, &body->bcc);
+            break;
+        case RFC822_CC:
+            message_parse_address(value, &body->cc);
+            break;
+        case RFC822_CONTENT_DESCRIPTION:
+            message_parse_string(value, &body->description);
+            break;
+        case RFC822_CONTENT_DISPOSITION:
+            message_parse_bodydisposition(value, body);
+            break;
+        case RFC822_CONTENT_ID:
+            message_parse_string(value, &body->id);
+            break;
+        case RFC822_CONTENT_LANGUAGE:
+            message_parse_language(value, &body->language);
+            break;
+        case RFC822_CONTENT_LOCATION:
+            message_parse_string(value, &body->location);
+            break;
+        case RFC822_CONTENT_MD5:
+            message_parse_string(value, &body->md5);
+            break;
+        case RFC822_CONTENT_TRANSFER_ENCODING:
+            message_parse_encoding(value, &body->encoding);
+
+            /* If we're encoding binary, replace "binary"
+               with "base64" in CTE header body */
+            if (msg->encode &&
+                !strcmpsafe(body->encoding, "BINARY")) {
+                char *p = (char*)
+                    stristr(msg->base + body->header_offset +
+                            (next - headers.s) + 27,
+                            "binary");
+                memcpy(p, "base64", 6);
+            }
+            break;
+        case RFC822_CONTENT_TYPE:
+            message_parse_bodytype(value, body);
+            break;
+        case RFC822_DATE:
+            message_parse_string(value, &body->date);
+            break;
+        case RFC822_FROM:
+            message_parse_address(value, &body->from);
+            break;
+        case RFC822_IN_REPLY_TO:
+            message_parse_string(value, &body->in_reply_to);
+            break;
+        case RFC822_MESSAGE_ID:
+            message_parse_string(value, &body->message_id);
+            break;
+        case RFC822_REPLY_TO:
+            message_parse_address(value, &body->reply_to);
+            break;
+        case RFC822_RECEIVED:
+            message_parse_received_date(value, &body->received_date);
+            break;
+        case RFC822_REFERENCES:
+            message_parse_string(value, &body->references);
+            break;
+        case RFC822_SUBJECT:
+            message_parse_string(value, &body->subject);
+            break;
+        case RFC822_SENDER:
+            message_parse_address(value, &body->sender);
+            break;
+        case RFC822_TO:
+            message_parse_address(value, &body->to);
+            break;
+        case RFC822_X_DELIVEREDINTERNALDATE:
+            /* Explicit x-deliveredinternaldate overrides received: headers */
+            message_parse_string(value, &body->x_deliveredinternaldate);
+            break;
+        case RFC822_X_ME_MESSAGE_ID:
+            message_parse_string(value, &body->x_me_message_id);
+            break;
+        default:
+            break;
+        } /* switch() */
     }
 
     /* If didn't find Content-Type: header, use the passed-in default type */
@@ -1894,13 +1917,7 @@ static void message_parse_content(struct msg *msg, struct body *body,
 
     while (msg->offset < msg->len) {
         line = msg->base + msg->offset;
-        endline = memchr(line, '\n', msg->len - msg->offset);
-        if (endline) {
-            endline++;
-        }
-        else {
-            endline = msg->base + msg->len;
-        }
+        endline = message_nextline(msg, line);
         len = endline - line;
         msg->offset += len;
 
@@ -2002,25 +2019,15 @@ static void message_parse_received_date(const char *hdr, char **hdrp)
 
 
 /*
- * Read a line from @msg into @buf.  Returns a pointer to the start of
- * the line inside @buf, or NULL at the end of @msg.
+ * Return the start of the line after @line in @msg, or the end of
+ * @msg if @line is the last one.
  */
-static char *message_getline(struct buf *buf, struct msg *msg)
+static const char *message_nextline(const struct msg *msg, const char *line)
 {
-    unsigned int oldlen = buf_len(buf);
-    int c;
+    const char *end = msg->base + msg->len;
+    const char *eol = memchr(line, '\n', end - line);
 
-    while (msg->offset < msg->len) {
-        c = msg->base[msg->offset++];
-        buf_putc(buf, c);
-        if (c == '\n')
-            break;
-    }
-    buf_cstring(buf);
-
-    if (buf_len(buf) == oldlen)
-        return 0;
-    return buf->s + oldlen;
+    return eol ? eol + 1 : end;
 }
 
 
@@ -4098,6 +4105,23 @@ static int message_need(const message_t *cm, unsigned int need)
         found(M_CACHEBODY|M_FULLBODY);
     }
 
+    if (is_missing(M_CHEADER)) {
+        r = message_need(m, M_CACHE);
+        if (r) return r;
+        header_index_build(&m->cheaders,
+                           cacheitem_base(&m->record, CACHE_HEADERS),
+                           cacheitem_size(&m->record, CACHE_HEADERS));
+        found(M_CHEADER);
+    }
+
+    if (is_missing(M_RHEADER)) {
+        r = message_need(m, M_MAP|M_CACHEBODY);
+        if (r) return r;
+        header_index_build(&m->rheaders, m->map.s + m->body->header_offset,
+                           m->body->header_size);
+        found(M_RHEADER);
+    }
+
     /* Check that we got everything we asked for and could get */
     assert(!is_missing(M_ALL));
 
@@ -4122,6 +4146,20 @@ static void message_yield(message_t *m, unsigned int yield)
      * or have no dynamically allocated memory */
     yield &= ~(M_MAILBOX|M_RECORD|M_UID|M_CACHE);
 
+    /* the raw header index is no use without the map */
+    if ((yield & M_MAP))
+        yield |= (m->have & M_RHEADER);
+
+    if ((yield & M_CHEADER)) {
+        header_index_fini(&m->cheaders);
+        m->have &= ~M_CHEADER;
+    }
+
+    if ((yield & M_RHEADER)) {
+        header_index_fini(&m->rheaders);
+        m->have &= ~M_RHEADER;
+    }
+
     if ((yield & M_MAP)) {
         buf_free(&m->map);
         m->have &= ~M_MAP;
@@ -5187,6 +5225,112 @@ static void extract_one(struct buf *buf,
     free(p);
 }
 
+/*
+ * Case-insensitive hash of a header field name.
+ */
+static unsigned header_name_hash(const char *name, size_t len)
+{
+    unsigned hash = 5381;
+
+    while (len--)
+        hash = ((hash << 5) + hash) ^ (unsigned char) TOLOWER(*name++);
+
+    return hash;
+}
+
+static void header_index_fini(struct header_index *idx)
+{
+    free(idx->spans);
+    free(idx->buckets);
+    memset(idx, 0, sizeof(struct header_index));
+}
+
+/*
+ * Index the fields in the block of headers at @base.  This walks the
+ * block exactly as message_pruneheader() does, so that looking up a
+ * field gives the same text that pruning a copy of the block would.
+ */
+static void header_index_build(struct header_index *idx,
+                               const char *base, size_t len)
+{
+    const char *p = base, *end, *colon, *next;
+    int maxlines = config_getint(IMAPOPT_MAXHEADERLINES);
+    int count = 0;
+    unsigned i;
+
+    header_index_fini(idx);
+
+    len = strnlen(base, len);
+    end = base + len;
+
+    while (p < end && *p != '\r') {
+        colon = memchr(p, ':', end - p);
+
+        next = p;
+        do {
+            next = memchr(next, '\n', end - next);
+            next = next ? next + 1 : end;
+        } while (next < end && (*next == ' ' || *next == '\t'));
+
+        if (colon && colon < next) {
+            struct header_span *span;
+
+            if (idx->count == idx->alloc) {
+                idx->alloc = idx->alloc ? idx->alloc * 2 : 32;
+                idx->spans = xrealloc(idx->spans,
+                                      idx->alloc * sizeof(struct header_span));
+            }
+            span = &idx->spans[idx->count++];
+            span->offset = p - base;
+            span->namelen = colon - p;
+            span->hash = header_name_hash(p, span->namelen);
+            span->len = next - p;
+        }
+        p = next;
+
+        /* stop giant headers causing massive loops */
+        if (maxlines && ++count > maxlines) break;
+    }
+
+    if (!idx->count) return;
+
+    for (idx->nbuckets = 16; idx->nbuckets < 2 * idx->count; idx->nbuckets *= 2);
+    idx->buckets = xzmalloc(idx->nbuckets * sizeof(unsigned));
+
+    /* fill backwards so each bucket lists its fields in header order */
+    for (i = idx->count; i > 0; i--) {
+        struct header_span *span = &idx->spans[i-1];
+        unsigned *bucket = &idx->buckets[span->hash & (idx->nbuckets - 1)];
+
+        span->next = *bucket;
+        *bucket = i;
+    }
+}
+
+/*
+ * Append every instance of field @name in the block of headers at
+ * @base, as indexed in @idx, to @raw.
+ */
+static void header_index_get(const struct header_index *idx, const char *base,
+                             const char *name, struct buf *raw)
+{
+    size_t namelen = strlen(name);
+    unsigned hash = header_name_hash(name, namelen);
+    unsigned i;
+
+    if (!idx->nbuckets) return;
+
+    for (i = idx->buckets[hash & (idx->nbuckets - 1)]; i;
+         i = idx->spans[i-1].next) {
+        const struct header_span *span = &idx->spans[i-1];
+
+        if (span->hash == hash && span->namelen == namelen &&
+            !strncasecmp(base + span->offset, name, namelen)) {
+            buf_appendmap(raw, base + span->offset, span->len);
+        }
+    }
+}
+
 EXPORTED int message_get_spamscore(message_t *m, uint32_t *valp)
 {
     struct buf buf = BUF_INITIALIZER;
@@ -5198,7 +5342,6 @@ EXPORTED int message_get_spamscore(message_t *m, uint32_t *valp)
 
 EXPORTED int message_get_field(message_t *m, const char *hdr, int flags, struct buf *buf)
 {
-    strarray_t want = STRARRAY_INITIALIZER;
     struct buf raw = BUF_INITIALIZER;
     int hasname = 1;
     int isutf8 = 0;
@@ -5305,15 +5448,11 @@ EXPORTED int message_get_field(message_t *m, const char *hdr, int flags, struct
         unsigned cache_version = mailbox_cached_header(hdr);
         if (!r && m->record.cache_version >= cache_version) {
             /* it's in the cache */
-            char *headers = NULL;
-            int r = message_need(m, M_CACHE);
+            int r = message_need(m, M_CHEADER);
             if (r) return r;
-            headers = xstrndup(cacheitem_base(&m->record, CACHE_HEADERS),
-                      cacheitem_size(&m->record, CACHE_HEADERS));
-            strarray_append(&want, hdr);
-            message_pruneheader(headers, &want, NULL);
-            buf_appendcstr(&raw, headers);
-            free(headers);
+            header_index_get(&m->cheaders,
+                             cacheitem_base(&m->record, CACHE_HEADERS),
+                             hdr, &raw);
             hasname = 1;
             found_field = 1;
         } else if (r && r != IMAP_NOTFOUND) return r;
@@ -5321,14 +5460,10 @@ EXPORTED int message_get_field(message_t *m, const char *hdr, int flags, struct
 
     if (!found_field) {
         /* fall back to read field from raw headers */
-        char *headers = NULL;
-        int r = message_need(m, M_MAP|M_CACHEBODY);
+        int r = message_need(m, M_RHEADER);
         if (r) return r;
-        headers = xstrndup(m->map.s + m->body->header_offset, m->body->header_size);
-        strarray_append(&want, hdr);
-        message_pruneheader(headers, &want, NULL);
-        buf_appendcstr(&raw, headers);
-        free(headers);
+        header_index_get(&m->rheaders, m->map.s + m->body->header_offset,
+                         hdr, &raw);
         hasname = 1;
         found_field = 1;
     }
@@ -5337,7 +5472,6 @@ EXPORTED int message_get_field(message_t *m, const char *hdr, int flags, struct
         extract_one(buf, hdr, flags, hasname, isutf8, &raw);
 
     buf_free(&raw);
-    strarray_fini(&want);
 
     return 0;
 }
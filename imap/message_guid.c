@@ -41,7 +41,10 @@
  */
 
 #include <config.h>
+#include <errno.h>
 #include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
 
 #include "assert.h"
 #include "global.h"
@@ -89,6 +92,84 @@ EXPORTED void message_guid_generate(struct message_guid *guid,
     xsha1((const unsigned char *) msg_base, msg_len, guid->value);
 }
 
+/* message_guid_init(), message_guid_update(), message_guid_final() ******
+ *
+ * Generate GUID from message data in pieces
+ *
+ ************************************************************************/
+
+EXPORTED void message_guid_init(struct message_guid_ctx *ctx)
+{
+#ifdef HAVE_SSL
+    ctx->md = EVP_MD_CTX_new();
+    if (!ctx->md || !EVP_DigestInit_ex(ctx->md, EVP_sha1(), NULL))
+        fatal("message_guid_init: can't initialise SHA1 digest", EX_SOFTWARE);
+#else
+    SHA1_Init(&ctx->sha1);
+#endif
+}
+
+EXPORTED void message_guid_update(struct message_guid_ctx *ctx,
+                                  const char *base, size_t len)
+{
+#ifdef HAVE_SSL
+    EVP_DigestUpdate(ctx->md, base, len);
+#else
+    /* the builtin SHA1_Update() only takes an unsigned int */
+    while (len) {
+        size_t n = len > (1U << 30) ? (1U << 30) : len;
+
+        SHA1_Update(&ctx->sha1, (const unsigned char *) base, n);
+        base += n;
+        len -= n;
+    }
+#endif
+}
+
+EXPORTED void message_guid_final(struct message_guid_ctx *ctx,
+                                 struct message_guid *guid)
+{
+    guid->status = GUID_NONNULL;
+#ifdef HAVE_SSL
+    EVP_DigestFinal_ex(ctx->md, guid->value, NULL);
+    EVP_MD_CTX_free(ctx->md);
+    ctx->md = NULL;
+#else
+    SHA1_Final(guid->value, &ctx->sha1);
+#endif
+}
+
+/* message_guid_generate_fd() ********************************************
+ *
+ * Generate GUID from an open file
+ *
+ ************************************************************************/
+
+EXPORTED int message_guid_generate_fd(struct message_guid *guid, int fd)
+{
+    struct message_guid_ctx ctx;
+    char buf[65536];
+    ssize_t n;
+
+    message_guid_init(&ctx);
+
+    while ((n = read(fd, buf, sizeof(buf)))) {
+        if (n < 0) {
+            int saved_errno = errno;
+            if (saved_errno == EINTR) continue;
+            message_guid_final(&ctx, guid);
+            message_guid_set_null(guid);
+            errno = saved_errno;
+            return -1;
+        }
+        message_guid_update(&ctx, buf, n);
+    }
+
+    message_guid_final(&ctx, guid);
+
+    return 0;
+}
+
 /* message_guid_copy() ***************************************************
  *
  * Copy GUID
@@ -44,6 +44,13 @@
 #define MESSAGE_GUID_H
 
 #include <stdint.h>
+#include <stddef.h>
+
+#include "xsha1.h"
+
+#ifdef HAVE_SSL
+#include <openssl/evp.h>
+#endif
 
 /* Public interface */
 
@@ -64,6 +71,31 @@ struct message_guid {
 void message_guid_generate(struct message_guid *guid,
                            const char *msg_base, unsigned long msg_len);
 
+/* Generate GUID from message data which arrives in pieces, such as
+ * while it is being written out.  message_guid_final() gives the same
+ * GUID that message_guid_generate() would for all the pieces together.
+ * message_guid_final() must always be called, to release the context.
+ */
+struct message_guid_ctx {
+#ifdef HAVE_SSL
+    EVP_MD_CTX *md;
+#else
+    SHA_CTX sha1;
+#endif
+};
+
+void message_guid_init(struct message_guid_ctx *ctx);
+void message_guid_update(struct message_guid_ctx *ctx,
+                         const char *base, size_t len);
+void message_guid_final(struct message_guid_ctx *ctx,
+                        struct message_guid *guid);
+
+/* Generate GUID from the contents of an open file, reading it through
+ * rather than mapping it.  Returns 0 on success, -1 with errno set on
+ * a read error.
+ */
+int message_guid_generate_fd(struct message_guid *guid, int fd);
+
 /* Copy a GUID */
 void message_guid_copy(struct message_guid *dst, const struct message_guid *src);
 
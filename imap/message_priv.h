@@ -68,13 +68,39 @@
 #define M_CACHEBODY     (1<<6)      /* MIME header details from fields, or
                                      * BODYSTRUCTURE from cyrus.cache */
 #define M_FULLBODY      (1<<7)      /* BODY parsed from the raw message */
-#define M_CHEADER       (1<<8)      /* header from cyrus.cache */
+#define M_CHEADER       (1<<8)      /* header index over cyrus.cache */
 #define M_CENVELOPE     (1<<9)      /* envelope from cyrus.cache */
 #define M_INDEX         (1<<10)     /* per-index bits: msgno & indexflags */
+#define M_RHEADER       (1<<11)     /* header index over the raw message */
 #define M_ALL           (~0U)       /* everything */
 
 #define M_BODY (M_CACHEBODY|M_FULLBODY) /* for yield masking */
 
+/*
+ * Where each header field sits in a block of headers, hashed on the
+ * lowercased field name so that looking one up doesn't mean walking
+ * the whole block.  Spans are offsets into the block, which belongs
+ * to someone else (the cyrus.cache record or the mapped message) and
+ * may move if that is mapped again.
+ */
+struct header_span
+{
+    unsigned hash;
+    unsigned next;          /* 1-based index of next span in bucket */
+    size_t offset;          /* start of the field, name and all */
+    size_t namelen;
+    size_t len;             /* whole field, folded lines and CRLF */
+};
+
+struct header_index
+{
+    struct header_span *spans;
+    unsigned count;
+    unsigned alloc;
+    unsigned *buckets;      /* 1-based index of first span, or 0 */
+    unsigned nbuckets;
+};
+
 struct message
 {
     int refcount;
@@ -88,6 +114,8 @@ struct message
     struct body *body;
     char **envelope;
     struct index_record record;
+    struct header_index cheaders;
+    struct header_index rheaders;
 
     /* fallback fields for messages without record */
     struct message_guid guid;
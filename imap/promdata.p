@@ -17,6 +17,10 @@
 # There is not currently a line-continuation character supported by the parser,
 # so this file will contain long lines!
 
+metric counter cyrus_db_repack_total                     The total number of database repacks
+metric counter cyrus_db_repack_seconds_total             The total time spent repacking databases
+metric counter cyrus_db_repack_locked_seconds_total      The total time databases were write locked for repacks
+
 metric counter cyrus_imap_connections_total             The total number of IMAP connections
 metric gauge   cyrus_imap_active_connections            The number of currently active IMAP connections
 metric gauge   cyrus_imap_ready_listeners               The number of currently ready IMAP listeners
@@ -69,6 +73,16 @@ metric counter cyrus_imap_unsubscribe_total             The total number of IMAP
 metric counter cyrus_imap_unselect_total                The total number of IMAP UNSELECTs
 metric counter cyrus_imap_xbackup_total                 The total number of IMAP XBACKUPs
 
+metric counter cyrus_idled_notify_received_total       The number of mailbox change notifications received by idled
+metric counter cyrus_idled_notify_coalesced_total      The number of notifications merged into one already waiting to be sent
+metric counter cyrus_idled_notify_sent_total           The number of notifications sent by idled to idling processes
+metric counter cyrus_idled_notify_delay_seconds_total  The total time notifications waited in idled before being sent
+metric gauge   cyrus_idled_pending_mailboxes           The number of mailboxes with notifications waiting to be sent
+metric gauge   cyrus_idled_subscriptions               The number of processes idling on a mailbox or watching a user
+metric counter cyrus_idled_parked_total                The number of idling IMAP connections handed over to idled
+metric counter cyrus_idled_resumed_total               The number of parked connections handed back to imapd
+metric gauge   cyrus_idled_parked_connections          The number of IMAP connections parked in idled
+
 metric counter cyrus_lmtp_connections_total             The total number of LMTP connections
 metric gauge   cyrus_lmtp_active_connections            The number of active LMTP connections
 metric gauge   cyrus_lmtp_ready_listeners               The number of currently ready LMTP listeners
@@ -140,3 +154,7 @@ metric counter cyrus_http_unbind_total            The total number of HTTP UNBIN
     label cyrus_http_unbind_total namespace default admin applepush calendar freebusy addressbook principal notify dblookup ischedule domainkeys jmap prometheus rss tzdist drive cgi
 metric counter cyrus_http_unlock_total            The total number of HTTP UNLOCKs
     label cyrus_http_unlock_total namespace default admin applepush calendar freebusy addressbook principal notify dblookup ischedule domainkeys jmap prometheus rss tzdist drive cgi
+
+metric counter cyrus_squatter_mailboxes_indexed_total   The number of mailboxes indexed by squatter
+metric counter cyrus_squatter_index_seconds_total       The total time squatter spent indexing mailboxes
+metric counter cyrus_squatter_worker_jobs_total         The number of users indexed by squatter worker processes
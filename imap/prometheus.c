@@ -164,6 +164,17 @@ error:
     promhandle = NULL;
 }
 
+EXPORTED void prometheus_after_fork(void)
+{
+    if (!promhandle) return;
+
+    /* the file still belongs to the parent, so leave it for the parent's
+     * prometheus_done() rather than folding it into doneprocs */
+    mappedfile_close(&promhandle->mf);
+    free(promhandle);
+    promhandle = NULL;
+}
+
 static void prometheus_done(void *rock __attribute__((unused)))
 {
     struct prom_stats accum = PROM_STATS_INITIALIZER;
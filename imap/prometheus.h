@@ -70,6 +70,10 @@ extern void prometheus_apply_delta(enum prom_metric_id metric_id,
 
 extern int prometheus_text_report(struct buf *buf, const char **mimetype);
 
+/* Call in a child process after fork() to drop the parent's per-process
+ * stats without reporting them; the child gets its own on first use. */
+extern void prometheus_after_fork(void);
+
 extern enum prom_metric_id prometheus_lookup_label(enum prom_labelled_metric metric,
                                                    const char *value);
 
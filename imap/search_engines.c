@@ -152,21 +152,43 @@ static int search_batch_size(void)
             config_getint(IMAPOPT_SEARCH_BATCHSIZE) : INT_MAX);
 }
 
+/*
+ * Whether a batch of 'count' messages, with another 'pending' bytes of
+ * messages still to be indexed, should end here.  A batch is at least
+ * search_batchsize messages, and then grows until the search engine
+ * wants to commit it.  Bulk updates index the whole mailbox in one
+ * batch.
+ */
+static int batch_ends(search_text_receiver_t *rx, int flags,
+                      int count, size_t pending)
+{
+    if (!(flags & SEARCH_UPDATE_BATCH) || (flags & SEARCH_UPDATE_BULK))
+        return 0;
+    if (count < search_batch_size())
+        return 0;
+    return (rx->batch_full ? rx->batch_full(rx, pending) : 1);
+}
+
 /*
  * Flush a batch of messages to the search engine's indexer code.  We
  * drop the index lock during the presumably CPU and IO heavy parts of
  * the procedure and re-acquire it afterward, to avoid delaying other
  * processes like imapds.  The reacquisition may of course fail.
+ * If the batch turns out to be bigger than it looked, the messages
+ * past the point where it ends are left for the next one, and
+ * '*incompletep' is set.
  * Returns an IMAP error code or 0 on success.
  */
 static int flush_batch(search_text_receiver_t *rx,
                        struct mailbox *mailbox,
                        int flags,
-                       ptrarray_t *batch)
+                       ptrarray_t *batch,
+                       int *incompletep)
 {
     int i;
     int r = 0;
     int indexflags = 0;
+    int full = 0;
 
     /* give someone else a chance */
     mailbox_unlock_index(mailbox, NULL);
@@ -188,13 +210,19 @@ static int flush_batch(search_text_receiver_t *rx,
 
     for (i = 0 ; i < batch->count ; i++) {
         message_t *msg = ptrarray_nth(batch, i);
-        if (!r) r = index_getsearchtext(msg, NULL, rx, indexflags);
+        if (!r && !full) {
+            r = index_getsearchtext(msg, NULL, rx, indexflags);
+            if (!r && i + 1 < batch->count && batch_ends(rx, flags, i + 1, 0))
+                full = 1;
+        }
         message_unref(&msg);
     }
     ptrarray_truncate(batch, 0);
 
     if (r) return r;
 
+    if (full) *incompletep = 1;
+
     if (rx->flush) {
         r = rx->flush(rx);
         if (r) return r;
@@ -211,7 +239,7 @@ EXPORTED int search_update_mailbox(search_text_receiver_t *rx,
     int r = 0;                  /* Using IMAP_* not SQUAT_* return codes here */
     int r2;
     int incomplete_batch = 0;
-    int batch_size = search_batch_size();
+    size_t batch_bytes = 0;
     ptrarray_t batch = PTRARRAY_INITIALIZER;
     const message_t *msg;
     int reindex_partials = flags & SEARCH_UPDATE_REINDEX_PARTIALS;
@@ -228,9 +256,9 @@ EXPORTED int search_update_mailbox(search_text_receiver_t *rx,
 
     while ((msg = mailbox_iter_step(iter))) {
         const struct index_record *record = msg_record(msg);
-        if ((flags & SEARCH_UPDATE_BATCH) && batch.count >= batch_size) {
-            syslog(LOG_INFO, "search_update_mailbox batching %u messages to %s",
-                   batch.count, mailbox->name);
+        if (batch_ends(rx, flags, batch.count, batch_bytes)) {
+            syslog(LOG_INFO, "search_update_mailbox batching %u messages (%zu bytes) to %s",
+                   batch.count, batch_bytes, mailbox->name);
             incomplete_batch = 1;
             break;
         }
@@ -244,15 +272,17 @@ EXPORTED int search_update_mailbox(search_text_receiver_t *rx,
             indexlevel = 0;
         }
 
-        if (!indexlevel)
+        if (!indexlevel) {
             ptrarray_append(&batch, msg);
+            batch_bytes += record->size;
+        }
         else
             message_unref(&msg);
     }
     mailbox_iter_done(&iter);
 
     if (batch.count)
-        r = flush_batch(rx, mailbox, flags, &batch);
+        r = flush_batch(rx, mailbox, flags, &batch, &incomplete_batch);
 
  done:
     ptrarray_fini(&batch);
@@ -135,11 +135,30 @@ struct search_text_receiver {
     int (*end_message)(search_text_receiver_t *, uint8_t indexlevel);
     int (*end_mailbox)(search_text_receiver_t *, struct mailbox *);
     int (*flush)(search_text_receiver_t *);
+    /* Optional: whether an update batch, with another 'pending' bytes
+     * of messages to index, has reached the point where the engine
+     * wants to commit.  Without it, batches are search_batchsize
+     * messages. */
+    int (*batch_full)(search_text_receiver_t *, size_t pending);
     int (*audit_mailbox)(search_text_receiver_t *, bitvector_t *unindexed);
     int (*index_charset_flags)(int base_flags);
     int (*index_message_format)(int format, int is_snippet);
+    /* Optional cache of extracted body part text.  Keys are built by
+     * index_getsearchtext() from the part's content GUID, then
+     * SEARCH_TEXTCACHE_VERSION, then the conversion settings.
+     * get_cached_text returns 0 on a hit, IMAP_NOTFOUND otherwise;
+     * put_cached_text may defer the write. */
+    int (*get_cached_text)(search_text_receiver_t *, const char *key,
+                           struct buf *text);
+    void (*put_cached_text)(search_text_receiver_t *, const char *key,
+                            const struct buf *text);
 };
 
+/* Bump this whenever a change to charset conversion or HTML stripping
+ * changes the text extracted from a body part, so that text cached by
+ * older code is neither used nor kept. */
+#define SEARCH_TEXTCACHE_VERSION 1
+
 struct search_langstat {
     char *iso_lang;
     size_t count;
@@ -206,6 +225,7 @@ extern void search_end_search(search_builder_t *);
 #define SEARCH_UPDATE_ALLOW_PARTIALS (1<<5)
 #define SEARCH_UPDATE_REINDEX_PARTIALS (1<<6)
 #define SEARCH_UPDATE_ALLOW_DUPPARTS (1<<7)
+#define SEARCH_UPDATE_BULK (1<<8)
 search_text_receiver_t *search_begin_update(int verbose);
 int search_update_mailbox(search_text_receiver_t *rx,
                           struct mailbox *mailbox,
@@ -78,6 +78,8 @@
 
 #define INDEXEDDB_VERSION       2
 #define INDEXEDDB_FNAME         "/cyrus.indexed.db"
+#define TEXTCACHE_FNAME         "/cyrus.textcache.db"
+#define TEXTCACHE_DB            "twoskip"
 #define XAPIAN_DIRNAME          "/xapian"
 #define ACTIVEFILE_METANAME     "xapianactive"
 #define XAPIAN_NAME_LOCK_PREFIX "$XAPIAN$"
@@ -2127,6 +2129,9 @@ struct xapian_receiver
     unsigned int parts_total;
     int truncate_warning;
     ptrarray_t segs;
+    char *textcache_fname;
+    struct db *textcache;
+    hash_table textcache_pending;
 };
 
 /* receiver used for updating the index */
@@ -2139,6 +2144,12 @@ struct xapian_update_receiver
     struct mboxlock *xapiandb_namelock;
     unsigned int uncommitted;
     unsigned int commits;
+    size_t uncommitted_bytes;
+    struct timeval txn_start;
+    size_t batch_bytes;
+    struct timeval batch_start;
+    size_t commit_bytes;
+    int commit_interval;
     struct seqset *oldindexed;
     struct seqset *indexed;
     strarray_t *activedirs;
@@ -2168,6 +2179,274 @@ struct is_indexed_rock {
 
 static int is_indexed_cb(const conv_guidrec_t *rec, void *rock);
 
+/* ====================================================================== */
+
+/*
+ * The text cache holds the extracted text of large body parts, keyed
+ * by content GUID, in one database per user in the default search tier.
+ * It lives outside the xapian.N directories so that it survives
+ * compaction, and is removed along with the rest of the user's search
+ * data.  Writes are queued in memory and written in one short
+ * transaction so that readers generating snippets are not held up.
+ */
+static void textcache_init(xapian_receiver_t *tr, struct mailbox *mailbox)
+{
+    char *basedir = NULL;
+
+    if (tr->textcache_fname) return;
+    if (!config_getswitch(IMAPOPT_SEARCH_TEXTCACHE)) return;
+
+    xapian_basedir(config_getstring(IMAPOPT_DEFAULTSEARCHTIER),
+                   mailbox->name, mailbox->part, NULL, &basedir);
+    if (!basedir) return;
+
+    tr->textcache_fname = strconcat(basedir, TEXTCACHE_FNAME, (char *)NULL);
+    construct_hash_table(&tr->textcache_pending, 64, 0);
+    free(basedir);
+}
+
+static int textcache_open(xapian_receiver_t *tr)
+{
+    int r;
+
+    if (tr->textcache || !tr->textcache_fname) return 0;
+
+    r = cyrusdb_open(TEXTCACHE_DB, tr->textcache_fname,
+                     CYRUSDB_CREATE, &tr->textcache);
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: failed to open %s: %s",
+               tr->textcache_fname, cyrusdb_strerror(r));
+        tr->textcache = NULL;
+        return IMAP_IOERROR;
+    }
+
+    return 0;
+}
+
+struct textcache_rock {
+    struct db *db;
+    struct txn **tid;
+    int r;
+};
+
+static void textcache_store_cb(const char *key, void *data, void *rock)
+{
+    struct textcache_rock *trock = (struct textcache_rock *)rock;
+    struct buf *text = (struct buf *)data;
+
+    if (trock->r) return;
+    trock->r = cyrusdb_store(trock->db, key, strlen(key),
+                             text->s, text->len, trock->tid);
+}
+
+static void textcache_free_cb(void *data)
+{
+    struct buf *text = (struct buf *)data;
+
+    buf_destroy(text);
+}
+
+/* Write out any queued cache entries */
+static int textcache_flush(xapian_receiver_t *tr)
+{
+    struct txn *txn = NULL;
+    struct textcache_rock trock = { NULL, &txn, 0 };
+    int r;
+
+    if (!tr->textcache_fname || !hash_numrecords(&tr->textcache_pending))
+        return 0;
+
+    r = textcache_open(tr);
+    if (r) goto out;
+
+    trock.db = tr->textcache;
+    hash_enumerate(&tr->textcache_pending, textcache_store_cb, &trock);
+    r = trock.r;
+    if (!r && txn)
+        r = cyrusdb_commit(tr->textcache, txn);
+    else if (txn)
+        cyrusdb_abort(tr->textcache, txn);
+
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: failed to write %s: %s",
+               tr->textcache_fname, cyrusdb_strerror(r));
+        r = IMAP_IOERROR;
+    }
+
+out:
+    free_hash_table(&tr->textcache_pending, textcache_free_cb);
+    construct_hash_table(&tr->textcache_pending, 64, 0);
+    return r;
+}
+
+static void textcache_fini(xapian_receiver_t *tr)
+{
+    if (!tr->textcache_fname) return;
+
+    /* a failure to cache text is not a failure to index it */
+    textcache_flush(tr);
+
+    if (tr->textcache) {
+        cyrusdb_close(tr->textcache);
+        tr->textcache = NULL;
+    }
+    free_hash_table(&tr->textcache_pending, textcache_free_cb);
+    free(tr->textcache_fname);
+    tr->textcache_fname = NULL;
+}
+
+static int get_cached_text(search_text_receiver_t *rx, const char *key,
+                           struct buf *text)
+{
+    xapian_receiver_t *tr = (xapian_receiver_t *)rx;
+    const char *data = NULL;
+    size_t datalen = 0;
+    struct buf *pending;
+    int r;
+
+    if (!tr->textcache_fname) return IMAP_NOTFOUND;
+
+    pending = hash_lookup(key, &tr->textcache_pending);
+    if (pending) {
+        buf_copy(text, pending);
+        return 0;
+    }
+
+    r = textcache_open(tr);
+    if (r) return IMAP_NOTFOUND;
+
+    r = cyrusdb_fetch(tr->textcache, key, strlen(key), &data, &datalen, NULL);
+    if (r) {
+        if (r != CYRUSDB_NOTFOUND)
+            syslog(LOG_ERR, "IOERROR: failed to read %s: %s",
+                   tr->textcache_fname, cyrusdb_strerror(r));
+        return IMAP_NOTFOUND;
+    }
+
+    buf_setmap(text, data, datalen);
+    return 0;
+}
+
+static void put_cached_text(search_text_receiver_t *rx, const char *key,
+                            const struct buf *text)
+{
+    xapian_receiver_t *tr = (xapian_receiver_t *)rx;
+    struct buf *copy;
+
+    if (!tr->textcache_fname) return;
+    if (hash_lookup(key, &tr->textcache_pending)) return;
+
+    copy = buf_new();
+    buf_copy(copy, text);
+    hash_insert(key, copy, &tr->textcache_pending);
+}
+
+struct textcache_prune_rock {
+    struct conversations_state *cstate;
+    strarray_t stale;
+    struct buf guidrep;
+};
+
+static int textcache_prune_cb(void *rock,
+                              const char *key, size_t keylen,
+                              const char *data __attribute__((unused)),
+                              size_t datalen __attribute__((unused)))
+{
+    struct textcache_prune_rock *prock = (struct textcache_prune_rock *)rock;
+    const char *dot = memchr(key, '.', keylen);
+    const char *p;
+    bit64 version = 0;
+
+    /* keys start with the content GUID of the part and the version of
+     * the code which extracted the text */
+    if (!dot || parsenum(dot + 1, &p, keylen - (dot + 1 - key), &version)
+             || version != SEARCH_TEXTCACHE_VERSION)
+        goto stale;
+
+    buf_setmap(&prock->guidrep, key, dot - key);
+    if (conversations_guid_exists(prock->cstate, buf_cstring(&prock->guidrep)))
+        return 0;
+
+stale:
+    strarray_appendm(&prock->stale, xstrndup(key, keylen));
+    return 0;
+}
+
+/*
+ * Remove cached text for parts which are no longer in any of the
+ * user's messages, and text extracted by a different version of the
+ * code.  Nothing else ever deletes from the cache, so this
+ * runs after each compaction.  The stale keys are found first and then
+ * deleted in one short transaction, so that indexers and snippet
+ * readers are not held up while the whole cache is checked.
+ */
+static int textcache_prune(const char *userid, const char *mboxname,
+                           const char *partition, int verbose)
+{
+    struct textcache_prune_rock prock = { NULL, STRARRAY_INITIALIZER, BUF_INITIALIZER };
+    char *basedir = NULL;
+    char *fname = NULL;
+    struct db *db = NULL;
+    struct txn *txn = NULL;
+    struct stat sbuf;
+    int r = 0;
+    int i;
+
+    xapian_basedir(config_getstring(IMAPOPT_DEFAULTSEARCHTIER),
+                   mboxname, partition, NULL, &basedir);
+    if (!basedir) goto out;
+
+    fname = strconcat(basedir, TEXTCACHE_FNAME, (char *)NULL);
+    if (stat(fname, &sbuf)) goto out;
+
+    r = cyrusdb_open(TEXTCACHE_DB, fname, 0, &db);
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: failed to open %s: %s",
+               fname, cyrusdb_strerror(r));
+        goto out;
+    }
+
+    r = conversations_open_user(userid, 1/*shared*/, &prock.cstate);
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: failed to open conversations for %s: %s",
+               userid, error_message(r));
+        goto out;
+    }
+
+    r = cyrusdb_foreach(db, "", 0, NULL, textcache_prune_cb, &prock, NULL);
+    conversations_commit(&prock.cstate);
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: failed to read %s: %s",
+               fname, cyrusdb_strerror(r));
+        goto out;
+    }
+
+    for (i = 0; !r && i < prock.stale.count; i++) {
+        const char *key = strarray_nth(&prock.stale, i);
+        r = cyrusdb_delete(db, key, strlen(key), &txn, /*force*/1);
+    }
+    if (!r && txn)
+        r = cyrusdb_commit(db, txn);
+    else if (txn)
+        cyrusdb_abort(db, txn);
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: failed to prune %s: %s",
+               fname, cyrusdb_strerror(r));
+        goto out;
+    }
+
+    if (verbose && prock.stale.count)
+        printf("pruned %d entries from %s\n", prock.stale.count, fname);
+
+out:
+    if (db) cyrusdb_close(db);
+    strarray_fini(&prock.stale);
+    buf_free(&prock.guidrep);
+    free(fname);
+    free(basedir);
+    return r;
+}
+
 static const char *xapian_rootdir(const char *tier, const char *partition)
 {
     char *confkey;
@@ -2280,31 +2559,134 @@ out:
     return r;
 }
 
-static int flush(search_text_receiver_t *rx)
+/*
+ * Look up the commit thresholds for updates written to search tier
+ * 'tier'.  A <tier>search_commit_bytes or <tier>search_commit_interval
+ * entry in imapd.conf overrides the global setting for that tier.
+ */
+static void commit_thresholds(const char *tier, size_t *bytesp, int *intervalp)
+{
+    const char *val;
+    char *confkey;
+
+    *bytesp = config_getint(IMAPOPT_SEARCH_COMMIT_BYTES);
+    *intervalp = config_getduration(IMAPOPT_SEARCH_COMMIT_INTERVAL, 's');
+    if (!tier) return;
+
+    confkey = strconcat(tier, "search_commit_bytes", (char *)NULL);
+    val = config_getoverflowstring(confkey, NULL);
+    if (val) {
+        char *end = NULL;
+        unsigned long n = strtoul(val, &end, 10);
+        if (end == val || *end)
+            syslog(LOG_WARNING, "%s: invalid value '%s', using %zu",
+                   confkey, val, *bytesp);
+        else
+            *bytesp = n;
+    }
+    free(confkey);
+
+    confkey = strconcat(tier, "search_commit_interval", (char *)NULL);
+    val = config_getoverflowstring(confkey, NULL);
+    if (val) {
+        int interval;
+        if (config_parseduration(val, 's', &interval))
+            syslog(LOG_WARNING, "%s: invalid value '%s', using %ds",
+                   confkey, val, *intervalp);
+        else
+            *intervalp = interval;
+    }
+    free(confkey);
+}
+
+static int commit_txn(xapian_update_receiver_t *tr)
 {
-    xapian_update_receiver_t *tr = (xapian_update_receiver_t *)rx;
     int r = 0;
     struct timeval start, end;
 
-    if (tr->uncommitted) {
-        assert(tr->dbw);
+    if (!tr->uncommitted) return 0;
 
-        gettimeofday(&start, NULL);
-        r = xapian_dbw_commit_txn(tr->dbw);
-        if (r) goto out;
-        gettimeofday(&end, NULL);
+    assert(tr->dbw);
+
+    gettimeofday(&start, NULL);
+    r = xapian_dbw_commit_txn(tr->dbw);
+    if (r) return r;
+    gettimeofday(&end, NULL);
+
+    syslog(LOG_INFO, "Xapian committed %u updates (%zu bytes) in %.6f sec",
+                tr->uncommitted, tr->uncommitted_bytes, timesub(&start, &end));
+
+    tr->uncommitted = 0;
+    tr->uncommitted_bytes = 0;
+    tr->commits++;
+
+    /* a failure to cache text is not a failure to index it */
+    textcache_flush(&tr->super);
+
+    return 0;
+}
+
+/*
+ * Decide whether the open transaction has grown big enough, or been
+ * open long enough, to be committed before the end of the batch.
+ * Bulk updates never commit before end_mailbox_update().
+ */
+static int commit_due(const xapian_update_receiver_t *tr)
+{
+    struct timeval now;
+
+    if (!tr->uncommitted) return 0;
+    if (tr->flags & SEARCH_UPDATE_BULK) return 0;
+
+    if (tr->commit_bytes && tr->uncommitted_bytes >= tr->commit_bytes)
+        return 1;
+
+    if (tr->commit_interval) {
+        gettimeofday(&now, NULL);
+        if (now.tv_sec - tr->txn_start.tv_sec >= tr->commit_interval)
+            return 1;
+    }
+
+    return 0;
+}
 
-        syslog(LOG_INFO, "Xapian committed %u updates in %.6f sec",
-                    tr->uncommitted, timesub(&start, &end));
+/*
+ * Decide whether search_update_mailbox() should end the batch it is
+ * building, with 'pending' more bytes of messages yet to be indexed.
+ * Batches grow until they reach search_commit_bytes, or have taken
+ * search_commit_interval; without a byte limit they stay at
+ * search_batchsize messages.
+ */
+static int batch_full(search_text_receiver_t *rx, size_t pending)
+{
+    xapian_update_receiver_t *tr = (xapian_update_receiver_t *)rx;
+    struct timeval now;
+
+    if (!tr->commit_bytes) return 1;
+    if (tr->batch_bytes + pending >= tr->commit_bytes) return 1;
+
+    if (tr->commit_interval) {
+        gettimeofday(&now, NULL);
+        if (now.tv_sec - tr->batch_start.tv_sec >= tr->commit_interval)
+            return 1;
+    }
+
+    return 0;
+}
+
+static int flush_update(xapian_update_receiver_t *tr, int final)
+{
+    int r = 0;
 
-        tr->uncommitted = 0;
-        tr->commits++;
+    if (final || !(tr->flags & SEARCH_UPDATE_BULK)) {
+        r = commit_txn(tr);
+        if (r) goto out;
     }
 
     /* We write out the indexed list for the mailbox only after successfully
      * updating the index, to avoid a future instance not realising that
      * there are unindexed messages should we fail to index */
-    if (tr->indexed) {
+    if (tr->indexed && !tr->uncommitted) {
         r = write_indexed(strarray_nth(tr->activedirs, 0),
                           tr->super.mailbox->name, tr->super.mailbox->i.uidvalidity,
                           tr->indexed, tr->super.verbose);
@@ -2315,6 +2697,11 @@ out:
     return r;
 }
 
+static int flush(search_text_receiver_t *rx)
+{
+    return flush_update((xapian_update_receiver_t *)rx, /*final*/0);
+}
+
 static int audit_mailbox(search_text_receiver_t *rx, bitvector_t *unindexed)
 {
     xapian_update_receiver_t *tr = (xapian_update_receiver_t *)rx;
@@ -2526,6 +2913,7 @@ static int end_message_update(search_text_receiver_t *rx, uint8_t indexlevel)
     if (!tr->uncommitted) {
         r = xapian_dbw_begin_txn(tr->dbw);
         if (r) goto out;
+        gettimeofday(&tr->txn_start, NULL);
     }
     r = xapian_dbw_begin_doc(tr->dbw, &tr->super.guid, XAPIAN_WRAP_DOCTYPE_MSG);
     if (r) goto out;
@@ -2533,6 +2921,8 @@ static int end_message_update(search_text_receiver_t *rx, uint8_t indexlevel)
         seg = (struct segment *)ptrarray_nth(&tr->super.segs, i);
         r = xapian_dbw_doc_part(tr->dbw, &seg->text, seg->part);
         if (r) goto out;
+        tr->uncommitted_bytes += seg->text.len;
+        tr->batch_bytes += seg->text.len;
     }
     r = xapian_dbw_end_doc(tr->dbw, indexlevel);
     if (r) goto out;
@@ -2583,6 +2973,9 @@ static int end_message_update(search_text_receiver_t *rx, uint8_t indexlevel)
     }
     seqset_add(tr->indexed, tr->super.uid, 1);
 
+    if (commit_due(tr))
+        r = commit_txn(tr);
+
 out:
     tr->super.uid = 0;
     message_guid_set_null(&tr->super.guid);
@@ -2613,6 +3006,8 @@ static int begin_mailbox_update(search_text_receiver_t *rx,
     char *userid = NULL;
 
     tr->flags = flags;
+    tr->batch_bytes = 0;
+    gettimeofday(&tr->batch_start, NULL);
 
     /* not an indexable mailbox, fine - return a code to avoid
      * trying to index each message as well */
@@ -2694,6 +3089,10 @@ static int begin_mailbox_update(search_text_receiver_t *rx,
     // this should never be able to fail here, because the first item will always exist!
     assert(tr->activedirs && tr->activedirs->count);
 
+    /* updates always go to the default tier, see above */
+    commit_thresholds(deftier, &tr->commit_bytes, &tr->commit_interval);
+    textcache_init(&tr->super, mailbox);
+
     /* create the directory if needed */
     r = check_directory(strarray_nth(tr->activedirs, 0), tr->super.verbose, /*create*/1);
     if (r) goto out;
@@ -2841,7 +3240,7 @@ static int end_mailbox_update(search_text_receiver_t *rx,
     xapian_update_receiver_t *tr = (xapian_update_receiver_t *)rx;
     int r = 0;
 
-    r = flush(rx);
+    r = flush_update(tr, /*final*/1);
 
     /* flush before cleaning up, since indexed data is written by flush */
     if (tr->indexed) {
@@ -2855,6 +3254,8 @@ static int end_mailbox_update(search_text_receiver_t *rx,
 
     tr->super.mailbox = NULL;
 
+    textcache_fini(&tr->super);
+
     if (tr->dbw) {
         xapian_dbw_close(tr->dbw);
         tr->dbw = NULL;
@@ -2915,9 +3316,12 @@ static search_text_receiver_t *begin_update(int verbose)
     tr->super.super.end_message = end_message_update;
     tr->super.super.end_mailbox = end_mailbox_update;
     tr->super.super.flush = flush;
+    tr->super.super.batch_full = batch_full;
     tr->super.super.audit_mailbox = audit_mailbox;
     tr->super.super.index_charset_flags = xapian_charset_flags;
     tr->super.super.index_message_format = xapian_message_format;
+    tr->super.super.get_cached_text = get_cached_text;
+    tr->super.super.put_cached_text = put_cached_text;
 
     tr->super.verbose = verbose;
 
@@ -2928,6 +3332,7 @@ static search_text_receiver_t *begin_update(int verbose)
 
 static void free_receiver(xapian_receiver_t *tr)
 {
+    textcache_fini(tr);
     free_segments(tr);
     ptrarray_fini(&tr->segs);
     free(tr);
@@ -2958,6 +3363,8 @@ static int begin_mailbox_snippets(search_text_receiver_t *rx,
     tr->snipgen = xapian_snipgen_new(tr->lock.db, tr->markup->hi_start,
                                      tr->markup->hi_end, tr->markup->omit);
 
+    textcache_init(&tr->super, mailbox);
+
 out:
     return r;
 }
@@ -3089,6 +3496,7 @@ static int end_mailbox_snippets(search_text_receiver_t *rx,
 {
     xapian_snippet_receiver_t *tr = (xapian_snippet_receiver_t *)rx;
 
+    textcache_fini(&tr->super);
     xapiandb_lock_release(&tr->lock);
     tr->super.mailbox = NULL;
     xapian_snipgen_free(tr->snipgen);
@@ -3117,6 +3525,8 @@ static search_text_receiver_t *begin_snippets(void *internalised,
     tr->super.super.end_mailbox = end_mailbox_snippets;
     tr->super.super.flush = flush_snippets;
     tr->super.super.index_charset_flags = xapian_charset_flags;
+    tr->super.super.get_cached_text = get_cached_text;
+    tr->super.super.put_cached_text = put_cached_text;
 
     tr->super.verbose = verbose;
     tr->root = (struct opnode *)internalised;
@@ -3456,6 +3866,9 @@ static int reindex_mb(void *rock,
     tr->super.mailbox = mailbox;
     tr->activedirs = strarray_dup(filter->destpaths);
     tr->activetiers = strarray_dup(filter->desttiers);
+    commit_thresholds(strarray_nth(filter->desttiers, 0),
+                      &tr->commit_bytes, &tr->commit_interval);
+    textcache_init(&tr->super, mailbox);
     // include all the new databases too
     strarray_cat(&alldirs, &filter->temptargets);
     // skip the first one, there's no data in there!
@@ -3521,12 +3934,12 @@ static int reindex_mb(void *rock,
             filter->numindexed++;
         }
 
-        // the next write will start a new transaction if uncommitted == 0
-        if (tr->uncommitted) {
-            r = xapian_dbw_commit_txn(tr->dbw);
+        // the next write will start a new transaction if uncommitted == 0,
+        // and end_message_update() may already have committed this chunk
+        if (tr->commits || tr->uncommitted) {
+            r = commit_txn(tr);
             if (r) goto done;
-            tr->uncommitted = 0;
-            tr->commits++;
+            tr->commits = 0;
 
             // we don't want to blow out the temporary space, so let's split every so often!
             if (filter->numindexed > XAPIAN_REINDEX_TEMPDIR_COUNT ||
@@ -4044,6 +4457,9 @@ static int compact_dbs(const char *userid, const strarray_t *reindextiers,
         xapiandb_namelock = NULL;
     }
 
+    /* a failure to prune the text cache is not a failure to compact */
+    textcache_prune(userid, mboxname, mbentry->partition, verbose);
+
     if (verbose) {
         char *alist = strarray_join(active, ",");
         printf("finished compact of %s (active %s)\n", mboxname, alist);
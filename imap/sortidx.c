@@ -0,0 +1,561 @@
+/* sortidx.c -- Pre-normalised SORT keys alongside the mailbox index
+ *
+ * Copyright (c) 1994-2020 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * cyrus.sortidx holds the keys SORT and THREAD need for each message,
+ * already normalised the way index_msgdata_load() would compute them
+ * from the cache: the base subject, the localpart and display name of
+ * the first From and To addresses and the first Cc localpart.  Reading
+ * it is a walk over a small file instead of a cache record lookup and
+ * header parse per message.
+ *
+ * The file is a header followed by one variable length entry per
+ * message in ascending UID order.  Entries are appended on commit and
+ * the whole file is rewritten on repack.  The header records how much
+ * of the file is valid, so an interrupted append is simply overwritten
+ * by the next one.  The header has its own CRC, checked on open; each
+ * entry also carries a CRC, checked when the entry is read, and an
+ * entry which doesn't check out is loaded from the cache as before,
+ * like anything else not found here.
+ *
+ * Header (all values in network byte order):
+ *   0  magic (12 bytes)
+ *  12  version
+ *  16  uidvalidity
+ *  20  charset_flags the subjects were normalised with
+ *  24  end of valid data (64 bit)
+ *  32  crc32 of the above
+ *  36  reserved
+ *
+ * Entry:
+ *   0  uid
+ *   4  entry length, including padding
+ *   8  crc32 of the rest of the entry
+ *  12  is_refwd
+ *  16  xsubj, from, displayfrom, to, displayto, cc - each NUL
+ *      terminated, then padded with NULs to a multiple of 8 bytes
+ */
+
+#include <config.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include "assert.h"
+#include "byteorder.h"
+#include "crc32.h"
+#include "global.h"
+#include "index.h"
+#include "map.h"
+#include "retry.h"
+#include "sortidx.h"
+#include "util.h"
+#include "xmalloc.h"
+
+/* generated headers are not necessarily in current directory */
+#include "imap/imap_err.h"
+
+#define SORTIDX_MAGIC "\241\002\213\015sortidx"
+#define SORTIDX_MAGIC_SIZE 12
+#define SORTIDX_VERSION 2
+
+#define HEADER_MAGIC 0
+#define HEADER_VERSION 12
+#define HEADER_UIDVALIDITY 16
+#define HEADER_CHARSET_FLAGS 20
+#define HEADER_END 24
+#define HEADER_CRC 32
+#define SORTIDX_HEADER_SIZE 40
+
+#define ENTRY_UID 0
+#define ENTRY_LEN 4
+#define ENTRY_CRC 8
+#define ENTRY_REFWD 12
+#define ENTRY_STRINGS 16
+
+#define NUM_ENTRY_STRINGS 6
+
+/* flush repack output once this much is buffered */
+#define SORTIDX_FLUSH_SIZE (64*1024)
+
+struct sortidx_slot {
+    uint32_t uid;
+    size_t offset;
+};
+
+struct sortidx {
+    int fd;
+    const char *base;
+    size_t len;
+    size_t end;                 /* of valid data */
+    struct sortidx_slot *slots;
+    unsigned nslots;
+    unsigned hint;
+};
+
+static int header_valid(const char *base, size_t len, uint32_t uidvalidity)
+{
+    if (len < SORTIDX_HEADER_SIZE) return 0;
+    if (memcmp(base + HEADER_MAGIC, SORTIDX_MAGIC, SORTIDX_MAGIC_SIZE)) return 0;
+    if (ntohl(*((bit32 *)(base + HEADER_CRC))) != crc32_map(base, HEADER_CRC))
+        return 0;
+    if (ntohl(*((bit32 *)(base + HEADER_VERSION))) != SORTIDX_VERSION) return 0;
+    if (ntohl(*((bit32 *)(base + HEADER_UIDVALIDITY))) != uidvalidity) return 0;
+    /* subjects were normalised under different rules */
+    if (ntohl(*((bit32 *)(base + HEADER_CHARSET_FLAGS))) != (bit32)charset_flags)
+        return 0;
+    return 1;
+}
+
+static void header_to_buf(unsigned char *buf, uint32_t uidvalidity,
+                          uint64_t end)
+{
+    memset(buf, 0, SORTIDX_HEADER_SIZE);
+    memcpy(buf + HEADER_MAGIC, SORTIDX_MAGIC, SORTIDX_MAGIC_SIZE);
+    *((bit32 *)(buf + HEADER_VERSION)) = htonl(SORTIDX_VERSION);
+    *((bit32 *)(buf + HEADER_UIDVALIDITY)) = htonl(uidvalidity);
+    *((bit32 *)(buf + HEADER_CHARSET_FLAGS)) = htonl(charset_flags);
+    *((bit64 *)(buf + HEADER_END)) = htonll(end);
+    *((bit32 *)(buf + HEADER_CRC)) = htonl(crc32_map((char *)buf, HEADER_CRC));
+}
+
+/*
+ * Decode the entry at 'offset'.  Returns the length of the entry,
+ * or 0 if it isn't a valid entry.
+ */
+static size_t parse_entry(const char *base, size_t len, size_t offset,
+                          int verify, struct sortidx_entry *entry)
+{
+    const char *p = base + offset;
+    const char *strs[NUM_ENTRY_STRINGS];
+    const char *s, *end;
+    size_t elen;
+    int i;
+
+    if (offset + ENTRY_STRINGS > len) return 0;
+
+    elen = ntohl(*((bit32 *)(p + ENTRY_LEN)));
+    if (elen < ENTRY_STRINGS + NUM_ENTRY_STRINGS || elen % 8) return 0;
+    if (elen > len - offset) return 0;
+
+    if (verify && crc32_map(p + ENTRY_REFWD, elen - ENTRY_REFWD)
+                  != ntohl(*((bit32 *)(p + ENTRY_CRC))))
+        return 0;
+
+    s = p + ENTRY_STRINGS;
+    end = p + elen;
+    for (i = 0; i < NUM_ENTRY_STRINGS; i++) {
+        const char *nul = memchr(s, '\0', end - s);
+        if (!nul) return 0;
+        /* only the base subject is always present */
+        strs[i] = (i && !*s) ? NULL : s;
+        s = nul + 1;
+    }
+
+    entry->uid = ntohl(*((bit32 *)(p + ENTRY_UID)));
+    entry->is_refwd = ntohl(*((bit32 *)(p + ENTRY_REFWD)));
+    entry->xsubj = strs[0];
+    entry->from = strs[1];
+    entry->displayfrom = strs[2];
+    entry->to = strs[3];
+    entry->displayto = strs[4];
+    entry->cc = strs[5];
+
+    return elen;
+}
+
+/*
+ * Map in the sort key file 'fname', which must be for 'uidvalidity'.
+ * Only the header is verified here; each entry is checked when it is
+ * looked up.  Returns IMAP_NOTFOUND if there's no usable file.
+ */
+EXPORTED int sortidx_open_file(const char *fname, const char *mboxname,
+                               uint32_t uidvalidity, struct sortidx **sidxp)
+{
+    struct sortidx *sidx;
+    struct stat sbuf;
+    size_t offset, end, elen;
+    uint32_t uid;
+    unsigned alloc = 0;
+    int fd;
+
+    *sidxp = NULL;
+
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) {
+        if (errno == ENOENT) return IMAP_NOTFOUND;
+        xsyslog(LOG_ERR, "IOERROR: open failed",
+                         "fname=<%s>",
+                         fname);
+        return IMAP_IOERROR;
+    }
+
+    if (fstat(fd, &sbuf) == -1) {
+        xsyslog(LOG_ERR, "IOERROR: fstat failed",
+                         "fname=<%s>",
+                         fname);
+        close(fd);
+        return IMAP_IOERROR;
+    }
+
+    sidx = xzmalloc(sizeof(struct sortidx));
+    sidx->fd = fd;
+    map_refresh(fd, 1, &sidx->base, &sidx->len, sbuf.st_size,
+                fname, mboxname);
+
+    if (!header_valid(sidx->base, sidx->len, uidvalidity)) {
+        sortidx_close(&sidx);
+        return IMAP_NOTFOUND;
+    }
+
+    end = ntohll(*((bit64 *)(sidx->base + HEADER_END)));
+    if (end > sidx->len) end = sidx->len;
+    sidx->end = end;
+
+    /* just the UIDs and lengths, to find each entry */
+    for (offset = SORTIDX_HEADER_SIZE; offset + ENTRY_STRINGS <= end;
+         offset += elen) {
+        const char *p = sidx->base + offset;
+
+        uid = ntohl(*((bit32 *)(p + ENTRY_UID)));
+        elen = ntohl(*((bit32 *)(p + ENTRY_LEN)));
+        if (elen < ENTRY_STRINGS + NUM_ENTRY_STRINGS || elen % 8 ||
+            elen > end - offset) {
+            syslog(LOG_NOTICE, "sortidx: %s: bad entry at offset " SIZE_T_FMT
+                   ", ignoring the rest", mboxname, offset);
+            break;
+        }
+
+        /* appends only ever go up */
+        if (sidx->nslots && uid <= sidx->slots[sidx->nslots-1].uid)
+            break;
+
+        if (sidx->nslots == alloc) {
+            alloc = alloc ? alloc * 2 : 256;
+            sidx->slots = xrealloc(sidx->slots,
+                                   alloc * sizeof(struct sortidx_slot));
+        }
+        sidx->slots[sidx->nslots].uid = uid;
+        sidx->slots[sidx->nslots].offset = offset;
+        sidx->nslots++;
+    }
+
+    *sidxp = sidx;
+    return 0;
+}
+
+/*
+ * Map in the sort keys for 'mailbox'.  Returns IMAP_NOTFOUND if
+ * they aren't enabled or there's no usable file.
+ */
+EXPORTED int sortidx_open(struct mailbox *mailbox, struct sortidx **sidxp)
+{
+    const char *fname;
+
+    *sidxp = NULL;
+
+    if (!config_getswitch(IMAPOPT_MAILBOX_SORTIDX))
+        return IMAP_NOTFOUND;
+
+    fname = mailbox_meta_fname(mailbox, META_SORTIDX);
+    if (!fname) return IMAP_NOTFOUND;
+
+    return sortidx_open_file(fname, mailbox->name,
+                             mailbox->i.uidvalidity, sidxp);
+}
+
+/*
+ * Find the entry for 'uid'.  Lookups in ascending UID order, which
+ * is how messages are usually loaded, don't need to search.
+ */
+EXPORTED int sortidx_lookup(struct sortidx *sidx, uint32_t uid,
+                            struct sortidx_entry *entry)
+{
+    unsigned low, high, mid;
+
+    if (sidx->hint < sidx->nslots && sidx->slots[sidx->hint].uid == uid) {
+        mid = sidx->hint;
+        goto found;
+    }
+
+    low = 0;
+    high = sidx->nslots;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (sidx->slots[mid].uid == uid)
+            goto found;
+        if (sidx->slots[mid].uid < uid)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return IMAP_NOTFOUND;
+
+ found:
+    sidx->hint = mid + 1;
+    if (!parse_entry(sidx->base, sidx->end, sidx->slots[mid].offset,
+                     /*verify*/1, entry))
+        return IMAP_NOTFOUND;
+
+    return 0;
+}
+
+EXPORTED void sortidx_close(struct sortidx **sidxp)
+{
+    struct sortidx *sidx = *sidxp;
+
+    if (!sidx) return;
+
+    map_free(&sidx->base, &sidx->len);
+    xclose(sidx->fd);
+    free(sidx->slots);
+    free(sidx);
+
+    *sidxp = NULL;
+}
+
+static void append_string(struct buf *buf, const char *s)
+{
+    if (s) buf_appendcstr(buf, s);
+    buf_putc(buf, '\0');
+}
+
+/*
+ * Add 'entry' to 'buf' in the on-disk format.
+ */
+EXPORTED void sortidx_add_entry(struct buf *buf,
+                                const struct sortidx_entry *entry)
+{
+    size_t start = buf->len;
+    char *p;
+
+    buf_appendbit32(buf, entry->uid);
+    buf_appendbit32(buf, 0); /* length, filled in below */
+    buf_appendbit32(buf, 0); /* crc, filled in below */
+    buf_appendbit32(buf, entry->is_refwd);
+
+    append_string(buf, entry->xsubj);
+    append_string(buf, entry->from);
+    append_string(buf, entry->displayfrom);
+    append_string(buf, entry->to);
+    append_string(buf, entry->displayto);
+    append_string(buf, entry->cc);
+
+    while ((buf->len - start) % 8)
+        buf_putc(buf, '\0');
+
+    p = buf->s + start;
+    *((bit32 *)(p + ENTRY_LEN)) = htonl(buf->len - start);
+    *((bit32 *)(p + ENTRY_CRC)) =
+        htonl(crc32_map(p + ENTRY_REFWD, buf->len - start - ENTRY_REFWD));
+}
+
+/*
+ * Add the sort keys for 'record' to 'buf'.  The keys are computed
+ * exactly as index_msgdata_load() computes them from the cache.
+ */
+EXPORTED void sortidx_add_record(struct buf *buf,
+                                 const struct index_record *record)
+{
+    struct sortidx_entry entry;
+    char *xsubj, *from, *displayfrom, *to, *displayto, *cc;
+    int is_refwd = 0;
+
+    /* nothing to compute from */
+    if (!record->crec.len) return;
+
+    xsubj = index_extract_subject(cacheitem_base(record, CACHE_SUBJECT),
+                                  cacheitem_size(record, CACHE_SUBJECT),
+                                  &is_refwd);
+    from = index_get_localpart_addr(cacheitem_base(record, CACHE_FROM));
+    displayfrom = index_get_displayname(cacheitem_base(record, CACHE_FROM));
+    to = index_get_localpart_addr(cacheitem_base(record, CACHE_TO));
+    displayto = index_get_displayname(cacheitem_base(record, CACHE_TO));
+    cc = index_get_localpart_addr(cacheitem_base(record, CACHE_CC));
+
+    entry.uid = record->uid;
+    entry.is_refwd = is_refwd;
+    entry.xsubj = xsubj;
+    entry.from = from;
+    entry.displayfrom = displayfrom;
+    entry.to = to;
+    entry.displayto = displayto;
+    entry.cc = cc;
+
+    sortidx_add_entry(buf, &entry);
+
+    free(xsubj);
+    free(from);
+    free(displayfrom);
+    free(to);
+    free(displayto);
+    free(cc);
+}
+
+/*
+ * Create an empty sort key file at 'fname', replacing any existing
+ * file.  Returns the open file descriptor, or -1 on error.
+ */
+EXPORTED int sortidx_create(const char *fname, uint32_t uidvalidity)
+{
+    unsigned char buf[SORTIDX_HEADER_SIZE];
+    int fd;
+
+    fd = open(fname, O_RDWR|O_TRUNC|O_CREAT, 0666);
+    if (fd == -1) {
+        xsyslog(LOG_ERR, "IOERROR: create failed",
+                         "fname=<%s>",
+                         fname);
+        return -1;
+    }
+
+    header_to_buf(buf, uidvalidity, SORTIDX_HEADER_SIZE);
+    if (retry_write(fd, buf, SORTIDX_HEADER_SIZE) != SORTIDX_HEADER_SIZE) {
+        xsyslog(LOG_ERR, "IOERROR: write failed",
+                         "fname=<%s>",
+                         fname);
+        close(fd);
+        unlink(fname);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Append the entries in 'buf' at the end of the valid data in the
+ * file open on 'fd', then move the end marker past them.
+ */
+EXPORTED int sortidx_append(int fd, const char *fname, const struct buf *buf)
+{
+    unsigned char header[SORTIDX_HEADER_SIZE];
+    bit64 end;
+
+    if (!buf->len) return 0;
+
+    if (pread(fd, header, SORTIDX_HEADER_SIZE, 0) != SORTIDX_HEADER_SIZE)
+        goto fail;
+    end = ntohll(*((bit64 *)(header + HEADER_END)));
+
+    if (pwrite(fd, buf->s, buf->len, end) != (ssize_t)buf->len)
+        goto fail;
+
+    /* the end marker and the header CRC are adjacent, write both at once */
+    end += buf->len;
+    *((bit64 *)(header + HEADER_END)) = htonll(end);
+    *((bit32 *)(header + HEADER_CRC)) =
+        htonl(crc32_map((char *)header, HEADER_CRC));
+    if (pwrite(fd, header + HEADER_END, SORTIDX_HEADER_SIZE - HEADER_END,
+               HEADER_END) != SORTIDX_HEADER_SIZE - HEADER_END)
+        goto fail;
+
+    return 0;
+
+ fail:
+    xsyslog(LOG_ERR, "IOERROR: write failed",
+                     "fname=<%s>",
+                     fname);
+    return IMAP_IOERROR;
+}
+
+/*
+ * Append the entries in 'buf' to the sort key file for 'mailbox',
+ * starting a new file if there isn't a usable one.
+ */
+EXPORTED int sortidx_commit(struct mailbox *mailbox, const struct buf *buf)
+{
+    char header[SORTIDX_HEADER_SIZE];
+    const char *fname;
+    int fd;
+    int r;
+
+    if (!buf->len) return 0;
+
+    fname = mailbox_meta_fname(mailbox, META_SORTIDX);
+    if (!fname) return IMAP_MAILBOX_BADNAME;
+
+    fd = open(fname, O_RDWR, 0);
+    if (fd != -1) {
+        if (pread(fd, header, SORTIDX_HEADER_SIZE, 0) != SORTIDX_HEADER_SIZE ||
+            !header_valid(header, SORTIDX_HEADER_SIZE, mailbox->i.uidvalidity)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd == -1) {
+        fd = sortidx_create(fname, mailbox->i.uidvalidity);
+        if (fd == -1) return IMAP_IOERROR;
+    }
+
+    r = sortidx_append(fd, fname, buf);
+
+    close(fd);
+
+    return r;
+}
+
+/*
+ * Add the sort keys for 'record' to 'buf', writing them out to the
+ * file open on 'fd' once enough have been gathered.  Used to build
+ * a whole new file while repacking.
+ */
+EXPORTED int sortidx_add_and_flush(int fd, const char *fname, struct buf *buf,
+                                   const struct index_record *record)
+{
+    int r;
+
+    sortidx_add_record(buf, record);
+
+    if (buf->len < SORTIDX_FLUSH_SIZE) return 0;
+
+    r = sortidx_append(fd, fname, buf);
+    buf_reset(buf);
+
+    return r;
+}
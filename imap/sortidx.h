@@ -0,0 +1,82 @@
+/* sortidx.h -- Pre-normalised SORT keys alongside the mailbox index
+ *
+ * Copyright (c) 1994-2020 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef INCLUDED_SORTIDX_H
+#define INCLUDED_SORTIDX_H
+
+#include "mailbox.h"
+
+/* A sort key entry, as stored in cyrus.sortidx.  The strings point
+ * into the mapped file and are valid until sortidx_close(). */
+struct sortidx_entry {
+    uint32_t uid;
+    int is_refwd;
+    const char *xsubj;          /* base subject, never NULL */
+    const char *from;           /* the rest are NULL if not present */
+    const char *displayfrom;
+    const char *to;
+    const char *displayto;
+    const char *cc;
+};
+
+struct sortidx;
+
+/* reading */
+extern int sortidx_open(struct mailbox *mailbox, struct sortidx **sidxp);
+extern int sortidx_open_file(const char *fname, const char *mboxname,
+                             uint32_t uidvalidity, struct sortidx **sidxp);
+extern int sortidx_lookup(struct sortidx *sidx, uint32_t uid,
+                          struct sortidx_entry *entry);
+extern void sortidx_close(struct sortidx **sidxp);
+
+/* writing - the record's cache must already be loaded */
+extern void sortidx_add_entry(struct buf *buf,
+                              const struct sortidx_entry *entry);
+extern void sortidx_add_record(struct buf *buf,
+                               const struct index_record *record);
+extern int sortidx_create(const char *fname, uint32_t uidvalidity);
+extern int sortidx_append(int fd, const char *fname, const struct buf *buf);
+extern int sortidx_add_and_flush(int fd, const char *fname, struct buf *buf,
+                                 const struct index_record *record);
+extern int sortidx_commit(struct mailbox *mailbox, const struct buf *buf);
+
+#endif /* INCLUDED_SORTIDX_H */
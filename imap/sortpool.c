@@ -0,0 +1,285 @@
+/* sortpool.c -- Worker threads for sorting large mailboxes
+ *
+ * Copyright (c) 1994-2020 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "assert.h"
+#include "global.h"
+#include "sortpool.h"
+#include "xmalloc.h"
+
+/* below this many items, starting threads costs more than it saves */
+#define SORTPOOL_MIN_ITEMS 8192
+
+#define SORTPOOL_MAX_THREADS 64
+
+struct sortpool_job {
+    pthread_t tid;
+    int started;
+    void (*fn)(void *rock, size_t start, size_t end);
+    void *rock;
+    size_t start;
+    size_t end;
+};
+
+typedef int thread_create_t(pthread_t *, const pthread_attr_t *,
+                            void *(*)(void *), void *);
+static thread_create_t *thread_create = pthread_create;
+
+/* for testing the fallback when threads can't be started */
+EXPORTED void sortpool_set_thread_create(thread_create_t *fn)
+{
+    thread_create = fn ? fn : pthread_create;
+}
+
+EXPORTED unsigned sortpool_threads(size_t n)
+{
+    int nthreads = config_getint(IMAPOPT_SORT_THREADS);
+
+    if (nthreads <= 1 || n < SORTPOOL_MIN_ITEMS)
+        return 1;
+
+    if (nthreads > SORTPOOL_MAX_THREADS)
+        nthreads = SORTPOOL_MAX_THREADS;
+
+    /* at least SORTPOOL_MIN_ITEMS/2 items each */
+    if ((size_t)nthreads > n / (SORTPOOL_MIN_ITEMS/2))
+        nthreads = n / (SORTPOOL_MIN_ITEMS/2);
+
+    return nthreads;
+}
+
+static void *sortpool_worker(void *arg)
+{
+    struct sortpool_job *job = (struct sortpool_job *) arg;
+
+    job->fn(job->rock, job->start, job->end);
+
+    return NULL;
+}
+
+/*
+ * Split [0, n) into 'nthreads' ranges and run them concurrently,
+ * the first one in the calling thread.  If a thread can't be
+ * started its range is run in the calling thread instead, so the
+ * work always gets done.
+ */
+static void run_ranges(unsigned nthreads, size_t n,
+                       void (*fn)(void *rock, size_t start, size_t end),
+                       void *rock)
+{
+    struct sortpool_job jobs[SORTPOOL_MAX_THREADS];
+    sigset_t all, old;
+    unsigned i;
+
+    if (nthreads <= 1) {
+        fn(rock, 0, n);
+        return;
+    }
+
+    assert(nthreads <= SORTPOOL_MAX_THREADS);
+
+    for (i = 0; i < nthreads; i++) {
+        jobs[i].fn = fn;
+        jobs[i].rock = rock;
+        jobs[i].start = n * i / nthreads;
+        jobs[i].end = n * (i + 1) / nthreads;
+        jobs[i].started = 0;
+    }
+
+    /* signals are for the main thread, workers never see them */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    for (i = 1; i < nthreads; i++) {
+        int r = thread_create(&jobs[i].tid, NULL, sortpool_worker, &jobs[i]);
+        if (r) {
+            syslog(LOG_WARNING, "sortpool: pthread_create failed: %s",
+                   strerror(r));
+            continue;
+        }
+        jobs[i].started = 1;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    fn(rock, jobs[0].start, jobs[0].end);
+
+    for (i = 1; i < nthreads; i++) {
+        if (jobs[i].started)
+            pthread_join(jobs[i].tid, NULL);
+        else
+            fn(rock, jobs[i].start, jobs[i].end);
+    }
+}
+
+EXPORTED void sortpool_run(size_t n,
+                           void (*fn)(void *rock, size_t start, size_t end),
+                           void *rock)
+{
+    run_ranges(sortpool_threads(n), n, fn, rock);
+}
+
+struct sortpool_sort {
+    char *base;
+    char *tmp;
+    size_t size;
+    int (*compar)(const void *, const void *);
+    /* run boundaries, nruns+1 of them */
+    size_t *bounds;
+    size_t nruns;
+};
+
+static void sort_runs(void *rock, size_t start, size_t end)
+{
+    struct sortpool_sort *s = (struct sortpool_sort *) rock;
+    size_t i;
+
+    for (i = start; i < end; i++) {
+        size_t from = s->bounds[i];
+        qsort(s->base + from * s->size, s->bounds[i+1] - from,
+              s->size, s->compar);
+    }
+}
+
+/*
+ * Merge runs 2i and 2i+1 from base into tmp.  Ties take the item
+ * from the left hand run, so merging keeps the order qsort() gave.
+ */
+static void merge_runs(void *rock, size_t start, size_t end)
+{
+    struct sortpool_sort *s = (struct sortpool_sort *) rock;
+    size_t size = s->size;
+    size_t i;
+
+    for (i = start; i < end; i++) {
+        size_t left = s->bounds[2*i];
+        size_t mid = 2*i+1 < s->nruns ? s->bounds[2*i+1] : s->bounds[s->nruns];
+        size_t right = 2*i+2 < s->nruns ? s->bounds[2*i+2] : s->bounds[s->nruns];
+        char *a = s->base + left * size, *aend = s->base + mid * size;
+        char *b = aend, *bend = s->base + right * size;
+        char *out = s->tmp + left * size;
+
+        while (a < aend && b < bend) {
+            if (s->compar(b, a) < 0) {
+                memcpy(out, b, size);
+                b += size;
+            }
+            else {
+                memcpy(out, a, size);
+                a += size;
+            }
+            out += size;
+        }
+        if (a < aend) memcpy(out, a, aend - a);
+        else if (b < bend) memcpy(out, b, bend - b);
+    }
+}
+
+EXPORTED void sortpool_qsort(void *base, size_t nmemb, size_t size,
+                             int (*compar)(const void *, const void *))
+{
+    sortpool_qsort_threads(base, nmemb, size, compar,
+                           sortpool_threads(nmemb));
+}
+
+EXPORTED void sortpool_qsort_threads(void *base, size_t nmemb, size_t size,
+                                     int (*compar)(const void *, const void *),
+                                     unsigned nthreads)
+{
+    struct sortpool_sort s;
+    size_t i, npairs;
+    char *swap;
+
+    if (nthreads > SORTPOOL_MAX_THREADS)
+        nthreads = SORTPOOL_MAX_THREADS;
+    /* no empty slices */
+    if (nthreads > nmemb)
+        nthreads = nmemb;
+
+    if (nthreads <= 1) {
+        qsort(base, nmemb, size, compar);
+        return;
+    }
+
+    s.base = base;
+    s.tmp = xmalloc(nmemb * size);
+    s.size = size;
+    s.compar = compar;
+    s.nruns = nthreads;
+    s.bounds = xmalloc((nthreads + 1) * sizeof(size_t));
+    for (i = 0; i <= nthreads; i++)
+        s.bounds[i] = nmemb * i / nthreads;
+
+    /* sort a slice per thread */
+    run_ranges(nthreads, s.nruns, sort_runs, &s);
+
+    /* then merge pairs of runs, halving the number of runs each pass */
+    while (s.nruns > 1) {
+        npairs = (s.nruns + 1) / 2;
+        run_ranges(npairs, npairs, merge_runs, &s);
+
+        for (i = 0; 2*i < s.nruns; i++)
+            s.bounds[i] = s.bounds[2*i];
+        s.bounds[npairs] = nmemb;
+        s.nruns = npairs;
+
+        swap = s.base;
+        s.base = s.tmp;
+        s.tmp = swap;
+    }
+
+    /* the result ended up in the scratch buffer */
+    if (s.base != base) {
+        memcpy(base, s.base, nmemb * size);
+        s.tmp = s.base;
+    }
+
+    free(s.tmp);
+    free(s.bounds);
+}
@@ -0,0 +1,75 @@
+/* sortpool.h -- Worker threads for sorting large mailboxes
+ *
+ * Copyright (c) 1994-2020 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef INCLUDED_SORTPOOL_H
+#define INCLUDED_SORTPOOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* the number of threads worth using for 'n' items, 1 if none */
+extern unsigned sortpool_threads(size_t n);
+
+/* call fn(rock, start, end) over contiguous ranges covering [0, n),
+ * one range per thread.  Each range must only touch its own items. */
+extern void sortpool_run(size_t n,
+                         void (*fn)(void *rock, size_t start, size_t end),
+                         void *rock);
+
+/* qsort() using the worker threads.  Each thread sorts a slice and
+ * the slices are merged, so the result is identical to qsort()'s as
+ * long as compar never finds two distinct items equal. */
+extern void sortpool_qsort(void *base, size_t nmemb, size_t size,
+                           int (*compar)(const void *, const void *));
+
+/* the same, with exactly 'nthreads' slices whatever the size */
+extern void sortpool_qsort_threads(void *base, size_t nmemb, size_t size,
+                                   int (*compar)(const void *, const void *),
+                                   unsigned nthreads);
+
+/* replace pthread_create(), or restore it if 'fn' is NULL.  For
+ * testing the fallback when threads can't be started. */
+extern void sortpool_set_thread_create(
+        int (*fn)(pthread_t *, const pthread_attr_t *,
+                  void *(*)(void *), void *));
+
+#endif /* INCLUDED_SORTPOOL_H */
@@ -57,6 +57,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <sysexits.h>
@@ -67,6 +69,8 @@
 #include "assert.h"
 #include "bitvector.h"
 #include "bsearch.h"
+#include "dlist.h"
+#include "hash.h"
 #include "mboxlist.h"
 #include "global.h"
 #include "search_engines.h"
@@ -83,6 +87,7 @@
 #include "index.h"
 #include "message.h"
 #include "util.h"
+#include "prometheus.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -105,6 +110,8 @@ static int allow_partials = 0;
 static int allow_duplicateparts = 0;
 static int reindex_partials = 0;
 static int reindex_minlevel = 0;
+static int bulk_import = 0;
+static int nworkers = 1;
 static search_text_receiver_t *rx = NULL;
 
 static strarray_t *skip_domains = NULL;
@@ -114,6 +121,9 @@ static const char *name_starts_from = NULL;
 
 static void shut_down(int code) __attribute__((noreturn));
 
+enum sq_mode { SQ_INDEXER, SQ_SYNCLOG, SQ_ROLLING };
+static int do_indexer_parallel(const strarray_t *mboxnames, enum sq_mode mode);
+
 __attribute__((noreturn)) static int usage(const char *name)
 {
     fprintf(stderr,
@@ -130,11 +140,13 @@ __attribute__((noreturn)) static int usage(const char *name)
             "\n"
             "Index mode options:\n"
             "  -i          index incrementally\n"
+            "  -I          bulk import: commit once per mailbox\n"
             "  -p          allow partially indexed messages\n"
             "  -P          reindex partially indexed messages (implies -Z)\n"
             "  -L level    reindex messages where indexlevel < level (implies -Z)\n"
             "  -N name     index mailbox names starting with name\n"
             "  -S seconds  sleep seconds between indexing mailboxes\n"
+            "  -j workers  index users in parallel in this many processes\n"
             "  -Z          Xapian: use internal index rather than cyrus.indexed.db\n"
             "\n"
             "Index sources:\n"
@@ -145,6 +157,7 @@ __attribute__((noreturn)) static int usage(const char *name)
             "Rolling indexer options:\n"
             "  -n channel  listen to channel\n"
             "  -d          don't background process\n"
+            "  -j workers  index users in parallel in this many processes\n"
             "\n"
             "Compact mode options:\n"
             "  -t tier...  compact from tiers\n"
@@ -281,6 +294,8 @@ static int index_one(const char *name, int blocking)
         flags |= SEARCH_UPDATE_REINDEX_PARTIALS;
     if (allow_duplicateparts)
         flags |= SEARCH_UPDATE_ALLOW_DUPPARTS;
+    if (bulk_import)
+        flags |= SEARCH_UPDATE_BULK;
 
     /* Convert internal name to external */
     char *extname = mboxname_to_external(name, &squat_namespace, NULL);
@@ -353,10 +368,18 @@ again:
         printf("Indexing mailbox %s... ", extname);
     }
 
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
     r = search_update_mailbox(rx, mailbox, reindex_minlevel, flags);
 
     mailbox_close(&mailbox);
 
+    gettimeofday(&end, NULL);
+    prometheus_increment(CYRUS_SQUATTER_MAILBOXES_INDEXED_TOTAL);
+    prometheus_apply_delta(CYRUS_SQUATTER_INDEX_SECONDS_TOTAL,
+                           timesub(&start, &end));
+
     /* in non-blocking (rolling) mode, only do one batch per mailbox at
      * a time for fairness [IRIS-2471].  The squatter will re-insert the
      * mailbox in the queue */
@@ -411,6 +434,12 @@ static int do_indexer(const strarray_t *mboxnames)
     if (rx == NULL)
         return 0;       /* no indexer defined */
 
+    if (nworkers > 1) {
+        search_end_update(rx);
+        rx = NULL;
+        return do_indexer_parallel(mboxnames, SQ_INDEXER);
+    }
+
     for (i = 0 ; i < strarray_size(mboxnames) ; i++) {
         const char *mboxname = strarray_nth(mboxnames, i);
         if (!should_index(mboxname)) continue;
@@ -682,6 +711,11 @@ static int do_synclogfile(const char *synclogfile)
 
     signals_poll();
 
+    if (nworkers > 1) {
+        r = do_indexer_parallel(mboxnames, SQ_SYNCLOG);
+        goto out;
+    }
+
     /* have some due items in the queue, try to index them */
     rx = search_begin_update(verbose);
     if (NULL == rx) {
@@ -794,6 +828,581 @@ static void do_rolling(const char *channel)
     sync_log_reader_free(slr);
 }
 
+/* ====================================================================== */
+
+/*
+ * Parallel indexing (-j).  A coordinator groups the mailboxes to index
+ * by user and hands each user to one of a pool of worker processes.  A
+ * user is only ever given to one worker at a time, so the workers never
+ * contend for the same user's search databases.
+ *
+ * Coordinator and workers talk over a socketpair using dlists, one per
+ * line:
+ *
+ *   job:    %(USERID user MBOXES (mboxname...))
+ *   reply:  %(USERID user MAILBOXES n ERRORS n)
+ */
+
+struct sq_job {
+    char *userid;
+    strarray_t mboxnames;
+    int attempts;
+};
+
+struct sq_worker {
+    int fd;
+    pid_t pid;
+    struct protstream *in;
+    struct protstream *out;
+    struct sq_job *job;         /* NULL when idle */
+    struct timeval started;
+    unsigned long users;
+    unsigned long mailboxes;
+    unsigned long errors;
+    double busy;
+};
+
+struct sq_pool {
+    enum sq_mode mode;
+    const char *channel;        /* rolling mode: requeue locked mailboxes */
+    struct sq_worker *workers;
+    int nworkers;
+    int nbusy;
+    hash_table jobs;            /* queued jobs by userid */
+    strarray_t queue;           /* userids in the order they were queued */
+    int qhead;
+    int nerrors;
+    time_t lastreport;
+};
+
+#define SQ_REPORT_INTERVAL 300  /* seconds between worker stats in syslog */
+#define SQ_MAX_ATTEMPTS 2       /* times to try a job whose worker died */
+
+static void sq_job_free(void *data)
+{
+    struct sq_job *job = (struct sq_job *)data;
+
+    if (!job) return;
+    free(job->userid);
+    strarray_fini(&job->mboxnames);
+    free(job);
+}
+
+/* index a user's mailboxes in a worker, returns the number of errors */
+static int worker_index(const struct sq_pool *pool, strarray_t *mboxnames,
+                        unsigned long *nindexedp)
+{
+    int blocking = (pool->mode != SQ_ROLLING);
+    int nskipped = 0;
+    int nerrors = 0;
+    int i, r;
+
+    for (i = 0; i < strarray_size(mboxnames); i++) {
+        const char *mboxname = strarray_nth(mboxnames, i);
+
+        signals_poll();
+
+        if (!should_index(mboxname)) continue;
+        if (verbose > 1)
+            syslog(LOG_INFO, "worker: indexing %s", mboxname);
+        r = index_one(mboxname, blocking);
+        if (r == IMAP_MAILBOX_NONEXISTENT)
+            r = 0;
+        if (r == IMAP_AGAIN || r == IMAP_MAILBOX_LOCKED) {
+            if (pool->mode == SQ_ROLLING) {
+                sync_log_channel_append(pool->channel, mboxname);
+            }
+            else if (pool->mode == SQ_SYNCLOG) {
+                if (++nskipped > 10000) {
+                    syslog(LOG_ERR, "IOERROR: skipped too many times at %s",
+                           mboxname);
+                    nerrors++;
+                    break;
+                }
+                /* try again at the end */
+                strarray_append(mboxnames, mboxname);
+            }
+            r = 0;
+        }
+        else if (!r) {
+            (*nindexedp)++;
+        }
+        if (r) {
+            syslog(LOG_ERR, "IOERROR: failed to index %s: %s",
+                   mboxname, error_message(r));
+            nerrors++;
+            /* rolling mode forgets the mailbox and carries on, the
+             * others stop at the first failure */
+            if (pool->mode != SQ_ROLLING) break;
+        }
+        if (sleepmicroseconds)
+            usleep(sleepmicroseconds);
+    }
+
+    return nerrors;
+}
+
+static void worker_main(const struct sq_pool *pool, int fd)
+{
+    struct protstream *in = prot_new(fd, 0);
+    struct protstream *out = prot_new(fd, 1);
+
+    prot_setflushonread(in, out);
+
+    for (;;) {
+        struct dlist *dl = NULL, *mbs = NULL, *di;
+        strarray_t mboxnames = STRARRAY_INITIALIZER;
+        const char *userid = "";
+        unsigned long nindexed = 0;
+        int nerrors;
+        int c;
+
+        c = dlist_parse(&dl, 1, 0, in);
+        if (c == '\r') c = prot_getc(in);
+        if (c != '\n' || !dl) {
+            /* the coordinator has gone away, or is done with us */
+            dlist_free(&dl);
+            break;
+        }
+
+        dlist_getatom(dl, "USERID", &userid);
+        if (dlist_getlist(dl, "MBOXES", &mbs)) {
+            for (di = mbs->head; di; di = di->next)
+                strarray_append(&mboxnames, dlist_cstring(di));
+        }
+
+        rx = search_begin_update(verbose);
+        if (rx == NULL)
+            fatal("could not construct search text receiver", EX_CONFIG);
+        nerrors = worker_index(pool, &mboxnames, &nindexed);
+        search_end_update(rx);
+        rx = NULL;
+
+        prometheus_increment(CYRUS_SQUATTER_WORKER_JOBS_TOTAL);
+
+        struct dlist *kl = dlist_newkvlist(NULL, "DONE");
+        dlist_setatom(kl, "USERID", userid);
+        dlist_setnum32(kl, "MAILBOXES", nindexed);
+        dlist_setnum32(kl, "ERRORS", nerrors);
+        dlist_print(kl, 1, out);
+        prot_printf(out, "\r\n");
+        prot_flush(out);
+        dlist_free(&kl);
+
+        strarray_fini(&mboxnames);
+        dlist_free(&dl);
+    }
+
+    prot_free(in);
+    prot_free(out);
+    close(fd);
+
+    shut_down(0);
+}
+
+static void pool_spawn(struct sq_pool *pool, struct sq_worker *w)
+{
+    int sv[2];
+    int i;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        fatal("socketpair failed", EX_OSERR);
+
+    /* don't share the coordinator's mailboxes.db handle with the worker */
+    mboxlist_close();
+
+    w->pid = fork();
+    if (w->pid < 0)
+        fatal("fork failed", EX_OSERR);
+
+    if (!w->pid) {
+        /* worker: the coordinator's stats are its own to report */
+        prometheus_after_fork();
+
+        /* only keep our own end of our own socket, so that we all
+         * notice when the coordinator exits */
+        close(sv[0]);
+        for (i = 0; i < pool->nworkers; i++) {
+            if (pool->workers[i].fd >= 0)
+                close(pool->workers[i].fd);
+        }
+        worker_main(pool, sv[1]);
+        /* never returns */
+    }
+
+    close(sv[1]);
+    w->fd = sv[0];
+    w->in = prot_new(w->fd, 0);
+    w->out = prot_new(w->fd, 1);
+    w->job = NULL;
+
+    syslog(LOG_INFO, "started indexing worker %d", (int)w->pid);
+}
+
+static void pool_init(struct sq_pool *pool, enum sq_mode mode,
+                      const char *channel, int n)
+{
+    int i;
+
+    memset(pool, 0, sizeof(struct sq_pool));
+    pool->mode = mode;
+    pool->channel = channel;
+    pool->nworkers = n;
+    pool->workers = xzmalloc(n * sizeof(struct sq_worker));
+    construct_hash_table(&pool->jobs, 1024, 0);
+    pool->lastreport = time(NULL);
+
+    for (i = 0; i < n; i++)
+        pool->workers[i].fd = -1;
+    for (i = 0; i < n; i++)
+        pool_spawn(pool, &pool->workers[i]);
+}
+
+static void pool_add(struct sq_pool *pool, const char *mboxname)
+{
+    char *userid = mboxname_to_userid(mboxname);
+    const char *key = userid ? userid : "";
+    struct sq_job *job = hash_lookup(key, &pool->jobs);
+
+    if (!job) {
+        job = xzmalloc(sizeof(struct sq_job));
+        job->userid = xstrdup(key);
+        hash_insert(key, job, &pool->jobs);
+        strarray_append(&pool->queue, key);
+    }
+    strarray_append(&job->mboxnames, mboxname);
+
+    free(userid);
+}
+
+static void pool_clear(struct sq_pool *pool)
+{
+    free_hash_table(&pool->jobs, sq_job_free);
+    construct_hash_table(&pool->jobs, 1024, 0);
+    strarray_truncate(&pool->queue, 0);
+    pool->qhead = 0;
+}
+
+static int pool_isbusy(const struct sq_pool *pool, const char *userid)
+{
+    int i;
+
+    for (i = 0; i < pool->nworkers; i++) {
+        if (pool->workers[i].job &&
+            !strcmp(pool->workers[i].job->userid, userid))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int pool_idle(struct sq_pool *pool)
+{
+    return !pool->nbusy && !hash_numrecords(&pool->jobs);
+}
+
+/* pick the oldest queued user that nobody is working on */
+static struct sq_job *pool_nextjob(struct sq_pool *pool)
+{
+    int i;
+
+    for (i = pool->qhead; i < strarray_size(&pool->queue); i++) {
+        const char *userid = strarray_nth(&pool->queue, i);
+        struct sq_job *job = hash_lookup(userid, &pool->jobs);
+
+        if (!job) {
+            /* already dispatched */
+            if (i == pool->qhead) pool->qhead++;
+            continue;
+        }
+        if (pool_isbusy(pool, userid))
+            continue;
+
+        hash_del(userid, &pool->jobs);
+        if (i == pool->qhead) pool->qhead++;
+        return job;
+    }
+
+    if (pool->qhead >= strarray_size(&pool->queue)) {
+        strarray_truncate(&pool->queue, 0);
+        pool->qhead = 0;
+    }
+
+    return NULL;
+}
+
+static void pool_dispatch(struct sq_pool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->nworkers && pool->nbusy < pool->nworkers; i++) {
+        struct sq_worker *w = &pool->workers[i];
+        struct sq_job *job;
+        struct dlist *kl, *mbs;
+        int j;
+
+        if (w->job) continue;
+
+        job = pool_nextjob(pool);
+        if (!job) break;
+
+        /* sort mboxnames for locality of reference, and deduplicate */
+        strarray_sort(&job->mboxnames, cmpstringp_raw);
+        strarray_uniq(&job->mboxnames);
+
+        kl = dlist_newkvlist(NULL, "JOB");
+        dlist_setatom(kl, "USERID", job->userid);
+        mbs = dlist_newlist(kl, "MBOXES");
+        for (j = 0; j < strarray_size(&job->mboxnames); j++)
+            dlist_setatom(mbs, NULL, strarray_nth(&job->mboxnames, j));
+        dlist_print(kl, 1, w->out);
+        prot_printf(w->out, "\r\n");
+        prot_flush(w->out);
+        dlist_free(&kl);
+
+        if (verbose > 1)
+            syslog(LOG_INFO, "worker %d: indexing user %s (%d mailboxes)",
+                   (int)w->pid, job->userid, strarray_size(&job->mboxnames));
+
+        job->attempts++;
+        w->job = job;
+        gettimeofday(&w->started, NULL);
+        pool->nbusy++;
+    }
+}
+
+static void pool_reap(struct sq_worker *w)
+{
+    int status;
+
+    prot_free(w->in);
+    prot_free(w->out);
+    w->in = w->out = NULL;
+    close(w->fd);
+    w->fd = -1;
+
+    if (waitpid(w->pid, &status, 0) < 0)
+        status = -1;
+    w->pid = 0;
+
+    if (status)
+        syslog(LOG_ERR, "IOERROR: indexing worker exited with status %d",
+               status);
+}
+
+static void pool_finish(struct sq_pool *pool, struct sq_worker *w)
+{
+    struct sq_job *job = w->job;
+    struct timeval now;
+    struct dlist *dl = NULL;
+    bit32 nindexed = 0;
+    bit32 nerrors = 0;
+    int c;
+
+    c = dlist_parse(&dl, 1, 0, w->in);
+    if (c == '\r') c = prot_getc(w->in);
+
+    gettimeofday(&now, NULL);
+    w->busy += timesub(&w->started, &now);
+    w->job = NULL;
+    pool->nbusy--;
+
+    if (c != '\n' || !dl) {
+        /* the worker died, give its job another chance and replace it */
+        syslog(LOG_ERR, "IOERROR: indexing worker %d died indexing user %s",
+               (int)w->pid, job->userid);
+        dlist_free(&dl);
+        pool_reap(w);
+
+        if (job->attempts < SQ_MAX_ATTEMPTS && !hash_lookup(job->userid, &pool->jobs)) {
+            hash_insert(job->userid, job, &pool->jobs);
+            strarray_append(&pool->queue, job->userid);
+            job = NULL;
+        }
+        else {
+            syslog(LOG_ERR, "IOERROR: giving up indexing user %s", job->userid);
+            w->errors++;
+            pool->nerrors++;
+        }
+        sq_job_free(job);
+
+        pool_spawn(pool, w);
+        return;
+    }
+
+    dlist_getnum32(dl, "MAILBOXES", &nindexed);
+    dlist_getnum32(dl, "ERRORS", &nerrors);
+    dlist_free(&dl);
+
+    w->users++;
+    w->mailboxes += nindexed;
+    w->errors += nerrors;
+    pool->nerrors += nerrors;
+
+    sq_job_free(job);
+
+    /* stop at the first failure like the serial indexer, except in
+     * rolling mode which just logs and carries on */
+    if (nerrors && pool->mode != SQ_ROLLING)
+        pool_clear(pool);
+}
+
+/* wait up to a second for workers to finish their jobs */
+static void pool_wait(struct sq_pool *pool)
+{
+    struct protgroup *group, *ready = NULL;
+    struct timeval timeout = { 1, 0 };
+    int i;
+
+    if (!pool->nbusy) return;
+
+    group = protgroup_new(pool->nworkers);
+    for (i = 0; i < pool->nworkers; i++) {
+        if (pool->workers[i].job)
+            protgroup_insert(group, pool->workers[i].in);
+    }
+
+    if (prot_select(group, -1, &ready, NULL, &timeout) > 0) {
+        for (i = 0; i < pool->nworkers; i++) {
+            struct sq_worker *w = &pool->workers[i];
+            size_t j;
+
+            if (!w->job) continue;
+            for (j = 0; protgroup_getelement(ready, j); j++) {
+                if (protgroup_getelement(ready, j) == w->in) {
+                    pool_finish(pool, w);
+                    break;
+                }
+            }
+        }
+    }
+
+    protgroup_free(ready);
+    protgroup_free(group);
+}
+
+static void pool_report(struct sq_pool *pool, int force)
+{
+    time_t now = time(NULL);
+    double elapsed = now - pool->lastreport;
+    int i;
+
+    if (!force && elapsed < SQ_REPORT_INTERVAL) return;
+
+    for (i = 0; i < pool->nworkers; i++) {
+        struct sq_worker *w = &pool->workers[i];
+
+        syslog(LOG_INFO, "indexing worker %d: %lu users %lu mailboxes"
+                         " %lu errors in %.1fs busy (%.0f%%)",
+               i, w->users, w->mailboxes, w->errors, w->busy,
+               elapsed > 0 ? 100.0 * w->busy / elapsed : 0.0);
+        if (verbose)
+            printf("worker %d: %lu users %lu mailboxes %lu errors"
+                   " in %.1fs busy\n",
+                   i, w->users, w->mailboxes, w->errors, w->busy);
+
+        w->users = w->mailboxes = w->errors = 0;
+        w->busy = 0;
+    }
+
+    pool->lastreport = now;
+}
+
+static void pool_fini(struct sq_pool *pool)
+{
+    int i;
+
+    pool_report(pool, 1);
+
+    /* closing the sockets tells the workers to exit */
+    for (i = 0; i < pool->nworkers; i++) {
+        if (pool->workers[i].fd >= 0) {
+            sq_job_free(pool->workers[i].job);
+            pool_reap(&pool->workers[i]);
+        }
+    }
+
+    free(pool->workers);
+    free_hash_table(&pool->jobs, sq_job_free);
+    strarray_fini(&pool->queue);
+}
+
+static int do_indexer_parallel(const strarray_t *mboxnames, enum sq_mode mode)
+{
+    struct sq_pool pool;
+    int i, r;
+
+    pool_init(&pool, mode, NULL, nworkers);
+
+    for (i = 0; i < strarray_size(mboxnames); i++)
+        pool_add(&pool, strarray_nth(mboxnames, i));
+
+    while (!pool_idle(&pool)) {
+        signals_poll();
+        pool_dispatch(&pool);
+        pool_wait(&pool);
+        pool_report(&pool, 0);
+    }
+
+    r = pool.nerrors ? IMAP_IOERROR : 0;
+    pool_fini(&pool);
+
+    return r;
+}
+
+static void do_rolling_parallel(const char *channel)
+{
+    struct sq_pool pool;
+    strarray_t *mboxnames;
+    sync_log_reader_t *slr;
+    int i;
+    int r;
+
+    slr = sync_log_reader_create_with_channel(channel);
+    pool_init(&pool, SQ_ROLLING, channel, nworkers);
+
+    for (;;) {
+        int sig = signals_poll();
+
+        if (sig == SIGHUP && getenv("CYRUS_ISDAEMON")) {
+            syslog(LOG_DEBUG, "received SIGHUP, shutting down gracefully\n");
+            /* keep the work file for next time unless it's all done */
+            if (pool_idle(&pool))
+                sync_log_reader_end(slr);
+            pool_fini(&pool);
+            shut_down(0);
+        }
+
+        if (shutdown_file(NULL, 0)) {
+            pool_fini(&pool);
+            shut_down(EX_TEMPFAIL);
+        }
+
+        /* only move on to the next log file once everything from the
+         * previous one has been indexed, so nothing is lost if we crash */
+        if (pool_idle(&pool)) {
+            r = sync_log_reader_begin(slr);
+            if (r) { /* including IMAP_AGAIN */
+                usleep(100000);    /* 1/10th second */
+                continue;
+            }
+
+            mboxnames = read_sync_log_items(slr);
+            for (i = 0; i < strarray_size(mboxnames); i++)
+                pool_add(&pool, strarray_nth(mboxnames, i));
+            strarray_free(mboxnames);
+        }
+
+        pool_dispatch(&pool);
+        pool_wait(&pool);
+        pool_report(&pool, 0);
+    }
+
+    /* XXX - we don't really get here... */
+    pool_fini(&pool);
+    sync_log_reader_free(slr);
+}
+
 static int audit_one(const char *mboxname, bitvector_t *unindexed)
 {
     int r2, r = 0;
@@ -896,7 +1505,7 @@ int main(int argc, char **argv)
 
     setbuf(stdout, NULL);
 
-    while ((opt = getopt(argc, argv, "C:N:RUBXZDT:S:Fde:f:mn:riavpPL:Az:t:ouhl")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:N:RUBXZDT:S:Fde:f:Ij:mn:riavpPL:Az:t:ouhl")) != EOF) {
         switch (opt) {
         case 'A':
             if (mode != UNKNOWN) usage(argv[0]);
@@ -941,6 +1550,10 @@ int main(int argc, char **argv)
             allow_partials = 1;
             break;
 
+        case 'I':               /* bulk import */
+            bulk_import = 1;
+            break;
+
         case 'D':
             allow_duplicateparts = 1;
             break;
@@ -968,6 +1581,15 @@ int main(int argc, char **argv)
             background = 0;
             break;
 
+        case 'j':               /* number of worker processes */
+            nworkers = atoi(optarg);
+            if (nworkers < 1) {
+                fprintf(stderr, "%s: %s: invalid number of workers\n",
+                        argv[0], optarg);
+                exit(EX_USAGE);
+            }
+            break;
+
         /* This option is deliberately undocumented, for testing only */
         case 'e':               /* add a search term */
             if (mode != UNKNOWN && mode != SEARCH) usage(argv[0]);
@@ -1110,7 +1732,10 @@ int main(int argc, char **argv)
     case ROLLING:
         if (background && !getenv("CYRUS_ISDAEMON"))
             become_daemon();
-        do_rolling(channel);
+        if (nworkers > 1)
+            do_rolling_parallel(channel);
+        else
+            do_rolling(channel);
         /* never returns */
         break;
     case SYNCLOG:
@@ -86,7 +86,7 @@ static void statuscache_open(void)
     if (!fname)
         fname = strconcat(config_dir, FNAME_STATUSCACHEDB, (char *)NULL);
 
-    int r = cyrusdb_open(DB, fname, CYRUSDB_CREATE, &statuscachedb);
+    int r = cyrusdb_open(DB, fname, CYRUSDB_CREATE|CYRUSDB_BLOOM, &statuscachedb);
     if (r) {
         syslog(LOG_ERR, "DBERROR: opening %s: %s", fname,
                cyrusdb_strerror(r));
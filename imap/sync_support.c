@@ -2313,15 +2313,16 @@ redo:
                                             0, &record->guid);
 
         /* check that the sha1 of the file on disk is correct */
-        struct index_record record2;
-        memset(&record2, 0, sizeof(struct index_record));
-        r = message_parse(mailbox_msg_path, &record2);
-        if (r) {
-            syslog(LOG_ERR, "IOERROR: Unable to parse %s",
+        struct message_guid guid2;
+        int fd = open(mailbox_msg_path, O_RDONLY);
+        if (fd == -1 || message_guid_generate_fd(&guid2, fd)) {
+            syslog(LOG_ERR, "IOERROR: Unable to read %s: %m",
                    mailbox_msg_path);
+            if (fd != -1) close(fd);
             continue;
         }
-        if (!message_guid_equal(&record->guid, &record2.guid)) {
+        close(fd);
+        if (!message_guid_equal(&record->guid, &guid2)) {
             syslog(LOG_ERR, "IOERROR: GUID mismatch on parse for %s",
                    mailbox_msg_path);
             continue;
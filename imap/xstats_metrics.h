@@ -41,6 +41,7 @@
  */
 X(CONV_LOAD),
 X(CONV_SAVE),
+X(CONV_CACHE_HIT),
 X(CONV_GET_MODSEQ),
 X(CONV_NEW),
 X(MSGDATA_LOAD),
@@ -49,5 +50,6 @@ X(SEARCH_EVALUATE),
 X(SEARCH_HEADER),
 X(SEARCH_CACHE_HEADER),
 X(SEARCH_BODY),
+X(SEARCH_TEXTCACHE_HIT),
 X(SEARCH_TRIVIAL),
 X(SEARCH_RESULT),
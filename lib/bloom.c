@@ -84,9 +84,10 @@ int bloom_init_size(struct bloom * bloom, int entries, double error,
 }
 
 
-EXPORTED int bloom_init(struct bloom * bloom, int entries, double error)
+static int bloom_size(struct bloom * bloom, int entries, double error)
 {
   bloom->ready = 0;
+  bloom->external = 0;
 
   if (entries < 1 || error == 0) {
     return 1;
@@ -110,6 +111,16 @@ EXPORTED int bloom_init(struct bloom * bloom, int entries, double error)
 
   bloom->hashes = (int)ceil(0.693147180559945 * bloom->bpe);  // ln(2)
 
+  return 0;
+}
+
+
+EXPORTED int bloom_init(struct bloom * bloom, int entries, double error)
+{
+  if (bloom_size(bloom, entries, error)) {
+    return 1;
+  }
+
   bloom->bf = (unsigned char *)calloc(bloom->bytes, sizeof(unsigned char));
   if (bloom->bf == NULL) {
     return 1;
@@ -120,6 +131,24 @@ EXPORTED int bloom_init(struct bloom * bloom, int entries, double error)
 }
 
 
+EXPORTED int bloom_init_buffer(struct bloom * bloom, int entries, double error,
+                               unsigned char * buf, size_t len)
+{
+  if (bloom_size(bloom, entries, error)) {
+    return 1;
+  }
+
+  if (buf == NULL || len < (size_t)bloom->bytes) {
+    return 1;
+  }
+
+  bloom->bf = buf;
+  bloom->external = 1;
+  bloom->ready = 1;
+  return 0;
+}
+
+
 EXPORTED int bloom_check(struct bloom * bloom, const void * buffer, int len)
 {
   return bloom_check_add(bloom, buffer, len, 0);
@@ -146,10 +175,11 @@ void bloom_print(struct bloom * bloom)
 
 EXPORTED void bloom_free(struct bloom * bloom)
 {
-  if (bloom->ready) {
+  if (bloom->ready && !bloom->external) {
     free(bloom->bf);
   }
   bloom->ready = 0;
+  bloom->external = 0;
 }
 
 
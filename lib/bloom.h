@@ -8,6 +8,8 @@
 #ifndef _BLOOM_H
 #define _BLOOM_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -36,6 +38,7 @@ struct bloom
   double bpe;
   unsigned char * bf;
   int ready;
+  int external;
 };
 
 
@@ -68,6 +71,32 @@ struct bloom
 int bloom_init(struct bloom * bloom, int entries, double error);
 
 
+/** ***************************************************************************
+ * Initialize the bloom filter over storage provided by the caller, such
+ * as a shared memory map of a file written out from another filter.
+ *
+ * Sizing is exactly as for bloom_init(), so a filter initialized with the
+ * same entries and error will find the same bits.  The bit field is not
+ * cleared, and bloom_free() will not free it.
+ *
+ * Parameters:
+ * -----------
+ *     bloom   - Pointer to an allocated struct bloom (see above).
+ *     entries - The expected number of entries which will be inserted.
+ *     error   - Probability of collision.
+ *     buf     - Storage for the bit field.
+ *     len     - Size of 'buf', at least bloom->bytes.
+ *
+ * Return:
+ * -------
+ *     0 - on success
+ *     1 - on failure, including 'buf' being too small
+ *
+ */
+int bloom_init_buffer(struct bloom * bloom, int entries, double error,
+                      unsigned char * buf, size_t len);
+
+
 /** ***************************************************************************
  * Deprecated, use bloom_init()
  *
@@ -56,6 +56,16 @@
 
 #include <unicode/ustring.h>
 #include <unicode/unorm2.h>
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define CHARSET_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ >= 5 || defined(__clang__))
+#define CHARSET_HAVE_AVX2
+#include <immintrin.h>
+#endif
 #include <unicode/utf8.h>
 
 #define U_REPLACEMENT   0xfffd
@@ -204,6 +214,8 @@ static void table_reset(struct convert_rock *rock, int to_uni);
 static void table_free(struct convert_rock *rock);
 
 typedef void convertproc_t(struct convert_rock *rock, uint32_t c);
+typedef void convertblockproc_t(struct convert_rock *rock,
+                                const uint32_t *c, size_t n);
 typedef void freeconvert_t(struct convert_rock *rock);
 typedef void flushproc_t(struct convert_rock *rock);
 
@@ -213,6 +225,7 @@ struct convert_rock {
     flushproc_t *flush;
     struct convert_rock *next;
     void *state;
+    convertblockproc_t *fblock;     /* optional, see convert_putblock */
 };
 
 #define GROWSIZE 100
@@ -220,6 +233,40 @@ struct convert_rock {
 int charset_debug;
 static const char *convert_name(struct convert_rock *rock);
 
+static int charset_fast_codecs = 1;
+
+/* Turn this off to make charset_decode(), charset_decode_mimebody() and
+ * charset_encode_mimebody() use the plain conversion chain and C
+ * encoder, e.g. to compare against in tests */
+EXPORTED void charset_set_fast_codecs(int enabled)
+{
+    charset_fast_codecs = enabled;
+}
+
+static int charset_block_convert = 1;
+
+/* Turn this off to pass one codepoint at a time between the stages of
+ * the conversion chain, even those with a block handler, e.g. to
+ * compare against in tests */
+EXPORTED void charset_set_block_convert(int enabled)
+{
+    charset_block_convert = enabled;
+}
+
+#ifdef CHARSET_HAVE_AVX2
+static int cpu_has_avx2(void)
+{
+    static int have = -1;
+
+    if (have < 0) {
+        __builtin_cpu_init();
+        have = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+
+    return have;
+}
+#endif
+
 #define XX 127
 /*
  * Table for decoding hexadecimal in quoted-printable
@@ -344,28 +391,104 @@ static inline void convert_putc(struct convert_rock *rock, uint32_t c)
     rock->f(rock, c);
 }
 
-static void convert_cat(struct convert_rock *rock, const char *s)
+/* Number of codepoints passed from one stage to the next at a time */
+#define CONVERT_BLOCK 256
+
+/*
+ * Stages which set 'fblock' take an array of codepoints at a time and
+ * collect what they emit in a struct convert_out, so the next stage
+ * is also called once per block rather than once per codepoint.
+ * Their 'f' just passes a single codepoint on to 'fblock'.
+ */
+struct convert_out {
+    struct convert_rock *next;
+    size_t n;
+    uint32_t c[CONVERT_BLOCK];
+};
+
+static void convert_putblock(struct convert_rock *rock,
+                             const uint32_t *c, size_t n)
 {
-    while (*s) {
-        convert_putc(rock, (unsigned char)*s);
-        s++;
+    size_t i;
+
+    if (rock->fblock && charset_block_convert && !charset_debug) {
+        rock->fblock(rock, c, n);
+        return;
+    }
+
+    for (i = 0; i < n; i++)
+        convert_putc(rock, c[i]);
+}
+
+static inline void out_init(struct convert_out *out,
+                            struct convert_rock *next)
+{
+    out->next = next;
+    out->n = 0;
+}
+
+static inline void out_flush(struct convert_out *out)
+{
+    if (out->n) {
+        convert_putblock(out->next, out->c, out->n);
+        out->n = 0;
+    }
+}
+
+static inline void out_putc(struct convert_out *out, uint32_t c)
+{
+    out->c[out->n++] = c;
+    if (out->n == CONVERT_BLOCK)
+        out_flush(out);
+}
+
+/* Pass on a run of codepoints unchanged */
+static inline void out_putn(struct convert_out *out,
+                            const uint32_t *c, size_t n)
+{
+    if (n < 32 && out->n + n < CONVERT_BLOCK) {
+        memcpy(out->c + out->n, c, n * sizeof(uint32_t));
+        out->n += n;
+        return;
     }
+
+    out_flush(out);
+    convert_putblock(out->next, c, n);
+}
+
+static void convert_putbytes(struct convert_rock *rock,
+                             const char *s, size_t len)
+{
+    uint32_t c[CONVERT_BLOCK];
+
+    while (len) {
+        size_t i, n = len < CONVERT_BLOCK ? len : CONVERT_BLOCK;
+
+        for (i = 0; i < n; i++)
+            c[i] = (unsigned char)s[i];
+        convert_putblock(rock, c, n);
+
+        s += n;
+        len -= n;
+    }
+}
+
+static void convert_cat(struct convert_rock *rock, const char *s)
+{
+    convert_putbytes(rock, s, strlen(s));
     convert_flush(rock);
 }
 
 static void convert_catn(struct convert_rock *rock, const char *s, size_t len)
 {
-    while (len-- > 0) {
-        convert_putc(rock, (unsigned char)*s);
-        s++;
-    }
+    convert_putbytes(rock, s, len);
     convert_flush(rock);
 }
 
 /* convertproc_t conversion functions */
-static void qp_flushline(struct convert_rock *rock, int endline)
+static void qp_flushline(struct qp_state *s, struct convert_out *out,
+                         int endline)
 {
-    struct qp_state *s = (struct qp_state *)rock->state;
     int i;
 
     /* strip trailing whitespace: RFC 2405 transport-padding */
@@ -384,28 +507,28 @@ static void qp_flushline(struct convert_rock *rock, int endline)
                 int val1 = HEXCHAR(s->buf[i+1]);
                 int val2 = HEXCHAR(s->buf[i+2]);
                 if (val1 != XX && val2 != XX) {
-                    convert_putc(rock->next, (val1<<4) + val2);
+                    out_putc(out, (val1<<4) + val2);
                     i += 2;
                     break;
                 }
             }
             /* otherwise too close to the end or invalid, just eject
              * a literal '=' and keep going */
-            convert_putc(rock->next, '=');
+            out_putc(out, '=');
             break;
         case '_':
             /* underscores are space in headers */
-            convert_putc(rock->next, s->isheader ? ' ' : '_');
+            out_putc(out, s->isheader ? ' ' : '_');
             break;
         default:
-            convert_putc(rock->next, s->buf[i]);
+            out_putc(out, s->buf[i]);
             break;
         }
     }
 
     if (endline) {
-        convert_putc(rock->next, '\r');
-        convert_putc(rock->next, '\n');
+        out_putc(out, '\r');
+        out_putc(out, '\n');
     }
 
     s->len = 0;
@@ -413,67 +536,116 @@ static void qp_flushline(struct convert_rock *rock, int endline)
 
 static void qp_flush(struct convert_rock *rock)
 {
-    qp_flushline(rock, 0);
+    struct convert_out out;
+
+    out_init(&out, rock->next);
+    qp_flushline((struct qp_state *)rock->state, &out, 0);
+    out_flush(&out);
 }
 
-static void qp2byte(struct convert_rock *rock, uint32_t c)
+static void qp2byte_block(struct convert_rock *rock,
+                          const uint32_t *c, size_t n)
 {
     struct qp_state *s = (struct qp_state *)rock->state;
+    struct convert_out out;
+    size_t i;
 
-    assert(c == U_REPLACEMENT || (unsigned)c <= 0xff);
+    out_init(&out, rock->next);
 
-    switch(c) {
-    case U_REPLACEMENT: /* just skip invalid characters */
-        break;
-    case '\r': // XXX - handle \r embedded in lines?
-        break;
-    case '\n':
-        qp_flushline(rock, 1);
-        break;
-    default:
-        s->buf[s->len++] = c;
-        /* really overlength line? just flush now */
-        if (s->len > 998)
-            qp_flushline(rock, 0);
-        break;
+    for (i = 0; i < n; i++) {
+        assert(c[i] == U_REPLACEMENT || (unsigned)c[i] <= 0xff);
+
+        switch(c[i]) {
+        case U_REPLACEMENT: /* just skip invalid characters */
+            break;
+        case '\r': // XXX - handle \r embedded in lines?
+            break;
+        case '\n':
+            qp_flushline(s, &out, 1);
+            break;
+        default:
+            s->buf[s->len++] = c[i];
+            /* really overlength line? just flush now */
+            if (s->len > 998)
+                qp_flushline(s, &out, 0);
+            break;
+        }
     }
+
+    out_flush(&out);
 }
 
-static void b64_2byte(struct convert_rock *rock, uint32_t c)
+static void qp2byte(struct convert_rock *rock, uint32_t c)
+{
+    qp2byte_block(rock, &c, 1);
+}
+
+static void b64_2byte_block(struct convert_rock *rock,
+                            const uint32_t *c, size_t n)
 {
     struct b64_state *s = (struct b64_state *)rock->state;
-    char b = CHAR64(c);
+    struct convert_out out;
+    size_t i = 0;
 
-    /* could just be whitespace, ignore it */
-    if (b == XX) return;
+    out_init(&out, rock->next);
 
-    /* the padding character, reset state */
-    if (b == 64) {
-        s->codepoint = 0;
-        s->bytesleft = 0;
-        return;
-    }
+    while (i < n) {
+        char b;
 
-    switch (s->bytesleft) {
-    case 0:
-        s->codepoint = b;
-        s->bytesleft = 3;
-        break;
-    case 3:
-        convert_putc(rock->next, ((s->codepoint << 2) | (b >> 4)) & 0xff);
-        s->codepoint = b;
-        s->bytesleft = 2;
-        break;
-    case 2:
-        convert_putc(rock->next, ((s->codepoint << 4) | (b >> 2)) & 0xff);
-        s->codepoint = b;
-        s->bytesleft = 1;
-        break;
-    case 1:
-        convert_putc(rock->next, ((s->codepoint << 6) | b) & 0xff);
-        s->codepoint = 0;
-        s->bytesleft = 0;
+        /* at a quantum boundary, decode whole groups of four at once */
+        while (!s->bytesleft && i + 4 <= n) {
+            unsigned char b0 = CHAR64(c[i]), b1 = CHAR64(c[i+1]);
+            unsigned char b2 = CHAR64(c[i+2]), b3 = CHAR64(c[i+3]);
+
+            if ((b0 | b1 | b2 | b3) & 0xc0) break;
+
+            out_putc(&out, ((b0 << 2) | (b1 >> 4)) & 0xff);
+            out_putc(&out, ((b1 << 4) | (b2 >> 2)) & 0xff);
+            out_putc(&out, ((b2 << 6) | b3) & 0xff);
+            i += 4;
+        }
+        if (i >= n) break;
+
+        b = CHAR64(c[i++]);
+
+        /* could just be whitespace, ignore it */
+        if (b == XX) continue;
+
+        /* the padding character, reset state */
+        if (b == 64) {
+            s->codepoint = 0;
+            s->bytesleft = 0;
+            continue;
+        }
+
+        switch (s->bytesleft) {
+        case 0:
+            s->codepoint = b;
+            s->bytesleft = 3;
+            break;
+        case 3:
+            out_putc(&out, ((s->codepoint << 2) | (b >> 4)) & 0xff);
+            s->codepoint = b;
+            s->bytesleft = 2;
+            break;
+        case 2:
+            out_putc(&out, ((s->codepoint << 4) | (b >> 2)) & 0xff);
+            s->codepoint = b;
+            s->bytesleft = 1;
+            break;
+        case 1:
+            out_putc(&out, ((s->codepoint << 6) | b) & 0xff);
+            s->codepoint = 0;
+            s->bytesleft = 0;
+        }
     }
+
+    out_flush(&out);
+}
+
+static void b64_2byte(struct convert_rock *rock, uint32_t c)
+{
+    b64_2byte_block(rock, &c, 1);
 }
 
 /*
@@ -524,15 +696,15 @@ static void unfold2uni(struct convert_rock *rock, uint32_t c)
  * decomposition, like U+2026 HORIZONTAL ELLIPSIS to the three
  * characters U+2E U+2E U+2E).
  */
-static void uni2searchform(struct convert_rock *rock, uint32_t c)
+static void uni2searchform_one(struct canon_state *s, struct convert_out *out,
+                               uint32_t c)
 {
-    struct canon_state *s = (struct canon_state *)rock->state;
     int i;
     int code;
     unsigned char table16, table8;
 
     if (c == U_REPLACEMENT) {
-        convert_putc(rock->next, c);
+        out_putc(out, c);
         return;
     }
 
@@ -540,7 +712,7 @@ static void uni2searchform(struct convert_rock *rock, uint32_t c)
 
     /* no translations */
     if (table16 == 255) {
-        convert_putc(rock->next, c);
+        out_putc(out, c);
         return;
     }
 
@@ -548,7 +720,7 @@ static void uni2searchform(struct convert_rock *rock, uint32_t c)
 
     /* no translations */
     if (table8 == 255) {
-        convert_putc(rock->next, c);
+        out_putc(out, c);
         return;
     }
 
@@ -583,7 +755,7 @@ static void uni2searchform(struct convert_rock *rock, uint32_t c)
             if (0x300 <= code && code <= 0x36f)
                 return;
         }
-        convert_putc(rock->next, code);
+        out_putc(out, code);
         return;
     }
 
@@ -599,10 +771,28 @@ static void uni2searchform(struct convert_rock *rock, uint32_t c)
                 continue;
         }
         /* note: whitespace already stripped from multichar sequences... */
-        convert_putc(rock->next, c);
+        out_putc(out, c);
     }
 }
 
+static void uni2searchform_block(struct convert_rock *rock,
+                                 const uint32_t *c, size_t n)
+{
+    struct canon_state *s = (struct canon_state *)rock->state;
+    struct convert_out out;
+    size_t i;
+
+    out_init(&out, rock->next);
+    for (i = 0; i < n; i++)
+        uni2searchform_one(s, &out, c[i]);
+    out_flush(&out);
+}
+
+static void uni2searchform(struct convert_rock *rock, uint32_t c)
+{
+    uni2searchform_block(rock, &c, 1);
+}
+
 /*
  * Given a Unicode codepoint, emit one or more Unicode codepoints in
  * HTML form, suitable for generating search snippets.
@@ -698,6 +888,17 @@ static void byte2search(struct convert_rock *rock, uint32_t c)
     s->offset++;
 }
 
+static void byte2search_block(struct convert_rock *rock,
+                              const uint32_t *c, size_t n)
+{
+    struct search_state *s = (struct search_state *)rock->state;
+    size_t i;
+
+    /* nothing more to learn once we have a match */
+    for (i = 0; i < n && !s->havematch; i++)
+        byte2search(rock, c[i]);
+}
+
 /* Given an octet, append it to a buffer */
 static void byte2buffer(struct convert_rock *rock, uint32_t c)
 {
@@ -706,6 +907,17 @@ static void byte2buffer(struct convert_rock *rock, uint32_t c)
     buf_putc(buf, c & 0xff);
 }
 
+static void byte2buffer_block(struct convert_rock *rock,
+                              const uint32_t *c, size_t n)
+{
+    struct buf *buf = (struct buf *)rock->state;
+    size_t i;
+
+    buf_ensure(buf, n);
+    for (i = 0; i < n; i++)
+        buf->s[buf->len++] = c[i] & 0xff;
+}
+
 /* Given an octet c and an icu converter, convert c to
  * its Unicode codepoint. During a flush, c is ignored.
  */
@@ -837,13 +1049,13 @@ static void uni2icu(struct convert_rock *rock, uint32_t c)
 
 /* Given an octet in a UTF-8 encoded string, possibly emit a Unicode
  * code point */
-static void utf8_2uni(struct convert_rock *rock, uint32_t c)
+static void utf8_2uni_one(struct charset_converter *s, struct convert_out *out,
+                          uint32_t c)
 {
-    struct charset_converter *s = (struct charset_converter *)rock->state;
 
     if (c == U_REPLACEMENT) {
 emit_replacement:
-        convert_putc(rock->next, U_REPLACEMENT);
+        out_putc(out, U_REPLACEMENT);
         s->bytesleft = 0;
         s->codepoint = 0;
         return;
@@ -883,7 +1095,7 @@ emit_replacement:
     if ((c & 0xf8) == 0xf0) { /* 11110xxx */
         /* first of a 4 char sequence */
         if (s->bytesleft)       /* incomplete sequence */
-            convert_putc(rock->next, U_REPLACEMENT);
+            out_putc(out, U_REPLACEMENT);
         if (c >= 0xf5 && c <= 0xf7) goto emit_replacement;
         s->bytesleft = 3;
         s->codepoint = c & 0x07; /* 00000111 */
@@ -891,14 +1103,14 @@ emit_replacement:
     else if ((c & 0xf0) == 0xe0) { /* 1110xxxx */
         /* first of a 3 char sequence */
         if (s->bytesleft)       /* incomplete sequence */
-            convert_putc(rock->next, U_REPLACEMENT);
+            out_putc(out, U_REPLACEMENT);
         s->bytesleft = 2;
         s->codepoint = c & 0x0f; /* 00001111 */
     }
     else if ((c & 0xe0) == 0xc0) { /* 110xxxxx */
         /* first of a 2 char sequence */
         if (s->bytesleft)       /* incomplete sequence */
-            convert_putc(rock->next, U_REPLACEMENT);
+            out_putc(out, U_REPLACEMENT);
         if (c == 0xc0 || c == 0xc1) goto emit_replacement;
         s->bytesleft = 1;
         s->codepoint = c & 0x1f; /* 00011111 */
@@ -909,7 +1121,7 @@ emit_replacement:
             s->codepoint = (s->codepoint << 6) + (c & 0x3f); /* 00111111 */
             s->bytesleft--;
             if (!s->bytesleft) {
-                convert_putc(rock->next, s->codepoint);
+                out_putc(out, s->codepoint);
                 s->codepoint = 0;
             }
         }
@@ -921,15 +1133,44 @@ emit_replacement:
     }
     else { /* plain ASCII char */
         if (s->bytesleft)       /* incomplete sequence */
-            convert_putc(rock->next, U_REPLACEMENT);
-        convert_putc(rock->next, c);
+            out_putc(out, U_REPLACEMENT);
+        out_putc(out, c);
         s->bytesleft = 0;
         s->codepoint = 0;
     }
 }
 
+static void utf8_2uni_block(struct convert_rock *rock,
+                            const uint32_t *c, size_t n)
+{
+    struct charset_converter *s = (struct charset_converter *)rock->state;
+    struct convert_out out;
+    size_t i = 0;
+
+    out_init(&out, rock->next);
+
+    while (i < n) {
+        /* runs of ASCII outside a sequence go through untouched */
+        if (!s->bytesleft && c[i] < 0x80) {
+            size_t j = i + 1;
+            while (j < n && c[j] < 0x80) j++;
+            out_putn(&out, c + i, j - i);
+            i = j;
+            continue;
+        }
+        utf8_2uni_one(s, &out, c[i++]);
+    }
+
+    out_flush(&out);
+}
+
+static void utf8_2uni(struct convert_rock *rock, uint32_t c)
+{
+    utf8_2uni_block(rock, &c, 1);
+}
+
 /* Given a Unicode codepoint, emit valid UTF-8 encoded octets */
-static void uni2utf8(struct convert_rock *rock, uint32_t c)
+static void uni2utf8_one(struct convert_out *out, uint32_t c)
 {
     if (!unicode_isvalid(c))
         c = U_REPLACEMENT;
@@ -939,44 +1180,86 @@ static void uni2utf8(struct convert_rock *rock, uint32_t c)
      * range. */
 
     if (c > 0xffff) {
-        convert_putc(rock->next, 0xF0 + ((c >> 18) & 0x07));
-        convert_putc(rock->next, 0x80 + ((c >> 12) & 0x3f));
-        convert_putc(rock->next, 0x80 + ((c >>  6) & 0x3f));
-        convert_putc(rock->next, 0x80 + ( c        & 0x3f));
+        out_putc(out, 0xF0 + ((c >> 18) & 0x07));
+        out_putc(out, 0x80 + ((c >> 12) & 0x3f));
+        out_putc(out, 0x80 + ((c >>  6) & 0x3f));
+        out_putc(out, 0x80 + ( c        & 0x3f));
     }
     else if (c > 0x7ff) {
-        convert_putc(rock->next, 0xE0 + ((c >> 12) & 0x0f));
-        convert_putc(rock->next, 0x80 + ((c >>  6) & 0x3f));
-        convert_putc(rock->next, 0x80 + ( c        & 0x3f));
+        out_putc(out, 0xE0 + ((c >> 12) & 0x0f));
+        out_putc(out, 0x80 + ((c >>  6) & 0x3f));
+        out_putc(out, 0x80 + ( c        & 0x3f));
     }
     else if (c > 0x7f) {
-        convert_putc(rock->next, 0xC0 + ((c >>  6) & 0x1f));
-        convert_putc(rock->next, 0x80 + ( c        & 0x3f));
+        out_putc(out, 0xC0 + ((c >>  6) & 0x1f));
+        out_putc(out, 0x80 + ( c        & 0x3f));
     }
     else {
-        convert_putc(rock->next, c);
+        out_putc(out, c);
     }
 }
 
+static void uni2utf8_block(struct convert_rock *rock,
+                           const uint32_t *c, size_t n)
+{
+    struct convert_out out;
+    size_t i = 0;
+
+    out_init(&out, rock->next);
+
+    while (i < n) {
+        if (c[i] < 0x80) {
+            size_t j = i + 1;
+            while (j < n && c[j] < 0x80) j++;
+            out_putn(&out, c + i, j - i);
+            i = j;
+            continue;
+        }
+        uni2utf8_one(&out, c[i++]);
+    }
+
+    out_flush(&out);
+}
+
+static void uni2utf8(struct convert_rock *rock, uint32_t c)
+{
+    uni2utf8_block(rock, &c, 1);
+}
+
 /* Given an octet which is a codepoint in some 7bit or 8bit character
  * set, or the Unicode replacement character, emit the corresponding
  * Unicode codepoint. */
-static void table2uni(struct convert_rock *rock, uint32_t c)
+static void table2uni_block(struct convert_rock *rock,
+                            const uint32_t *c, size_t n)
 {
     struct charset_converter *s = (struct charset_converter *)rock->state;
-    struct charmap *map;
+    struct convert_out out;
+    size_t i;
 
-    if (c == U_REPLACEMENT) {
-        convert_putc(rock->next, c);
-        return;
+    out_init(&out, rock->next);
+
+    for (i = 0; i < n; i++) {
+        struct charmap *map;
+
+        if (c[i] == U_REPLACEMENT) {
+            out_putc(&out, c[i]);
+            continue;
+        }
+
+        assert((unsigned)c[i] <= 0xff);
+        map = (struct charmap *)&s->curtable[0][c[i] & 0xff];
+        if (map->c)
+            out_putc(&out, map->c);
+
+        s->curtable = s->initialtable + map->next;
     }
 
-    assert((unsigned)c <= 0xff);
-    map = (struct charmap *)&s->curtable[0][c & 0xff];
-    if (map->c)
-        convert_putc(rock->next, map->c);
+    out_flush(&out);
+}
 
-    s->curtable = s->initialtable + map->next;
+static void table2uni(struct convert_rock *rock, uint32_t c)
+{
+    table2uni_block(rock, &c, 1);
 }
 
 /*
@@ -1625,6 +1908,7 @@ static void icu_reset(struct convert_rock *rock, int to_uni)
     s->src_next = s->src_base;
 
     rock->f = to_uni ? icu2uni : uni2icu;
+    rock->fblock = NULL;
     rock->flush = icu_flush;
     rock->cleanup = icu_free;
 }
@@ -1644,12 +1928,14 @@ static void table_reset(struct convert_rock *rock, int to_uni)
     }
     if (strstr(chartables_charset_table[s->num].name, "utf-8")) {
         rock->f = to_uni ? utf8_2uni : uni2utf8;
+        rock->fblock = to_uni ? utf8_2uni_block : uni2utf8_block;
     } else {
         /* A truly table-based converter may never convert from Unicode
          * to its charmap. This has been implicitly assumed in the existing
          * code, but let's be explicit here. */
         assert(to_uni);
         rock->f = table2uni;
+        rock->fblock = table2uni_block;
     }
     s->bytesleft = 0;
     s->codepoint = 0;
@@ -1740,6 +2026,7 @@ static struct convert_rock *qp_init(int isheader, struct convert_rock *next)
     s->isheader = isheader;
     rock->state = (void *)s;
     rock->f = qp2byte;
+    rock->fblock = qp2byte_block;
     rock->flush = qp_flush;
     rock->next = next;
     return rock;
@@ -1750,6 +2037,7 @@ static struct convert_rock *b64_init(struct convert_rock *next)
     struct convert_rock *rock = xzmalloc(sizeof(struct convert_rock));
     rock->state = xzmalloc(sizeof(struct b64_state));
     rock->f = b64_2byte;
+    rock->fblock = b64_2byte_block;
     rock->next = next;
     return rock;
 }
@@ -1772,8 +2060,10 @@ static struct convert_rock *canon_init(int flags, struct convert_rock *next)
     s->flags = flags;
     if ((flags & CHARSET_KEEPCASE))
         rock->f = uni2html;
-    else
+    else {
         rock->f = uni2searchform;
+        rock->fblock = uni2searchform_block;
+    }
     rock->state = s;
     rock->next = next;
     return rock;
@@ -1820,6 +2110,7 @@ static struct convert_rock *search_init(const char *substr, comp_pat *pat) {
 
     /* set up the rock */
     rock->f = byte2search;
+    rock->fblock = byte2search_block;
     rock->cleanup = search_free;
     rock->state = (void *)s;
 
@@ -1834,6 +2125,7 @@ static struct convert_rock *buffer_init(size_t hint)
     if (hint) buf_ensure(buf, hint);
 
     rock->f = byte2buffer;
+    rock->fblock = byte2buffer_block;
     rock->cleanup = buffer_free;
     rock->state = (void *)buf;
 
@@ -2306,6 +2598,265 @@ EXPORTED char *charset_to_utf8(const char *msg_base, size_t len, charset_t chars
 }
 
 /* Decode bytes from src into buffer dst */
+/*
+ * Base64 and quoted-printable decoding straight from bytes to bytes,
+ * for callers which don't need any charset conversion.  These give
+ * exactly the same results as b64_2byte() and qp2byte(), including
+ * how they deal with junk, but skip the conversion chain.
+ */
+
+#ifdef CHARSET_HAVE_AVX2
+/* Decode 32 base64 characters to 24 bytes at a time, until a block
+ * has anything but the 64 base64 characters in it (line breaks,
+ * padding or junk).  Writes 8 bytes beyond what it decodes.
+ *
+ * This is the algorithm of Wojciech Mula and Daniel Lemire. */
+__attribute__((target("avx2")))
+static void b64_decode_avx2(const unsigned char **srcp,
+                            const unsigned char *end, unsigned char **dstp)
+{
+    const unsigned char *s = *srcp;
+    unsigned char *d = *dstp;
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+    const __m256i pack = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+
+    while (end - s >= 32) {
+        __m256i in = _mm256_loadu_si256((const __m256i *)s);
+        __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask_2f);
+        __m256i lo_nibbles = _mm256_and_si256(in, mask_2f);
+        __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        __m256i eq_2f, roll, out;
+
+        if (!_mm256_testz_si256(lo, hi))
+            break;
+
+        eq_2f = _mm256_cmpeq_epi8(in, mask_2f);
+        roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+        in = _mm256_add_epi8(in, roll);
+
+        out = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+        out = _mm256_madd_epi16(out, _mm256_set1_epi32(0x00011000));
+        out = _mm256_shuffle_epi8(out, pack);
+        out = _mm256_permutevar8x32_epi32(out, lanes);
+        _mm256_storeu_si256((__m256i *)d, out);
+
+        s += 32;
+        d += 24;
+    }
+
+    *srcp = s;
+    *dstp = d;
+}
+
+/* Encode 24 bytes to 32 base64 characters.  Reads the 4 bytes before
+ * 's' and the 4 after the 24 too. */
+__attribute__((target("avx2")))
+static void b64_encode_avx2(const unsigned char *s, char *d)
+{
+    __m256i in = _mm256_loadu_si256((const __m256i *)(s - 4));
+    __m256i t0, t1, t2, t3, idx, out;
+
+    /* spread each 3 bytes over 4, then each 6 bits into its own byte */
+    in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+        14, 15, 13, 14, 11, 12, 10, 11, 8, 9, 7, 8, 5, 6, 4, 5));
+    t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    in = _mm256_or_si256(t1, t3);
+
+    /* and map 0..63 to the alphabet */
+    idx = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+    idx = _mm256_sub_epi8(idx, _mm256_cmpgt_epi8(in, _mm256_set1_epi8(25)));
+    out = _mm256_add_epi8(in, _mm256_shuffle_epi8(_mm256_setr_epi8(
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0), idx));
+
+    _mm256_storeu_si256((__m256i *)d, out);
+}
+#endif /* CHARSET_HAVE_AVX2 */
+
+static void b64_decode_buf(struct buf *dst, const char *src, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)src;
+    const unsigned char *end = s + len;
+    unsigned char *d;
+    int bytesleft = 0, codepoint = 0;
+#ifdef CHARSET_HAVE_AVX2
+    int avx2 = cpu_has_avx2();
+#endif
+
+    /* three bytes for every four characters, plus room for the
+     * vector code to write past the end */
+    buf_ensure(dst, (len / 4) * 3 + 32);
+    d = (unsigned char *)dst->s + dst->len;
+
+    while (s < end) {
+        char b;
+
+        if (!bytesleft) {
+#ifdef CHARSET_HAVE_AVX2
+            if (avx2) b64_decode_avx2(&s, end, &d);
+#endif
+            while (end - s >= 4) {
+                unsigned char b0 = CHAR64(s[0]), b1 = CHAR64(s[1]);
+                unsigned char b2 = CHAR64(s[2]), b3 = CHAR64(s[3]);
+
+                if ((b0 | b1 | b2 | b3) & 0xc0) break;
+
+                *d++ = (b0 << 2) | (b1 >> 4);
+                *d++ = (b1 << 4) | (b2 >> 2);
+                *d++ = (b2 << 6) | b3;
+                s += 4;
+            }
+            if (s >= end) break;
+        }
+
+        /* same as b64_2byte() from here on */
+        b = CHAR64(*s++);
+        if (b == XX) continue;
+
+        if (b == 64) {
+            codepoint = 0;
+            bytesleft = 0;
+            continue;
+        }
+
+        switch (bytesleft) {
+        case 0:
+            codepoint = b;
+            bytesleft = 3;
+            break;
+        case 3:
+            *d++ = ((codepoint << 2) | (b >> 4)) & 0xff;
+            codepoint = b;
+            bytesleft = 2;
+            break;
+        case 2:
+            *d++ = ((codepoint << 4) | (b >> 2)) & 0xff;
+            codepoint = b;
+            bytesleft = 1;
+            break;
+        case 1:
+            *d++ = ((codepoint << 6) | b) & 0xff;
+            codepoint = 0;
+            bytesleft = 0;
+        }
+    }
+
+    dst->len = d - (unsigned char *)dst->s;
+}
+
+/* Decode one body line which has had its CRs removed, like
+ * qp_flushline() does */
+static void qp_decode_line(struct buf *dst, const char *s, size_t len,
+                           int endline)
+{
+    const char *end;
+
+    /* strip trailing whitespace: RFC 2405 transport-padding */
+    while (len && (s[len-1] == ' ' || s[len-1] == '\t'))
+        len--;
+    end = s + len;
+
+    while (s < end) {
+        const char *eq = memchr(s, '=', end - s);
+
+        if (!eq) {
+            buf_appendmap(dst, s, end - s);
+            break;
+        }
+        buf_appendmap(dst, s, eq - s);
+        s = eq;
+
+        if (s + 1 >= end) {
+            /* soft linebreak */
+            endline = 0;
+            break;
+        }
+        if (s + 2 < end) {
+            int val1 = HEXCHAR(s[1]);
+            int val2 = HEXCHAR(s[2]);
+            if (val1 != XX && val2 != XX) {
+                buf_putc(dst, (val1 << 4) + val2);
+                s += 3;
+                continue;
+            }
+        }
+        /* otherwise too close to the end or invalid, just eject
+         * a literal '=' and keep going */
+        buf_putc(dst, '=');
+        s++;
+    }
+
+    if (endline)
+        buf_appendmap(dst, "\r\n", 2);
+}
+
+static void qp_decode_buf(struct buf *dst, const char *src, size_t len)
+{
+    const char *p = src, *end = src + len;
+    char line[1000];
+    size_t n = 0;
+
+    buf_ensure(dst, len);
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *eol = nl ? nl : end;
+        const char *q = eol;
+
+        /* the usual case: a whole line, CRLF or not, decoded in place */
+        if (!n && q > p && q[-1] == '\r') q--;
+        if (!n && q - p <= 998 && !memchr(p, '\r', q - p)) {
+            if (nl)
+                qp_decode_line(dst, p, q - p, 1);
+            else {
+                memcpy(line, p, q - p);
+                n = q - p;
+            }
+        }
+        else {
+            /* gather it without CRs, flushing overlong lines like
+             * qp2byte() does */
+            for (q = p; q < eol; q++) {
+                if (*q == '\r') continue;
+                line[n++] = *q;
+                if (n > 998) {
+                    qp_decode_line(dst, line, n, 0);
+                    n = 0;
+                }
+            }
+            if (nl) {
+                qp_decode_line(dst, line, n, 1);
+                n = 0;
+            }
+        }
+
+        p = nl ? nl + 1 : end;
+    }
+
+    qp_decode_line(dst, line, n, 0);
+}
+
 EXPORTED int charset_decode(struct buf *dst, const char *src, size_t len, int encoding)
 {
     struct convert_rock *input;
@@ -2318,6 +2869,16 @@ EXPORTED int charset_decode(struct buf *dst, const char *src, size_t len, int en
         return 0;
     }
 
+    /* no charset to convert, so skip the conversion chain */
+    if (charset_fast_codecs && encoding == ENCODING_BASE64) {
+        b64_decode_buf(dst, src, len);
+        return 0;
+    }
+    if (charset_fast_codecs && encoding == ENCODING_QP) {
+        qp_decode_buf(dst, src, len);
+        return 0;
+    }
+
     /* set up the conversion path */
     input = buffer_init(len);
     buffer_setbuf(input, dst);
@@ -2687,6 +3248,316 @@ EXPORTED int charset_search_mimeheader(const char *substr, comp_pat *pat,
     return res;
 }
 
+/*
+ * Fast path for searching text which is plain ASCII.
+ *
+ * For ASCII input the conversion chain maps each byte to at most one
+ * codepoint, so rather than pushing every byte through it we fold
+ * bytes with a per-flags table and only verify the positions where
+ * the first (and last) byte of the pattern could match.  Candidates
+ * are found 16 or 32 bytes at a time where the CPU allows.  Anything
+ * that isn't ASCII makes a negative answer inconclusive, and the
+ * caller then runs the full pipeline.
+ */
+
+enum {
+    FOLD_CHAR = 0,      /* one ASCII codepoint, in fold->out */
+    FOLD_SPACE,         /* ' ', merged with adjacent FOLD_SPACE bytes */
+    FOLD_DROP,          /* no output at all */
+    FOLD_OTHER          /* anything else: leave it to the pipeline */
+};
+
+struct ascii_fold {
+    int flags;
+    int valid;
+    int has_other;      /* some byte is FOLD_OTHER */
+    int drop_only_nul;  /* no byte but NUL is FOLD_DROP */
+    unsigned char cls[128];
+    unsigned char out[128];
+};
+
+struct fold_capture {
+    int n;
+    uint32_t c;
+};
+
+static void uni2capture(struct convert_rock *rock, uint32_t c)
+{
+    struct fold_capture *cap = (struct fold_capture *)rock->state;
+
+    if (!cap->n++) cap->c = c;
+}
+
+static const struct ascii_fold *ascii_fold_get(int flags)
+{
+    static struct ascii_fold fold;
+    struct fold_capture cap;
+    struct canon_state cs;
+    struct convert_rock capture = { uni2capture, NULL, NULL, NULL, &cap };
+    struct convert_rock canon = { NULL, NULL, NULL, &capture, &cs };
+    int b;
+
+    if (fold.valid && fold.flags == flags)
+        return &fold;
+
+    canon.f = (flags & CHARSET_KEEPCASE) ? uni2html : uni2searchform;
+    fold.flags = flags;
+    fold.has_other = 0;
+    fold.drop_only_nul = 1;
+
+    for (b = 0; b < 128; b++) {
+        cs.flags = flags;
+        cs.seenspace = 0;
+        cap.n = 0;
+        convert_putc(&canon, b);
+
+        if (!cap.n) {
+            fold.cls[b] = FOLD_DROP;
+            if (b) fold.drop_only_nul = 0;
+        }
+        else if (cap.n > 1 || cap.c >= 0x80) {
+            fold.cls[b] = FOLD_OTHER;
+            fold.has_other = 1;
+        }
+        else {
+            fold.out[b] = cap.c;
+            /* a second one straight after tells us if it merges */
+            cap.n = 0;
+            convert_putc(&canon, b);
+            fold.cls[b] = cap.n ? FOLD_CHAR : FOLD_SPACE;
+        }
+    }
+
+    fold.valid = 1;
+    return &fold;
+}
+
+/* The bytes which fold to 'c', if there are no more than two */
+static int ascii_fold_bytes(const struct ascii_fold *fold, unsigned char c,
+                            unsigned char *b1, unsigned char *b2)
+{
+    int b, n = 0;
+
+    for (b = 0; b < 128; b++) {
+        if (fold->cls[b] != FOLD_CHAR || fold->out[b] != c)
+            continue;
+        if (n == 0) *b1 = *b2 = b;
+        else if (n == 1) *b2 = b;
+        else return 0;
+        n++;
+    }
+
+    return n;
+}
+
+struct ascii_scan {
+    const unsigned char *s;
+    size_t len;
+    size_t last;        /* offset of the second byte tested */
+    unsigned char a1, a2;   /* bytes allowed at the candidate */
+    unsigned char b1, b2;   /* bytes allowed at candidate + last */
+    unsigned char z;        /* byte which counts as irregular, with 8-bit */
+    int irregular;
+};
+
+typedef size_t ascii_scanproc_t(struct ascii_scan *sc, size_t i);
+
+/* Return the first candidate at or after 'i', or sc->len if none.
+ * Every byte from 'i' up to the returned offset has been checked
+ * for irregularity. */
+static size_t ascii_scan_generic(struct ascii_scan *sc, size_t i)
+{
+    const unsigned char *s = sc->s;
+
+    for (; i + sc->last < sc->len; i++) {
+        if (s[i] >= 0x80 || s[i] == sc->z)
+            sc->irregular = 1;
+        if ((s[i] == sc->a1 || s[i] == sc->a2) &&
+            (s[i + sc->last] == sc->b1 || s[i + sc->last] == sc->b2))
+            return i;
+    }
+    /* the tail can't start a match, but may still be irregular */
+    for (; i < sc->len; i++) {
+        if (s[i] >= 0x80 || s[i] == sc->z)
+            sc->irregular = 1;
+    }
+
+    return sc->len;
+}
+
+#ifdef CHARSET_HAVE_SSE2
+static size_t ascii_scan_sse2(struct ascii_scan *sc, size_t i)
+{
+    const __m128i a1 = _mm_set1_epi8(sc->a1), a2 = _mm_set1_epi8(sc->a2);
+    const __m128i b1 = _mm_set1_epi8(sc->b1), b2 = _mm_set1_epi8(sc->b2);
+    const __m128i z = _mm_set1_epi8(sc->z);
+    __m128i irr = _mm_setzero_si128();
+
+    for (; i + sc->last + 16 <= sc->len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(sc->s + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(sc->s + i + sc->last));
+        __m128i m = _mm_and_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(x, a1), _mm_cmpeq_epi8(x, a2)),
+            _mm_or_si128(_mm_cmpeq_epi8(y, b1), _mm_cmpeq_epi8(y, b2)));
+        int bits = _mm_movemask_epi8(m);
+
+        irr = _mm_or_si128(irr, _mm_or_si128(x, _mm_cmpeq_epi8(x, z)));
+        if (bits) {
+            if (_mm_movemask_epi8(irr)) sc->irregular = 1;
+            return i + __builtin_ctz(bits);
+        }
+    }
+    if (_mm_movemask_epi8(irr)) sc->irregular = 1;
+
+    return ascii_scan_generic(sc, i);
+}
+#endif /* CHARSET_HAVE_SSE2 */
+
+#ifdef CHARSET_HAVE_AVX2
+__attribute__((target("avx2")))
+static size_t ascii_scan_avx2(struct ascii_scan *sc, size_t i)
+{
+    const __m256i a1 = _mm256_set1_epi8(sc->a1), a2 = _mm256_set1_epi8(sc->a2);
+    const __m256i b1 = _mm256_set1_epi8(sc->b1), b2 = _mm256_set1_epi8(sc->b2);
+    const __m256i z = _mm256_set1_epi8(sc->z);
+    __m256i irr = _mm256_setzero_si256();
+
+    for (; i + sc->last + 32 <= sc->len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(sc->s + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(sc->s + i + sc->last));
+        __m256i m = _mm256_and_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(x, a1), _mm256_cmpeq_epi8(x, a2)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(y, b1), _mm256_cmpeq_epi8(y, b2)));
+        unsigned bits = _mm256_movemask_epi8(m);
+
+        irr = _mm256_or_si256(irr, _mm256_or_si256(x, _mm256_cmpeq_epi8(x, z)));
+        if (bits) {
+            if (_mm256_movemask_epi8(irr)) sc->irregular = 1;
+            return i + __builtin_ctz(bits);
+        }
+    }
+    if (_mm256_movemask_epi8(irr)) sc->irregular = 1;
+
+    return ascii_scan_generic(sc, i);
+}
+#endif /* CHARSET_HAVE_AVX2 */
+
+static ascii_scanproc_t *ascii_scan_impl(void)
+{
+    static ascii_scanproc_t *impl;
+
+    if (!impl) {
+        impl = ascii_scan_generic;
+#ifdef CHARSET_HAVE_SSE2
+        impl = ascii_scan_sse2;
+#endif
+#ifdef CHARSET_HAVE_AVX2
+        if (cpu_has_avx2())
+            impl = ascii_scan_avx2;
+#endif
+    }
+
+    return impl;
+}
+
+/* Does the folded text starting at s[i] begin with pat?  s[i] is
+ * already known to fold to pat[0], which isn't a space. */
+static int ascii_match_at(const struct ascii_fold *fold,
+                          const unsigned char *pat, size_t patlen,
+                          const unsigned char *s, size_t len, size_t i)
+{
+    size_t j = 1;
+    int seenspace = 0;
+
+    for (i++; j < patlen; i++) {
+        unsigned char c;
+
+        if (i >= len || s[i] >= 0x80)
+            return 0;
+
+        switch (fold->cls[s[i]]) {
+        case FOLD_CHAR:
+            c = fold->out[s[i]];
+            seenspace = 0;
+            break;
+        case FOLD_SPACE:
+            if (seenspace) continue;
+            c = ' ';
+            seenspace = 1;
+            break;
+        case FOLD_DROP:
+            continue;
+        default:
+            return 0;
+        }
+
+        if (c != pat[j++])
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Does 'cs' encode ASCII characters as themselves, one byte each? */
+static int charset_is_ascii_superset(charset_t cs)
+{
+    const char *name = charset_canon_name(cs);
+
+    return !strcasecmp(name, "utf-8") || !strcasecmp(name, "us-ascii");
+}
+
+/*
+ * Search for the search-normalised pattern 'substr' in ASCII text.
+ * Returns 1 if found, 0 if definitely not there, or -1 if the
+ * answer depends on something the fast path doesn't handle.
+ */
+static int search_ascii(const char *substr, const char *s, size_t len,
+                        int flags)
+{
+    const struct ascii_fold *fold = ascii_fold_get(flags);
+    const unsigned char *pat = (const unsigned char *)substr;
+    size_t patlen = strlen(substr);
+    ascii_scanproc_t *scan = ascii_scan_impl();
+    struct ascii_scan sc;
+    int merges = 0;
+    size_t i;
+
+    for (i = 0; i < patlen; i++) {
+        if (pat[i] >= 0x80) return -1;
+    }
+    if (memchr(pat, ' ', patlen)) {
+        for (i = 0; i < 128; i++) {
+            if (fold->cls[i] == FOLD_SPACE) merges = 1;
+        }
+    }
+
+    memset(&sc, 0, sizeof(sc));
+    sc.s = (const unsigned char *)s;
+    sc.len = len;
+    if (!ascii_fold_bytes(fold, pat[0], &sc.a1, &sc.a2))
+        return -1;
+
+    /* Testing the last byte too is only safe when a match covers
+     * exactly patlen bytes; a NUL in the text then makes us unsure */
+    if (patlen > 1 && !merges && fold->drop_only_nul &&
+        ascii_fold_bytes(fold, pat[patlen-1], &sc.b1, &sc.b2)) {
+        sc.last = patlen - 1;
+        sc.z = 0;
+    }
+    else {
+        sc.b1 = sc.a1;
+        sc.b2 = sc.a2;
+        sc.z = 0x80;
+    }
+
+    for (i = 0; (i = scan(&sc, i)) < len; i++) {
+        if (ascii_match_at(fold, pat, patlen, sc.s, len, i))
+            return 1;
+    }
+
+    return (sc.irregular || fold->has_other) ? -1 : 0;
+}
+
 /* Compile a search pattern for later comparison.  We just count
  * how long the string is, and how many times the first character
  * occurs.  Later optimisation could reduce the max_start by
@@ -2727,9 +3598,12 @@ EXPORTED int charset_searchstring(const char *substr, comp_pat *pat,
     if (!substr[0])
         return 1; /* zero length string always matches */
 
+    int res = search_ascii(substr, s, len, flags);
+    if (res >= 0)
+        return res;
+
     struct convert_rock *tosearch;
     struct convert_rock *input;
-    int res;
     charset_t utf8from, utf8to;
     utf8from = charset_lookupname("utf-8");
     utf8to = charset_lookupname("utf-8");
@@ -2742,10 +3616,12 @@ EXPORTED int charset_searchstring(const char *substr, comp_pat *pat,
     input = canon_init(flags, input);
     input = convert_init(utf8from, 1/*to_uni*/, input);
 
-    /* feed the handler */
-    while (len-- > 0) {
-        convert_putc(input, (unsigned char)*s++);
-        if (search_havematch(tosearch)) break; /* shortcut if there's a match */
+    /* feed the handler, a block at a time */
+    while (len > 0 && !search_havematch(tosearch)) {
+        size_t n = len < CONVERT_BLOCK ? len : CONVERT_BLOCK;
+        convert_putbytes(input, s, n);
+        s += n;
+        len -= n;
     }
 
     /* copy the value */
@@ -2782,6 +3658,13 @@ EXPORTED int charset_searchfile(const char *substr, comp_pat *pat,
     if (strlen(substr) == 0)
         return 1;
 
+    /* unencoded ASCII doesn't need converting to search it */
+    if (encoding == ENCODING_NONE && charset_is_ascii_superset(charset)) {
+        res = search_ascii(substr, msg_base, len, flags);
+        if (res >= 0)
+            return res;
+    }
+
     /* set up the conversion path */
     utf8 = charset_lookupname("utf-8");
     tosearch = search_init(substr, pat);
@@ -2812,10 +3695,10 @@ EXPORTED int charset_searchfile(const char *substr, comp_pat *pat,
         return 0;
     }
 
-    /* implement the loop here so we can check on the search each time */
-    for (i = 0; i < len; i++) {
-        convert_putc(input, (unsigned char)msg_base[i]);
-        if (search_havematch(tosearch)) break;
+    /* implement the loop here so we can check on the search each block */
+    for (i = 0; i < len && !search_havematch(tosearch); i += CONVERT_BLOCK) {
+        convert_putbytes(input, msg_base + i,
+                         len - i < CONVERT_BLOCK ? len - i : CONVERT_BLOCK);
     }
 
     res = search_havematch(tosearch); /* copy before we free it */
@@ -2891,8 +3774,9 @@ EXPORTED int charset_extract(void (*cb)(const struct buf *, void *),
     /* point to the buffer for easy block sending */
     out = (struct buf *)tobuffer->state;
 
-    for (i = 0; i < data->len; i++) {
-        convert_putc(input, (unsigned char)data->s[i]);
+    for (i = 0; i < data->len; i += CONVERT_BLOCK) {
+        convert_putbytes(input, data->s + i, data->len - i < CONVERT_BLOCK ?
+                                             data->len - i : CONVERT_BLOCK);
 
         /* process a block of output every so often */
         if (buf_len(out) > 4096) {
@@ -2936,13 +3820,20 @@ EXPORTED const char *charset_decode_mimebody(const char *msg_base, size_t len, i
         return msg_base;
 
     case ENCODING_QP:
-        tobuffer = buffer_init(len);
-        input = qp_init(0, tobuffer);
-        break;
-
     case ENCODING_BASE64:
+        if (charset_fast_codecs && len) {
+            struct buf buf = BUF_INITIALIZER;
+
+            charset_decode(&buf, msg_base, len, encoding);
+            *outlen = buf.len;
+            *decbuf = buf_release(&buf);
+            goto done;
+        }
         tobuffer = buffer_init(len);
-        input = b64_init(tobuffer);
+        if (encoding == ENCODING_QP)
+            input = qp_init(0, tobuffer);
+        else
+            input = b64_init(tobuffer);
         break;
 
     default:
@@ -2961,6 +3852,7 @@ EXPORTED const char *charset_decode_mimebody(const char *msg_base, size_t len, i
 
     convert_free(input);
 
+ done:
     if (!*decbuf) {
         /* didn't get a result - maybe blank input, don't return NULL */
         *outlen = len;
@@ -2994,6 +3886,9 @@ EXPORTED char *charset_encode_mimebody(const char *msg_base, size_t len,
     unsigned char s0, s1, s2;
     char *d;
     int b64_len, b64_lines, cnt;
+#ifdef CHARSET_HAVE_AVX2
+    int avx2;
+#endif
 
     b64_len = ((len + 2) / 3) * 4;
     if (wrap) {
@@ -3009,6 +3904,10 @@ EXPORTED char *charset_encode_mimebody(const char *msg_base, size_t len,
 
     if (!msg_base) return NULL;
 
+#ifdef CHARSET_HAVE_AVX2
+    avx2 = charset_fast_codecs && cpu_has_avx2();
+#endif
+
     for (s = (const unsigned char*) msg_base, d = retval, cnt = 0; len;
          s += 3, d += 4, cnt += 4) { /* process tuplets */
         if (wrap && cnt == ENCODED_MAX_LINE_LEN) {
@@ -3018,6 +3917,19 @@ EXPORTED char *charset_encode_mimebody(const char *msg_base, size_t len,
             *d++ = '\n';
         }
 
+#ifdef CHARSET_HAVE_AVX2
+        /* 8 tuplets at a time, when they fit on the line and the
+         * vector code may read a little either side of them */
+        while (avx2 && len >= 28 && s >= (const unsigned char *)msg_base + 4 &&
+               (!wrap || cnt + 32 < ENCODED_MAX_LINE_LEN)) {
+            b64_encode_avx2(s, d);
+            s += 24;
+            d += 32;
+            cnt += 32;
+            len -= 24;
+        }
+#endif
+
         s0 = s[0];
         s1 = --len ? s[1] : 0;
         /* byte 1: high 6 bits (1) */
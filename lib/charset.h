@@ -158,4 +158,10 @@ struct char_counts {
  * in the first INT32_MAX bytes of data. */
 extern struct char_counts charset_count_validutf8(const char *data, size_t datalen);
 
+/* use the vectorised base64 and quoted-printable codecs (default on) */
+extern void charset_set_fast_codecs(int enabled);
+
+/* pass blocks of codepoints between conversion stages (default on) */
+extern void charset_set_block_convert(int enabled);
+
 #endif /* INCLUDED_CHARSET_H */
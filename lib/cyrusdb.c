@@ -297,6 +297,30 @@ EXPORTED int cyrusdb_forone(struct db *db,
     return r;
 }
 
+EXPORTED int cyrusdb_fetchmany(struct db *db,
+               const bufarray_t *keys,
+               foreach_cb *cb, void *rock,
+               struct txn **tid)
+{
+    size_t i;
+    int r = 0;
+
+#ifdef DEBUGDB
+    syslog(LOG_NOTICE, "DEBUGDB fetchmany(%llx, %llu keys)\n", (long long unsigned)db->engine, (long long unsigned)bufarray_size(keys));
+#endif
+    if (db->backend->fetchmany)
+        return db->backend->fetchmany(db->engine, keys, cb, rock, tid);
+
+    /* one at a time, then */
+    for (i = 0; !r && i < bufarray_size(keys); i++) {
+        const struct buf *key = bufarray_nth(keys, i);
+        if (!key->len) continue;
+        r = cyrusdb_forone(db, key->s, key->len, NULL, cb, rock, tid);
+    }
+
+    return r;
+}
+
 EXPORTED int cyrusdb_create(struct db *db,
               const char *key, size_t keylen,
               const char *data, size_t datalen,
@@ -373,6 +397,21 @@ EXPORTED int cyrusdb_repack(struct db *db)
     return db->backend->repack(db->engine);
 }
 
+static cyrusdb_repack_cb *repack_cb = NULL;
+static void *repack_rock = NULL;
+
+EXPORTED void cyrusdb_set_repack_progress(cyrusdb_repack_cb *cb, void *rock)
+{
+    repack_cb = cb;
+    repack_rock = rock;
+}
+
+/* called by the backends as the repack proceeds */
+EXPORTED void cyrusdb_repack_progress(const struct cyrusdb_repack_progress *progress)
+{
+    if (repack_cb) repack_cb(progress, repack_rock);
+}
+
 EXPORTED int cyrusdb_compar(struct db *db,
                    const char *a, int alen,
                    const char *b, int blen)
@@ -43,6 +43,7 @@
 #define INCLUDED_CYRUSDB_H
 
 #include <stdio.h>
+#include "bufarray.h"
 #include "strarray.h"
 
 struct db;
@@ -76,7 +77,9 @@ enum cyrusdb_openflags {
     CYRUSDB_CONVERT   = 0x04,    /* Convert to the named format if not already */
     CYRUSDB_NOCOMPACT = 0x08,    /* Don't run any database compaction routines */
     CYRUSDB_SHARED    = 0x10,    /* Open in shared lock mode */
-    CYRUSDB_NOCRC     = 0x20     /* Don't check CRC32 on read */
+    CYRUSDB_NOCRC     = 0x20,    /* Don't check CRC32 on read */
+    CYRUSDB_BLOOM     = 0x40     /* Mostly probed for missing keys, so keep
+                                    a bloom filter if the backend can */
 };
 
 typedef int foreach_p(void *rock,
@@ -223,6 +226,22 @@ struct cyrusdb_backend {
     int (*repack)(struct dbengine *db);
     int (*compar)(struct dbengine *db, const char *s1, int l1,
                   const char *s2, int l2);
+
+    /* fetchmany: look up each of 'keys' and call 'cb' for the ones
+       which exist, in the order given.  Missing and empty keys are
+       skipped.
+
+       Keys should be sorted in database order (see cyrusdb_compar)
+       so that the backend can walk forwards from one to the next
+       rather than searching from the top every time, but any order
+       gives the right answer.  'tid' works as for fetch, and 'cb'
+       follows the same rules as for foreach.
+
+       NULL means cyrusdb_fetchmany() just calls fetch for each key */
+    int (*fetchmany)(struct dbengine *mydb,
+                     const bufarray_t *keys,
+                     foreach_cb *cb, void *rock,
+                     struct txn **tid);
 };
 
 extern int cyrusdb_copyfile(const char *srcname, const char *dstname);
@@ -278,6 +297,10 @@ extern int cyrusdb_forone(struct db *db,
                            foreach_p *p,
                            foreach_cb *cb, void *rock,
                            struct txn **tid);
+extern int cyrusdb_fetchmany(struct db *db,
+                             const bufarray_t *keys,
+                             foreach_cb *cb, void *rock,
+                             struct txn **tid);
 int cyrusdb_create(struct db *db,
                           const char *key, size_t keylen,
                           const char *data, size_t datalen,
@@ -294,6 +317,31 @@ extern int cyrusdb_abort(struct db *db, struct txn *tid);
 extern int cyrusdb_dump(struct db *db, int detail);
 extern int cyrusdb_consistent(struct db *db);
 extern int cyrusdb_repack(struct db *db);
+
+/* progress reporting for repacks, whether explicit or automatic */
+enum cyrusdb_repack_phase {
+    CYRUSDB_REPACK_COPY = 0,    /* copying live records, unlocked */
+    CYRUSDB_REPACK_REPLAY,      /* applying later changes, locked */
+    CYRUSDB_REPACK_DONE
+};
+
+struct cyrusdb_repack_progress {
+    const char *fname;
+    enum cyrusdb_repack_phase phase;
+    size_t records;             /* records copied so far */
+    size_t total;               /* records in the snapshot being copied */
+    size_t replayed;            /* changes applied while locked */
+    size_t old_size;
+    size_t new_size;            /* only valid when DONE */
+    double elapsed;             /* seconds since the repack started */
+    double locked;              /* seconds spent holding the write lock */
+};
+
+typedef void cyrusdb_repack_cb(const struct cyrusdb_repack_progress *progress,
+                               void *rock);
+
+extern void cyrusdb_set_repack_progress(cyrusdb_repack_cb *cb, void *rock);
+extern void cyrusdb_repack_progress(const struct cyrusdb_repack_progress *progress);
 extern int cyrusdb_compar(struct db *db,
                           const char *a, int alen,
                           const char *b, int blen);
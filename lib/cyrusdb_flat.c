@@ -857,5 +857,7 @@ EXPORTED struct cyrusdb_backend cyrusdb_flat =
     NULL,
     NULL,
     NULL,
-    &mycompar
+    &mycompar,
+
+    NULL
 };
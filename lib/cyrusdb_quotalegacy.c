@@ -901,5 +901,7 @@ HIDDEN struct cyrusdb_backend cyrusdb_quotalegacy =
     NULL,
     NULL,
     NULL,
-    &mycompar
+    &mycompar,
+
+    NULL
 };
@@ -2446,5 +2446,7 @@ EXPORTED struct cyrusdb_backend cyrusdb_skiplist =
     &dump,
     &consistent,
     &mycheckpoint,
-    &mycompar
+    &mycompar,
+
+    NULL
 };
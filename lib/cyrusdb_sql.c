@@ -920,5 +920,7 @@ HIDDEN struct cyrusdb_backend cyrusdb_sql =
     NULL,
     NULL,
     NULL,
-    &mycompar
+    &mycompar,
+
+    NULL
 };
@@ -43,22 +43,28 @@
 #include <config.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 
 #include "assert.h"
+#include "bloom.h"
 #include "bsearch.h"
 #include "byteorder.h"
 #include "cyrusdb.h"
 #include "crc32.h"
 #include "libcyr_cfg.h"
 #include "mappedfile.h"
+#include "retry.h"
 #include "util.h"
 #include "xmalloc.h"
 
@@ -152,7 +158,9 @@
  * always point somewhere past the 'end' until commit.
  *
  * The DUMMY is always MAXLEVEL level, with zero keylen and vallen
- * The DELETE is always zero level, with zero keylen and vallen
+ * The DELETE is always zero level, with zero vallen.  It carries the
+ * key being deleted so the log can be replayed (versions before
+ * 3.3.1 wrote zero keylen, and readers must accept both)
  * crc32_head is calculated on all bytes before it in the record
  * crc32_tail is calculated on all bytes after, INCLUDING padding
  *
@@ -262,6 +270,51 @@
  * regular fetches that happen to hit either the current key,
  * the gap immediately after, or the next key.  All other
  * locations cause a full relocate.
+ *
+ * SNAPSHOT READS:
+ * If twoskip_snapshot_reads is enabled, fetches and foreach which
+ * are not part of a transaction don't take a lock at all.  Instead
+ * they refresh the map and read "current_size" from the header, and
+ * treat that as the end of the file.  Everything before that offset
+ * is committed and never rewritten except for record heads, which
+ * are protected by crc32_head.  Any pointer at level 1 or higher
+ * which points past the end was written by a later transaction, and
+ * is treated as the end of that level, so the search just drops to
+ * a lower level.  The "level zero" pair always keeps one pointer
+ * from before the current transaction, so the highest one before
+ * the end is correct for our snapshot.  If both are past the end
+ * (more than one commit since we looked), or a record head fails
+ * its CRC because it's being rewritten, the read starts again with
+ * a fresh snapshot - and after a few tries falls back to taking the
+ * read lock like everyone else.
+ *
+ * ONLINE REPACK:
+ * An explicit repack copies the database into a new file from a
+ * snapshot, without holding any lock, and remembers where the
+ * snapshot ended.  Then it takes the write lock just long enough to
+ * replay every record written since that offset into the new file,
+ * commit it and rename it into place.  Anything committed during the
+ * copy is in the replayed range, so it doesn't matter if the copy
+ * saw a mixture of newer and older snapshots.  If the generation
+ * changes under us somebody else repacked first, and we just give
+ * up.  Databases opened without CRCs, or containing old-style DELETE
+ * records without a key, are repacked entirely under the lock.
+ *
+ * BLOOM FILTERS:
+ * If twoskip_bloom_filters is enabled, databases opened with
+ * CYRUSDB_BLOOM keep a bloom filter of every key ever stored in
+ * "fname.bloom", mapped shared by everyone using the database.  Its
+ * header records the generation and "current_size" of the database
+ * the filter covers.  A fetch only trusts a miss in the filter if the
+ * generation matches and the filter covers at least up to the
+ * current_size it's reading, so a filter which has fallen behind (a
+ * writer which didn't ask for it, or a crash) is never wrong, just
+ * ignored.  Writers add each key as they store it, so reads inside
+ * the transaction see them too, and after each commit catch the
+ * filter up to the new end, syncing the bits before moving the end
+ * past them.  Deleted keys stay in the filter until the next
+ * checkpoint or repack, which builds a fresh filter from the keys it
+ * copies.
  */
 
 
@@ -279,6 +332,21 @@
 /* release lock in foreach at least every N records */
 #define FOREACH_LOCK_RELEASE 256
 
+/* give up on lockless snapshot reads after this many retries */
+#define SNAPSHOT_MAXTRIES 3
+
+/* report repack progress every N records copied */
+#define REPACK_PROGRESS_INTERVAL 10000
+
+/* bloom filters are sized for twice the records at build time, and
+ * keep this false positive rate until they fill up */
+#define BLOOM_ERROR 0.01
+#define BLOOM_MINENTRIES 1024
+#define BLOOM_MAXENTRIES (200 * 1000 * 1000)
+
+/* look for a missing or replaced bloom filter every N seconds */
+#define BLOOM_RETRY 1
+
 /* format specifics */
 #undef VERSION /* defined in config.h */
 #define VERSION 1
@@ -358,10 +426,20 @@ struct skiploc {
     /* need a generation so we know if the location is still valid */
     uint64_t generation;
     size_t end;
+
+    /* found by a lockless snapshot read, so not safe to write from */
+    int is_snapshot;
 };
 
 #define DIRTY (1<<0)
 
+/* snapshot read states */
+enum {
+    SNAPSHOT_NONE = 0,
+    SNAPSHOT_ACTIVE = 1,
+    SNAPSHOT_LOCKED = 2
+};
+
 struct txn {
     /* logstart is where we start changes from on commit, where we truncate
        to on abort */
@@ -392,6 +470,20 @@ struct dbengine {
     int txn_num;
     struct txn *current_txn;
 
+    /* lockless reads */
+    int snapshot_reads;
+    int snapshot;
+
+    /* bloom filter, mapped from the sidecar file */
+    int use_bloom;
+    struct bloom bloom;
+    char *bloom_base;
+    size_t bloom_len;
+    int bloom_writable;
+    time_t bloom_tried;
+    /* or being built for a new file, during checkpoint */
+    struct bloom *bloom_build;
+
     /* comparator function to use for sorting */
     int open_flags;
     int (*compar) (const char *s1, int l1, const char *s2, int l2);
@@ -419,6 +511,21 @@ enum {
 };
 
 #define HEADER_SIZE 64
+
+/* the bloom filter file: a header, then the filter's bits */
+#define BLOOM_SUFFIX ".bloom"
+#define BLOOM_MAGIC ("\241\002\213\015twoskip bloom\0\0\0")
+#define BLOOM_MAGIC_SIZE (20)
+#define BLOOM_FILE_VERSION 1
+
+enum {
+    BLOOM_OFFSET_VERSION = 20,
+    BLOOM_OFFSET_ENTRIES = 24,
+    BLOOM_OFFSET_GENERATION = 32,
+    BLOOM_OFFSET_END = 40,
+};
+
+#define BLOOM_HEADER_SIZE 64
 #define DUMMY_OFFSET HEADER_SIZE
 #define MAXRECORDHEAD ((MAXLEVEL + 5)*8)
 // NOTE: MAXLEVEL should be chosen so that MAXRECORDHEAD always
@@ -440,6 +547,8 @@ static int myconsistent(struct dbengine *db, struct txn *tid);
 static int recovery(struct dbengine *db);
 static int recovery1(struct dbengine *db, int *count);
 static int recovery2(struct dbengine *db, int *count);
+static int bloom_miss(struct dbengine *db, const char *key, size_t keylen);
+static void bloom_store(struct dbengine *db, const char *key, size_t keylen);
 
 /************** HELPER FUNCTIONS ****************/
 
@@ -469,26 +578,36 @@ static uint8_t randlvl(uint8_t lvl, uint8_t maxlvl)
 
 /************** HEADER ****************/
 
+/* is this a lockless read?  Any inconsistency means "try again" */
+#define IS_SNAPSHOT(db) ((db)->snapshot == SNAPSHOT_ACTIVE)
+
 /* given an open, mapped db, read in the header information */
 static int read_header(struct dbengine *db)
 {
+    union skipwritebuf hbuf;
+    const char *base = hbuf.s;
     uint32_t crc;
 
     assert(db && db->mf && db->is_open);
 
     if (SIZE(db) < HEADER_SIZE) {
+        if (IS_SNAPSHOT(db)) return CYRUSDB_AGAIN;
         syslog(LOG_ERR,
                "twoskip: file not large enough for header: %s", FNAME(db));
         return CYRUSDB_IOERROR;
     }
 
-    if (memcmp(BASE(db), HEADER_MAGIC, HEADER_MAGIC_SIZE)) {
+    /* take a private copy, a snapshot reader could see it change */
+    memcpy(hbuf.s, BASE(db), HEADER_SIZE);
+
+    if (memcmp(base, HEADER_MAGIC, HEADER_MAGIC_SIZE)) {
+        if (IS_SNAPSHOT(db)) return CYRUSDB_AGAIN;
         syslog(LOG_ERR, "twoskip: invalid magic header: %s", FNAME(db));
         return CYRUSDB_IOERROR;
     }
 
     db->header.version
-        = ntohl(*((uint32_t *)(BASE(db) + OFFSET_VERSION)));
+        = ntohl(*((uint32_t *)(base + OFFSET_VERSION)));
 
     if (db->header.version > VERSION) {
         syslog(LOG_ERR, "twoskip: version mismatch: %s has version %d",
@@ -497,28 +616,29 @@ static int read_header(struct dbengine *db)
     }
 
     db->header.generation
-        = ntohll(*((uint64_t *)(BASE(db) + OFFSET_GENERATION)));
+        = ntohll(*((uint64_t *)(base + OFFSET_GENERATION)));
 
     db->header.num_records
-        = ntohll(*((uint64_t *)(BASE(db) + OFFSET_NUM_RECORDS)));
+        = ntohll(*((uint64_t *)(base + OFFSET_NUM_RECORDS)));
 
     db->header.repack_size
-        = ntohll(*((uint64_t *)(BASE(db) + OFFSET_REPACK_SIZE)));
+        = ntohll(*((uint64_t *)(base + OFFSET_REPACK_SIZE)));
 
     db->header.current_size
-        = ntohll(*((uint64_t *)(BASE(db) + OFFSET_CURRENT_SIZE)));
+        = ntohll(*((uint64_t *)(base + OFFSET_CURRENT_SIZE)));
 
     db->header.flags
-        = ntohl(*((uint32_t *)(BASE(db) + OFFSET_FLAGS)));
+        = ntohl(*((uint32_t *)(base + OFFSET_FLAGS)));
 
-    crc = ntohl(*((uint32_t *)(BASE(db) + OFFSET_CRC32)));
+    crc = ntohl(*((uint32_t *)(base + OFFSET_CRC32)));
 
     db->end = db->header.current_size;
 
     if ((db->open_flags & CYRUSDB_NOCRC))
         return 0;
 
-    if (crc32_map(BASE(db), OFFSET_CRC32) != crc) {
+    if (crc32_map(base, OFFSET_CRC32) != crc) {
+        if (IS_SNAPSHOT(db)) return CYRUSDB_AGAIN;
         syslog(LOG_ERR, "DBERROR: %s: twoskip header CRC failure",
                FNAME(db));
         return CYRUSDB_IOERROR;
@@ -584,6 +704,8 @@ static int read_onerecord(struct dbengine *db, size_t offset,
 static int read_onerecord(struct dbengine *db, size_t offset,
                           struct skiprecord *record)
 {
+    union skipwritebuf hbuf;
+    const char *head;
     const char *base;
     int i;
 
@@ -591,6 +713,10 @@ static int read_onerecord(struct dbengine *db, size_t offset,
 
     if (!offset) return 0;
 
+    /* written after our snapshot was taken */
+    if (IS_SNAPSHOT(db) && offset >= db->end)
+        return CYRUSDB_AGAIN;
+
     record->offset = offset;
     record->len = 24; /* absolute minimum */
 
@@ -598,7 +724,18 @@ static int read_onerecord(struct dbengine *db, size_t offset,
     if (record->offset + record->len > SIZE(db))
         goto badsize;
 
-    base = BASE(db) + offset;
+    head = BASE(db) + record->offset;
+
+    /* a snapshot reader could see the pointers being rewritten, so take
+     * a private copy and check the CRC against the bytes we parse */
+    if (IS_SNAPSHOT(db)) {
+        size_t headlen = SIZE(db) - record->offset;
+        if (headlen > MAXRECORDHEAD) headlen = MAXRECORDHEAD;
+        memcpy(hbuf.s, head, headlen);
+        head = hbuf.s;
+    }
+
+    base = head;
 
     /* read in the record header */
     record->type = base[0];
@@ -609,6 +746,7 @@ static int read_onerecord(struct dbengine *db, size_t offset,
 
     /* make sure we fit */
     if (record->level > MAXLEVEL) {
+        if (IS_SNAPSHOT(db)) return CYRUSDB_AGAIN;
         syslog(LOG_ERR, "DBERROR: twoskip invalid level %d for %s at %08llX",
                record->level, FNAME(db), (LLU)offset);
         return CYRUSDB_IOERROR;
@@ -616,14 +754,14 @@ static int read_onerecord(struct dbengine *db, size_t offset,
 
     /* long key */
     if (record->keylen == UINT16_MAX) {
-        base = BASE(db) + offset;
+        base = head + (offset - record->offset);
         record->keylen = ntohll(*((uint64_t *)base));
         offset += 8;
     }
 
     /* long value */
     if (record->vallen == UINT32_MAX) {
-        base = BASE(db) + offset;
+        base = head + (offset - record->offset);
         record->vallen = ntohll(*((uint64_t *)base));
         offset += 8;
     }
@@ -638,12 +776,12 @@ static int read_onerecord(struct dbengine *db, size_t offset,
         goto badsize;
 
     for (i = 0; i <= record->level; i++) {
-        base = BASE(db) + offset;
+        base = head + (offset - record->offset);
         record->nextloc[i] = ntohll(*((uint64_t *)base));
         offset += 8;
     }
 
-    base = BASE(db) + offset;
+    base = head + (offset - record->offset);
     record->crc32_head = ntohl(*((uint32_t *)base));
     record->crc32_tail = ntohl(*((uint32_t *)(base+4)));
     record->keyoffset = offset + 8;
@@ -652,8 +790,10 @@ static int read_onerecord(struct dbengine *db, size_t offset,
     if ((db->open_flags & CYRUSDB_NOCRC))
         return 0;
 
-    uint32_t crc = crc32_map(BASE(db) + record->offset, (offset - record->offset));
+    uint32_t crc = crc32_map(head, (offset - record->offset));
     if (crc != record->crc32_head) {
+        /* probably being rewritten under us right now */
+        if (IS_SNAPSHOT(db)) return CYRUSDB_AGAIN;
         syslog(LOG_ERR, "DBERROR: twoskip checksum head error for %s at %08llX",
                FNAME(db), (LLU)offset);
         return CYRUSDB_IOERROR;
@@ -662,6 +802,7 @@ static int read_onerecord(struct dbengine *db, size_t offset,
     return 0;
 
 badsize:
+    if (IS_SNAPSHOT(db)) return CYRUSDB_AGAIN;
     syslog(LOG_ERR, "twoskip: attempt to read past end of file %s: %08llX > %08llX",
            FNAME(db), (LLU)record->offset + record->len, (LLU)SIZE(db));
     return CYRUSDB_IOERROR;
@@ -860,8 +1001,13 @@ static size_t _getloc(struct dbengine *db, struct skiprecord *record,
 static size_t _getloc(struct dbengine *db, struct skiprecord *record,
                       uint8_t level)
 {
-    if (level)
+    if (level) {
+        /* a pointer into a later transaction is the end of this
+         * level as far as a snapshot is concerned */
+        if (IS_SNAPSHOT(db) && record->nextloc[level + 1] >= db->end)
+            return 0;
         return record->nextloc[level + 1];
+    }
 
     /* if one is past, must be the other */
     if (record->nextloc[0] >= db->end)
@@ -923,10 +1069,12 @@ static int relocate(struct dbengine *db)
     /* pointer validity */
     loc->generation = db->header.generation;
     loc->end = db->end;
+    loc->is_snapshot = IS_SNAPSHOT(db);
 
     /* start with the dummy */
     r = read_onerecord(db, DUMMY_OFFSET, &loc->record);
     loc->is_exactmatch = 0;
+    if (r) return r;
 
     /* initialise pointers */
     level = loc->record.level;
@@ -988,9 +1136,119 @@ static int relocate(struct dbengine *db)
     return 0;
 }
 
+/* like relocate, but for a key after the current location.  Rather
+ * than starting at the top, climb only as far as we need to from the
+ * pointers we already have, then search down from there - so nearby
+ * keys are cheap to find.  The location must be current */
+static int relocate_forward(struct dbengine *db)
+{
+    struct skiploc *loc = &db->loc;
+    struct skiprecord newrecord;
+    size_t offset;
+    size_t oldoffset = 0;
+    uint8_t level = 0;
+    uint8_t i;
+    int cmp = -1;
+    int r;
+
+    /* every level now goes from a record before the key to its next */
+    if (loc->is_exactmatch) {
+        for (i = 0; i < loc->record.level; i++)
+            loc->backloc[i] = loc->record.offset;
+    }
+    loc->is_exactmatch = 0;
+
+    /* climb while the next record one level up is still before the key */
+    while (level + 1 < MAXLEVEL && loc->forwardloc[level + 1]) {
+        r = read_onerecord(db, loc->forwardloc[level + 1], &newrecord);
+        if (r) return r;
+
+        cmp = db->compar(KEY(db, &newrecord), newrecord.keylen,
+                         loc->keybuf.s, loc->keybuf.len);
+        if (cmp >= 0) break;
+
+        level++;
+    }
+
+    /* and search down from the furthest record we know about */
+    r = read_onerecord(db, loc->backloc[level], &loc->record);
+    if (r) return r;
+
+    level++;
+    cmp = -1;
+    newrecord.offset = 0;
+
+    while (level) {
+        offset = _getloc(db, &loc->record, level-1);
+
+        loc->backloc[level-1] = loc->record.offset;
+        loc->forwardloc[level-1] = offset;
+
+        if (offset != oldoffset) {
+            oldoffset = offset;
+            r = read_skipdelete(db, offset, &newrecord);
+            if (r) return r;
+
+            if (newrecord.offset) {
+                cmp = db->compar(KEY(db, &newrecord), newrecord.keylen,
+                                 loc->keybuf.s, loc->keybuf.len);
+
+                /* not there?  stay at this level */
+                if (cmp < 0) {
+                    /* move the offset range along */
+                    loc->record = newrecord;
+                    continue;
+                }
+            }
+            else {
+                cmp = -1;
+            }
+        }
+
+        level--;
+    }
+
+    if (cmp == 0) { /* we found it exactly */
+        loc->is_exactmatch = 1;
+        loc->record = newrecord;
+
+        for (i = 0; i < loc->record.level; i++)
+            loc->forwardloc[i] = _getloc(db, &loc->record, i);
+
+        /* make sure this record is complete */
+        r = check_tailcrc(db, &loc->record);
+        if (r) return r;
+    }
+
+    return 0;
+}
+
+/* are the offsets in the current location still usable?  A location
+ * found by a snapshot read may have skipped over pointers from a
+ * transaction that was in progress, so never write from it */
+static int loc_is_current(struct dbengine *db)
+{
+    struct skiploc *loc = &db->loc;
+
+    return (loc->end == db->end
+            && loc->generation == db->header.generation
+            && loc->is_snapshot == IS_SNAPSHOT(db));
+}
+
+/* a snapshot read which gives up part way through moving the location
+ * leaves a mix of old and new offsets in it, which must not be mistaken
+ * for a current location when the retry gets the same snapshot end */
+static int loc_check_again(struct dbengine *db, int r)
+{
+    if (r == CYRUSDB_AGAIN)
+        db->loc.end = 0;
+
+    return r;
+}
+
 /* helper function to find a location, either by using the existing
  * location if it's close enough, or using the full relocate above */
-static int find_loc(struct dbengine *db, const char *key, size_t keylen)
+static int _find_loc(struct dbengine *db, const char *key, size_t keylen)
 {
     struct skiprecord newrecord;
     struct skiploc *loc = &db->loc;
@@ -1002,8 +1260,7 @@ static int find_loc(struct dbengine *db, const char *key, size_t keylen)
         buf_truncate(&loc->keybuf, keylen);
 
     /* can we special case advance? */
-    if (keylen && loc->end == db->end
-               && loc->generation == db->header.generation) {
+    if (keylen && loc_is_current(db)) {
         cmp = db->compar(KEY(db, &loc->record), loc->record.keylen,
                          loc->keybuf.s, loc->keybuf.len);
         /* same place, and was exact.  Otherwise we're going back,
@@ -1048,6 +1305,9 @@ static int find_loc(struct dbengine *db, const char *key, size_t keylen)
                 db->loc.is_exactmatch = 0;
                 return 0;
             }
+
+            /* further along, search forwards from here */
+            return relocate_forward(db);
         }
         /* if we fell out here, it's not a "local" record, just search */
     }
@@ -1055,16 +1315,21 @@ static int find_loc(struct dbengine *db, const char *key, size_t keylen)
     return relocate(db);
 }
 
+static int find_loc(struct dbengine *db, const char *key, size_t keylen)
+{
+    return loc_check_again(db, _find_loc(db, key, keylen));
+}
+
 /* helper function to advance to the "next" record.  Used by foreach,
  * fetchnext, and internal functions */
-static int advance_loc(struct dbengine *db)
+static int _advance_loc(struct dbengine *db)
 {
     struct skiploc *loc = &db->loc;
     uint8_t i;
     int r;
 
     /* has another session made changes?  Need to re-find the location */
-    if (loc->end != db->end || loc->generation != db->header.generation) {
+    if (!loc_is_current(db)) {
         r = relocate(db);
         if (r) return r;
     }
@@ -1098,6 +1363,11 @@ static int advance_loc(struct dbengine *db)
     return 0;
 }
 
+static int advance_loc(struct dbengine *db)
+{
+    return loc_check_again(db, _advance_loc(db));
+}
+
 /* helper function to update all the back records efficiently
  * after appending a new record, either create or delete.  The
  * caller must set forwardloc[] correctly for each level it has
@@ -1168,6 +1438,8 @@ static int store_here(struct dbengine *db, const char *val, size_t vallen)
     r = append_record(db, &newrecord, loc->keybuf.s, val);
     if (r) return r;
 
+    bloom_store(db, loc->keybuf.s, loc->keybuf.len);
+
     /* get the nextlevel to point here for all this record's levels */
     for (i = 0; i < newrecord.level; i++)
         loc->forwardloc[i] = newrecord.offset;
@@ -1205,10 +1477,11 @@ static int delete_here(struct dbengine *db)
     /* build a delete record */
     memset(&newrecord, 0, sizeof(struct skiprecord));
     newrecord.type = DELETE;
+    newrecord.keylen = loc->keybuf.len;
     newrecord.nextloc[0] = nextrecord.offset;
 
-    /* append to the file */
-    r = append_record(db, &newrecord, NULL, NULL);
+    /* append to the file, with the key for replaying the log */
+    r = append_record(db, &newrecord, loc->keybuf.s, NULL);
     if (r) return r;
 
     /* get the nextlevel to point here */
@@ -1313,131 +1586,525 @@ static int newtxn(struct dbengine *db, int shared, struct txn **tidptr)
     return 0;
 }
 
-static void dispose_db(struct dbengine *db)
+/* start a lockless read.  After too many retries, just take the
+ * read lock instead and wait for the writers like everyone else */
+static int snapshot_begin(struct dbengine *db, int tries)
 {
-    if (!db) return;
+    int r;
 
-    if (db->mf) {
-        if (mappedfile_islocked(db->mf))
-            unlock(db);
-        mappedfile_close(&db->mf);
+    assert(!db->current_txn);
+    assert(db->snapshot == SNAPSHOT_NONE);
+
+    if (tries >= SNAPSHOT_MAXTRIES) {
+        r = read_lock(db);
+        if (r) return r;
+        db->snapshot = SNAPSHOT_LOCKED;
+        return 0;
     }
 
-    buf_free(&db->loc.keybuf);
+    r = mappedfile_refresh(db->mf);
+    if (r) return CYRUSDB_IOERROR;
 
-    free(db);
+    db->snapshot = SNAPSHOT_ACTIVE;
+
+    r = read_header(db);
+    if (r) return r;
+
+    /* committed since we mapped the file */
+    if (db->end > SIZE(db))
+        return CYRUSDB_AGAIN;
+
+    return 0;
 }
 
-/************************************************************/
+static int snapshot_end(struct dbengine *db)
+{
+    int r = 0;
 
-static int opendb(const char *fname, int flags, struct dbengine **ret, struct txn **mytid)
+    if (db->snapshot == SNAPSHOT_LOCKED)
+        r = unlock(db);
+
+    db->snapshot = SNAPSHOT_NONE;
+
+    return r;
+}
+
+/* where snapshot_seek() leaves the location */
+enum {
+    SEEK_AT = 0,        /* at 'key', or the gap where it would be */
+    SEEK_AFTER = 1,     /* at the first record after 'key' */
+    SEEK_FIRST = 2,     /* at the first record at or after 'key' */
+    SEEK_EXACT = 3      /* like SEEK_AT, but CYRUSDB_NOTFOUND without a
+                           location if the bloom filter rules 'key' out */
+};
+
+/* find 'key' in a fresh snapshot, retrying as required */
+static int snapshot_seek(struct dbengine *db, const struct buf *key,
+                         int how, int *triesp)
 {
-    struct dbengine *db;
     int r;
-    int mappedfile_flags = MAPPEDFILE_RW;
 
-    assert(fname);
-    assert(ret);
+    for (;;) {
+        r = snapshot_begin(db, *triesp);
+        if (!r && how == SEEK_EXACT && bloom_miss(db, key->s, key->len))
+            return CYRUSDB_NOTFOUND;
+        if (!r) r = find_loc(db, key->s, key->len);
+        if (!r && (how == SEEK_AFTER
+                   || (how == SEEK_FIRST && !db->loc.is_exactmatch)))
+            r = advance_loc(db);
+        if (r != CYRUSDB_AGAIN) return r;
 
-    db = (struct dbengine *) xzmalloc(sizeof(struct dbengine));
+        snapshot_end(db);
+        (*triesp)++;
+    }
+}
 
-    if (flags & CYRUSDB_CREATE)
-        mappedfile_flags |= MAPPEDFILE_CREATE;
+/******************** BLOOM FILTER *********************/
 
-    db->open_flags = flags & ~CYRUSDB_CREATE;
-    db->compar = (flags & CYRUSDB_MBOXSORT) ? bsearch_ncompare_mbox
-                                            : bsearch_ncompare_raw;
+static size_t bloom_entries(uint64_t num_records)
+{
+    uint64_t entries = num_records * 2;
 
-    r = mappedfile_open(&db->mf, fname, mappedfile_flags);
-    if (r) {
-        /* convert to CYRUSDB errors*/
-        if (r == -ENOENT) r = CYRUSDB_NOTFOUND;
-        else r = CYRUSDB_IOERROR;
-        goto done;
+    if (entries < BLOOM_MINENTRIES) entries = BLOOM_MINENTRIES;
+    if (entries > BLOOM_MAXENTRIES) entries = BLOOM_MAXENTRIES;
+
+    return entries;
+}
+
+static void bloom_close(struct dbengine *db)
+{
+    if (db->bloom_base) {
+        munmap(db->bloom_base, db->bloom_len);
+        db->bloom_base = NULL;
+        db->bloom_len = 0;
     }
+    bloom_free(&db->bloom);
+}
 
-    db->is_open = 0;
+static uint64_t bloom_generation(struct dbengine *db)
+{
+    return ntohll(*((uint64_t *)(db->bloom_base + BLOOM_OFFSET_GENERATION)));
+}
 
-    /* grab a read lock, only reading the header */
-    r = read_lock(db);
-    if (r) goto done;
+/* the writer moves this on while snapshot readers are looking */
+static size_t bloom_end(struct dbengine *db)
+{
+    uint64_t *endp = (uint64_t *)(db->bloom_base + BLOOM_OFFSET_END);
+    return ntohll(__atomic_load_n(endp, __ATOMIC_ACQUIRE));
+}
 
-    /* if there's any issue which requires fixing, get a write lock */
-    if (0) {
-    retry_write:
-        unlock(db);
-        db->is_open = 0;
-        r = write_lock(db);
-        if (r) goto done;
-    }
+static void bloom_set_end(struct dbengine *db, size_t end)
+{
+    uint64_t *endp = (uint64_t *)(db->bloom_base + BLOOM_OFFSET_END);
+    __atomic_store_n(endp, htonll(end), __ATOMIC_RELEASE);
+}
 
-    /* if the map size is zero, it's a new file - we need to create an
-     * initial header */
-    if (mappedfile_size(db->mf) == 0) {
-        struct skiprecord dummy;
+/* is the mapped filter for the generation we're reading? */
+static int bloom_current(struct dbengine *db)
+{
+    return db->bloom_base
+        && bloom_generation(db) == db->header.generation;
+}
 
-        if (!mappedfile_iswritelocked(db->mf))
-            goto retry_write;
+/* map fname.bloom, if there's a valid one */
+static void bloom_open(struct dbengine *db)
+{
+    char fname[1024];
+    struct stat sbuf;
+    int prot = PROT_READ|PROT_WRITE;
+    char *base;
+    int fd;
 
-        /* create the dummy! */
-        memset(&dummy, 0, sizeof(struct skiprecord));
-        dummy.type = DUMMY;
-        dummy.level = MAXLEVEL;
+    bloom_close(db);
+    db->bloom_tried = time(NULL);
 
-        /* append dummy after header location */
-        db->end = DUMMY_OFFSET;
-        r = write_record(db, &dummy, NULL, NULL);
-        if (r) {
-            syslog(LOG_ERR, "DBERROR: writing dummy node for %s: %m",
-                   fname);
-            goto done;
-        }
+    snprintf(fname, sizeof(fname), "%s%s", FNAME(db), BLOOM_SUFFIX);
 
-        /* create the header */
-        db->header.version = VERSION;
-        db->header.generation = 1;
-        db->header.repack_size = db->end;
-        db->header.current_size = db->end;
-        r = commit_header(db);
-        if (r) {
-            syslog(LOG_ERR, "DBERROR: writing header for %s: %m",
-                   fname);
-            goto done;
-        }
+    fd = open(fname, O_RDWR);
+    if (fd < 0) {
+        fd = open(fname, O_RDONLY);
+        prot = PROT_READ;
     }
+    if (fd < 0) return;
 
-    db->is_open = 1;
+    if (fstat(fd, &sbuf) < 0 || sbuf.st_size < BLOOM_HEADER_SIZE) {
+        close(fd);
+        return;
+    }
 
-    r = read_header(db);
-    if (r) goto done;
+    base = mmap(NULL, sbuf.st_size, prot, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return;
+
+    if (memcmp(base, BLOOM_MAGIC, BLOOM_MAGIC_SIZE)
+        || ntohl(*((uint32_t *)(base + BLOOM_OFFSET_VERSION)))
+           != BLOOM_FILE_VERSION
+        || bloom_init_buffer(&db->bloom,
+                             ntohl(*((uint32_t *)(base + BLOOM_OFFSET_ENTRIES))),
+                             BLOOM_ERROR,
+                             (unsigned char *)base + BLOOM_HEADER_SIZE,
+                             sbuf.st_size - BLOOM_HEADER_SIZE)) {
+        syslog(LOG_ERR, "DBERROR: twoskip: invalid bloom filter %s", fname);
+        munmap(base, sbuf.st_size);
+        return;
+    }
 
-    if (!db_is_clean(db)) {
-        if (!mappedfile_iswritelocked(db->mf))
-            goto retry_write;
+    db->bloom_base = base;
+    db->bloom_len = sbuf.st_size;
+    db->bloom_writable = (prot & PROT_WRITE);
+}
 
-        /* recovery will clean the flag once it's committed the fixes */
-        r = recovery(db);
-        if (r) goto done;
-    }
+/* can a miss in the filter be trusted for what we're reading? */
+static int bloom_usable(struct dbengine *db)
+{
+    int writing = db->current_txn && !db->current_txn->shared;
 
-    /* unlock the DB */
-    unlock(db);
+    if (!db->use_bloom) return 0;
 
-    *ret = db;
+    /* pick up a filter built since we last looked - a writer may have
+     * replaced it with a bigger one for the same generation - but not
+     * part way through our own changes, which aren't in it */
+    if ((!bloom_current(db) || bloom_end(db) < db->header.current_size)
+        && !writing && time(NULL) >= db->bloom_tried + BLOOM_RETRY)
+        bloom_open(db);
 
-    if (mytid) {
-        r = newtxn(db, flags & CYRUSDB_SHARED, mytid);
-        if (r) goto done;
-    }
+    if (!bloom_current(db)) return 0;
 
-done:
-    if (r) dispose_db(db);
-    return r;
+    /* our own uncommitted keys are only there if we could add them */
+    if (writing && !db->bloom_writable) return 0;
+
+    return bloom_end(db) >= db->header.current_size;
 }
 
-static int myopen(const char *fname, int flags, struct dbengine **ret, struct txn **mytid)
+/* true if 'key' has certainly never been stored */
+static int bloom_miss(struct dbengine *db, const char *key, size_t keylen)
 {
-    struct db_list *ent;
+    if (!bloom_usable(db)) return 0;
+
+    return !bloom_check(&db->bloom, key, keylen);
+}
+
+/* called for every record stored */
+static void bloom_store(struct dbengine *db, const char *key, size_t keylen)
+{
+    if (db->bloom_build)
+        bloom_add(db->bloom_build, key, keylen);
+    if (db->bloom_base && db->bloom_writable)
+        bloom_add(&db->bloom, key, keylen);
+}
+
+/* add the key of every record between 'from' and 'to' */
+static int bloom_scan(struct dbengine *db, struct bloom *bloom,
+                      size_t from, size_t to)
+{
+    struct skiprecord record;
+    size_t offset;
+    int r;
+
+    for (offset = from; offset < to; offset += record.len) {
+        if (!memcmp(BASE(db) + offset, BLANK, 8)) {
+            record.len = 8;
+            continue;
+        }
+
+        r = read_onerecord(db, offset, &record);
+        if (r) return r;
+
+        if (record.type == RECORD)
+            bloom_add(bloom, KEY(db, &record), record.keylen);
+    }
+
+    return 0;
+}
+
+/* write out 'bloom' as the filter for everything committed in db,
+ * and map it */
+static int bloom_save(struct dbengine *db, struct bloom *bloom)
+{
+    char fname[1024];
+    char newfname[sizeof(fname) + 32];  /* room for ".NEW.<pid>" */
+    char header[BLOOM_HEADER_SIZE];
+    int r = 0;
+    int fd;
+
+    snprintf(fname, sizeof(fname), "%s%s", FNAME(db), BLOOM_SUFFIX);
+    snprintf(newfname, sizeof(newfname), "%s.NEW.%d", fname, (int)getpid());
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, BLOOM_MAGIC, BLOOM_MAGIC_SIZE);
+    *((uint32_t *)(header + BLOOM_OFFSET_VERSION)) = htonl(BLOOM_FILE_VERSION);
+    *((uint32_t *)(header + BLOOM_OFFSET_ENTRIES)) = htonl(bloom->entries);
+    *((uint64_t *)(header + BLOOM_OFFSET_GENERATION)) = htonll(db->header.generation);
+    *((uint64_t *)(header + BLOOM_OFFSET_END)) = htonll(db->header.current_size);
+
+    fd = open(newfname, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0) {
+        syslog(LOG_ERR, "IOERROR: twoskip: creating %s: %m", newfname);
+        return CYRUSDB_IOERROR;
+    }
+
+    /* the bits must be on disk before anything can trust them */
+    if (retry_write(fd, header, BLOOM_HEADER_SIZE) < 0
+        || retry_write(fd, bloom->bf, bloom->bytes) < 0
+        || fsync(fd) < 0) {
+        syslog(LOG_ERR, "IOERROR: twoskip: writing %s: %m", newfname);
+        r = CYRUSDB_IOERROR;
+    }
+    close(fd);
+
+    if (!r && rename(newfname, fname) < 0) {
+        syslog(LOG_ERR, "IOERROR: twoskip: renaming %s: %m", newfname);
+        r = CYRUSDB_IOERROR;
+    }
+
+    if (r) {
+        unlink(newfname);
+        return r;
+    }
+
+    bloom_open(db);
+
+    return 0;
+}
+
+/* build a filter from scratch from the whole file */
+static void bloom_rebuild(struct dbengine *db)
+{
+    struct bloom bloom;
+    int r;
+
+    if (bloom_init(&bloom, bloom_entries(db->header.num_records), BLOOM_ERROR)) {
+        db->use_bloom = 0;
+        return;
+    }
+
+    r = bloom_scan(db, &bloom, DUMMY_OFFSET, db->header.current_size);
+    if (!r) r = bloom_save(db, &bloom);
+    bloom_free(&bloom);
+
+    if (r) {
+        /* don't pay for a full scan on every commit */
+        syslog(LOG_ERR, "DBERROR: twoskip: failed to build bloom filter"
+                        " for %s, not using one", FNAME(db));
+        db->use_bloom = 0;
+        bloom_close(db);
+    }
+}
+
+static int bloom_needs_rebuild(struct dbengine *db)
+{
+    if (!bloom_current(db) || !db->bloom_writable)
+        return 1;
+
+    /* can't happen unless the filter is from some other file */
+    if (bloom_end(db) > db->header.current_size)
+        return 1;
+
+    /* full, so the false positive rate is climbing */
+    if (db->header.num_records > (uint64_t) db->bloom.entries
+        && db->bloom.entries < BLOOM_MAXENTRIES)
+        return 1;
+
+    return 0;
+}
+
+/* after a commit, with the write lock still held: bring the filter
+ * up to date with everything committed so far */
+static void bloom_update(struct dbengine *db)
+{
+    size_t from;
+    int r;
+
+    if (bloom_needs_rebuild(db)) {
+        /* somebody else may have done it already */
+        bloom_open(db);
+        if (bloom_needs_rebuild(db)) {
+            bloom_rebuild(db);
+            return;
+        }
+    }
+
+    from = bloom_end(db);
+    if (from >= db->header.current_size) return;
+    if (from < DUMMY_OFFSET) from = DUMMY_OFFSET;
+
+    /* mostly just our own transaction, already added as we went */
+    r = bloom_scan(db, &db->bloom, from, db->header.current_size);
+
+    /* the bits must be on disk before the end which vouches for them */
+    if (!r && msync(db->bloom_base, db->bloom_len, MS_SYNC) < 0) {
+        syslog(LOG_ERR, "IOERROR: twoskip: msync %s%s: %m",
+               FNAME(db), BLOOM_SUFFIX);
+        r = CYRUSDB_IOERROR;
+    }
+    if (r) return;
+
+    bloom_set_end(db, db->header.current_size);
+}
+
+/* collect the keys of a new file as it's written */
+static void bloom_start_build(struct dbengine *db, uint64_t num_records)
+{
+    if (!db->use_bloom) return;
+
+    db->bloom_build = xzmalloc(sizeof(struct bloom));
+    if (bloom_init(db->bloom_build, bloom_entries(num_records), BLOOM_ERROR)) {
+        free(db->bloom_build);
+        db->bloom_build = NULL;
+    }
+}
+
+/* and write them out once it's committed and renamed into place */
+static void bloom_finish_build(struct dbengine *db)
+{
+    if (!db->bloom_build) return;
+
+    bloom_save(db, db->bloom_build);
+
+    bloom_free(db->bloom_build);
+    free(db->bloom_build);
+    db->bloom_build = NULL;
+}
+
+static void dispose_db(struct dbengine *db)
+{
+    if (!db) return;
+
+    bloom_close(db);
+    if (db->bloom_build) {
+        bloom_free(db->bloom_build);
+        free(db->bloom_build);
+    }
+
+    if (db->mf) {
+        if (mappedfile_islocked(db->mf))
+            unlock(db);
+        mappedfile_close(&db->mf);
+    }
+
+    buf_free(&db->loc.keybuf);
+
+    free(db);
+}
+
+/************************************************************/
+
+static int opendb(const char *fname, int flags, struct dbengine **ret, struct txn **mytid)
+{
+    struct dbengine *db;
+    int r;
+    int mappedfile_flags = MAPPEDFILE_RW;
+
+    assert(fname);
+    assert(ret);
+
+    db = (struct dbengine *) xzmalloc(sizeof(struct dbengine));
+
+    if (flags & CYRUSDB_CREATE)
+        mappedfile_flags |= MAPPEDFILE_CREATE;
+
+    db->open_flags = flags & ~CYRUSDB_CREATE;
+    db->compar = (flags & CYRUSDB_MBOXSORT) ? bsearch_ncompare_mbox
+                                            : bsearch_ncompare_raw;
+
+    /* we rely on the CRCs to detect records changing under us */
+    db->snapshot_reads =
+        libcyrus_config_getswitch(CYRUSOPT_TWOSKIP_SNAPSHOT_READS)
+        && !(flags & CYRUSDB_NOCRC);
+
+    db->use_bloom = (flags & CYRUSDB_BLOOM)
+        && libcyrus_config_getswitch(CYRUSOPT_TWOSKIP_BLOOM_FILTERS);
+
+    r = mappedfile_open(&db->mf, fname, mappedfile_flags);
+    if (r) {
+        /* convert to CYRUSDB errors*/
+        if (r == -ENOENT) r = CYRUSDB_NOTFOUND;
+        else r = CYRUSDB_IOERROR;
+        goto done;
+    }
+
+    db->is_open = 0;
+
+    /* grab a read lock, only reading the header */
+    r = read_lock(db);
+    if (r) goto done;
+
+    /* if there's any issue which requires fixing, get a write lock */
+    if (0) {
+    retry_write:
+        unlock(db);
+        db->is_open = 0;
+        r = write_lock(db);
+        if (r) goto done;
+    }
+
+    /* if the map size is zero, it's a new file - we need to create an
+     * initial header */
+    if (mappedfile_size(db->mf) == 0) {
+        struct skiprecord dummy;
+
+        if (!mappedfile_iswritelocked(db->mf))
+            goto retry_write;
+
+        /* create the dummy! */
+        memset(&dummy, 0, sizeof(struct skiprecord));
+        dummy.type = DUMMY;
+        dummy.level = MAXLEVEL;
+
+        /* append dummy after header location */
+        db->end = DUMMY_OFFSET;
+        r = write_record(db, &dummy, NULL, NULL);
+        if (r) {
+            syslog(LOG_ERR, "DBERROR: writing dummy node for %s: %m",
+                   fname);
+            goto done;
+        }
+
+        /* create the header */
+        db->header.version = VERSION;
+        db->header.generation = 1;
+        db->header.repack_size = db->end;
+        db->header.current_size = db->end;
+        r = commit_header(db);
+        if (r) {
+            syslog(LOG_ERR, "DBERROR: writing header for %s: %m",
+                   fname);
+            goto done;
+        }
+    }
+
+    db->is_open = 1;
+
+    r = read_header(db);
+    if (r) goto done;
+
+    if (!db_is_clean(db)) {
+        if (!mappedfile_iswritelocked(db->mf))
+            goto retry_write;
+
+        /* recovery will clean the flag once it's committed the fixes */
+        r = recovery(db);
+        if (r) goto done;
+    }
+
+    /* unlock the DB */
+    unlock(db);
+
+    *ret = db;
+
+    if (mytid) {
+        r = newtxn(db, flags & CYRUSDB_SHARED, mytid);
+        if (r) goto done;
+    }
+
+done:
+    if (r) dispose_db(db);
+    return r;
+}
+
+static int myopen(const char *fname, int flags, struct dbengine **ret, struct txn **mytid)
+{
+    struct db_list *ent;
     struct dbengine *mydb;
     int r = 0;
 
@@ -1527,23 +2194,41 @@ static int myfetch(struct dbengine *db,
     if (!tidptr && db->current_txn)
         tidptr = &db->current_txn;
 
-    if (tidptr) {
-        if (!*tidptr) {
-            r = newtxn(db, 0/*shared*/, tidptr);
+    if (!tidptr && db->snapshot_reads) {
+        struct buf keybuf = BUF_INITIALIZER;
+        int tries = 0;
+
+        /* key may point into our location, which a retry would clobber */
+        buf_setmap(&keybuf, key, keylen);
+        r = snapshot_seek(db, &keybuf, fetchnext ? SEEK_AFTER : SEEK_EXACT,
+                          &tries);
+        buf_free(&keybuf);
+        if (r) goto done;
+    }
+    else {
+        if (tidptr) {
+            if (!*tidptr) {
+                r = newtxn(db, 0/*shared*/, tidptr);
+                if (r) return r;
+            }
+        } else {
+            /* grab a r lock */
+            r = read_lock(db);
             if (r) return r;
         }
-    } else {
-        /* grab a r lock */
-        r = read_lock(db);
-        if (r) return r;
-    }
 
-    r = find_loc(db, key, keylen);
-    if (r) goto done;
+        if (!fetchnext && bloom_miss(db, key, keylen)) {
+            r = CYRUSDB_NOTFOUND;
+            goto done;
+        }
 
-    if (fetchnext) {
-        r = advance_loc(db);
+        r = find_loc(db, key, keylen);
         if (r) goto done;
+
+        if (fetchnext) {
+            r = advance_loc(db);
+            if (r) goto done;
+        }
     }
 
     if (foundkey) *foundkey = db->loc.keybuf.s;
@@ -1559,7 +2244,13 @@ static int myfetch(struct dbengine *db,
     }
 
 done:
-    if (!tidptr) {
+    if (db->snapshot) {
+        int r1;
+        if ((r1 = snapshot_end(db)) < 0) {
+            return r1;
+        }
+    }
+    else if (!tidptr) {
         /* release read lock */
         int r1;
         if ((r1 = unlock(db)) < 0) {
@@ -1570,6 +2261,192 @@ done:
     return r;
 }
 
+/* one value found by fetchmany, copied out from under the lock */
+struct fetchmany_item {
+    size_t keyidx;
+    size_t offset;
+    size_t len;
+};
+
+static int myfetchmany(struct dbengine *db,
+                       const bufarray_t *keys,
+                       foreach_cb *cb, void *rock,
+                       struct txn **tidptr)
+{
+    struct fetchmany_item *items = NULL;
+    struct buf vals = BUF_INITIALIZER;
+    size_t nkeys = bufarray_size(keys);
+    size_t nitems = 0;
+    size_t i;
+    int tries = 0;
+    int r = 0;
+
+    assert(db);
+    assert(cb);
+
+    /* Hacky workaround:
+     *
+     * If no transaction was passed, but we're in a transaction,
+     * then just do the read within that transaction.
+     */
+    if (!tidptr && db->current_txn)
+        tidptr = &db->current_txn;
+
+    /* inside a transaction the callback can do what it likes */
+    if (tidptr) {
+        if (!*tidptr) {
+            r = newtxn(db, 0/*shared*/, tidptr);
+            if (r) return r;
+        }
+
+        for (i = 0; !r && i < nkeys; i++) {
+            const struct buf *key = bufarray_nth(keys, i);
+
+            if (!key->len) continue;
+            if (bloom_miss(db, key->s, key->len)) continue;
+
+            r = find_loc(db, key->s, key->len);
+            if (r) break;
+
+            if (db->loc.is_exactmatch)
+                r = cb(rock, key->s, key->len,
+                       VAL(db, &db->loc.record), db->loc.record.vallen);
+        }
+
+        return r;
+    }
+
+    /* otherwise find everything with one lock (or snapshot), and make
+     * the callbacks once we've let go of it */
+    items = xmalloc(nkeys * sizeof(struct fetchmany_item) + 1);
+
+    if (!db->snapshot_reads) {
+        r = read_lock(db);
+        if (r) goto done;
+    }
+
+    for (i = 0; i < nkeys; i++) {
+        const struct buf *key = bufarray_nth(keys, i);
+
+        if (!key->len) continue;
+
+        /* once we have a lock or snapshot to check it against */
+        if ((!db->snapshot_reads || db->snapshot != SNAPSHOT_NONE)
+            && bloom_miss(db, key->s, key->len))
+            continue;
+
+        if (!db->snapshot_reads) {
+            r = find_loc(db, key->s, key->len);
+        }
+        else if (db->snapshot == SNAPSHOT_NONE) {
+            r = snapshot_seek(db, key, SEEK_AT, &tries);
+        }
+        else {
+            r = find_loc(db, key->s, key->len);
+            if (r == CYRUSDB_AGAIN) {
+                snapshot_end(db);
+                tries++;
+                r = snapshot_seek(db, key, SEEK_AT, &tries);
+            }
+        }
+        if (r) break;
+
+        if (db->loc.is_exactmatch) {
+            items[nitems].keyidx = i;
+            items[nitems].offset = vals.len;
+            items[nitems].len = db->loc.record.vallen;
+            buf_appendmap(&vals, VAL(db, &db->loc.record),
+                          db->loc.record.vallen);
+            nitems++;
+        }
+    }
+
+    if (db->snapshot) snapshot_end(db);
+    else if (!db->snapshot_reads) unlock(db);
+    if (r) goto done;
+
+    for (i = 0; !r && i < nitems; i++) {
+        const struct buf *key = bufarray_nth(keys, items[i].keyidx);
+        /* zero length values still get a non-NULL pointer */
+        const char *val = vals.s ? vals.s + items[i].offset : "";
+
+        r = cb(rock, key->s, key->len, val, items[i].len);
+    }
+
+ done:
+    buf_free(&vals);
+    free(items);
+    return r;
+}
+
+/* foreach without holding any locks.  Like the locked version, changes
+ * made by other sessions may or may not be seen, but we always pick up
+ * a new snapshot after each callback. */
+static int snapshot_foreach(struct dbengine *db,
+                            const char *prefix, size_t prefixlen,
+                            foreach_p *goodp,
+                            foreach_cb *cb, void *rock)
+{
+    int r = 0, cb_r = 0;
+    int tries = 0;
+    const char *val;
+    size_t vallen;
+    struct buf keybuf = BUF_INITIALIZER;
+
+    buf_setmap(&keybuf, prefix, prefixlen);
+
+    r = snapshot_seek(db, &keybuf, SEEK_FIRST, &tries);
+
+    while (!r && db->loc.is_exactmatch) {
+        /* does it match prefix? */
+        if (prefixlen) {
+            if (db->loc.record.keylen < prefixlen) break;
+            if (db->compar(KEY(db, &db->loc.record), prefixlen, prefix, prefixlen)) break;
+        }
+
+        val = VAL(db, &db->loc.record);
+        vallen = db->loc.record.vallen;
+
+        if (!goodp || goodp(rock, db->loc.keybuf.s, db->loc.keybuf.len,
+                                  val, vallen)) {
+            /* take a copy of the key - cb may clobber loc */
+            buf_copy(&keybuf, &db->loc.keybuf);
+
+            /* don't hold anything over the callback */
+            r = snapshot_end(db);
+            if (r) break;
+
+            /* make callback */
+            cb_r = cb(rock, keybuf.s, keybuf.len, val, vallen);
+            if (cb_r) break;
+
+            /* and pick up any changes */
+            tries = 0;
+            r = snapshot_seek(db, &keybuf, SEEK_AFTER, &tries);
+            continue;
+        }
+
+        /* move to the next one */
+        r = advance_loc(db);
+        if (r == CYRUSDB_AGAIN) {
+            /* loc->keybuf is still the record we were on */
+            buf_copy(&keybuf, &db->loc.keybuf);
+            snapshot_end(db);
+            tries++;
+            r = snapshot_seek(db, &keybuf, SEEK_AFTER, &tries);
+        }
+    }
+
+    buf_free(&keybuf);
+
+    if (db->snapshot) {
+        int r1 = snapshot_end(db);
+        if (r1) return r1;
+    }
+
+    return r ? r : cb_r;
+}
+
 /* foreach allows for subsidiary mailbox operations in 'cb'.
    if there is a txn, 'cb' must make use of it.
 */
@@ -1597,6 +2474,10 @@ static int myforeach(struct dbengine *db,
      */
     if (!tidptr && db->current_txn)
         tidptr = &db->current_txn;
+
+    if (!tidptr && db->snapshot_reads)
+        return snapshot_foreach(db, prefix, prefixlen, goodp, cb, rock);
+
     if (tidptr) {
         if (!*tidptr) {
             r = newtxn(db, 0/*shared*/, tidptr);
@@ -1736,6 +2617,7 @@ static int skipwrite(struct dbengine *db,
 static int mycommit(struct dbengine *db, struct txn *tid)
 {
     struct skiprecord newrecord;
+    int committed = 0;
     int r = 0;
 
     assert(db);
@@ -1767,6 +2649,7 @@ static int mycommit(struct dbengine *db, struct txn *tid)
     db->header.current_size = db->end;
     db->header.flags &= ~DIRTY;
     r = commit_header(db);
+    if (!r) committed = 1;
 
  done:
     if (r) {
@@ -1791,6 +2674,9 @@ static int mycommit(struct dbengine *db, struct txn *tid)
             }
         }
         else {
+            /* a new file being built keeps its own */
+            if (committed && db->use_bloom && !db->bloom_build)
+                bloom_update(db);
             unlock(db);
         }
 
@@ -1886,9 +2772,13 @@ static int mycheckpoint(struct dbengine *db)
     size_t old_size = db->header.current_size;
     char newfname[1024];
     clock_t start = sclock();
+    struct timeval begin, end;
+    struct cyrusdb_repack_progress progress;
     struct copy_rock cr;
     int r = 0;
 
+    gettimeofday(&begin, NULL);
+
     r = myconsistent(db, db->current_txn);
     if (r) {
         syslog(LOG_ERR, "db %s, inconsistent pre-checkpoint, bailing out",
@@ -1904,7 +2794,12 @@ static int mycheckpoint(struct dbengine *db)
     cr.db = NULL;
     cr.tid = NULL;
     r = opendb(newfname, db->open_flags | CYRUSDB_CREATE, &cr.db, &cr.tid);
-    if (r) return r;
+    if (r) {
+        unlock(db);
+        return r;
+    }
+
+    bloom_start_build(cr.db, db->header.num_records);
 
     r = myforeach(db, NULL, 0, NULL, copy_cb, &cr, &db->current_txn);
     if (r) goto err;
@@ -1931,12 +2826,15 @@ static int mycheckpoint(struct dbengine *db)
     r = mappedfile_rename(cr.db->mf, FNAME(db));
     if (r) goto err;
 
+    bloom_finish_build(cr.db);
+
     /* OK, we're committed now - clean up */
     unlock(db);
 
     /* gotta clean it all up */
     mappedfile_close(&db->mf);
     buf_free(&db->loc.keybuf);
+    bloom_close(db);
 
     *db = *cr.db;
     free(cr.db); /* leaked? */
@@ -1950,6 +2848,17 @@ static int mycheckpoint(struct dbengine *db)
                (sclock() - start) / (double) CLOCKS_PER_SEC);
     }
 
+    /* the whole thing was done under the lock */
+    gettimeofday(&end, NULL);
+    memset(&progress, 0, sizeof(progress));
+    progress.fname = FNAME(db);
+    progress.phase = CYRUSDB_REPACK_DONE;
+    progress.records = progress.total = db->header.num_records;
+    progress.old_size = old_size;
+    progress.new_size = db->header.current_size;
+    progress.elapsed = progress.locked = timesub(&begin, &end);
+    cyrusdb_repack_progress(&progress);
+
     return 0;
 
  err:
@@ -1960,6 +2869,250 @@ static int mycheckpoint(struct dbengine *db)
     return CYRUSDB_IOERROR;
 }
 
+/* checkpoint from outside a transaction, holding the lock throughout */
+static int locked_repack(struct dbengine *db)
+{
+    struct txn *tid = NULL;
+    int r;
+
+    r = newtxn(db, 0/*shared*/, &tid);
+    if (r) return r;
+
+    /* releases the lock, and replaces db on success */
+    r = mycheckpoint(db);
+
+    free(tid);
+    db->current_txn = NULL;
+
+    return r;
+}
+
+/* apply every record written between 'from' and 'to' to the new db */
+static int replay_changes(struct dbengine *db, struct copy_rock *cr,
+                          size_t from, size_t to, size_t *countp)
+{
+    struct skiprecord record;
+    size_t offset;
+    int r = 0;
+
+    for (offset = from; offset < to; offset += record.len) {
+        /* skip over blanks */
+        if (!memcmp(BASE(db) + offset, BLANK, 8)) {
+            record.len = 8;
+            continue;
+        }
+
+        r = read_onerecord(db, offset, &record);
+        if (r) return r;
+
+        switch (record.type) {
+        case RECORD:
+            r = check_tailcrc(db, &record);
+            if (r) return r;
+            r = mystore(cr->db, KEY(db, &record), record.keylen,
+                        VAL(db, &record), record.vallen, &cr->tid, 1);
+            break;
+        case DELETE:
+            /* written before deletes carried their key */
+            if (!record.keylen) return CYRUSDB_NOTIMPLEMENTED;
+            r = check_tailcrc(db, &record);
+            if (r) return r;
+            r = mystore(cr->db, KEY(db, &record), record.keylen,
+                        NULL, 0, &cr->tid, 1);
+            break;
+        case COMMIT:
+            continue;
+        default:
+            return CYRUSDB_IOERROR;
+        }
+        if (r) return r;
+
+        (*countp)++;
+    }
+
+    return 0;
+}
+
+/* repack from a snapshot, only taking the write lock at the end
+ * to catch up with whatever was committed in the meantime */
+static int myrepack(struct dbengine *db)
+{
+    struct cyrusdb_repack_progress progress;
+    struct buf keybuf = BUF_INITIALIZER;
+    struct timeval start, lockstart, now;
+    struct copy_rock cr = { NULL, NULL };
+    char newfname[1024];
+    uint64_t generation;
+    size_t replay_from;
+    int tries = 0;
+    int r;
+
+    /* legacy behaviour from inside a transaction */
+    if (db->current_txn) return mycheckpoint(db);
+
+    /* can't read safely without the lock unless we have CRCs */
+    if (db->open_flags & CYRUSDB_NOCRC) return locked_repack(db);
+
+    gettimeofday(&start, NULL);
+    memset(&progress, 0, sizeof(progress));
+
+    /* unique, so that a parallel repack can't clobber our copy */
+    snprintf(newfname, sizeof(newfname), "%s.NEW.%d",
+             FNAME(db), (int)getpid());
+    unlink(newfname);
+
+    r = opendb(newfname, db->open_flags | CYRUSDB_CREATE, &cr.db, &cr.tid);
+    if (r) return r;
+
+    bloom_start_build(cr.db, db->header.num_records);
+
+    r = snapshot_seek(db, &keybuf, SEEK_FIRST, &tries);
+    if (r) goto err;
+
+    generation = db->header.generation;
+    replay_from = db->end;
+
+    progress.fname = FNAME(db);
+    progress.phase = CYRUSDB_REPACK_COPY;
+    progress.total = db->header.num_records;
+    progress.old_size = db->end;
+
+    while (db->loc.is_exactmatch) {
+        r = mystore(cr.db, KEY(db, &db->loc.record), db->loc.record.keylen,
+                    VAL(db, &db->loc.record), db->loc.record.vallen,
+                    &cr.tid, 0);
+        if (r) goto err;
+
+        progress.records++;
+        if (!(progress.records % REPACK_PROGRESS_INTERVAL)) {
+            gettimeofday(&now, NULL);
+            progress.elapsed = timesub(&start, &now);
+            cyrusdb_repack_progress(&progress);
+        }
+
+        r = CYRUSDB_AGAIN;
+        /* don't hold up the writers for the rest of the copy */
+        if (db->snapshot == SNAPSHOT_ACTIVE)
+            r = advance_loc(db);
+        if (r == CYRUSDB_AGAIN) {
+            buf_copy(&keybuf, &db->loc.keybuf);
+            snapshot_end(db);
+            tries = 0;
+            r = snapshot_seek(db, &keybuf, SEEK_AFTER, &tries);
+        }
+        if (r) goto err;
+
+        if (db->header.generation != generation) goto raced;
+    }
+
+    snapshot_end(db);
+
+    /* check and flush the copy before anyone has to wait for us */
+    r = myconsistent(cr.db, cr.tid);
+    if (r) {
+        syslog(LOG_ERR, "db %s, inconsistent post-repack, bailing out",
+               FNAME(db));
+        goto err;
+    }
+
+    r = mappedfile_commit(cr.db->mf);
+    if (r) goto err;
+
+    gettimeofday(&lockstart, NULL);
+    r = write_lock(db);
+    if (r) goto err;
+
+    if (db->header.generation != generation) {
+        unlock(db);
+        goto raced;
+    }
+
+    progress.phase = CYRUSDB_REPACK_REPLAY;
+    cyrusdb_repack_progress(&progress);
+
+    r = replay_changes(db, &cr, replay_from, db->end,
+                       &progress.replayed);
+    if (r == CYRUSDB_NOTIMPLEMENTED) {
+        /* can't replay this one - start again the slow way */
+        syslog(LOG_NOTICE, "twoskip: %s has old delete records,"
+               " repacking under lock", FNAME(db));
+        unlock(db);
+        myabort(cr.db, cr.tid);
+        cr.tid = NULL;
+        unlink(FNAME(cr.db));
+        dispose_db(cr.db);
+        buf_free(&keybuf);
+        return locked_repack(db);
+    }
+    if (r) {
+        unlock(db);
+        goto err;
+    }
+
+    /* remember the repack size */
+    cr.db->header.repack_size = cr.db->end;
+
+    /* increase the generation count */
+    cr.db->header.generation = db->header.generation + 1;
+
+    r = mycommit(cr.db, cr.tid);
+    cr.tid = NULL;  /* invalid even if the commit failed */
+    if (r) {
+        unlock(db);
+        goto err;
+    }
+
+    /* move new file to original file name */
+    r = mappedfile_rename(cr.db->mf, FNAME(db));
+    if (r) {
+        unlock(db);
+        goto err;
+    }
+
+    bloom_finish_build(cr.db);
+
+    /* OK, we're committed now - clean up */
+    unlock(db);
+    gettimeofday(&now, NULL);
+
+    mappedfile_close(&db->mf);
+    buf_free(&db->loc.keybuf);
+    bloom_close(db);
+
+    *db = *cr.db;
+    free(cr.db);
+    buf_free(&keybuf);
+
+    progress.fname = FNAME(db);
+    progress.phase = CYRUSDB_REPACK_DONE;
+    progress.new_size = db->header.current_size;
+    progress.elapsed = timesub(&start, &now);
+    progress.locked = timesub(&lockstart, &now);
+    cyrusdb_repack_progress(&progress);
+
+    syslog(LOG_INFO,
+           "twoskip: repacked %s (%llu record%s, %llu => %llu bytes,"
+           " %llu replayed) in %2.3f seconds, %2.3f locked",
+           FNAME(db), (LLU)db->header.num_records,
+           db->header.num_records == 1 ? "" : "s",
+           (LLU)progress.old_size, (LLU)progress.new_size,
+           (LLU)progress.replayed, progress.elapsed, progress.locked);
+
+    return 0;
+
+ raced:
+    syslog(LOG_NOTICE, "twoskip: %s was repacked by someone else", FNAME(db));
+    r = 0;
+
+ err:
+    snapshot_end(db);
+    if (cr.tid) myabort(cr.db, cr.tid);
+    unlink(FNAME(cr.db));
+    dispose_db(cr.db);
+    buf_free(&keybuf);
+    return r ? CYRUSDB_IOERROR : 0;
+}
+
 
 /* dump the database.
    if detail == 1, dump all records.
@@ -2164,8 +3317,10 @@ static int _copy_commit(struct dbengine *db, struct dbengine *newdb,
         switch (record.type) {
         case DELETE:
             /* find the record we are deleting */
-            r = read_onerecord(db, record.nextloc[0], &record);
-            if (r) goto err;
+            if (!record.keylen) {
+                r = read_onerecord(db, record.nextloc[0], &record);
+                if (r) goto err;
+            }
             /* and delete it from the new DB */
             r = mystore(newdb, KEY(db, &record), record.keylen, NULL, 0, &tid, 1);
             if (r) goto err;
@@ -2262,6 +3417,7 @@ static int recovery2(struct dbengine *db, int *count)
     /* gotta clean it all up */
     mappedfile_close(&db->mf);
     buf_free(&db->loc.keybuf);
+    bloom_close(db);
 
     *db = *newdb;
     free(newdb); /* leaked? */
@@ -2279,6 +3435,27 @@ static int recovery2(struct dbengine *db, int *count)
     return r;
 }
 
+/* drop a level zero pointer past the end.  It gets a copy of the
+ * other one rather than zero: a snapshot reader from before the last
+ * commit could take a zero as the end of the list, but it will see
+ * two pointers past its end and retry */
+static int fix_level0(struct dbengine *db, struct skiprecord *record)
+{
+    if (record->nextloc[0] >= db->end && record->nextloc[1] >= db->end) {
+        record->nextloc[0] = record->nextloc[1] = 0;
+        return 1;
+    }
+    if (record->nextloc[0] >= db->end) {
+        record->nextloc[0] = record->nextloc[1];
+        return 1;
+    }
+    if (record->nextloc[1] >= db->end) {
+        record->nextloc[1] = record->nextloc[0];
+        return 1;
+    }
+    return 0;
+}
+
 /* run recovery on this file.
  * always called with a write lock. */
 static int recovery1(struct dbengine *db, int *count)
@@ -2322,12 +3499,9 @@ static int recovery1(struct dbengine *db, int *count)
     }
 
     /* check for broken level - pointers */
-    for (i = 0; i < 2; i++) {
-        if (prevrecord.nextloc[i] >= db->end) {
-            prevrecord.nextloc[i] = 0;
-            r = rewrite_record(db, &prevrecord);
-            changed++;
-        }
+    if (fix_level0(db, &prevrecord)) {
+        r = rewrite_record(db, &prevrecord);
+        changed++;
     }
 
     nextoffset = _getloc(db, &prevrecord, 0);
@@ -2371,13 +3545,10 @@ static int recovery1(struct dbengine *db, int *count)
         }
 
         /* check for broken level - pointers */
-        for (i = 0; i < 2; i++) {
-            if (record.nextloc[i] >= db->end) {
-                record.nextloc[i] = 0;
-                r = rewrite_record(db, &record);
-                if (r) return r;
-                changed++;
-            }
+        if (fix_level0(db, &record)) {
+            r = rewrite_record(db, &record);
+            if (r) return r;
+            changed++;
         }
 
         num_records++;
@@ -2531,6 +3702,8 @@ HIDDEN struct cyrusdb_backend cyrusdb_twoskip =
 
     &dump,
     &consistent,
-    &mycheckpoint,
-    &mycompar
+    &myrepack,
+    &mycompar,
+
+    &myfetchmany
 };
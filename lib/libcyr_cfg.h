@@ -105,6 +105,10 @@ enum cyrus_opt {
     CYRUSOPT_SQL_USESSL,
     /* Checkpoint after every recovery (OFF) */
     CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
+    /* Read twoskip databases without locking (OFF) */
+    CYRUSOPT_TWOSKIP_SNAPSHOT_READS,
+    /* Keep bloom filters for twoskip databases which ask for them (OFF) */
+    CYRUSOPT_TWOSKIP_BLOOM_FILTERS,
 
     CYRUSOPT_LAST
 
@@ -226,6 +226,47 @@ EXPORTED int mappedfile_readlock(struct mappedfile *mf)
     return 0;
 }
 
+/* Bring the map up to date with the file on disk WITHOUT taking a lock.
+ * If the file has been replaced (e.g. by a checkpoint) then the new file
+ * is opened instead.  The caller is responsible for coping with concurrent
+ * writers, as nothing stops the contents changing under the map. */
+EXPORTED int mappedfile_refresh(struct mappedfile *mf)
+{
+    struct stat sbuf, sbuffile;
+    int newfd = -1;
+
+    assert(mf->lock_status == MF_UNLOCKED);
+    assert(mf->fd != -1);
+    assert(!mf->dirty);
+
+    for (;;) {
+        if (fstat(mf->fd, &sbuf) == -1) {
+            syslog(LOG_ERR, "IOERROR: fstat %s: %m", mf->fname);
+            return -EIO;
+        }
+
+        if (stat(mf->fname, &sbuffile) == -1) {
+            syslog(LOG_ERR, "IOERROR: stat %s: %m", mf->fname);
+            return -EIO;
+        }
+        if (sbuf.st_ino == sbuffile.st_ino) break;
+        buf_free(&mf->map_buf);
+
+        newfd = open(mf->fname, mf->is_rw ? O_RDWR : O_RDONLY, 0644);
+        if (newfd == -1) {
+            syslog(LOG_ERR, "IOERROR: open %s: %m", mf->fname);
+            return -EIO;
+        }
+
+        dup2(newfd, mf->fd);
+        close(newfd);
+    }
+
+    _ensure_mapped(mf, sbuf.st_size, /*update*/0);
+
+    return 0;
+}
+
 EXPORTED int mappedfile_writelock(struct mappedfile *mf)
 {
     int r;
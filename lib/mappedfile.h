@@ -81,6 +81,7 @@ extern int mappedfile_close(struct mappedfile **mfp);
 extern int mappedfile_readlock(struct mappedfile *mf);
 extern int mappedfile_writelock(struct mappedfile *mf);
 extern int mappedfile_unlock(struct mappedfile *mf);
+extern int mappedfile_refresh(struct mappedfile *mf);
 
 extern int mappedfile_commit(struct mappedfile *mf);
 extern ssize_t mappedfile_pwrite(struct mappedfile *mf,
@@ -57,6 +57,12 @@
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include "assert.h"
 #include "imparse.h"
@@ -74,8 +80,18 @@ struct protgroup
     size_t nalloced; /* Number of nodes in the group */
     size_t next_element; /* Node number of next group member */
     struct protstream **group;
+#ifdef HAVE_SYS_EPOLL_H
+    int epfd; /* members registered for epoll, once we've selected on it */
+#endif
 };
 
+#ifdef HAVE_SYS_EPOLL_H
+#define PROTGROUP_EPOLL_UNUSED  -1      /* not selected on yet */
+#define PROTGROUP_EPOLL_FAILED  -2      /* fall back to select() */
+#define PROTGROUP_EPOLL_EVENTS  256     /* ready streams per wakeup */
+#define PROTGROUP_EPOLL_MIN     64      /* smaller groups just use select() */
+#endif
+
 /*
  * Create a new protection stream for file descriptor 'fd'.  Stream
  * will be used for writing iff 'write' is nonzero.
@@ -94,6 +110,7 @@ EXPORTED struct protstream *prot_new(int fd, int write)
     newstream->write = write;
     newstream->logfd = PROT_NO_FD;
     newstream->big_buffer = PROT_NO_FD;
+    newstream->sendfile_fd = PROT_NO_FD;
     if(write)
         newstream->cnt = PROT_BUFSIZE;
 
@@ -117,6 +134,7 @@ EXPORTED struct protstream *prot_writebuf(struct buf *buf)
     newstream->fd = PROT_NO_FD;
     newstream->logfd = PROT_NO_FD;
     newstream->big_buffer =  PROT_NO_FD;
+    newstream->sendfile_fd = PROT_NO_FD;
     /* there's no way to wait for + go ahead here! */
     newstream->isclient = 1;
 
@@ -1206,6 +1224,90 @@ int prot_flush_internal(struct protstream *s, int force)
     return 0;
 }
 
+EXPORTED void prot_setsendfile(struct protstream *s, const char *base,
+                               size_t len, int fd)
+{
+    assert(s->write);
+
+    if (fd == PROT_NO_FD) {
+        base = NULL;
+        len = 0;
+    }
+
+    s->sendfile_base = base;
+    s->sendfile_len = len;
+    s->sendfile_fd = fd;
+}
+
+EXPORTED int prot_cansendfile(struct protstream *s)
+{
+#ifdef HAVE_SYS_SENDFILE_H
+    if (!s->write || s->fd == PROT_NO_FD || s->writetobuf) return 0;
+
+    /* anything which needs to see the bytes rules it out */
+    if (s->saslssf || s->logfd != PROT_NO_FD) return 0;
+#ifdef HAVE_ZLIB
+    if (s->zstrm) return 0;
+#endif /* HAVE_ZLIB */
+#ifdef HAVE_SSL
+    if (s->tls_conn) {
+#ifdef BIO_get_ktls_send
+        /* unless the kernel is doing the encryption for us */
+        return BIO_get_ktls_send(SSL_get_wbio(s->tls_conn));
+#else
+        return 0;
+#endif /* BIO_get_ktls_send */
+    }
+#endif /* HAVE_SSL */
+
+    return 1;
+#else
+    (void)s;
+    return 0;
+#endif /* HAVE_SYS_SENDFILE_H */
+}
+
+#ifdef HAVE_SYS_SENDFILE_H
+/*
+ * Write 'len' bytes starting at 'offset' in the registered sendfile
+ * file straight to the output descriptor, after flushing anything
+ * already buffered.
+ */
+static int prot_sendfile(struct protstream *s, off_t offset, size_t len)
+{
+    size_t left = len;
+    ssize_t n;
+
+    if (prot_flush_internal(s, 1) == EOF) return EOF;
+
+    while (left) {
+        do {
+            cmdtime_netstart();
+#if defined(HAVE_SSL) && defined(BIO_get_ktls_send)
+            if (s->tls_conn != NULL) {
+                n = SSL_sendfile(s->tls_conn, s->sendfile_fd, offset, left, 0);
+                if (n > 0) offset += n;
+            }
+            else
+#endif
+            n = sendfile(s->fd, s->sendfile_fd, &offset, left);
+            cmdtime_netend();
+        } while (n == -1 && errno == EINTR && !signals_poll());
+
+        if (n <= 0) {
+            /* a zero return means the file is shorter than its mapping */
+            s->error = xstrdup(n ? strerror(errno) : PROT_EOF_STRING);
+            return EOF;
+        }
+
+        left -= n;
+    }
+
+    s->bytes_out += len;
+    return 0;
+}
+#endif /* HAVE_SYS_SENDFILE_H */
+
 /*
  * Write to the output stream 's' the 'len' bytes of data at 'buf'
  */
@@ -1246,6 +1348,16 @@ EXPORTED int prot_write(struct protstream *s, const char *buf, unsigned len)
         s->boundary = 0;
     }
 
+#ifdef HAVE_SYS_SENDFILE_H
+    /* large writes from a registered file mapping skip the buffer */
+    if (len >= PROT_SENDFILE_MIN && s->sendfile_base &&
+        buf >= s->sendfile_base && len <= s->sendfile_len &&
+        (size_t)(buf - s->sendfile_base) <= s->sendfile_len - len &&
+        prot_cansendfile(s)) {
+        return prot_sendfile(s, buf - s->sendfile_base, len);
+    }
+#endif /* HAVE_SYS_SENDFILE_H */
+
     while (len >= s->cnt) {
         /* XXX can we manage to write data from 'buf' without copying it
            to s->ptr ? */
@@ -1466,6 +1578,157 @@ EXPORTED int prot_readbuf(struct protstream *s, struct buf *buf, unsigned size)
     return size;
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+static int protgroup_contains(struct protgroup *group, struct protstream *s)
+{
+    size_t i;
+
+    if (!group) return 0;
+
+    for (i = 0; i < group->next_element; i++) {
+        if (group->group[i] == s) return 1;
+    }
+
+    return 0;
+}
+
+static int protgroup_epoll_add(struct protgroup *group, struct protstream *s)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+
+    if (epoll_ctl(group->epfd, EPOLL_CTL_ADD, s->fd, &ev) == -1) {
+        syslog(LOG_ERR, "IOERROR: epoll_ctl(ADD, %d): %m", s->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void protgroup_epoll_del(struct protgroup *group, struct protstream *s)
+{
+    size_t i;
+
+    /* if the stream's descriptor was closed and reused by another
+     * member, the registration now belongs to that member */
+    for (i = 0; i < group->next_element; i++) {
+        if (group->group[i] && group->group[i]->fd == s->fd) return;
+    }
+
+    /* a closed descriptor has already left the set by itself */
+    if (epoll_ctl(group->epfd, EPOLL_CTL_DEL, s->fd, NULL) == -1 &&
+        errno != EBADF && errno != ENOENT) {
+        syslog(LOG_ERR, "IOERROR: epoll_ctl(DEL, %d): %m", s->fd);
+    }
+}
+
+static void protgroup_epoll_fail(struct protgroup *group)
+{
+    if (group->epfd >= 0) close(group->epfd);
+    group->epfd = PROTGROUP_EPOLL_FAILED;
+}
+
+/*
+ * Register every member of a group with a new epoll set the first time
+ * it is selected on while large (or holding a descriptor too big for
+ * select()); protgroup_insert() and protgroup_delete() keep the set up
+ * to date from then on.  Small groups, which are often rebuilt from
+ * scratch before each select, aren't worth the syscalls.
+ * Returns nonzero if epoll can be used.
+ */
+static int protgroup_epoll_setup(struct protgroup *group)
+{
+    size_t i;
+
+    if (!group || group->epfd == PROTGROUP_EPOLL_FAILED) return 0;
+    if (group->epfd >= 0) return 1;
+
+    if (group->next_element < PROTGROUP_EPOLL_MIN) {
+        for (i = 0; i < group->next_element; i++) {
+            if (group->group[i] && group->group[i]->fd >= FD_SETSIZE) break;
+        }
+        if (i == group->next_element) return 0;
+    }
+
+    group->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (group->epfd == -1) {
+        syslog(LOG_ERR, "IOERROR: epoll_create1: %m");
+        group->epfd = PROTGROUP_EPOLL_FAILED;
+        return 0;
+    }
+
+    for (i = 0; i < group->next_element; i++) {
+        if (group->group[i] &&
+            protgroup_epoll_add(group, group->group[i])) {
+            protgroup_epoll_fail(group);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Wait for the members of an epoll-registered group (and the extra fd,
+ * if any) to become readable, adding the ready ones to *retval.
+ * Returns the number of ready descriptors, or -1 on error.
+ */
+static int prot_select_epoll(struct protgroup *readstreams, int extra_read_fd,
+                             int *extra_read_flag, struct timeval *timeout,
+                             struct protgroup **retval)
+{
+    struct epoll_event events[PROTGROUP_EPOLL_EVENTS];
+    struct epoll_event ev;
+    int found_fds = 0;
+    int i, n;
+
+    if (extra_read_flag) *extra_read_flag = 0;
+
+    /* the extra fd changes from call to call, so it isn't kept in the
+     * set; the group itself marks its events */
+    if (extra_read_fd != PROT_NO_FD) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = readstreams;
+        if (epoll_ctl(readstreams->epfd, EPOLL_CTL_ADD,
+                      extra_read_fd, &ev) == -1) {
+            syslog(LOG_ERR, "IOERROR: epoll_ctl(ADD, %d): %m", extra_read_fd);
+            return -1;
+        }
+    }
+
+    n = signals_epoll_wait(readstreams->epfd, events,
+                           PROTGROUP_EPOLL_EVENTS, timeout);
+
+    if (extra_read_fd != PROT_NO_FD) {
+        int saved_errno = errno;
+        epoll_ctl(readstreams->epfd, EPOLL_CTL_DEL, extra_read_fd, NULL);
+        errno = saved_errno;
+    }
+
+    if (n == -1) return -1;
+
+    for (i = 0; i < n; i++) {
+        if (events[i].data.ptr == readstreams) {
+            *extra_read_flag = 1;
+            found_fds++;
+            continue;
+        }
+
+        if (!*retval)
+            *retval = protgroup_new(readstreams->next_element + 1);
+
+        protgroup_insert(*retval, events[i].data.ptr);
+        found_fds++;
+    }
+
+    return found_fds;
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
 /*
  * select() for protection streams, read only
  * Also supports selecting on an extra file descriptor
@@ -1481,6 +1744,7 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
     struct protstream *s, *timeout_prot = NULL;
     struct protgroup *retval = NULL;
     int max_fd, found_fds = 0;
+    int use_epoll = 0;
     unsigned i;
     fd_set rfds;
     int have_readtimeout = 0;
@@ -1502,6 +1766,10 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
      * will override it */
     max_fd = extra_read_fd;
 
+#ifdef HAVE_SYS_EPOLL_H
+    use_epoll = protgroup_epoll_setup(readstreams);
+#endif
+
     for(i = 0; i<readstreams->next_element; i++) {
         int have_thistimeout = 0; /* used to compute the minimal timeout for */
         time_t this_timeout = 0;  /* this stream */
@@ -1535,9 +1803,11 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
                 timeout_prot = s;
         }
 
-        FD_SET(s->fd, &rfds);
-        if(s->fd > max_fd)
-            max_fd = s->fd;
+        if (!use_epoll) {
+            FD_SET(s->fd, &rfds);
+            if(s->fd > max_fd)
+                max_fd = s->fd;
+        }
 
         /* Is something currently pending in our protstream's buffer? */
         if(s->cnt > 0) {
@@ -1566,12 +1836,6 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
     if(!retval) {
         time_t sleepfor;
 
-        /* do a select */
-        if(extra_read_fd != PROT_NO_FD) {
-            /* max_fd started with atleast extra_read_fd */
-            FD_SET(extra_read_fd, &rfds);
-        }
-
         if(read_timeout < now)
             sleepfor = 0;
         else
@@ -1587,6 +1851,39 @@ EXPORTED int prot_select(struct protgroup *readstreams, int extra_read_fd,
             timeout->tv_usec = 0;
         }
 
+#ifdef HAVE_SYS_EPOLL_H
+        if (use_epoll) {
+            found_fds = prot_select_epoll(readstreams, extra_read_fd,
+                                          extra_read_flag, timeout, &retval);
+            if (found_fds == -1)
+                return -1;
+
+            /* Reset now */
+            now = time(NULL);
+
+            /* If we timed out, be sure to add the protstream we were
+             * waiting for, even if it didn't show up */
+            if (timeout_prot && now >= read_timeout &&
+                !protgroup_contains(retval, timeout_prot)) {
+                found_fds++;
+
+                if(!retval)
+                    retval = protgroup_new(readstreams->next_element + 1);
+
+                protgroup_insert(retval, timeout_prot);
+            }
+
+            *out = retval;
+            return found_fds;
+        }
+#endif /* HAVE_SYS_EPOLL_H */
+
+        /* do a select */
+        if(extra_read_fd != PROT_NO_FD) {
+            /* max_fd started with atleast extra_read_fd */
+            FD_SET(extra_read_fd, &rfds);
+        }
+
         if(signals_select(max_fd + 1, &rfds, NULL, NULL, timeout) == -1)
             return -1;
 
@@ -1662,6 +1959,9 @@ EXPORTED struct protgroup *protgroup_new(size_t size)
     ret->nalloced = size;
     ret->next_element = 0;
     ret->group = xzmalloc(size * sizeof(struct protstream *));
+#ifdef HAVE_SYS_EPOLL_H
+    ret->epfd = PROTGROUP_EPOLL_UNUSED;
+#endif
 
     return ret;
 }
@@ -1684,6 +1984,10 @@ EXPORTED void protgroup_reset(struct protgroup *group)
         memset(group->group, 0,
                group->nalloced * sizeof(struct protstream *));
         group->next_element = 0;
+#ifdef HAVE_SYS_EPOLL_H
+        if (group->epfd >= 0) close(group->epfd);
+        group->epfd = PROTGROUP_EPOLL_UNUSED;
+#endif
     }
 }
 
@@ -1691,6 +1995,9 @@ EXPORTED void protgroup_free(struct protgroup *group)
 {
     if(group) {
         assert(group->group);
+#ifdef HAVE_SYS_EPOLL_H
+        if (group->epfd >= 0) close(group->epfd);
+#endif
         free(group->group);
         free(group);
     }
@@ -1717,6 +2024,11 @@ EXPORTED void protgroup_insert(struct protgroup *group, struct protstream *item)
     }
     /* Insert the item at the empty location */
     group->group[empty] = item;
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (group->epfd >= 0 && protgroup_epoll_add(group, item))
+        protgroup_epoll_fail(group);
+#endif
 }
 
 EXPORTED void protgroup_delete(struct protgroup *group, struct protstream *item)
@@ -1735,6 +2047,9 @@ EXPORTED void protgroup_delete(struct protgroup *group, struct protstream *item)
                 group->group[i] = group->group[i+1];
             }
             group->group[i] = NULL;
+#ifdef HAVE_SYS_EPOLL_H
+            if (group->epfd >= 0) protgroup_epoll_del(group, item);
+#endif
             return;
         }
     }
@@ -66,6 +66,9 @@
 
 #define PROT_NO_FD -1
 
+/* writes smaller than this are copied even if they could be sendfile()d */
+#define PROT_SENDFILE_MIN (16*1024)
+
 struct protstream;
 struct prot_waitevent;
 
@@ -110,6 +113,11 @@ struct protstream {
     size_t bigbuf_len; /* Length of mapped file */
     size_t bigbuf_pos; /* Current Position */
 
+    /* Memory mapped from a file which may be sent with sendfile() */
+    const char *sendfile_base;
+    size_t sendfile_len;
+    int sendfile_fd;
+
     /* Callback-fill information */
     prot_fillcallback_t *fillcallback_proc;
     void *fillcallback_rock;
@@ -252,6 +260,18 @@ int prot_setcompress(struct protstream *s);
 void prot_unsetcompress(struct protstream *s);
 #endif /* HAVE_ZLIB */
 
+/* Tell the protstream that the 'len' bytes at 'base' are a mapping of
+ * the start of the file open on 'fd', so that large writes from that
+ * memory can be handed to the kernel with sendfile() rather than copied
+ * through the buffer.  Only used when nothing (compression, SASL, TLS
+ * other than kernel TLS, telemetry) needs to see the data.  Pass
+ * PROT_NO_FD to forget the mapping again, before unmapping it. */
+extern void prot_setsendfile(struct protstream *s, const char *base,
+                             size_t len, int fd);
+
+/* Could this protstream use sendfile() at the moment? */
+extern int prot_cansendfile(struct protstream *s);
+
 /* Tell the protstream that the type of data is about to change. */
 int prot_data_boundary(struct protstream *s);
 
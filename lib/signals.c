@@ -49,6 +49,9 @@
 #include <syslog.h>
 #include <string.h>
 #include <errno.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include "assert.h"
 #include "signals.h"
@@ -282,6 +285,48 @@ EXPORTED int signals_select(int nfds, fd_set *rfds, fd_set *wfds,
 #endif
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * Same as signals_select() but waiting on an epoll set, for callers
+ * with more descriptors than select() can handle.
+ */
+EXPORTED int signals_epoll_wait(int epfd, struct epoll_event *events,
+                                int maxevents, struct timeval *tout)
+{
+    sigset_t blocked;
+    sigset_t oldmask;
+    int timeout = -1;
+    int saved_errno;
+    int r;
+
+    /* round up, so that we never wake just before a deadline */
+    if (tout)
+        timeout = tout->tv_sec * 1000 + (tout->tv_usec + 999) / 1000;
+
+    /* see signals_select() */
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigaddset(&blocked, SIGALRM);
+    sigaddset(&blocked, SIGQUIT);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigprocmask(SIG_BLOCK, &blocked, &oldmask);
+
+    signals_poll_mask(&oldmask);
+
+    r = epoll_pwait(epfd, events, maxevents, timeout, &oldmask);
+
+    if (r < 0 && (errno == EAGAIN || errno == EINTR))
+        signals_poll_mask(&oldmask);
+
+    saved_errno = errno;
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    errno = saved_errno;
+
+    return r;
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
 EXPORTED void signals_clear(int sig)
 {
     if (sig >= 0 && sig < _NSIG)
@@ -54,6 +54,11 @@ void signals_set_shutdown(shutdownfn *s);
 int signals_poll(void);
 int signals_select(int nfds, fd_set *rfds, fd_set *wfds,
                    fd_set *efds, struct timeval *tout);
+#ifdef HAVE_SYS_EPOLL_H
+struct epoll_event;
+int signals_epoll_wait(int epfd, struct epoll_event *events,
+                       int maxevents, struct timeval *tout);
+#endif
 void signals_clear(int sig);
 int signals_cancelled();
 
@@ -73,12 +73,12 @@
 /* to limit changes to the code below, set up the right types here */
 #include "lib/xsha1.h" /* for the typedefs and such */
 
-/* The SHA1 structure: */
-struct _SHA_CTX {
-    sha1_quadbyte   state[5];
-    sha1_quadbyte   count[2];
-    sha1_byte   buffer[SHA1_BLOCK_LENGTH];
-};
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ >= 5 || defined(__clang__))
+#define XSHA1_HAVE_SHANI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
 /* Downloaded from http://www.aarongifford.com/computers/hmac_sha1.tar.gz
  * by Bron Gondwana <brong@fastmail.fm> on 2011-09-20
@@ -159,6 +159,107 @@ static void SHA1_Transform(sha1_quadbyte state[5], const sha1_byte buffer[64]) {
 }
 
 
+#ifdef XSHA1_HAVE_SHANI
+/* One round group of four, for rounds 16 onwards, using the Intel SHA
+ * extensions.  The message schedule for later groups is worked out as
+ * we go, rotating through msg[0..3]. */
+#define SHANI_ROUNDS(i) do { \
+    e[(i)&1] = _mm_sha1nexte_epu32(e[(i)&1], msg[(i)&3]); \
+    e[((i)+1)&1] = abcd; \
+    msg[((i)+1)&3] = _mm_sha1msg2_epu32(msg[((i)+1)&3], msg[(i)&3]); \
+    abcd = _mm_sha1rnds4_epu32(abcd, e[(i)&1], (i)/5); \
+    msg[((i)+3)&3] = _mm_sha1msg1_epu32(msg[((i)+3)&3], msg[(i)&3]); \
+    msg[((i)+2)&3] = _mm_xor_si128(msg[((i)+2)&3], msg[(i)&3]); \
+} while (0)
+
+/* Hash @blocks 512-bit blocks with the SHA extensions */
+__attribute__((target("sha,sse4.1")))
+static void SHA1_Transform_shani(sha1_quadbyte state[5],
+                                 const sha1_byte *data, size_t blocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL,
+                                         0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e_save, e[2], msg[4];
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1b);
+    e[0] = _mm_set_epi32(state[4], 0, 0, 0);
+
+    for (; blocks; blocks--, data += 64) {
+        abcd_save = abcd;
+        e_save = e[0];
+
+        /* rounds 0-15, loading the block as we go */
+        msg[0] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), bswap);
+        e[0] = _mm_add_epi32(e[0], msg[0]);
+        e[1] = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e[0], 0);
+
+        msg[1] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)), bswap);
+        e[1] = _mm_sha1nexte_epu32(e[1], msg[1]);
+        e[0] = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e[1], 0);
+        msg[0] = _mm_sha1msg1_epu32(msg[0], msg[1]);
+
+        msg[2] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)), bswap);
+        e[0] = _mm_sha1nexte_epu32(e[0], msg[2]);
+        e[1] = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e[0], 0);
+        msg[1] = _mm_sha1msg1_epu32(msg[1], msg[2]);
+        msg[0] = _mm_xor_si128(msg[0], msg[2]);
+
+        msg[3] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)), bswap);
+        SHANI_ROUNDS(3);
+
+        /* rounds 16-79 */
+        SHANI_ROUNDS(4);  SHANI_ROUNDS(5);  SHANI_ROUNDS(6);  SHANI_ROUNDS(7);
+        SHANI_ROUNDS(8);  SHANI_ROUNDS(9);  SHANI_ROUNDS(10); SHANI_ROUNDS(11);
+        SHANI_ROUNDS(12); SHANI_ROUNDS(13); SHANI_ROUNDS(14); SHANI_ROUNDS(15);
+        SHANI_ROUNDS(16); SHANI_ROUNDS(17); SHANI_ROUNDS(18); SHANI_ROUNDS(19);
+
+        e[0] = _mm_sha1nexte_epu32(e[0], e_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = _mm_extract_epi32(e[0], 3);
+}
+#undef SHANI_ROUNDS
+
+static int cpu_has_shani(void)
+{
+    static int have = -1;
+    unsigned a, b, c, d;
+
+    if (have < 0) {
+        have = 0;
+        /* SHA (leaf 7 EBX bit 29) needs SSSE3 and SSE4.1 alongside */
+        if (__get_cpuid(1, &a, &b, &c, &d) &&
+            (c & bit_SSSE3) && (c & bit_SSE4_1) &&
+            __get_cpuid_max(0, NULL) >= 7) {
+            __cpuid_count(7, 0, a, b, c, d);
+            have = (b & (1 << 29)) ? 1 : 0;
+        }
+    }
+
+    return have;
+}
+#endif /* XSHA1_HAVE_SHANI */
+
+/* Hash @blocks 512-bit blocks with whatever the CPU does best */
+static void SHA1_Transform_blocks(sha1_quadbyte state[5],
+                                  const sha1_byte *data, size_t blocks)
+{
+#ifdef XSHA1_HAVE_SHANI
+    if (cpu_has_shani()) {
+        SHA1_Transform_shani(state, data, blocks);
+        return;
+    }
+#endif
+
+    for (; blocks; blocks--, data += 64)
+        SHA1_Transform(state, data);
+}
+
 /* SHA1_Init - Initialize new context */
 EXPORTED int SHA1_Init(SHA_CTX* context) {
     /* SHA1 initialization constants */
@@ -181,10 +282,9 @@ EXPORTED int SHA1_Update(SHA_CTX *context, const sha1_byte *data, unsigned int l
     context->count[1] += (len >> 29);
     if ((j + len) > 63) {
         memcpy(&context->buffer[j], data, (i = 64-j));
-        SHA1_Transform(context->state, context->buffer);
-        for ( ; i + 63 < len; i += 64) {
-            SHA1_Transform(context->state, &data[i]);
-        }
+        SHA1_Transform_blocks(context->state, context->buffer, 1);
+        SHA1_Transform_blocks(context->state, &data[i], (len - i) / 64);
+        i += (len - i) & ~63U;
         j = 0;
     }
     else i = 0;